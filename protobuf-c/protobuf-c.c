@@ -39,9 +39,6 @@
  */
 
 /**
- * \todo 64-BIT OPTIMIZATION: certain implementations use 32-bit math
- * even on 64-bit platforms (uint64_size, uint64_pack, parse_uint64).
- *
  * \todo Use size_t consistently.
  */
 
@@ -80,6 +77,15 @@
 /** The maximum length of a 64-bit integer in varint encoding. */
 #define MAX_UINT64_ENCODED_SIZE		10
 
+/** Number of packed varints encoded at once by protobuf_c_message_pack_to_buffer(). */
+#define PACK_CHUNK_ELEMENTS		64
+
+/**
+ * Returned by the internal sizing and packing routines when a message is
+ * nested too deeply for the frames of the walk to be allocated.
+ */
+#define PACK_FAILED			SIZE_MAX
+
 #ifndef PROTOBUF_C_UNPACK_ERROR
 # define PROTOBUF_C_UNPACK_ERROR(...)
 #endif
@@ -127,7 +133,8 @@ const char protobuf_c_empty_string[] = "";
 	ASSERT_IS_MESSAGE_DESCRIPTOR((message)->descriptor)
 
 #define ASSERT_IS_SERVICE_DESCRIPTOR(desc) \
-	assert((desc)->magic == PROTOBUF_C__SERVICE_DESCRIPTOR_MAGIC)
+	assert((desc)->magic == PROTOBUF_C__SERVICE_DESCRIPTOR_MAGIC || \
+	       (desc)->magic == PROTOBUF_C__SERVICE_DESCRIPTOR_HASHED_MAGIC)
 
 /**@}*/
 
@@ -161,19 +168,102 @@ system_free(void *allocator_data, void *data)
 	free(data);
 }
 
+/*
+ * An extended allocator is recognised by its base interface, whose functions
+ * are always these two trampolines and whose allocator_data is the
+ * ProtobufCAllocatorExt itself.
+ */
+static void *
+ext_alloc(void *allocator_data, size_t size)
+{
+	ProtobufCAllocatorExt *ext = allocator_data;
+
+	return ext->alloc(ext->allocator_data, size);
+}
+
+static void
+ext_free(void *allocator_data, void *data)
+{
+	ProtobufCAllocatorExt *ext = allocator_data;
+
+	if (ext->free != NULL)
+		ext->free(ext->allocator_data, data);
+	else
+		ext->free_sized(ext->allocator_data, data, 0);
+}
+
+static inline ProtobufCAllocatorExt *
+allocator_ext(ProtobufCAllocator *allocator)
+{
+	if (allocator->alloc != ext_alloc)
+		return NULL;
+	return allocator->allocator_data;
+}
+
 static inline void *
 do_alloc(ProtobufCAllocator *allocator, size_t size)
 {
 	return allocator->alloc(allocator->allocator_data, size);
 }
 
+/* `size` is the size the block was allocated with. */
 static inline void
-do_free(ProtobufCAllocator *allocator, void *data)
+do_free(ProtobufCAllocator *allocator, void *data, size_t size)
 {
-	if (data != NULL)
+	ProtobufCAllocatorExt *ext;
+
+	if (data == NULL)
+		return;
+	ext = allocator_ext(allocator);
+	if (ext != NULL)
+		ext->free_sized(ext->allocator_data, data, size);
+	else
 		allocator->free(allocator->allocator_data, data);
 }
 
+/*
+ * Free a NUL-terminated string; its length is only measured if needed. The
+ * measured size is short of the allocation if the string has an embedded
+ * NUL, as documented for ProtobufCAllocatorExt.
+ */
+static inline void
+do_free_string(ProtobufCAllocator *allocator, char *str)
+{
+	ProtobufCAllocatorExt *ext;
+
+	if (str == NULL)
+		return;
+	ext = allocator_ext(allocator);
+	if (ext != NULL)
+		ext->free_sized(ext->allocator_data, str, strlen(str) + 1);
+	else
+		allocator->free(allocator->allocator_data, str);
+}
+
+/*
+ * Resize a block, preserving its contents. On failure the block is left
+ * untouched and NULL is returned.
+ */
+static void *
+do_realloc(ProtobufCAllocator *allocator, void *data,
+	   size_t old_size, size_t new_size)
+{
+	ProtobufCAllocatorExt *ext = allocator_ext(allocator);
+	void *rv;
+
+	if (ext != NULL && ext->realloc != NULL)
+		return ext->realloc(ext->allocator_data, data,
+				    old_size, new_size);
+	if (allocator->alloc == system_alloc)
+		return realloc(data, new_size);
+	rv = do_alloc(allocator, new_size);
+	if (rv == NULL)
+		return NULL;
+	memcpy(rv, data, old_size < new_size ? old_size : new_size);
+	do_free(allocator, data, old_size);
+	return rv;
+}
+
 /*
  * This allocator uses the system's malloc() and free(). It is the default
  * allocator used if NULL is passed as the ProtobufCAllocator to an exported
@@ -185,6 +275,137 @@ static ProtobufCAllocator protobuf_c__allocator = {
 	.allocator_data = NULL,
 };
 
+void
+protobuf_c_allocator_ext_init(ProtobufCAllocatorExt *allocator)
+{
+	assert(allocator->version >= 1 &&
+	       allocator->version <= PROTOBUF_C_ALLOCATOR_EXT_VERSION);
+	allocator->base.alloc = ext_alloc;
+	allocator->base.free = ext_free;
+	allocator->base.allocator_data = allocator;
+}
+
+/*
+ * Without alloc_aligned(), aligned blocks are carved out of a larger one; the
+ * pointer to the larger block is kept just before the aligned one.
+ */
+#define ALIGNED_OVERHEAD(alignment)	((alignment) - 1 + sizeof(void *))
+
+void *
+protobuf_c_allocator_alloc_aligned(ProtobufCAllocator *allocator,
+				   size_t alignment, size_t size)
+{
+	ProtobufCAllocatorExt *ext;
+	uint8_t *block;
+	uintptr_t at;
+
+	assert(alignment != 0 && (alignment & (alignment - 1)) == 0);
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	ext = allocator_ext(allocator);
+	if (ext != NULL && ext->alloc_aligned != NULL)
+		return ext->alloc_aligned(ext->allocator_data, alignment, size);
+	block = do_alloc(allocator, size + ALIGNED_OVERHEAD(alignment));
+	if (block == NULL)
+		return NULL;
+	at = ((uintptr_t) block + sizeof(void *) + alignment - 1) &
+		~(uintptr_t) (alignment - 1);
+	((void **) at)[-1] = block;
+	return (void *) at;
+}
+
+void
+protobuf_c_allocator_free_aligned(ProtobufCAllocator *allocator,
+				  void *pointer, size_t alignment, size_t size)
+{
+	ProtobufCAllocatorExt *ext;
+
+	if (pointer == NULL)
+		return;
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	ext = allocator_ext(allocator);
+	if (ext != NULL && ext->alloc_aligned != NULL)
+		ext->free_sized(ext->allocator_data, pointer, size);
+	else
+		do_free(allocator, ((void **) pointer)[-1],
+			size + ALIGNED_OVERHEAD(alignment));
+}
+
+/* --- atomics --- */
+
+/*
+ * Atomic counters and spinlocks, for the reference counts of shared messages
+ * and the pool allocator. ATOMIC_ADD() is relaxed; ATOMIC_SUB() orders memory
+ * so that the thread dropping the last reference sees all earlier writes.
+ */
+#if defined(_MSC_VER)
+# include <intrin.h>
+typedef volatile long AtomicCount;
+# define ATOMIC_ADD(p, n)	(_InterlockedExchangeAdd((p), (long) (n)) + (long) (n))
+# define ATOMIC_SUB(p, n)	(_InterlockedExchangeAdd((p), -(long) (n)) - (long) (n))
+# define ATOMIC_LOAD(p)		(*(p))
+# define ATOMIC_TRYLOCK(p)	(_InterlockedExchange((p), 1) == 0)
+# define ATOMIC_UNLOCK(p)	_InterlockedExchange((p), 0)
+#elif defined(__GNUC__) || defined(__clang__)
+typedef size_t AtomicCount;
+# define ATOMIC_ADD(p, n)	__atomic_add_fetch((p), (n), __ATOMIC_RELAXED)
+# define ATOMIC_SUB(p, n)	__atomic_sub_fetch((p), (n), __ATOMIC_ACQ_REL)
+# define ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+# define ATOMIC_TRYLOCK(p)	(__atomic_exchange_n((p), 1, __ATOMIC_ACQUIRE) == 0)
+# define ATOMIC_UNLOCK(p)	__atomic_store_n((p), 0, __ATOMIC_RELEASE)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && \
+	!defined(__STDC_NO_ATOMICS__)
+# include <stdatomic.h>
+typedef atomic_size_t AtomicCount;
+# define ATOMIC_ADD(p, n)	(atomic_fetch_add((p), (n)) + (n))
+# define ATOMIC_SUB(p, n)	(atomic_fetch_sub((p), (n)) - (n))
+# define ATOMIC_LOAD(p)		atomic_load(p)
+# define ATOMIC_TRYLOCK(p)	(atomic_exchange((p), 1) == 0)
+# define ATOMIC_UNLOCK(p)	atomic_store((p), 0)
+#else
+/* No atomics available: the users of these are only safe on one thread. */
+typedef size_t AtomicCount;
+# define ATOMIC_ADD(p, n)	(*(p) += (n))
+# define ATOMIC_SUB(p, n)	(*(p) -= (n))
+# define ATOMIC_LOAD(p)		(*(p))
+# define ATOMIC_TRYLOCK(p)	(*(p) == 0 ? (*(p) = 1) : 0)
+# define ATOMIC_UNLOCK(p)	(*(p) = 0)
+#endif
+
+/*
+ * CPU_PAUSE() tells the processor that it is in a spin-wait loop, so that a
+ * sibling hardware thread holding the lock is not starved.
+ */
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+# define CPU_PAUSE()	_mm_pause()
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+# define CPU_PAUSE()	__yield()
+#elif (defined(__GNUC__) || defined(__clang__)) && \
+	(defined(__i386__) || defined(__x86_64__))
+# define CPU_PAUSE()	__builtin_ia32_pause()
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+# define CPU_PAUSE()	__asm__ __volatile__("yield")
+#else
+# define CPU_PAUSE()	((void) 0)
+#endif
+
+/* Spin on a plain load, so that waiters do not keep stealing the line. */
+static inline void
+spin_lock(AtomicCount *lock)
+{
+	while (!ATOMIC_TRYLOCK(lock)) {
+		while (ATOMIC_LOAD(lock) != 0)
+			CPU_PAUSE();
+	}
+}
+
+static inline void
+spin_unlock(AtomicCount *lock)
+{
+	ATOMIC_UNLOCK(lock);
+}
+
 /* === buffer-simple === */
 
 void
@@ -203,14 +424,18 @@ protobuf_c_buffer_simple_append(ProtobufCBuffer *buffer,
 			allocator = &protobuf_c__allocator;
 		while (new_alloced < new_len)
 			new_alloced += new_alloced;
-		new_data = do_alloc(allocator, new_alloced);
-		if (!new_data)
-			return;
-		memcpy(new_data, simp->data, simp->len);
-		if (simp->must_free_data)
-			do_free(allocator, simp->data);
-		else
+		if (simp->must_free_data) {
+			new_data = do_realloc(allocator, simp->data,
+					      simp->alloced, new_alloced);
+			if (!new_data)
+				return;
+		} else {
+			new_data = do_alloc(allocator, new_alloced);
+			if (!new_data)
+				return;
+			memcpy(new_data, simp->data, simp->len);
 			simp->must_free_data = TRUE;
+		}
 		simp->data = new_data;
 		simp->alloced = new_alloced;
 	}
@@ -218,944 +443,1081 @@ protobuf_c_buffer_simple_append(ProtobufCBuffer *buffer,
 	simp->len = new_len;
 }
 
-/**
- * \defgroup packedsz protobuf_c_message_get_packed_size() implementation
- *
- * Routines mainly used by protobuf_c_message_get_packed_size().
- *
- * \ingroup internal
- * @{
- */
+/* === interning === */
 
-/**
- * Return the number of bytes required to store the tag for the field. Includes
- * 3 bits for the wire-type, and a single bit that denotes the end-of-tag.
- *
- * \param number
- *      Field tag to encode.
- * \return
- *      Number of bytes required.
+/*
+ * An interning table is a chained hash table of reference-counted byte
+ * strings. Every value handed out by intern_value() is preceded in memory by
+ * its InternEntry, so releasing a value never needs a lookup by content.
  */
-static inline size_t
-get_tag_size(uint32_t number)
+typedef struct InternEntry InternEntry;
+struct InternEntry {
+	InternEntry *next;  /**< Next entry in the same bucket. */
+	uint32_t hash;      /**< Hash of the value bytes. */
+	size_t refcount;    /**< Number of message members sharing the value. */
+	size_t len;         /**< Value length, excluding the trailing NUL. */
+	/* followed by len + 1 bytes of value data */
+};
+
+struct ProtobufCIntern {
+	ProtobufCAllocator *allocator;
+	InternEntry **buckets;
+	size_t n_buckets;   /* always a power of two */
+	size_t n_entries;
+};
+
+#define INTERN_INITIAL_BUCKETS	64
+
+static inline uint32_t
+intern_hash(const uint8_t *data, size_t len)
 {
-	if (number < (1UL << 4)) {
-		return 1;
-	} else if (number < (1UL << 11)) {
-		return 2;
-	} else if (number < (1UL << 18)) {
-		return 3;
-	} else if (number < (1UL << 25)) {
-		return 4;
-	} else {
-		return 5;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 16777619U;
 	}
+	return h;
 }
 
-/**
- * Return the number of bytes required to store a variable-length unsigned
- * 32-bit integer in base-128 varint encoding.
- *
- * \param v
- *      Value to encode.
- * \return
- *      Number of bytes required.
- */
-static inline size_t
-uint32_size(uint32_t v)
+static void
+intern_grow(ProtobufCIntern *intern)
 {
-	if (v < (1UL << 7)) {
-		return 1;
-	} else if (v < (1UL << 14)) {
-		return 2;
-	} else if (v < (1UL << 21)) {
-		return 3;
-	} else if (v < (1UL << 28)) {
-		return 4;
-	} else {
-		return 5;
+	size_t new_n_buckets = intern->n_buckets * 2;
+	InternEntry **new_buckets;
+	size_t i;
+
+	new_buckets = do_alloc(intern->allocator,
+			       new_n_buckets * sizeof(InternEntry *));
+	if (new_buckets == NULL)
+		return; /* keep working with longer chains */
+	memset(new_buckets, 0, new_n_buckets * sizeof(InternEntry *));
+	for (i = 0; i < intern->n_buckets; i++) {
+		InternEntry *entry = intern->buckets[i];
+
+		while (entry != NULL) {
+			InternEntry *next = entry->next;
+			size_t b = entry->hash & (new_n_buckets - 1);
+
+			entry->next = new_buckets[b];
+			new_buckets[b] = entry;
+			entry = next;
+		}
 	}
+	do_free(intern->allocator, intern->buckets,
+		intern->n_buckets * sizeof(InternEntry *));
+	intern->buckets = new_buckets;
+	intern->n_buckets = new_n_buckets;
 }
 
-/**
- * Return the number of bytes required to store a variable-length signed 32-bit
- * integer in base-128 varint encoding.
- *
- * \param v
- *      Value to encode.
- * \return
- *      Number of bytes required.
+/*
+ * Return a NUL-terminated shared copy of `len` bytes at `data`, taking a
+ * reference on it.
  */
-static inline size_t
-int32_size(int32_t v)
+static uint8_t *
+intern_value(ProtobufCIntern *intern, const uint8_t *data, size_t len)
 {
-	if (v < 0) {
-		return 10;
-	} else if (v < (1L << 7)) {
-		return 1;
-	} else if (v < (1L << 14)) {
-		return 2;
-	} else if (v < (1L << 21)) {
-		return 3;
-	} else if (v < (1L << 28)) {
-		return 4;
-	} else {
-		return 5;
+	uint32_t hash = intern_hash(data, len);
+	InternEntry *entry;
+	size_t b = hash & (intern->n_buckets - 1);
+
+	for (entry = intern->buckets[b]; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && entry->len == len &&
+		    memcmp(entry + 1, data, len) == 0)
+		{
+			entry->refcount++;
+			return (uint8_t *) (entry + 1);
+		}
 	}
-}
 
-/**
- * Return the ZigZag-encoded 32-bit unsigned integer form of a 32-bit signed
- * integer.
- *
- * \param v
- *      Value to encode.
- * \return
- *      ZigZag encoded integer.
- */
-static inline uint32_t
-zigzag32(int32_t v)
-{
-	// Note:  Using unsigned types prevents undefined behavior
-	return ((uint32_t)v << 1) ^ -((uint32_t)v >> 31);
+	entry = do_alloc(intern->allocator, sizeof(InternEntry) + len + 1);
+	if (entry == NULL)
+		return NULL;
+	entry->hash = hash;
+	entry->refcount = 1;
+	entry->len = len;
+	memcpy(entry + 1, data, len);
+	((uint8_t *) (entry + 1))[len] = 0;
+	entry->next = intern->buckets[b];
+	intern->buckets[b] = entry;
+
+	if (++intern->n_entries > intern->n_buckets)
+		intern_grow(intern);
+	return (uint8_t *) (entry + 1);
 }
 
-/**
- * Return the number of bytes required to store a signed 32-bit integer,
- * converted to an unsigned 32-bit integer with ZigZag encoding, using base-128
- * varint encoding.
- *
- * \param v
- *      Value to encode.
- * \return
- *      Number of bytes required.
- */
-static inline size_t
-sint32_size(int32_t v)
+/* Drop a reference taken by intern_value(). */
+static void
+intern_release(ProtobufCIntern *intern, void *value)
 {
-	return uint32_size(zigzag32(v));
+	InternEntry *entry = (InternEntry *) value - 1;
+	InternEntry **pentry;
+
+	if (--entry->refcount != 0)
+		return;
+	pentry = &intern->buckets[entry->hash & (intern->n_buckets - 1)];
+	while (*pentry != entry)
+		pentry = &(*pentry)->next;
+	*pentry = entry->next;
+	intern->n_entries--;
+	do_free(intern->allocator, entry, sizeof(InternEntry) + entry->len + 1);
 }
 
-/**
- * Return the number of bytes required to store a 64-bit unsigned integer in
- * base-128 varint encoding.
- *
- * \param v
- *      Value to encode.
- * \return
- *      Number of bytes required.
- */
-static inline size_t
-uint64_size(uint64_t v)
+ProtobufCIntern *
+protobuf_c_intern_new(ProtobufCAllocator *allocator)
 {
-	uint32_t upper_v = (uint32_t) (v >> 32);
+	ProtobufCIntern *intern;
 
-	if (upper_v == 0) {
-		return uint32_size((uint32_t) v);
-	} else if (upper_v < (1UL << 3)) {
-		return 5;
-	} else if (upper_v < (1UL << 10)) {
-		return 6;
-	} else if (upper_v < (1UL << 17)) {
-		return 7;
-	} else if (upper_v < (1UL << 24)) {
-		return 8;
-	} else if (upper_v < (1UL << 31)) {
-		return 9;
-	} else {
-		return 10;
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	intern = do_alloc(allocator, sizeof(ProtobufCIntern));
+	if (intern == NULL)
+		return NULL;
+	intern->allocator = allocator;
+	intern->n_buckets = INTERN_INITIAL_BUCKETS;
+	intern->n_entries = 0;
+	intern->buckets = do_alloc(allocator,
+				   intern->n_buckets * sizeof(InternEntry *));
+	if (intern->buckets == NULL) {
+		do_free(allocator, intern, sizeof(ProtobufCIntern));
+		return NULL;
 	}
+	memset(intern->buckets, 0, intern->n_buckets * sizeof(InternEntry *));
+	return intern;
 }
 
-/**
- * Return the ZigZag-encoded 64-bit unsigned integer form of a 64-bit signed
- * integer.
- *
- * \param v
- *      Value to encode.
- * \return
- *      ZigZag encoded integer.
- */
-static inline uint64_t
-zigzag64(int64_t v)
+size_t
+protobuf_c_intern_get_n_values(const ProtobufCIntern *intern)
 {
-	// Note:  Using unsigned types prevents undefined behavior
-	return ((uint64_t)v << 1) ^ -((uint64_t)v >> 63);
+	return intern->n_entries;
 }
 
-/**
- * Return the number of bytes required to store a signed 64-bit integer,
- * converted to an unsigned 64-bit integer with ZigZag encoding, using base-128
- * varint encoding.
- *
- * \param v
- *      Value to encode.
- * \return
- *      Number of bytes required.
- */
-static inline size_t
-sint64_size(int64_t v)
+void
+protobuf_c_intern_free(ProtobufCIntern *intern)
 {
-	return uint64_size(zigzag64(v));
-}
+	size_t i;
 
-/**
- * Calculate the serialized size of a single required message field, including
- * the space needed by the preceding tag.
+	if (intern == NULL)
+		return;
+	for (i = 0; i < intern->n_buckets; i++) {
+		InternEntry *entry = intern->buckets[i];
+
+		while (entry != NULL) {
+			InternEntry *next = entry->next;
+			do_free(intern->allocator, entry,
+				sizeof(InternEntry) + entry->len + 1);
+			entry = next;
+		}
+	}
+	do_free(intern->allocator, intern->buckets,
+		intern->n_buckets * sizeof(InternEntry *));
+	do_free(intern->allocator, intern, sizeof(ProtobufCIntern));
+}
+
+/* === pool allocator === */
+
+/*
+ * The pool hands out blocks from per-size-class free lists, one class per
+ * distinct (aligned) sizeof_message of the registered descriptors. Every
+ * block is preceded by a PoolHeader naming its class, so a free never has to
+ * search. Requests that fit no class go straight to the backing allocator.
  *
- * \param field
- *      Field descriptor for member.
- * \param member
- *      Field to encode.
- * \return
- *      Number of bytes required.
+ * Free blocks are kept in shared lists protected by a spinlock and, where the
+ * compiler supports thread-local storage, in a per-thread cache that serves
+ * most allocations and frees without touching the lock. A thread caches
+ * blocks for up to POOL_CACHE_SLOTS pools at once. Pools are told apart by a
+ * unique id: when a slot is reused, or the thread calls
+ * protobuf_c_pool_thread_flush(), the cached blocks and unpublished hits go
+ * back to their pool if it is still on the list of live pools, and are
+ * simply dropped if the pool has been freed.
  */
-static size_t
-required_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-			       const void *member)
+#define POOL_MAX_CLASSES	32
+#define POOL_CHUNK_BLOCKS	64
+#define POOL_CACHE_MAX		64	/* blocks per class kept by a thread */
+#define POOL_STATS_BATCH	1024	/* thread-local hits published at once */
+#define POOL_CACHE_SLOTS	4	/* pools a thread caches blocks for */
+
+#if defined(_MSC_VER)
+# define POOL_THREAD_LOCAL	__declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+# define POOL_THREAD_LOCAL	__thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && \
+	!defined(__STDC_NO_THREADS__)
+# define POOL_THREAD_LOCAL	_Thread_local
+#endif
+
+/*
+ * `tag` is the size class of a pooled block, or POOL_MAX_CLASSES plus the
+ * requested size for a block from the backing allocator.
+ */
+typedef union {
+	size_t tag;
+	uint64_t align_u64;
+	double align_double;
+	void *align_ptr;
+} PoolHeader;
+
+#define POOL_ALIGN(size) \
+	(((size) + sizeof(PoolHeader) - 1) & ~(sizeof(PoolHeader) - 1))
+
+typedef union PoolChunk PoolChunk;
+union PoolChunk {
+	struct {
+		PoolChunk *next;
+		size_t size;
+	} c;
+	PoolHeader align;
+};
+
+/* Free blocks are linked through the first word of their payload. */
+#define POOL_NEXT(block)	(*(void **) (block))
+
+struct ProtobufCPool {
+	ProtobufCAllocator allocator;
+	ProtobufCAllocator *backing;
+	size_t id;
+	AtomicCount lock;
+	unsigned n_classes;
+	size_t class_size[POOL_MAX_CLASSES];
+	void *free_list[POOL_MAX_CLASSES];
+	PoolChunk *chunks;
+	AtomicCount n_hits;
+	AtomicCount n_misses;
+	AtomicCount n_bypasses;
+	ProtobufCPool *live_next;
+};
+
+static AtomicCount pool_last_id;
+
+/* Pools not yet freed, so that a thread's cache can tell if its pool is. */
+static ProtobufCPool *pool_live;
+static AtomicCount pool_live_lock;
+
+static inline void
+pool_lock(ProtobufCPool *pool)
 {
-	size_t rv = get_tag_size(field->id);
+	spin_lock(&pool->lock);
+}
 
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SINT32:
-		return rv + sint32_size(*(const int32_t *) member);
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		return rv + int32_size(*(const int32_t *) member);
-	case PROTOBUF_C_TYPE_UINT32:
-		return rv + uint32_size(*(const uint32_t *) member);
-	case PROTOBUF_C_TYPE_SINT64:
-		return rv + sint64_size(*(const int64_t *) member);
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		return rv + uint64_size(*(const uint64_t *) member);
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-		return rv + 4;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-		return rv + 8;
-	case PROTOBUF_C_TYPE_BOOL:
-		return rv + 1;
-	case PROTOBUF_C_TYPE_FLOAT:
-		return rv + 4;
-	case PROTOBUF_C_TYPE_DOUBLE:
-		return rv + 8;
-	case PROTOBUF_C_TYPE_STRING: {
-		const char *str = *(char * const *) member;
-		size_t len = str ? strlen(str) : 0;
-		return rv + uint32_size(len) + len;
-	}
-	case PROTOBUF_C_TYPE_BYTES: {
-		size_t len = ((const ProtobufCBinaryData *) member)->len;
-		return rv + uint32_size(len) + len;
-	}
-	case PROTOBUF_C_TYPE_MESSAGE: {
-		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
-		size_t subrv = msg ? protobuf_c_message_get_packed_size(msg) : 0;
-		return rv + uint32_size(subrv) + subrv;
-	}
+static inline void
+pool_unlock(ProtobufCPool *pool)
+{
+	spin_unlock(&pool->lock);
+}
+
+/* Smallest class that fits `size` without wasting more than half a block. */
+static int
+pool_size_class(const ProtobufCPool *pool, size_t size)
+{
+	int best = -1;
+	unsigned i;
+
+	for (i = 0; i < pool->n_classes; i++) {
+		size_t cs = pool->class_size[i];
+
+		if (cs >= size && cs / 2 <= size &&
+		    (best < 0 || cs < pool->class_size[best]))
+			best = i;
 	}
-	PROTOBUF_C__ASSERT_NOT_REACHED();
-	return 0;
+	return best;
 }
 
-/**
- * Calculate the serialized size of a single oneof message field, including
- * the space needed by the preceding tag. Returns 0 if the oneof field isn't
- * selected or is not set.
- *
- * \param field
- *      Field descriptor for member.
- * \param oneof_case
- *      Enum value that selects the field in the oneof.
- * \param member
- *      Field to encode.
- * \return
- *      Number of bytes required.
+/*
+ * Allocate a chunk of blocks of class `c` and push them onto `*list`.
+ * Called with the lock held.
  */
-static size_t
-oneof_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-			    uint32_t oneof_case,
-			    const void *member)
+static unsigned
+pool_carve(ProtobufCPool *pool, unsigned c, void **list)
 {
-	if (oneof_case != field->id) {
+	size_t stride = sizeof(PoolHeader) + pool->class_size[c];
+	size_t size = sizeof(PoolChunk) + POOL_CHUNK_BLOCKS * stride;
+	PoolChunk *chunk;
+	uint8_t *at;
+	unsigned i;
+
+	chunk = do_alloc(pool->backing, size);
+	if (chunk == NULL)
 		return 0;
+	chunk->c.next = pool->chunks;
+	chunk->c.size = size;
+	pool->chunks = chunk;
+	at = (uint8_t *) (chunk + 1);
+	for (i = 0; i < POOL_CHUNK_BLOCKS; i++, at += stride) {
+		PoolHeader *header = (PoolHeader *) at;
+
+		header->tag = c;
+		POOL_NEXT(header + 1) = *list;
+		*list = header + 1;
 	}
-	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
-	    field->type == PROTOBUF_C_TYPE_STRING)
-	{
-		const void *ptr = *(const void * const *) member;
-		if (ptr == NULL || ptr == field->default_value)
-			return 0;
-	}
-	return required_field_get_packed_size(field, member);
+	ATOMIC_ADD(&pool->n_misses, 1);
+	return POOL_CHUNK_BLOCKS;
 }
 
-/**
- * Calculate the serialized size of a single optional message field, including
- * the space needed by the preceding tag. Returns 0 if the optional field isn't
- * set.
- *
- * \param field
- *      Field descriptor for member.
- * \param has
- *      True if the field exists, false if not.
- * \param member
- *      Field to encode.
- * \return
- *      Number of bytes required.
+#ifdef POOL_THREAD_LOCAL
+typedef struct {
+	size_t pool_id;
+	void *free_list[POOL_MAX_CLASSES];
+	unsigned n_free[POOL_MAX_CLASSES];
+	size_t n_hits;
+} PoolCache;
+
+static POOL_THREAD_LOCAL PoolCache pool_cache[POOL_CACHE_SLOTS];
+static POOL_THREAD_LOCAL unsigned pool_cache_victim;
+
+static inline void
+pool_publish_hits(ProtobufCPool *pool, PoolCache *cache)
+{
+	ATOMIC_ADD(&pool->n_hits, cache->n_hits);
+	cache->n_hits = 0;
+}
+
+/*
+ * Empty a cache slot, handing its blocks and hits back to the pool they came
+ * from unless that pool has been freed. The live list lock is held
+ * throughout, so the pool cannot be freed while its lists are updated.
  */
-static size_t
-optional_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-			       const protobuf_c_boolean has,
-			       const void *member)
+static void
+pool_cache_release(PoolCache *cache)
 {
-	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
-	    field->type == PROTOBUF_C_TYPE_STRING)
-	{
-		const void *ptr = *(const void * const *) member;
-		if (ptr == NULL || ptr == field->default_value)
-			return 0;
-	} else {
-		if (!has)
-			return 0;
+	ProtobufCPool *pool;
+	unsigned c;
+
+	if (cache->pool_id == 0)
+		return;
+	spin_lock(&pool_live_lock);
+	for (pool = pool_live; pool != NULL; pool = pool->live_next)
+		if (pool->id == cache->pool_id)
+			break;
+	if (pool != NULL) {
+		pool_lock(pool);
+		for (c = 0; c < POOL_MAX_CLASSES; c++) {
+			void *tail = cache->free_list[c];
+
+			if (tail == NULL)
+				continue;
+			while (POOL_NEXT(tail) != NULL)
+				tail = POOL_NEXT(tail);
+			POOL_NEXT(tail) = pool->free_list[c];
+			pool->free_list[c] = cache->free_list[c];
+		}
+		pool_unlock(pool);
+		pool_publish_hits(pool, cache);
 	}
-	return required_field_get_packed_size(field, member);
+	spin_unlock(&pool_live_lock);
+	memset(cache, 0, sizeof(PoolCache));
 }
 
-static protobuf_c_boolean
-field_is_zeroish(const ProtobufCFieldDescriptor *field,
-		 const void *member)
+static inline PoolCache *
+pool_find_cache(const ProtobufCPool *pool)
 {
-	protobuf_c_boolean ret = FALSE;
+	unsigned i;
 
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_BOOL:
-		ret = (0 == *(const protobuf_c_boolean *) member);
-		break;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_SINT32:
-	case PROTOBUF_C_TYPE_INT32:
-	case PROTOBUF_C_TYPE_UINT32:
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-		ret = (0 == *(const uint32_t *) member);
-		break;
-	case PROTOBUF_C_TYPE_SINT64:
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-		ret = (0 == *(const uint64_t *) member);
-		break;
-	case PROTOBUF_C_TYPE_FLOAT:
-		ret = (0 == *(const float *) member);
-		break;
-	case PROTOBUF_C_TYPE_DOUBLE:
-		ret = (0 == *(const double *) member);
-		break;
-	case PROTOBUF_C_TYPE_STRING:
-		ret = (NULL == *(const char * const *) member) ||
-		      ('\0' == **(const char * const *) member);
-		break;
-	case PROTOBUF_C_TYPE_BYTES:
-	case PROTOBUF_C_TYPE_MESSAGE:
-		ret = (NULL == *(const void * const *) member);
-		break;
-	default:
-		ret = TRUE;
-		break;
-	}
+	for (i = 0; i < POOL_CACHE_SLOTS; i++)
+		if (pool_cache[i].pool_id == pool->id)
+			return &pool_cache[i];
+	return NULL;
+}
 
-	return ret;
+static PoolCache *
+pool_get_cache(ProtobufCPool *pool)
+{
+	PoolCache *cache = pool_find_cache(pool);
+	unsigned i;
+
+	if (cache != NULL)
+		return cache;
+	for (i = 0; i < POOL_CACHE_SLOTS; i++)
+		if (pool_cache[i].pool_id == 0)
+			break;
+	if (i == POOL_CACHE_SLOTS) {
+		i = pool_cache_victim;
+		pool_cache_victim = (i + 1) % POOL_CACHE_SLOTS;
+	}
+	cache = &pool_cache[i];
+	pool_cache_release(cache);
+	cache->pool_id = pool->id;
+	return cache;
 }
 
-/**
- * Calculate the serialized size of a single unlabeled message field, including
- * the space needed by the preceding tag. Returns 0 if the field isn't set or
- * if it is set to a "zeroish" value (null pointer or 0 for numerical values).
- * Unlabeled fields are supported only in proto3.
- *
- * \param field
- *      Field descriptor for member.
- * \param member
- *      Field to encode.
- * \return
- *      Number of bytes required.
+/*
+ * Move up to half a cache worth of blocks from the shared list into the
+ * thread's cache, carving a new chunk if the shared list is empty. Returns
+ * FALSE if no memory is available.
  */
-static size_t
-unlabeled_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-				const void *member)
+static protobuf_c_boolean
+pool_refill(ProtobufCPool *pool, PoolCache *cache, unsigned c,
+	    protobuf_c_boolean *carved)
 {
-	if (field_is_zeroish(field, member))
-		return 0;
-	return required_field_get_packed_size(field, member);
+	unsigned n = 0;
+
+	pool_lock(pool);
+	while (pool->free_list[c] != NULL && n < POOL_CACHE_MAX / 2) {
+		void *block = pool->free_list[c];
+
+		pool->free_list[c] = POOL_NEXT(block);
+		POOL_NEXT(block) = cache->free_list[c];
+		cache->free_list[c] = block;
+		n++;
+	}
+	*carved = FALSE;
+	if (n == 0) {
+		n = pool_carve(pool, c, &cache->free_list[c]);
+		*carved = TRUE;
+	}
+	pool_unlock(pool);
+	pool_publish_hits(pool, cache);
+	cache->n_free[c] += n;
+	return n != 0;
 }
 
-/**
- * Calculate the serialized size of repeated message fields, which may consist
- * of any number of values (including 0). Includes the space needed by the
- * preceding tags (as needed).
- *
- * \param field
- *      Field descriptor for member.
- * \param count
- *      Number of repeated field members.
- * \param member
- *      Field to encode.
- * \return
- *      Number of bytes required.
- */
-static size_t
-repeated_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-			       size_t count, const void *member)
+/* Give half of a full cache list back to the shared list. */
+static void
+pool_spill(ProtobufCPool *pool, PoolCache *cache, unsigned c)
 {
-	size_t header_size;
-	size_t rv = 0;
-	unsigned i;
-	void *array = *(void * const *) member;
+	unsigned n;
 
-	if (count == 0)
-		return 0;
-	header_size = get_tag_size(field->id);
-	if (0 == (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED))
-		header_size *= count;
+	pool_lock(pool);
+	for (n = 0; n < POOL_CACHE_MAX / 2; n++) {
+		void *block = cache->free_list[c];
 
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SINT32:
-		for (i = 0; i < count; i++)
-			rv += sint32_size(((int32_t *) array)[i]);
-		break;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		for (i = 0; i < count; i++)
-			rv += int32_size(((int32_t *) array)[i]);
-		break;
-	case PROTOBUF_C_TYPE_UINT32:
-		for (i = 0; i < count; i++)
-			rv += uint32_size(((uint32_t *) array)[i]);
-		break;
-	case PROTOBUF_C_TYPE_SINT64:
-		for (i = 0; i < count; i++)
-			rv += sint64_size(((int64_t *) array)[i]);
-		break;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		for (i = 0; i < count; i++)
-			rv += uint64_size(((uint64_t *) array)[i]);
-		break;
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		rv += 4 * count;
-		break;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		rv += 8 * count;
-		break;
-	case PROTOBUF_C_TYPE_BOOL:
-		rv += count;
-		break;
-	case PROTOBUF_C_TYPE_STRING:
-		for (i = 0; i < count; i++) {
-			size_t len = strlen(((char **) array)[i]);
-			rv += uint32_size(len) + len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_BYTES:
-		for (i = 0; i < count; i++) {
-			size_t len = ((ProtobufCBinaryData *) array)[i].len;
-			rv += uint32_size(len) + len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_MESSAGE:
-		for (i = 0; i < count; i++) {
-			size_t len = protobuf_c_message_get_packed_size(
-				((ProtobufCMessage **) array)[i]);
-			rv += uint32_size(len) + len;
-		}
-		break;
+		cache->free_list[c] = POOL_NEXT(block);
+		POOL_NEXT(block) = pool->free_list[c];
+		pool->free_list[c] = block;
 	}
+	pool_unlock(pool);
+	cache->n_free[c] -= n;
+}
+#endif /* POOL_THREAD_LOCAL */
 
-	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED))
-		header_size += uint32_size(rv);
-	return header_size + rv;
+static void *
+pool_alloc(void *allocator_data, size_t size)
+{
+	ProtobufCPool *pool = allocator_data;
+	int c = pool_size_class(pool, size);
+	void *block;
+
+	if (c < 0) {
+		PoolHeader *header = do_alloc(pool->backing,
+					      sizeof(PoolHeader) + size);
+		if (header == NULL)
+			return NULL;
+		header->tag = POOL_MAX_CLASSES + size;
+		ATOMIC_ADD(&pool->n_bypasses, 1);
+		return header + 1;
+	}
+
+#ifdef POOL_THREAD_LOCAL
+	{
+		PoolCache *cache = pool_get_cache(pool);
+
+		if (cache->n_free[c] == 0) {
+			protobuf_c_boolean carved;
+
+			if (!pool_refill(pool, cache, c, &carved))
+				return NULL;
+			if (!carved)
+				cache->n_hits++;
+		} else if (++cache->n_hits >= POOL_STATS_BATCH) {
+			pool_publish_hits(pool, cache);
+		}
+		block = cache->free_list[c];
+		cache->free_list[c] = POOL_NEXT(block);
+		cache->n_free[c]--;
+		return block;
+	}
+#else
+	pool_lock(pool);
+	if (pool->free_list[c] != NULL)
+		ATOMIC_ADD(&pool->n_hits, 1);
+	else
+		pool_carve(pool, c, &pool->free_list[c]);
+	block = pool->free_list[c];
+	if (block != NULL)
+		pool->free_list[c] = POOL_NEXT(block);
+	pool_unlock(pool);
+	return block;
+#endif
 }
 
-/**
- * Calculate the serialized size of an unknown field, i.e. one that is passed
- * through mostly uninterpreted. This is required for forward compatibility if
- * new fields are added to the message descriptor.
- *
- * \param field
- *      Unknown field type.
- * \return
- *      Number of bytes required.
- */
-static inline size_t
-unknown_field_get_packed_size(const ProtobufCMessageUnknownField *field)
+static void
+pool_free(void *allocator_data, void *data)
 {
-	return get_tag_size(field->tag) + field->len;
+	ProtobufCPool *pool = allocator_data;
+	PoolHeader *header = (PoolHeader *) data - 1;
+	size_t c = header->tag;
+
+	if (c >= POOL_MAX_CLASSES) {
+		do_free(pool->backing, header,
+			sizeof(PoolHeader) + c - POOL_MAX_CLASSES);
+		return;
+	}
+
+#ifdef POOL_THREAD_LOCAL
+	{
+		PoolCache *cache = pool_find_cache(pool);
+
+		if (cache == NULL)
+			goto shared;
+		POOL_NEXT(data) = cache->free_list[c];
+		cache->free_list[c] = data;
+		if (++cache->n_free[c] > POOL_CACHE_MAX)
+			pool_spill(pool, cache, c);
+		return;
+	}
+shared:
+#endif
+	pool_lock(pool);
+	POOL_NEXT(data) = pool->free_list[c];
+	pool->free_list[c] = data;
+	pool_unlock(pool);
 }
 
-/**@}*/
+ProtobufCPool *
+protobuf_c_pool_new(ProtobufCAllocator *backing)
+{
+	ProtobufCPool *pool;
 
-/*
- * Calculate the serialized size of the message.
- */
-size_t protobuf_c_message_get_packed_size(const ProtobufCMessage *message)
+	if (backing == NULL)
+		backing = &protobuf_c__allocator;
+	pool = do_alloc(backing, sizeof(ProtobufCPool));
+	if (pool == NULL)
+		return NULL;
+	memset(pool, 0, sizeof(ProtobufCPool));
+	pool->allocator.alloc = pool_alloc;
+	pool->allocator.free = pool_free;
+	pool->allocator.allocator_data = pool;
+	pool->backing = backing;
+	pool->id = ATOMIC_ADD(&pool_last_id, 1);
+	spin_lock(&pool_live_lock);
+	pool->live_next = pool_live;
+	pool_live = pool;
+	spin_unlock(&pool_live_lock);
+	return pool;
+}
+
+protobuf_c_boolean
+protobuf_c_pool_register(ProtobufCPool *pool,
+			 const ProtobufCMessageDescriptor *descriptor)
 {
+	size_t size;
 	unsigned i;
-	size_t rv = 0;
 
-	ASSERT_IS_MESSAGE(message);
-	for (i = 0; i < message->descriptor->n_fields; i++) {
-		const ProtobufCFieldDescriptor *field =
-			message->descriptor->fields + i;
-		const void *member =
-			((const char *) message) + field->offset;
-		const void *qmember =
-			((const char *) message) + field->quantifier_offset;
-
-		if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			rv += required_field_get_packed_size(field, member);
-		} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
-			    field->label == PROTOBUF_C_LABEL_NONE) &&
-			   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
-			rv += oneof_field_get_packed_size(
-				field,
-				*(const uint32_t *) qmember,
-				member
-			);
-		} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
-			rv += optional_field_get_packed_size(
-				field,
-				*(protobuf_c_boolean *) qmember,
-				member
-			);
-		} else if (field->label == PROTOBUF_C_LABEL_NONE) {
-			rv += unlabeled_field_get_packed_size(
-				field,
-				member
-			);
-		} else {
-			rv += repeated_field_get_packed_size(
-				field,
-				*(const size_t *) qmember,
-				member
-			);
-		}
+	ASSERT_IS_MESSAGE_DESCRIPTOR(descriptor);
+	size = POOL_ALIGN(descriptor->sizeof_message);
+	for (i = 0; i < pool->n_classes; i++)
+		if (pool->class_size[i] == size)
+			return TRUE;
+	if (pool->n_classes == POOL_MAX_CLASSES)
+		return FALSE;
+	/* classes are never reordered: live blocks refer to them by index */
+	pool->class_size[pool->n_classes++] = size;
+	return TRUE;
+}
+
+ProtobufCAllocator *
+protobuf_c_pool_get_allocator(ProtobufCPool *pool)
+{
+	return &pool->allocator;
+}
+
+void
+protobuf_c_pool_get_stats(ProtobufCPool *pool, ProtobufCPoolStats *stats)
+{
+#ifdef POOL_THREAD_LOCAL
+	PoolCache *cache = pool_find_cache(pool);
+
+	if (cache != NULL)
+		pool_publish_hits(pool, cache);
+#endif
+	stats->hits = ATOMIC_LOAD(&pool->n_hits);
+	stats->misses = ATOMIC_LOAD(&pool->n_misses);
+	stats->bypasses = ATOMIC_LOAD(&pool->n_bypasses);
+}
+
+void
+protobuf_c_pool_free(ProtobufCPool *pool)
+{
+	ProtobufCPool **link;
+	PoolChunk *chunk;
+
+	if (pool == NULL)
+		return;
+	spin_lock(&pool_live_lock);
+	for (link = &pool_live; *link != pool; link = &(*link)->live_next)
+		;
+	*link = pool->live_next;
+	spin_unlock(&pool_live_lock);
+#ifdef POOL_THREAD_LOCAL
+	{
+		PoolCache *cache = pool_find_cache(pool);
+
+		if (cache != NULL)
+			memset(cache, 0, sizeof(PoolCache));
 	}
-	for (i = 0; i < message->n_unknown_fields; i++)
-		rv += unknown_field_get_packed_size(&message->unknown_fields[i]);
-	return rv;
+#endif
+	chunk = pool->chunks;
+	while (chunk != NULL) {
+		PoolChunk *next = chunk->c.next;
+		do_free(pool->backing, chunk, chunk->c.size);
+		chunk = next;
+	}
+	do_free(pool->backing, pool, sizeof(ProtobufCPool));
+}
+
+void
+protobuf_c_pool_thread_flush(void)
+{
+#ifdef POOL_THREAD_LOCAL
+	unsigned i;
+
+	for (i = 0; i < POOL_CACHE_SLOTS; i++)
+		pool_cache_release(&pool_cache[i]);
+#endif
+}
+
+/* --- bit scanning --- */
+
+/*
+ * CLZ64() and CTZ64() count the leading and trailing zero bits of a non-zero
+ * 64-bit value in a single instruction where the compiler offers one. The
+ * varint routines fall back to compare chains and byte loops without them.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+# define CLZ64(v)	((unsigned) __builtin_clzll(v))
+# define CTZ64(v)	((unsigned) __builtin_ctzll(v))
+#elif defined(_MSC_VER) && defined(_WIN64)
+static inline unsigned
+clz64(uint64_t v)
+{
+	unsigned long i;
+	_BitScanReverse64(&i, v);
+	return 63 - (unsigned) i;
 }
+static inline unsigned
+ctz64(uint64_t v)
+{
+	unsigned long i;
+	_BitScanForward64(&i, v);
+	return (unsigned) i;
+}
+# define CLZ64(v)	clz64(v)
+# define CTZ64(v)	ctz64(v)
+#endif
+
+/*
+ * Varints are decoded a 64-bit word at a time on little-endian machines that
+ * can count trailing zeros cheaply.
+ */
+#if defined(CTZ64) && !defined(WORDS_BIGENDIAN)
+# define VARINT_WORD_DECODE 1
+#endif
+
+/*
+ * Arrays of varints are sized and encoded four elements at a time, and UTF-8
+ * strings are validated 32 bytes at a time, with AVX2 when the CPU supports
+ * it, as checked at runtime. Define
+ * PROTOBUF_C_DISABLE_SIMD to build without the vector kernels.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__) && \
+	defined(VARINT_WORD_DECODE) && !defined(PROTOBUF_C_DISABLE_SIMD)
+# include <immintrin.h>
+# define SIMD_AVX2 1
+# define SIMD_TARGET_AVX2	__attribute__((target("avx2")))
+# define SIMD_HAVE_AVX2()	__builtin_cpu_supports("avx2")
+#endif
 
 /**
- * \defgroup pack protobuf_c_message_pack() implementation
+ * \defgroup packedsz protobuf_c_message_get_packed_size() implementation
  *
- * Routines mainly used by protobuf_c_message_pack().
+ * Routines mainly used by protobuf_c_message_get_packed_size().
  *
  * \ingroup internal
  * @{
  */
 
 /**
- * Pack an unsigned 32-bit integer in base-128 varint encoding and return the
- * number of bytes written, which must be 5 or less.
+ * Return the number of bytes required to store a 64-bit unsigned integer in
+ * base-128 varint encoding.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static inline size_t
-uint32_pack(uint32_t value, uint8_t *out)
+uint64_size(uint64_t v)
 {
-	unsigned rv = 0;
+#ifdef CLZ64
+	/* one byte per started group of 7 significant bits: (bits + 6) / 7 */
+	return ((63 - CLZ64(v | 1)) * 9 + 73) / 64;
+#else
+	uint32_t upper_v = (uint32_t) (v >> 32);
 
-	if (value >= 0x80) {
-		out[rv++] = value | 0x80;
-		value >>= 7;
-		if (value >= 0x80) {
-			out[rv++] = value | 0x80;
-			value >>= 7;
-			if (value >= 0x80) {
-				out[rv++] = value | 0x80;
-				value >>= 7;
-				if (value >= 0x80) {
-					out[rv++] = value | 0x80;
-					value >>= 7;
-				}
-			}
-		}
+	if (upper_v == 0) {
+		if (v < (1UL << 7))
+			return 1;
+		else if (v < (1UL << 14))
+			return 2;
+		else if (v < (1UL << 21))
+			return 3;
+		else if (v < (1UL << 28))
+			return 4;
+		return 5;
+	} else if (upper_v < (1UL << 3)) {
+		return 5;
+	} else if (upper_v < (1UL << 10)) {
+		return 6;
+	} else if (upper_v < (1UL << 17)) {
+		return 7;
+	} else if (upper_v < (1UL << 24)) {
+		return 8;
+	} else if (upper_v < (1UL << 31)) {
+		return 9;
+	} else {
+		return 10;
 	}
-	/* assert: value<128 */
-	out[rv++] = value;
-	return rv;
+#endif
 }
 
 /**
- * Pack a signed 32-bit integer and return the number of bytes written,
- * passed as unsigned to avoid implementation-specific behavior.
- * Negative numbers are encoded as two's complement 64-bit integers.
+ * Return the number of bytes required to store the tag for the field. Includes
+ * 3 bits for the wire-type, and a single bit that denotes the end-of-tag.
  *
- * \param value
- *      Value to encode.
- * \param[out] out
- *      Packed value.
+ * \param number
+ *      Field tag to encode.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static inline size_t
-int32_pack(uint32_t value, uint8_t *out)
+get_tag_size(uint32_t number)
 {
-	if ((int32_t)value < 0) {
-		out[0] = value | 0x80;
-		out[1] = (value >> 7) | 0x80;
-		out[2] = (value >> 14) | 0x80;
-		out[3] = (value >> 21) | 0x80;
-		out[4] = (value >> 28) | 0xf0;
-		out[5] = out[6] = out[7] = out[8] = 0xff;
-		out[9] = 0x01;
-		return 10;
-	} else {
-		return uint32_pack(value, out);
-	}
+	return uint64_size((uint64_t) number << 3);
 }
 
 /**
- * Pack a signed 32-bit integer using ZigZag encoding and return the number of
- * bytes written.
+ * Return the number of bytes required to store a variable-length unsigned
+ * 32-bit integer in base-128 varint encoding.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static inline size_t
-sint32_pack(int32_t value, uint8_t *out)
+uint32_size(uint32_t v)
 {
-	return uint32_pack(zigzag32(value), out);
+#ifdef CLZ64
+	return uint64_size(v);
+#else
+	if (v < (1UL << 7)) {
+		return 1;
+	} else if (v < (1UL << 14)) {
+		return 2;
+	} else if (v < (1UL << 21)) {
+		return 3;
+	} else if (v < (1UL << 28)) {
+		return 4;
+	} else {
+		return 5;
+	}
+#endif
 }
 
 /**
- * Pack a 64-bit unsigned integer using base-128 varint encoding and return the
- * number of bytes written.
+ * Return the number of bytes required to store a variable-length signed 32-bit
+ * integer in base-128 varint encoding.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
-static size_t
-uint64_pack(uint64_t value, uint8_t *out)
+static inline size_t
+int32_size(int32_t v)
 {
-	uint32_t hi = (uint32_t) (value >> 32);
-	uint32_t lo = (uint32_t) value;
-	unsigned rv;
-
-	if (hi == 0)
-		return uint32_pack((uint32_t) lo, out);
-	out[0] = (lo) | 0x80;
-	out[1] = (lo >> 7) | 0x80;
-	out[2] = (lo >> 14) | 0x80;
-	out[3] = (lo >> 21) | 0x80;
-	if (hi < 8) {
-		out[4] = (hi << 4) | (lo >> 28);
-		return 5;
-	} else {
-		out[4] = ((hi & 7) << 4) | (lo >> 28) | 0x80;
-		hi >>= 3;
-	}
-	rv = 5;
-	while (hi >= 128) {
-		out[rv++] = hi | 0x80;
-		hi >>= 7;
-	}
-	out[rv++] = hi;
-	return rv;
-}
+	/* negative values are sign-extended to 64 bits */
+	return uint64_size((uint64_t) (int64_t) v);
+}
 
 /**
- * Pack a 64-bit signed integer in ZigZag encoding and return the number of
- * bytes written.
+ * Return the ZigZag-encoded 32-bit unsigned integer form of a 32-bit signed
+ * integer.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      ZigZag encoded integer.
  */
-static inline size_t
-sint64_pack(int64_t value, uint8_t *out)
+static inline uint32_t
+zigzag32(int32_t v)
 {
-	return uint64_pack(zigzag64(value), out);
+	// Note:  Using unsigned types prevents undefined behavior
+	return ((uint32_t)v << 1) ^ -((uint32_t)v >> 31);
 }
 
 /**
- * Pack a 32-bit quantity in little-endian byte order. Used for protobuf wire
- * types fixed32, sfixed32, float. Similar to "htole32".
+ * Return the number of bytes required to store a signed 32-bit integer,
+ * converted to an unsigned 32-bit integer with ZigZag encoding, using base-128
+ * varint encoding.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static inline size_t
-fixed32_pack(uint32_t value, void *out)
+sint32_size(int32_t v)
 {
-#if !defined(WORDS_BIGENDIAN)
-	memcpy(out, &value, 4);
-#else
-	uint8_t *buf = out;
-
-	buf[0] = value;
-	buf[1] = value >> 8;
-	buf[2] = value >> 16;
-	buf[3] = value >> 24;
-#endif
-	return 4;
+	return uint32_size(zigzag32(v));
 }
 
 /**
- * Pack a 64-bit quantity in little-endian byte order. Used for protobuf wire
- * types fixed64, sfixed64, double. Similar to "htole64".
- *
- * \todo The big-endian impl is really only good for 32-bit machines, a 64-bit
- * version would be appreciated, plus a way to decide to use 64-bit math where
- * convenient.
+ * Return the ZigZag-encoded 64-bit unsigned integer form of a 64-bit signed
+ * integer.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      ZigZag encoded integer.
  */
-static inline size_t
-fixed64_pack(uint64_t value, void *out)
+static inline uint64_t
+zigzag64(int64_t v)
 {
-#if !defined(WORDS_BIGENDIAN)
-	memcpy(out, &value, 8);
-#else
-	fixed32_pack(value, out);
-	fixed32_pack(value >> 32, ((char *) out) + 4);
-#endif
-	return 8;
+	// Note:  Using unsigned types prevents undefined behavior
+	return ((uint64_t)v << 1) ^ -((uint64_t)v >> 63);
 }
 
 /**
- * Pack a boolean value as an integer and return the number of bytes written.
- *
- * \todo Perhaps on some platforms *out = !!value would be a better impl, b/c
- * that is idiomatic C++ in some STL implementations.
+ * Return the number of bytes required to store a signed 64-bit integer,
+ * converted to an unsigned 64-bit integer with ZigZag encoding, using base-128
+ * varint encoding.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static inline size_t
-boolean_pack(protobuf_c_boolean value, uint8_t *out)
+sint64_size(int64_t v)
 {
-	*out = value ? TRUE : FALSE;
-	return 1;
+	return uint64_size(zigzag64(v));
 }
 
 /**
- * Pack a NUL-terminated C string and return the number of bytes written. The
- * output includes a length delimiter.
+ * Return element `i` of a repeated varint field as the unsigned 64-bit value
+ * that goes on the wire, i.e. sign-extended or ZigZag-encoded as the type
+ * requires.
  *
- * The NULL pointer is treated as an empty string. This isn't really necessary,
- * but it allows people to leave required strings blank. (See Issue #13 in the
- * bug tracker for a little more explanation).
- *
- * \param str
- *      String to encode.
- * \param[out] out
- *      Packed value.
+ * \param type
+ *      A varint type other than bool.
+ * \param array
+ *      The field's elements.
+ * \param i
+ *      Index of the element.
  * \return
- *      Number of bytes written to `out`.
+ *      Value to encode.
  */
-static inline size_t
-string_pack(const char *str, uint8_t *out)
+static inline uint64_t
+varint_array_get(ProtobufCType type, const void *array, size_t i)
 {
-	if (str == NULL) {
-		out[0] = 0;
-		return 1;
-	} else {
-		size_t len = strlen(str);
-		size_t rv = uint32_pack(len, out);
-		memcpy(out + rv, str, len);
-		return rv + len;
+	switch (type) {
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		return (uint64_t) (int64_t) ((const int32_t *) array)[i];
+	case PROTOBUF_C_TYPE_SINT32:
+		return zigzag32(((const int32_t *) array)[i]);
+	case PROTOBUF_C_TYPE_UINT32:
+		return ((const uint32_t *) array)[i];
+	case PROTOBUF_C_TYPE_SINT64:
+		return zigzag64(((const int64_t *) array)[i]);
+	default:
+		return ((const uint64_t *) array)[i];
 	}
 }
 
+#ifdef SIMD_AVX2
 /**
- * Pack a ProtobufCBinaryData and return the number of bytes written. The output
- * includes a length delimiter.
- *
- * \param bd
- *      ProtobufCBinaryData to encode.
- * \param[out] out
- *      Packed value.
- * \return
- *      Number of bytes written to `out`.
+ * Load elements `i` to `i + 3` of a repeated varint field as in
+ * varint_array_get().
  */
-static inline size_t
-binary_data_pack(const ProtobufCBinaryData *bd, uint8_t *out)
+SIMD_TARGET_AVX2 static inline __m256i
+varint_array_get4(ProtobufCType type, const void *array, size_t i)
 {
-	size_t len = bd->len;
-	size_t rv = uint32_pack(len, out);
-	memcpy(out + rv, bd->data, len);
-	return rv + len;
+	__m256i v, sign;
+
+	switch (type) {
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		return _mm256_cvtepi32_epi64(_mm_loadu_si128(
+			(const __m128i *) ((const int32_t *) array + i)));
+	case PROTOBUF_C_TYPE_SINT32:
+		v = _mm256_cvtepi32_epi64(_mm_loadu_si128(
+			(const __m128i *) ((const int32_t *) array + i)));
+		/* zigzag32() of the sign-extended value, truncated to 32 bits */
+		sign = _mm256_cmpgt_epi64(_mm256_setzero_si256(), v);
+		v = _mm256_xor_si256(_mm256_slli_epi64(v, 1), sign);
+		return _mm256_and_si256(v, _mm256_set1_epi64x(0xffffffff));
+	case PROTOBUF_C_TYPE_UINT32:
+		return _mm256_cvtepu32_epi64(_mm_loadu_si128(
+			(const __m128i *) ((const uint32_t *) array + i)));
+	case PROTOBUF_C_TYPE_SINT64:
+		v = _mm256_loadu_si256((const __m256i *) ((const int64_t *) array + i));
+		sign = _mm256_cmpgt_epi64(_mm256_setzero_si256(), v);
+		return _mm256_xor_si256(_mm256_slli_epi64(v, 1), sign);
+	default:
+		return _mm256_loadu_si256((const __m256i *) ((const uint64_t *) array + i));
+	}
 }
 
 /**
- * Pack a ProtobufCMessage and return the number of bytes written. The output
- * includes a length delimiter.
- *
- * \param message
- *      ProtobufCMessage object to pack.
- * \param[out] out
- *      Packed message.
- * \return
- *      Number of bytes written to `out`.
+ * Return the varint length of each of four values, as
+ * `1 + sum(v >= 2^(7k))` over k = 1..9 with unsigned compares.
  */
-static inline size_t
-prefixed_message_pack(const ProtobufCMessage *message, uint8_t *out)
+SIMD_TARGET_AVX2 static inline __m256i
+varint_size4(__m256i v)
 {
-	if (message == NULL) {
-		out[0] = 0;
-		return 1;
-	} else {
-		size_t rv = protobuf_c_message_pack(message, out + 1);
-		uint32_t rv_packed_size = uint32_size(rv);
-		if (rv_packed_size != 1)
-			memmove(out + rv_packed_size, out + 1, rv);
-		return uint32_pack(rv, out) + rv;
+	const __m256i bias = _mm256_set1_epi64x((long long) 0x8000000000000000ULL);
+	__m256i biased = _mm256_xor_si256(v, bias);
+	__m256i n = _mm256_set1_epi64x(1);
+	unsigned k;
+
+	for (k = 1; k <= 9; k++) {
+		__m256i limit = _mm256_set1_epi64x(
+			(long long) (((uint64_t) 1 << (7 * k)) - 1) ^
+			(long long) 0x8000000000000000ULL);
+		/* each true compare is -1 */
+		n = _mm256_sub_epi64(n, _mm256_cmpgt_epi64(biased, limit));
 	}
+	return n;
 }
 
+SIMD_TARGET_AVX2 static size_t
+varint_array_size_avx2(ProtobufCType type, const void *array, size_t count,
+		       size_t *done)
+{
+	__m256i sum = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4)
+		sum = _mm256_add_epi64(sum,
+			varint_size4(varint_array_get4(type, array, i)));
+	_mm256_storeu_si256((__m256i *) lanes, sum);
+	*done = i;
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#endif
+
 /**
- * Pack a field tag.
- *
- * Wire-type will be added in required_field_pack().
- *
- * \todo Just call uint64_pack on 64-bit platforms.
+ * Return the number of bytes required to store the elements of a repeated
+ * varint field, without tags or length prefix.
  *
- * \param id
- *      Tag value to encode.
- * \param[out] out
- *      Packed value.
+ * \param type
+ *      A varint type other than bool.
+ * \param array
+ *      The field's elements.
+ * \param count
+ *      Number of elements.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static size_t
-tag_pack(uint32_t id, uint8_t *out)
+varint_array_size(ProtobufCType type, const void *array, size_t count)
 {
-	if (id < (1UL << (32 - 3)))
-		return uint32_pack(id << 3, out);
-	else
-		return uint64_pack(((uint64_t) id) << 3, out);
+	size_t rv = 0;
+	size_t i = 0;
+
+#ifdef SIMD_AVX2
+	if (count >= 8 && SIMD_HAVE_AVX2())
+		rv = varint_array_size_avx2(type, array, count, &i);
+#endif
+	for (; i < count; i++)
+		rv += uint64_size(varint_array_get(type, array, i));
+	return rv;
 }
 
 /**
- * Pack a required field and return the number of bytes written.
+ * Calculate the serialized size of a single required message field, including
+ * the space needed by the preceding tag.
  *
  * \param field
- *      Field descriptor.
+ *      Field descriptor for member.
  * \param member
- *      The field member.
- * \param[out] out
- *      Packed value.
+ *      Field to encode.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static size_t
-required_field_pack(const ProtobufCFieldDescriptor *field,
-		    const void *member, uint8_t *out)
+required_field_get_packed_size(const ProtobufCFieldDescriptor *field,
+			       const void *member)
 {
-	size_t rv = tag_pack(field->id, out);
+	size_t rv = get_tag_size(field->id);
 
 	switch (field->type) {
 	case PROTOBUF_C_TYPE_SINT32:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + sint32_pack(*(const int32_t *) member, out + rv);
+		return rv + sint32_size(*(const int32_t *) member);
 	case PROTOBUF_C_TYPE_ENUM:
 	case PROTOBUF_C_TYPE_INT32:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + int32_pack(*(const int32_t *) member, out + rv);
+		return rv + int32_size(*(const int32_t *) member);
 	case PROTOBUF_C_TYPE_UINT32:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + uint32_pack(*(const uint32_t *) member, out + rv);
+		return rv + uint32_size(*(const uint32_t *) member);
 	case PROTOBUF_C_TYPE_SINT64:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + sint64_pack(*(const int64_t *) member, out + rv);
+		return rv + sint64_size(*(const int64_t *) member);
 	case PROTOBUF_C_TYPE_INT64:
 	case PROTOBUF_C_TYPE_UINT64:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + uint64_pack(*(const uint64_t *) member, out + rv);
+		return rv + uint64_size(*(const uint64_t *) member);
 	case PROTOBUF_C_TYPE_SFIXED32:
 	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_32BIT;
-		return rv + fixed32_pack(*(const uint32_t *) member, out + rv);
+		return rv + 4;
 	case PROTOBUF_C_TYPE_SFIXED64:
 	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_64BIT;
-		return rv + fixed64_pack(*(const uint64_t *) member, out + rv);
+		return rv + 8;
 	case PROTOBUF_C_TYPE_BOOL:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + boolean_pack(*(const protobuf_c_boolean *) member, out + rv);
-	case PROTOBUF_C_TYPE_STRING:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		return rv + string_pack(*(char *const *) member, out + rv);
-	case PROTOBUF_C_TYPE_BYTES:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		return rv + binary_data_pack((const ProtobufCBinaryData *) member, out + rv);
-	case PROTOBUF_C_TYPE_MESSAGE:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		return rv + prefixed_message_pack(*(ProtobufCMessage * const *) member, out + rv);
+		return rv + 1;
+	case PROTOBUF_C_TYPE_FLOAT:
+		return rv + 4;
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return rv + 8;
+	case PROTOBUF_C_TYPE_STRING: {
+		const char *str = *(char * const *) member;
+		size_t len = str ? strlen(str) : 0;
+		return rv + uint32_size(len) + len;
 	}
-	PROTOBUF_C__ASSERT_NOT_REACHED();
-	return 0;
+	case PROTOBUF_C_TYPE_BYTES: {
+		size_t len = ((const ProtobufCBinaryData *) member)->len;
+		return rv + uint32_size(len) + len;
+	}
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
+		size_t subrv = msg ? protobuf_c_message_get_packed_size(msg) : 0;
+		if (subrv == PACK_FAILED)
+			return PACK_FAILED;
+		return rv + uint32_size(subrv) + subrv;
+	}
+	}
+	PROTOBUF_C__ASSERT_NOT_REACHED();
+	return 0;
 }
 
 /**
- * Pack a oneof field and return the number of bytes written. Only packs the
- * field that is selected by the case enum.
+ * Calculate the serialized size of a single oneof message field, including
+ * the space needed by the preceding tag. Returns 0 if the oneof field isn't
+ * selected or is not set.
  *
  * \param field
- *      Field descriptor.
+ *      Field descriptor for member.
  * \param oneof_case
  *      Enum value that selects the field in the oneof.
  * \param member
- *      The field member.
- * \param[out] out
- *      Packed value.
+ *      Field to encode.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static size_t
-oneof_field_pack(const ProtobufCFieldDescriptor *field,
-		 uint32_t oneof_case,
-		 const void *member, uint8_t *out)
+oneof_field_get_packed_size(const ProtobufCFieldDescriptor *field,
+			    uint32_t oneof_case,
+			    const void *member)
 {
 	if (oneof_case != field->id) {
 		return 0;
@@ -1167,27 +1529,27 @@ oneof_field_pack(const ProtobufCFieldDescriptor *field,
 		if (ptr == NULL || ptr == field->default_value)
 			return 0;
 	}
-	return required_field_pack(field, member, out);
+	return required_field_get_packed_size(field, member);
 }
 
 /**
- * Pack an optional field and return the number of bytes written.
+ * Calculate the serialized size of a single optional message field, including
+ * the space needed by the preceding tag. Returns 0 if the optional field isn't
+ * set.
  *
  * \param field
- *      Field descriptor.
+ *      Field descriptor for member.
  * \param has
- *      Whether the field is set.
+ *      True if the field exists, false if not.
  * \param member
- *      The field member.
- * \param[out] out
- *      Packed value.
+ *      Field to encode.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static size_t
-optional_field_pack(const ProtobufCFieldDescriptor *field,
-		    const protobuf_c_boolean has,
-		    const void *member, uint8_t *out)
+optional_field_get_packed_size(const ProtobufCFieldDescriptor *field,
+			       const protobuf_c_boolean has,
+			       const void *member)
 {
 	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
 	    field->type == PROTOBUF_C_TYPE_STRING)
@@ -1199,2147 +1561,6489 @@ optional_field_pack(const ProtobufCFieldDescriptor *field,
 		if (!has)
 			return 0;
 	}
-	return required_field_pack(field, member, out);
+	return required_field_get_packed_size(field, member);
 }
 
-/**
- * Pack an unlabeled field and return the number of bytes written.
- *
- * \param field
- *      Field descriptor.
- * \param member
- *      The field member.
- * \param[out] out
- *      Packed value.
- * \return
- *      Number of bytes written to `out`.
- */
-static size_t
-unlabeled_field_pack(const ProtobufCFieldDescriptor *field,
-		     const void *member, uint8_t *out)
+static protobuf_c_boolean
+field_is_zeroish(ProtobufCType type, const void *member)
 {
-	if (field_is_zeroish(field, member))
-		return 0;
-	return required_field_pack(field, member, out);
-}
+	protobuf_c_boolean ret = FALSE;
 
-/**
- * Given a field type, return the in-memory size.
- *
- * \todo Implement as a table lookup.
- *
- * \param type
- *      Field type.
- * \return
- *      Size of the field.
- */
-static inline size_t
-sizeof_elt_in_repeated_array(ProtobufCType type)
-{
 	switch (type) {
+	case PROTOBUF_C_TYPE_BOOL:
+		ret = (0 == *(const protobuf_c_boolean *) member);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
 	case PROTOBUF_C_TYPE_SINT32:
 	case PROTOBUF_C_TYPE_INT32:
 	case PROTOBUF_C_TYPE_UINT32:
 	case PROTOBUF_C_TYPE_SFIXED32:
 	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-	case PROTOBUF_C_TYPE_ENUM:
-		return 4;
+		ret = (0 == *(const uint32_t *) member);
+		break;
 	case PROTOBUF_C_TYPE_SINT64:
 	case PROTOBUF_C_TYPE_INT64:
 	case PROTOBUF_C_TYPE_UINT64:
 	case PROTOBUF_C_TYPE_SFIXED64:
 	case PROTOBUF_C_TYPE_FIXED64:
+		ret = (0 == *(const uint64_t *) member);
+		break;
+	case PROTOBUF_C_TYPE_FLOAT:
+		ret = (0 == *(const float *) member);
+		break;
 	case PROTOBUF_C_TYPE_DOUBLE:
-		return 8;
-	case PROTOBUF_C_TYPE_BOOL:
-		return sizeof(protobuf_c_boolean);
+		ret = (0 == *(const double *) member);
+		break;
 	case PROTOBUF_C_TYPE_STRING:
-	case PROTOBUF_C_TYPE_MESSAGE:
-		return sizeof(void *);
+		ret = (NULL == *(const char * const *) member) ||
+		      ('\0' == **(const char * const *) member);
+		break;
 	case PROTOBUF_C_TYPE_BYTES:
-		return sizeof(ProtobufCBinaryData);
+	case PROTOBUF_C_TYPE_MESSAGE:
+		ret = (NULL == *(const void * const *) member);
+		break;
+	default:
+		ret = TRUE;
+		break;
 	}
-	PROTOBUF_C__ASSERT_NOT_REACHED();
-	return 0;
+
+	return ret;
 }
 
 /**
- * Pack an array of 32-bit quantities.
+ * Decide from the hot field data alone whether a field may contribute to the
+ * packed output. A FALSE result is definitive; a TRUE result still goes
+ * through the full per-label checks (e.g. against the default value).
  *
- * \param[out] out
- *      Destination.
- * \param[in] in
- *      Source.
- * \param[in] n
- *      Number of elements in the source array.
+ * \param message
+ *      The message containing the field.
+ * \param hot
+ *      Hot field data from the message descriptor's layout.
+ * \return
+ *      FALSE if the field is certainly absent.
  */
-static void
-copy_to_little_endian_32(void *out, const void *in, const unsigned n)
+static inline protobuf_c_boolean
+hot_field_maybe_present(const ProtobufCMessage *message,
+			const ProtobufCFieldHot *hot)
 {
-#if !defined(WORDS_BIGENDIAN)
-	memcpy(out, in, n * 4);
-#else
-	unsigned i;
-	const uint32_t *ini = in;
-	for (i = 0; i < n; i++)
-		fixed32_pack(ini[i], (uint32_t *) out + i);
-#endif
+	const void *member = ((const char *) message) + hot->offset;
+	const void *qmember = ((const char *) message) + hot->quantifier_offset;
+
+	if (hot->label == PROTOBUF_C_LABEL_REQUIRED)
+		return TRUE;
+	if (hot->label == PROTOBUF_C_LABEL_REPEATED)
+		return *(const size_t *) qmember != 0;
+	if (0 != (hot->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))
+		return *(const uint32_t *) qmember == hot->id;
+	if (hot->label == PROTOBUF_C_LABEL_NONE)
+		return !field_is_zeroish((ProtobufCType) hot->type, member);
+	if (hot->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    hot->type == PROTOBUF_C_TYPE_STRING)
+		return *(const void * const *) member != NULL;
+	return *(const protobuf_c_boolean *) qmember;
 }
 
 /**
- * Pack an array of 64-bit quantities.
- *
- * \param[out] out
- *      Destination.
- * \param[in] in
- *      Source.
- * \param[in] n
- *      Number of elements in the source array.
+ * Returns the hot field array of a message's descriptor, or NULL if it was
+ * generated without one.
  */
-static void
-copy_to_little_endian_64(void *out, const void *in, const unsigned n)
+static inline const ProtobufCFieldHot *
+hot_fields(const ProtobufCMessageDescriptor *desc)
 {
-#if !defined(WORDS_BIGENDIAN)
-	memcpy(out, in, n * 8);
-#else
-	unsigned i;
-	const uint64_t *ini = in;
-	for (i = 0; i < n; i++)
-		fixed64_pack(ini[i], (uint64_t *) out + i);
-#endif
+	return desc->layout != NULL ? desc->layout->fields : NULL;
 }
 
-/**
- * Get the minimum number of bytes required to pack a field value of a
- * particular type.
- *
- * \param type
- *      Field type.
- * \return
- *      Number of bytes.
+/*
+ * The packing functions walk a message tree without recursion: a PackWalk
+ * holds one frame per message on the path from the root, the first
+ * PACK_STACK_FRAMES of them on the C stack and any deeper ones in a heap
+ * array grown on demand.
  */
-static unsigned
-get_type_min_size(ProtobufCType type)
+#define PACK_STACK_FRAMES	16
+
+typedef struct {
+	const ProtobufCMessage *message;
+	const ProtobufCFieldHot *hot;
+	unsigned field;            /**< Field being packed. */
+	size_t elt;                /**< Values of that field visited so far. */
+	size_t size;               /**< Bytes counted, or offset of the body. */
+	size_t slot;               /**< Index of the message in PackSizes. */
+} PackFrame;
+
+typedef struct {
+	PackFrame *frames;
+	unsigned depth;            /**< Frames in use. */
+	unsigned n_frames;         /**< Frames available. */
+	PackFrame stack_frames[PACK_STACK_FRAMES];
+} PackWalk;
+
+/*
+ * Sizes of the sub-messages below a message in the order a walk enters them,
+ * so that protobuf_c_message_pack_to_buffer() can write each length prefix
+ * without sizing the sub-tree again.
+ */
+typedef struct {
+	size_t *sizes;
+	size_t n_sizes;            /**< Sizes recorded. */
+	size_t next;               /**< Sizes consumed. */
+	size_t max_sizes;          /**< Sizes the array can hold. */
+	protobuf_c_boolean failed; /**< Some size could not be recorded. */
+	size_t stack_sizes[PACK_STACK_FRAMES];
+} PackSizes;
+
+static inline void
+pack_walk_init(PackWalk *walk)
 {
-	if (type == PROTOBUF_C_TYPE_SFIXED32 ||
-	    type == PROTOBUF_C_TYPE_FIXED32 ||
-	    type == PROTOBUF_C_TYPE_FLOAT)
-	{
-		return 4;
+	walk->frames = walk->stack_frames;
+	walk->depth = 0;
+	walk->n_frames = PACK_STACK_FRAMES;
+}
+
+static inline void
+pack_walk_clear(PackWalk *walk)
+{
+	if (walk->frames != walk->stack_frames)
+		do_free(&protobuf_c__allocator, walk->frames,
+			walk->n_frames * sizeof(PackFrame));
+}
+
+static protobuf_c_boolean
+pack_walk_grow(PackWalk *walk)
+{
+	unsigned n_frames = walk->n_frames * 2;
+	PackFrame *frames;
+
+	frames = do_alloc(&protobuf_c__allocator, n_frames * sizeof(PackFrame));
+	if (frames == NULL)
+		return FALSE;
+	memcpy(frames, walk->frames, walk->depth * sizeof(PackFrame));
+	pack_walk_clear(walk);
+	walk->frames = frames;
+	walk->n_frames = n_frames;
+	return TRUE;
+}
+
+/*
+ * Push a frame for `message`. Returns NULL if the frame array cannot grow,
+ * in which case the caller gives up with PACK_FAILED: packing that message
+ * with a recursive call would put the depth back on the C stack.
+ */
+static inline PackFrame *
+pack_walk_push(PackWalk *walk, const ProtobufCMessage *message, size_t size)
+{
+	PackFrame *frame;
+
+	ASSERT_IS_MESSAGE(message);
+	if (walk->depth == walk->n_frames && !pack_walk_grow(walk))
+		return NULL;
+	frame = walk->frames + walk->depth++;
+	frame->message = message;
+	frame->hot = hot_fields(message->descriptor);
+	frame->field = 0;
+	frame->elt = 0;
+	frame->size = size;
+	frame->slot = 0;
+	return frame;
+}
+
+/*
+ * Reserve the next slot of `sizes`. Returns FALSE, and stops the recording,
+ * if the array cannot grow.
+ */
+static protobuf_c_boolean
+pack_sizes_reserve(PackSizes *sizes, size_t *slot)
+{
+	if (sizes->failed)
+		return FALSE;
+	if (sizes->n_sizes == sizes->max_sizes) {
+		size_t max_sizes = sizes->max_sizes * 2;
+		size_t *array;
+
+		array = do_alloc(&protobuf_c__allocator,
+				 max_sizes * sizeof(size_t));
+		if (array == NULL) {
+			sizes->failed = TRUE;
+			return FALSE;
+		}
+		memcpy(array, sizes->sizes, sizes->n_sizes * sizeof(size_t));
+		if (sizes->sizes != sizes->stack_sizes)
+			do_free(&protobuf_c__allocator, sizes->sizes,
+				sizes->max_sizes * sizeof(size_t));
+		sizes->sizes = array;
+		sizes->max_sizes = max_sizes;
 	}
-	if (type == PROTOBUF_C_TYPE_SFIXED64 ||
-	    type == PROTOBUF_C_TYPE_FIXED64 ||
-	    type == PROTOBUF_C_TYPE_DOUBLE)
-	{
-		return 8;
+	*slot = sizes->n_sizes++;
+	return TRUE;
+}
+
+/*
+ * Look for a value of the message field at index `i` of `frame` to descend
+ * into. If there is one it is returned in `*sub`, and `frame->field` is set to
+ * where the walk continues afterwards. A required or repeated value may be
+ * NULL, which is packed as an empty message.
+ */
+static inline protobuf_c_boolean
+pack_frame_next_message(PackFrame *frame, unsigned i,
+			const ProtobufCFieldDescriptor *field,
+			const ProtobufCMessage **sub)
+{
+	const char *message = (const char *) frame->message;
+	const void *member = message + field->offset;
+	const void *qmember = message + field->quantifier_offset;
+
+	if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+		if (frame->elt == *(const size_t *) qmember) {
+			frame->elt = 0;
+			return FALSE;
+		}
+		*sub = (*(ProtobufCMessage * const * const *) member)[frame->elt++];
+		frame->field = i;
+		return TRUE;
 	}
-	return 1;
+	*sub = *(ProtobufCMessage * const *) member;
+	frame->field = i + 1;
+	if (field->label == PROTOBUF_C_LABEL_REQUIRED)
+		return TRUE;
+	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) &&
+	    *(const uint32_t *) qmember != field->id)
+		return FALSE;
+	return *sub != NULL && *sub != field->default_value;
 }
 
 /**
- * Packs the elements of a repeated field and returns the serialised field and
- * its length.
+ * Calculate the serialized size of a single unlabeled message field, including
+ * the space needed by the preceding tag. Returns 0 if the field isn't set or
+ * if it is set to a "zeroish" value (null pointer or 0 for numerical values).
+ * Unlabeled fields are supported only in proto3.
  *
  * \param field
- *      Field descriptor.
- * \param count
- *      Number of elements in the repeated field array.
+ *      Field descriptor for member.
  * \param member
- *      Pointer to the elements for this repeated field.
- * \param[out] out
- *      Serialised representation of the repeated field.
+ *      Field to encode.
  * \return
- *      Number of bytes serialised to `out`.
+ *      Number of bytes required.
  */
 static size_t
-repeated_field_pack(const ProtobufCFieldDescriptor *field,
-		    size_t count, const void *member, uint8_t *out)
+unlabeled_field_get_packed_size(const ProtobufCFieldDescriptor *field,
+				const void *member)
 {
-	void *array = *(void * const *) member;
-	unsigned i;
-
-	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
-		unsigned header_len;
-		unsigned len_start;
-		unsigned min_length;
-		unsigned payload_len;
-		unsigned length_size_min;
-		unsigned actual_length_size;
-		uint8_t *payload_at;
-
-		if (count == 0)
-			return 0;
-		header_len = tag_pack(field->id, out);
-		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		len_start = header_len;
-		min_length = get_type_min_size(field->type) * count;
-		length_size_min = uint32_size(min_length);
-		header_len += length_size_min;
-		payload_at = out + header_len;
-
-		switch (field->type) {
-		case PROTOBUF_C_TYPE_SFIXED32:
-		case PROTOBUF_C_TYPE_FIXED32:
-		case PROTOBUF_C_TYPE_FLOAT:
-			copy_to_little_endian_32(payload_at, array, count);
-			payload_at += count * 4;
-			break;
-		case PROTOBUF_C_TYPE_SFIXED64:
-		case PROTOBUF_C_TYPE_FIXED64:
-		case PROTOBUF_C_TYPE_DOUBLE:
-			copy_to_little_endian_64(payload_at, array, count);
-			payload_at += count * 8;
-			break;
-		case PROTOBUF_C_TYPE_ENUM:
-		case PROTOBUF_C_TYPE_INT32: {
-			const int32_t *arr = (const int32_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += int32_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_SINT32: {
-			const int32_t *arr = (const int32_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += sint32_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_SINT64: {
-			const int64_t *arr = (const int64_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += sint64_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_UINT32: {
-			const uint32_t *arr = (const uint32_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += uint32_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_INT64:
-		case PROTOBUF_C_TYPE_UINT64: {
-			const uint64_t *arr = (const uint64_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += uint64_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_BOOL: {
-			const protobuf_c_boolean *arr = (const protobuf_c_boolean *) array;
-			for (i = 0; i < count; i++)
-				payload_at += boolean_pack(arr[i], payload_at);
-			break;
-		}
-		default:
-			PROTOBUF_C__ASSERT_NOT_REACHED();
-		}
-
-		payload_len = payload_at - (out + header_len);
-		actual_length_size = uint32_size(payload_len);
-		if (length_size_min != actual_length_size) {
-			assert(actual_length_size == length_size_min + 1);
-			memmove(out + header_len + 1, out + header_len,
-				payload_len);
-			header_len++;
-		}
-		uint32_pack(payload_len, out + len_start);
-		return header_len + payload_len;
-	} else {
-		/* not "packed" cased */
-		/* CONSIDER: optimize this case a bit (by putting the loop inside the switch) */
-		size_t rv = 0;
-		unsigned siz = sizeof_elt_in_repeated_array(field->type);
-
-		for (i = 0; i < count; i++) {
-			rv += required_field_pack(field, array, out + rv);
-			array = (char *)array + siz;
-		}
-		return rv;
-	}
-}
-
-static size_t
-unknown_field_pack(const ProtobufCMessageUnknownField *field, uint8_t *out)
-{
-	size_t rv = tag_pack(field->tag, out);
-	out[0] |= field->wire_type;
-	memcpy(out + rv, field->data, field->len);
-	return rv + field->len;
-}
-
-/**@}*/
-
-size_t
-protobuf_c_message_pack(const ProtobufCMessage *message, uint8_t *out)
-{
-	unsigned i;
-	size_t rv = 0;
-
-	ASSERT_IS_MESSAGE(message);
-	for (i = 0; i < message->descriptor->n_fields; i++) {
-		const ProtobufCFieldDescriptor *field =
-			message->descriptor->fields + i;
-		const void *member = ((const char *) message) + field->offset;
-
-		/*
-		 * It doesn't hurt to compute qmember (a pointer to the
-		 * quantifier field of the structure), but the pointer is only
-		 * valid if the field is:
-		 *  - a repeated field, or
-		 *  - a field that is part of a oneof
-		 *  - an optional field that isn't a pointer type
-		 * (Meaning: not a message or a string).
-		 */
-		const void *qmember =
-			((const char *) message) + field->quantifier_offset;
-
-		if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			rv += required_field_pack(field, member, out + rv);
-		} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
-			    field->label == PROTOBUF_C_LABEL_NONE) &&
-			   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
-			rv += oneof_field_pack(
-				field,
-				*(const uint32_t *) qmember,
-				member,
-				out + rv
-			);
-		} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
-			rv += optional_field_pack(
-				field,
-				*(const protobuf_c_boolean *) qmember,
-				member,
-				out + rv
-			);
-		} else if (field->label == PROTOBUF_C_LABEL_NONE) {
-			rv += unlabeled_field_pack(field, member, out + rv);
-		} else {
-			rv += repeated_field_pack(field, *(const size_t *) qmember,
-				member, out + rv);
-		}
-	}
-	for (i = 0; i < message->n_unknown_fields; i++)
-		rv += unknown_field_pack(&message->unknown_fields[i], out + rv);
-	return rv;
-}
-
-/**
- * \defgroup packbuf protobuf_c_message_pack_to_buffer() implementation
- *
- * Routines mainly used by protobuf_c_message_pack_to_buffer().
- *
- * \ingroup internal
- * @{
- */
+	if (field_is_zeroish(field->type, member))
+		return 0;
+	return required_field_get_packed_size(field, member);
+}
 
 /**
- * Pack a required field to a virtual buffer.
+ * Calculate the serialized size of repeated message fields, which may consist
+ * of any number of values (including 0). Includes the space needed by the
+ * preceding tags (as needed).
  *
  * \param field
- *      Field descriptor.
+ *      Field descriptor for member.
+ * \param count
+ *      Number of repeated field members.
  * \param member
- *      The element to be packed.
- * \param[out] buffer
- *      Virtual buffer to append data to.
+ *      Field to encode.
  * \return
- *      Number of bytes packed.
+ *      Number of bytes required.
  */
 static size_t
-required_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			      const void *member, ProtobufCBuffer *buffer)
+repeated_field_get_packed_size(const ProtobufCFieldDescriptor *field,
+			       size_t count, const void *member)
 {
-	size_t rv;
-	uint8_t scratch[MAX_UINT64_ENCODED_SIZE * 2];
+	size_t header_size;
+	size_t rv = 0;
+	unsigned i;
+	void *array = *(void * const *) member;
+
+	if (count == 0)
+		return 0;
+	header_size = get_tag_size(field->id);
+	if (0 == (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED))
+		header_size *= count;
 
-	rv = tag_pack(field->id, scratch);
 	switch (field->type) {
 	case PROTOBUF_C_TYPE_SINT32:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += sint32_pack(*(const int32_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
 	case PROTOBUF_C_TYPE_ENUM:
 	case PROTOBUF_C_TYPE_INT32:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += int32_pack(*(const int32_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
 	case PROTOBUF_C_TYPE_UINT32:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += uint32_pack(*(const uint32_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
 	case PROTOBUF_C_TYPE_SINT64:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += sint64_pack(*(const int64_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
 	case PROTOBUF_C_TYPE_INT64:
 	case PROTOBUF_C_TYPE_UINT64:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += uint64_pack(*(const uint64_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
+		rv += varint_array_size(field->type, array, count);
 		break;
 	case PROTOBUF_C_TYPE_SFIXED32:
 	case PROTOBUF_C_TYPE_FIXED32:
 	case PROTOBUF_C_TYPE_FLOAT:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_32BIT;
-		rv += fixed32_pack(*(const uint32_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
+		rv += 4 * count;
 		break;
 	case PROTOBUF_C_TYPE_SFIXED64:
 	case PROTOBUF_C_TYPE_FIXED64:
 	case PROTOBUF_C_TYPE_DOUBLE:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_64BIT;
-		rv += fixed64_pack(*(const uint64_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
+		rv += 8 * count;
 		break;
 	case PROTOBUF_C_TYPE_BOOL:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += boolean_pack(*(const protobuf_c_boolean *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
+		rv += count;
 		break;
-	case PROTOBUF_C_TYPE_STRING: {
-		const char *str = *(char *const *) member;
-		size_t sublen = str ? strlen(str) : 0;
-
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		rv += uint32_pack(sublen, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		buffer->append(buffer, sublen, (const uint8_t *) str);
-		rv += sublen;
+	case PROTOBUF_C_TYPE_STRING:
+		for (i = 0; i < count; i++) {
+			size_t len = strlen(((char **) array)[i]);
+			rv += uint32_size(len) + len;
+		}
 		break;
-	}
-	case PROTOBUF_C_TYPE_BYTES: {
-		const ProtobufCBinaryData *bd = ((const ProtobufCBinaryData *) member);
-		size_t sublen = bd->len;
-
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		rv += uint32_pack(sublen, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		buffer->append(buffer, sublen, bd->data);
-		rv += sublen;
+	case PROTOBUF_C_TYPE_BYTES:
+		for (i = 0; i < count; i++) {
+			size_t len = ((ProtobufCBinaryData *) array)[i].len;
+			rv += uint32_size(len) + len;
+		}
 		break;
-	}
-	case PROTOBUF_C_TYPE_MESSAGE: {
-		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
-		
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		if (msg == NULL) {
-			rv += uint32_pack(0, scratch + rv);
-			buffer->append(buffer, rv, scratch);
-		} else {
-			size_t sublen = protobuf_c_message_get_packed_size(msg);
-			rv += uint32_pack(sublen, scratch + rv);
-			buffer->append(buffer, rv, scratch);
-			protobuf_c_message_pack_to_buffer(msg, buffer);
-			rv += sublen;
+	case PROTOBUF_C_TYPE_MESSAGE:
+		for (i = 0; i < count; i++) {
+			size_t len = protobuf_c_message_get_packed_size(
+				((ProtobufCMessage **) array)[i]);
+			if (len == PACK_FAILED)
+				return PACK_FAILED;
+			rv += uint32_size(len) + len;
 		}
 		break;
 	}
-	default:
-		PROTOBUF_C__ASSERT_NOT_REACHED();
-	}
-	return rv;
+
+	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED))
+		header_size += uint32_size(rv);
+	return header_size + rv;
 }
 
 /**
- * Pack a oneof field to a buffer. Only packs the field that is selected by the case enum.
+ * Calculate the serialized size of an unknown field, i.e. one that is passed
+ * through mostly uninterpreted. This is required for forward compatibility if
+ * new fields are added to the message descriptor.
  *
  * \param field
- *      Field descriptor.
- * \param oneof_case
- *      Enum value that selects the field in the oneof.
- * \param member
- *      The element to be packed.
- * \param[out] buffer
- *      Virtual buffer to append data to.
+ *      Unknown field type.
  * \return
- *      Number of bytes serialised to `buffer`.
+ *      Number of bytes required.
  */
-static size_t
-oneof_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			   uint32_t oneof_case,
-			   const void *member, ProtobufCBuffer *buffer)
+static inline size_t
+unknown_field_get_packed_size(const ProtobufCMessageUnknownField *field)
 {
-	if (oneof_case != field->id) {
-		return 0;
+	return get_tag_size(field->tag) + field->len;
+}
+
+/*
+ * Calculate the serialized size of a single field that is not a message.
+ */
+static inline size_t
+field_get_packed_size(const ProtobufCMessage *message,
+		      const ProtobufCFieldDescriptor *field)
+{
+	const void *member = ((const char *) message) + field->offset;
+	const void *qmember = ((const char *) message) + field->quantifier_offset;
+
+	if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+		return required_field_get_packed_size(field, member);
+	} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
+		    field->label == PROTOBUF_C_LABEL_NONE) &&
+		   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
+		return oneof_field_get_packed_size(
+			field,
+			*(const uint32_t *) qmember,
+			member
+		);
+	} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
+		return optional_field_get_packed_size(
+			field,
+			*(protobuf_c_boolean *) qmember,
+			member
+		);
+	} else if (field->label == PROTOBUF_C_LABEL_NONE) {
+		return unlabeled_field_get_packed_size(
+			field,
+			member
+		);
+	} else {
+		return repeated_field_get_packed_size(
+			field,
+			*(const size_t *) qmember,
+			member
+		);
 	}
-	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
-	    field->type == PROTOBUF_C_TYPE_STRING)
-	{
-		const void *ptr = *(const void *const *) member;
-		if (ptr == NULL || ptr == field->default_value)
-			return 0;
+}
+
+/*
+ * Calculate the serialized size of the message, recording the size of each
+ * sub-message in `sizes` if that is not NULL. Returns PACK_FAILED if the walk
+ * cannot grow.
+ */
+static size_t
+message_get_packed_size(const ProtobufCMessage *message, PackSizes *sizes)
+{
+	PackWalk walk;
+	size_t rv = 0;
+
+	pack_walk_init(&walk);
+	pack_walk_push(&walk, message, 0);
+	while (walk.depth > 0) {
+		PackFrame *frame = walk.frames + walk.depth - 1;
+		const ProtobufCMessage *current = frame->message;
+		const ProtobufCMessageDescriptor *desc = current->descriptor;
+		const ProtobufCFieldHot *hot = frame->hot;
+		const ProtobufCFieldDescriptor *field = NULL;
+		const ProtobufCMessage *sub = NULL;
+		size_t size = frame->size;
+		size_t slot;
+		unsigned i;
+
+		for (i = frame->field; i < desc->n_fields; i++) {
+			if (hot != NULL && !hot_field_maybe_present(current, hot + i))
+				continue;
+			field = desc->fields + i;
+			if (field->type != PROTOBUF_C_TYPE_MESSAGE) {
+				size += field_get_packed_size(current, field);
+				continue;
+			}
+			if (pack_frame_next_message(frame, i, field, &sub))
+				break;
+		}
+		frame->size = size;
+
+		if (i < desc->n_fields) {
+			/* the length prefix is added once the size is known */
+			frame->size += get_tag_size(field->id);
+			if (sub == NULL) {
+				frame->size += 1;
+			} else if (pack_walk_push(&walk, sub, 0) == NULL) {
+				pack_walk_clear(&walk);
+				return PACK_FAILED;
+			} else if (sizes != NULL &&
+				   pack_sizes_reserve(sizes, &slot)) {
+				/* `frame` may have moved with the push */
+				walk.frames[walk.depth - 1].slot = slot;
+			}
+			continue;
+		}
+
+		for (i = 0; i < current->n_unknown_fields; i++)
+			frame->size += unknown_field_get_packed_size(
+				&current->unknown_fields[i]);
+		rv = frame->size;
+		if (--walk.depth > 0) {
+			frame[-1].size += uint32_size(rv) + rv;
+			if (sizes != NULL && !sizes->failed)
+				sizes->sizes[frame->slot] = rv;
+		}
 	}
-	return required_field_pack_to_buffer(field, member, buffer);
+	pack_walk_clear(&walk);
+	return rv;
+}
+
+/**@}*/
+
+size_t protobuf_c_message_get_packed_size(const ProtobufCMessage *message)
+{
+	return message_get_packed_size(message, NULL);
 }
 
 /**
- * Pack an optional field to a buffer.
+ * \defgroup pack protobuf_c_message_pack() implementation
  *
- * \param field
- *      Field descriptor.
- * \param has
- *      Whether the field is set.
- * \param member
- *      The element to be packed.
- * \param[out] buffer
- *      Virtual buffer to append data to.
+ * Routines mainly used by protobuf_c_message_pack().
+ *
+ * \ingroup internal
+ * @{
+ */
+
+/**
+ * Pack an unsigned 32-bit integer in base-128 varint encoding and return the
+ * number of bytes written, which must be 5 or less.
+ *
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
  * \return
- *      Number of bytes serialised to `buffer`.
+ *      Number of bytes written to `out`.
  */
-static size_t
-optional_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			      const protobuf_c_boolean has,
-			      const void *member, ProtobufCBuffer *buffer)
+static inline size_t
+uint32_pack(uint32_t value, uint8_t *out)
 {
-	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
-	    field->type == PROTOBUF_C_TYPE_STRING)
-	{
-		const void *ptr = *(const void *const *) member;
-		if (ptr == NULL || ptr == field->default_value)
-			return 0;
+	unsigned rv = 0;
+
+	if (value >= 0x80) {
+		out[rv++] = value | 0x80;
+		value >>= 7;
+		if (value >= 0x80) {
+			out[rv++] = value | 0x80;
+			value >>= 7;
+			if (value >= 0x80) {
+				out[rv++] = value | 0x80;
+				value >>= 7;
+				if (value >= 0x80) {
+					out[rv++] = value | 0x80;
+					value >>= 7;
+				}
+			}
+		}
+	}
+	/* assert: value<128 */
+	out[rv++] = value;
+	return rv;
+}
+
+/**
+ * Pack a signed 32-bit integer and return the number of bytes written,
+ * passed as unsigned to avoid implementation-specific behavior.
+ * Negative numbers are encoded as two's complement 64-bit integers.
+ *
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+int32_pack(uint32_t value, uint8_t *out)
+{
+	if ((int32_t)value < 0) {
+		out[0] = value | 0x80;
+		out[1] = (value >> 7) | 0x80;
+		out[2] = (value >> 14) | 0x80;
+		out[3] = (value >> 21) | 0x80;
+		out[4] = (value >> 28) | 0xf0;
+		out[5] = out[6] = out[7] = out[8] = 0xff;
+		out[9] = 0x01;
+		return 10;
 	} else {
-		if (!has)
-			return 0;
+		return uint32_pack(value, out);
 	}
-	return required_field_pack_to_buffer(field, member, buffer);
 }
 
 /**
- * Pack an unlabeled field to a buffer.
+ * Pack a signed 32-bit integer using ZigZag encoding and return the number of
+ * bytes written.
  *
- * \param field
- *      Field descriptor.
- * \param member
- *      The element to be packed.
- * \param[out] buffer
- *      Virtual buffer to append data to.
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
  * \return
- *      Number of bytes serialised to `buffer`.
+ *      Number of bytes written to `out`.
  */
-static size_t
-unlabeled_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			       const void *member, ProtobufCBuffer *buffer)
+static inline size_t
+sint32_pack(int32_t value, uint8_t *out)
 {
-	if (field_is_zeroish(field, member))
-		return 0;
-	return required_field_pack_to_buffer(field, member, buffer);
+	return uint32_pack(zigzag32(value), out);
 }
 
 /**
- * Get the packed size of an array of same field type.
+ * Pack a 64-bit unsigned integer using base-128 varint encoding and return the
+ * number of bytes written.
  *
- * \param field
- *      Field descriptor.
- * \param count
- *      Number of elements of this type.
- * \param array
- *      The elements to get the size of.
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
  * \return
- *      Number of bytes required.
+ *      Number of bytes written to `out`.
  */
-static size_t
-get_packed_payload_length(const ProtobufCFieldDescriptor *field,
-			  unsigned count, const void *array)
+static inline size_t
+uint64_pack(uint64_t value, uint8_t *out)
 {
-	unsigned rv = 0;
-	unsigned i;
+	size_t rv = 0;
 
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		return count * 4;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		return count * 8;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32: {
-		const int32_t *arr = (const int32_t *) array;
-		for (i = 0; i < count; i++)
-			rv += int32_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_SINT32: {
-		const int32_t *arr = (const int32_t *) array;
-		for (i = 0; i < count; i++)
-			rv += sint32_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_UINT32: {
-		const uint32_t *arr = (const uint32_t *) array;
-		for (i = 0; i < count; i++)
-			rv += uint32_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_SINT64: {
-		const int64_t *arr = (const int64_t *) array;
-		for (i = 0; i < count; i++)
-			rv += sint64_size(arr[i]);
-		break;
+	while (value >= 0x80) {
+		out[rv++] = (uint8_t) value | 0x80;
+		value >>= 7;
 	}
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64: {
-		const uint64_t *arr = (const uint64_t *) array;
-		for (i = 0; i < count; i++)
-			rv += uint64_size(arr[i]);
-		break;
+	out[rv++] = (uint8_t) value;
+	return rv;
+}
+
+/**
+ * Pack a 64-bit signed integer in ZigZag encoding and return the number of
+ * bytes written.
+ *
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+sint64_pack(int64_t value, uint8_t *out)
+{
+	return uint64_pack(zigzag64(value), out);
+}
+
+#ifdef SIMD_AVX2
+/**
+ * Encode the elements of a repeated varint field four at a time, storing each
+ * as a full 8-byte word. Stops before the last 11 elements, so that the bytes
+ * stored past the end of a varint are always overwritten by the varints that
+ * follow it. Blocks holding a value of 9 bytes or more are encoded one by
+ * one.
+ */
+SIMD_TARGET_AVX2 static size_t
+varint_array_pack_avx2(ProtobufCType type, const void *array, size_t count,
+		       uint8_t *out, size_t *done)
+{
+	const __m256i ones = _mm256_set1_epi64x(-1);
+	const __m256i cont = _mm256_set1_epi64x((long long) 0x8080808080808080ULL);
+	uint8_t *at = out;
+	size_t i;
+
+	for (i = 0; i + 12 <= count; i += 4) {
+		__m256i v = varint_array_get4(type, array, i);
+		__m256i n, x, hi;
+		__m128i x_lo, x_hi, n_lo, n_hi;
+		size_t o1, o2, o3;
+		unsigned k;
+
+		hi = _mm256_srli_epi64(v, 56);
+		if (!_mm256_testz_si256(hi, hi)) {
+			for (k = 0; k < 4; k++)
+				at += uint64_pack(varint_array_get(type, array, i + k), at);
+			continue;
+		}
+		/* 1 + sum(v >= 2^(7k)) for k = 1..7; signed compares suffice */
+		n = _mm256_set1_epi64x(1);
+		for (k = 1; k <= 7; k++)
+			n = _mm256_sub_epi64(n, _mm256_cmpgt_epi64(v,
+				_mm256_set1_epi64x(((long long) 1 << (7 * k)) - 1)));
+		x = _mm256_or_si256(
+			_mm256_and_si256(v, _mm256_set1_epi64x(0x000000000fffffffLL)),
+			_mm256_slli_epi64(_mm256_and_si256(v,
+				_mm256_set1_epi64x(0x00fffffff0000000LL)), 4));
+		x = _mm256_or_si256(
+			_mm256_and_si256(x, _mm256_set1_epi64x(0x00003fff00003fffLL)),
+			_mm256_slli_epi64(_mm256_and_si256(x,
+				_mm256_set1_epi64x(0x0fffc0000fffc000LL)), 2));
+		x = _mm256_or_si256(
+			_mm256_and_si256(x, _mm256_set1_epi64x(0x007f007f007f007fLL)),
+			_mm256_slli_epi64(_mm256_and_si256(x,
+				_mm256_set1_epi64x(0x3f803f803f803f80LL)), 1));
+		/* continuation bits on all but the last byte of each varint */
+		x = _mm256_or_si256(x, _mm256_andnot_si256(
+			_mm256_sllv_epi64(ones, _mm256_slli_epi64(
+				_mm256_sub_epi64(n, _mm256_set1_epi64x(1)), 3)),
+			cont));
+
+		/* offsets of the four varints, then four independent stores */
+		x_lo = _mm256_castsi256_si128(x);
+		x_hi = _mm256_extracti128_si256(x, 1);
+		n_lo = _mm256_castsi256_si128(n);
+		n_hi = _mm256_extracti128_si256(n, 1);
+		o1 = (size_t) _mm_cvtsi128_si64(n_lo);
+		o2 = o1 + (size_t) _mm_extract_epi64(n_lo, 1);
+		o3 = o2 + (size_t) _mm_cvtsi128_si64(n_hi);
+		_mm_storel_epi64((__m128i *) at, x_lo);
+		_mm_storel_epi64((__m128i *) (at + o1), _mm_unpackhi_epi64(x_lo, x_lo));
+		_mm_storel_epi64((__m128i *) (at + o2), x_hi);
+		_mm_storel_epi64((__m128i *) (at + o3), _mm_unpackhi_epi64(x_hi, x_hi));
+		at += o3 + (size_t) _mm_extract_epi64(n_hi, 1);
 	}
-	case PROTOBUF_C_TYPE_BOOL:
-		return count;
-	default:
-		PROTOBUF_C__ASSERT_NOT_REACHED();
+	*done = i;
+	return at - out;
+}
+#endif
+
+/**
+ * Encode the elements of a repeated varint field back to back, as the payload
+ * of a packed field.
+ *
+ * \param type
+ *      A varint type other than bool.
+ * \param array
+ *      The field's elements.
+ * \param count
+ *      Number of elements.
+ * \param[out] out
+ *      Packed payload, of varint_array_size() bytes.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static size_t
+varint_array_pack(ProtobufCType type, const void *array, size_t count,
+		  uint8_t *out)
+{
+	uint8_t *at = out;
+	size_t i = 0;
+
+#ifdef SIMD_AVX2
+	if (count >= 12 && SIMD_HAVE_AVX2())
+		at += varint_array_pack_avx2(type, array, count, out, &i);
+#endif
+	for (; i < count; i++)
+		at += uint64_pack(varint_array_get(type, array, i), at);
+	return at - out;
+}
+
+/**
+ * Pack a 32-bit quantity in little-endian byte order. Used for protobuf wire
+ * types fixed32, sfixed32, float. Similar to "htole32".
+ *
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+fixed32_pack(uint32_t value, void *out)
+{
+#if !defined(WORDS_BIGENDIAN)
+	memcpy(out, &value, 4);
+#else
+	uint8_t *buf = out;
+
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+#endif
+	return 4;
+}
+
+/**
+ * Pack a 64-bit quantity in little-endian byte order. Used for protobuf wire
+ * types fixed64, sfixed64, double. Similar to "htole64".
+ *
+ * \todo The big-endian impl is really only good for 32-bit machines, a 64-bit
+ * version would be appreciated, plus a way to decide to use 64-bit math where
+ * convenient.
+ *
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+fixed64_pack(uint64_t value, void *out)
+{
+#if !defined(WORDS_BIGENDIAN)
+	memcpy(out, &value, 8);
+#else
+	fixed32_pack(value, out);
+	fixed32_pack(value >> 32, ((char *) out) + 4);
+#endif
+	return 8;
+}
+
+/**
+ * Pack a boolean value as an integer and return the number of bytes written.
+ *
+ * \todo Perhaps on some platforms *out = !!value would be a better impl, b/c
+ * that is idiomatic C++ in some STL implementations.
+ *
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+boolean_pack(protobuf_c_boolean value, uint8_t *out)
+{
+	*out = value ? TRUE : FALSE;
+	return 1;
+}
+
+/**
+ * Pack a NUL-terminated C string and return the number of bytes written. The
+ * output includes a length delimiter.
+ *
+ * The NULL pointer is treated as an empty string. This isn't really necessary,
+ * but it allows people to leave required strings blank. (See Issue #13 in the
+ * bug tracker for a little more explanation).
+ *
+ * \param str
+ *      String to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+string_pack(const char *str, uint8_t *out)
+{
+	if (str == NULL) {
+		out[0] = 0;
+		return 1;
+	} else {
+		size_t len = strlen(str);
+		size_t rv = uint32_pack(len, out);
+		memcpy(out + rv, str, len);
+		return rv + len;
+	}
+}
+
+/**
+ * Pack a ProtobufCBinaryData and return the number of bytes written. The output
+ * includes a length delimiter.
+ *
+ * \param bd
+ *      ProtobufCBinaryData to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+binary_data_pack(const ProtobufCBinaryData *bd, uint8_t *out)
+{
+	size_t len = bd->len;
+	size_t rv = uint32_pack(len, out);
+	memcpy(out + rv, bd->data, len);
+	return rv + len;
+}
+
+/**
+ * Pack a ProtobufCMessage and return the number of bytes written. The output
+ * includes a length delimiter.
+ *
+ * \param message
+ *      ProtobufCMessage object to pack.
+ * \param[out] out
+ *      Packed message.
+ * \return
+ *      Number of bytes written to `out`, or PACK_FAILED.
+ */
+static size_t message_pack(const ProtobufCMessage *message, uint8_t *out);
+
+static inline size_t
+prefixed_message_pack(const ProtobufCMessage *message, uint8_t *out)
+{
+	if (message == NULL) {
+		out[0] = 0;
+		return 1;
+	} else {
+		size_t rv = message_pack(message, out + 1);
+		uint32_t rv_packed_size;
+		if (rv == PACK_FAILED)
+			return PACK_FAILED;
+		rv_packed_size = uint32_size(rv);
+		if (rv_packed_size != 1)
+			memmove(out + rv_packed_size, out + 1, rv);
+		return uint32_pack(rv, out) + rv;
+	}
+}
+
+/**
+ * Pack a field tag.
+ *
+ * Wire-type will be added in required_field_pack().
+ *
+ * \todo Just call uint64_pack on 64-bit platforms.
+ *
+ * \param id
+ *      Tag value to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static size_t
+tag_pack(uint32_t id, uint8_t *out)
+{
+	if (id < (1UL << (32 - 3)))
+		return uint32_pack(id << 3, out);
+	else
+		return uint64_pack(((uint64_t) id) << 3, out);
+}
+
+/**
+ * Pack a required field and return the number of bytes written.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param member
+ *      The field member.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static size_t
+required_field_pack(const ProtobufCFieldDescriptor *field,
+		    const void *member, uint8_t *out)
+{
+	size_t rv = tag_pack(field->id, out);
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SINT32:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + sint32_pack(*(const int32_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + int32_pack(*(const int32_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_UINT32:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + uint32_pack(*(const uint32_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_SINT64:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + sint64_pack(*(const int64_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + uint64_pack(*(const uint64_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_32BIT;
+		return rv + fixed32_pack(*(const uint32_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_64BIT;
+		return rv + fixed64_pack(*(const uint64_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_BOOL:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + boolean_pack(*(const protobuf_c_boolean *) member, out + rv);
+	case PROTOBUF_C_TYPE_STRING:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		return rv + string_pack(*(char *const *) member, out + rv);
+	case PROTOBUF_C_TYPE_BYTES:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		return rv + binary_data_pack((const ProtobufCBinaryData *) member, out + rv);
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		size_t len;
+
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		len = prefixed_message_pack(*(ProtobufCMessage * const *) member, out + rv);
+		return len == PACK_FAILED ? PACK_FAILED : rv + len;
+	}
+	}
+	PROTOBUF_C__ASSERT_NOT_REACHED();
+	return 0;
+}
+
+/**
+ * Pack a oneof field and return the number of bytes written. Only packs the
+ * field that is selected by the case enum.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param oneof_case
+ *      Enum value that selects the field in the oneof.
+ * \param member
+ *      The field member.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static size_t
+oneof_field_pack(const ProtobufCFieldDescriptor *field,
+		 uint32_t oneof_case,
+		 const void *member, uint8_t *out)
+{
+	if (oneof_case != field->id) {
+		return 0;
+	}
+	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    field->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void * const *) member;
+		if (ptr == NULL || ptr == field->default_value)
+			return 0;
+	}
+	return required_field_pack(field, member, out);
+}
+
+/**
+ * Pack an optional field and return the number of bytes written.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param has
+ *      Whether the field is set.
+ * \param member
+ *      The field member.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static size_t
+optional_field_pack(const ProtobufCFieldDescriptor *field,
+		    const protobuf_c_boolean has,
+		    const void *member, uint8_t *out)
+{
+	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    field->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void * const *) member;
+		if (ptr == NULL || ptr == field->default_value)
+			return 0;
+	} else {
+		if (!has)
+			return 0;
+	}
+	return required_field_pack(field, member, out);
+}
+
+/**
+ * Pack an unlabeled field and return the number of bytes written.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param member
+ *      The field member.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static size_t
+unlabeled_field_pack(const ProtobufCFieldDescriptor *field,
+		     const void *member, uint8_t *out)
+{
+	if (field_is_zeroish(field->type, member))
+		return 0;
+	return required_field_pack(field, member, out);
+}
+
+/**
+ * Given a field type, return the in-memory size.
+ *
+ * \todo Implement as a table lookup.
+ *
+ * \param type
+ *      Field type.
+ * \return
+ *      Size of the field.
+ */
+static inline size_t
+sizeof_elt_in_repeated_array(ProtobufCType type)
+{
+	switch (type) {
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+	case PROTOBUF_C_TYPE_ENUM:
+		return 4;
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return 8;
+	case PROTOBUF_C_TYPE_BOOL:
+		return sizeof(protobuf_c_boolean);
+	case PROTOBUF_C_TYPE_STRING:
+	case PROTOBUF_C_TYPE_MESSAGE:
+		return sizeof(void *);
+	case PROTOBUF_C_TYPE_BYTES:
+		return sizeof(ProtobufCBinaryData);
+	}
+	PROTOBUF_C__ASSERT_NOT_REACHED();
+	return 0;
+}
+
+/**
+ * Pack an array of 32-bit quantities.
+ *
+ * \param[out] out
+ *      Destination.
+ * \param[in] in
+ *      Source.
+ * \param[in] n
+ *      Number of elements in the source array.
+ */
+static void
+copy_to_little_endian_32(void *out, const void *in, const unsigned n)
+{
+#if !defined(WORDS_BIGENDIAN)
+	memcpy(out, in, n * 4);
+#else
+	unsigned i;
+	const uint32_t *ini = in;
+	for (i = 0; i < n; i++)
+		fixed32_pack(ini[i], (uint32_t *) out + i);
+#endif
+}
+
+/**
+ * Pack an array of 64-bit quantities.
+ *
+ * \param[out] out
+ *      Destination.
+ * \param[in] in
+ *      Source.
+ * \param[in] n
+ *      Number of elements in the source array.
+ */
+static void
+copy_to_little_endian_64(void *out, const void *in, const unsigned n)
+{
+#if !defined(WORDS_BIGENDIAN)
+	memcpy(out, in, n * 8);
+#else
+	unsigned i;
+	const uint64_t *ini = in;
+	for (i = 0; i < n; i++)
+		fixed64_pack(ini[i], (uint64_t *) out + i);
+#endif
+}
+
+/**
+ * Get the minimum number of bytes required to pack a field value of a
+ * particular type.
+ *
+ * \param type
+ *      Field type.
+ * \return
+ *      Number of bytes.
+ */
+static unsigned
+get_type_min_size(ProtobufCType type)
+{
+	if (type == PROTOBUF_C_TYPE_SFIXED32 ||
+	    type == PROTOBUF_C_TYPE_FIXED32 ||
+	    type == PROTOBUF_C_TYPE_FLOAT)
+	{
+		return 4;
+	}
+	if (type == PROTOBUF_C_TYPE_SFIXED64 ||
+	    type == PROTOBUF_C_TYPE_FIXED64 ||
+	    type == PROTOBUF_C_TYPE_DOUBLE)
+	{
+		return 8;
+	}
+	return 1;
+}
+
+/**
+ * Packs the elements of a repeated field and returns the serialised field and
+ * its length.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param count
+ *      Number of elements in the repeated field array.
+ * \param member
+ *      Pointer to the elements for this repeated field.
+ * \param[out] out
+ *      Serialised representation of the repeated field.
+ * \return
+ *      Number of bytes serialised to `out`.
+ */
+static size_t
+repeated_field_pack(const ProtobufCFieldDescriptor *field,
+		    size_t count, const void *member, uint8_t *out)
+{
+	void *array = *(void * const *) member;
+	unsigned i;
+
+	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
+		unsigned header_len;
+		unsigned len_start;
+		unsigned min_length;
+		unsigned payload_len;
+		unsigned length_size_min;
+		unsigned actual_length_size;
+		uint8_t *payload_at;
+
+		if (count == 0)
+			return 0;
+		header_len = tag_pack(field->id, out);
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		len_start = header_len;
+		min_length = get_type_min_size(field->type) * count;
+		length_size_min = uint32_size(min_length);
+		header_len += length_size_min;
+		payload_at = out + header_len;
+
+		switch (field->type) {
+		case PROTOBUF_C_TYPE_SFIXED32:
+		case PROTOBUF_C_TYPE_FIXED32:
+		case PROTOBUF_C_TYPE_FLOAT:
+			copy_to_little_endian_32(payload_at, array, count);
+			payload_at += count * 4;
+			break;
+		case PROTOBUF_C_TYPE_SFIXED64:
+		case PROTOBUF_C_TYPE_FIXED64:
+		case PROTOBUF_C_TYPE_DOUBLE:
+			copy_to_little_endian_64(payload_at, array, count);
+			payload_at += count * 8;
+			break;
+		case PROTOBUF_C_TYPE_ENUM:
+		case PROTOBUF_C_TYPE_INT32:
+		case PROTOBUF_C_TYPE_SINT32:
+		case PROTOBUF_C_TYPE_SINT64:
+		case PROTOBUF_C_TYPE_UINT32:
+		case PROTOBUF_C_TYPE_INT64:
+		case PROTOBUF_C_TYPE_UINT64:
+			payload_at += varint_array_pack(field->type, array, count,
+							payload_at);
+			break;
+		case PROTOBUF_C_TYPE_BOOL: {
+			const protobuf_c_boolean *arr = (const protobuf_c_boolean *) array;
+			for (i = 0; i < count; i++)
+				payload_at += boolean_pack(arr[i], payload_at);
+			break;
+		}
+		default:
+			PROTOBUF_C__ASSERT_NOT_REACHED();
+		}
+
+		payload_len = payload_at - (out + header_len);
+		actual_length_size = uint32_size(payload_len);
+		if (length_size_min != actual_length_size) {
+			assert(actual_length_size == length_size_min + 1);
+			memmove(out + header_len + 1, out + header_len,
+				payload_len);
+			header_len++;
+		}
+		uint32_pack(payload_len, out + len_start);
+		return header_len + payload_len;
+	} else {
+		/* not "packed" cased */
+		/* CONSIDER: optimize this case a bit (by putting the loop inside the switch) */
+		size_t rv = 0;
+		unsigned siz = sizeof_elt_in_repeated_array(field->type);
+
+		for (i = 0; i < count; i++) {
+			size_t len = required_field_pack(field, array, out + rv);
+			if (len == PACK_FAILED)
+				return PACK_FAILED;
+			rv += len;
+			array = (char *)array + siz;
+		}
+		return rv;
+	}
+}
+
+static size_t
+unknown_field_pack(const ProtobufCMessageUnknownField *field, uint8_t *out)
+{
+	size_t rv = tag_pack(field->tag, out);
+	out[0] |= field->wire_type;
+	memcpy(out + rv, field->data, field->len);
+	return rv + field->len;
+}
+
+/**
+ * Pack a single field that is not a message and return the number of bytes
+ * written.
+ */
+static inline size_t
+field_pack(const ProtobufCMessage *message,
+	   const ProtobufCFieldDescriptor *field, uint8_t *out)
+{
+	const void *member = ((const char *) message) + field->offset;
+
+	/*
+	 * It doesn't hurt to compute qmember (a pointer to the
+	 * quantifier field of the structure), but the pointer is only
+	 * valid if the field is:
+	 *  - a repeated field, or
+	 *  - a field that is part of a oneof
+	 *  - an optional field that isn't a pointer type
+	 * (Meaning: not a message or a string).
+	 */
+	const void *qmember = ((const char *) message) + field->quantifier_offset;
+
+	if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+		return required_field_pack(field, member, out);
+	} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
+		    field->label == PROTOBUF_C_LABEL_NONE) &&
+		   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
+		return oneof_field_pack(
+			field,
+			*(const uint32_t *) qmember,
+			member,
+			out
+		);
+	} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
+		return optional_field_pack(
+			field,
+			*(const protobuf_c_boolean *) qmember,
+			member,
+			out
+		);
+	} else if (field->label == PROTOBUF_C_LABEL_NONE) {
+		return unlabeled_field_pack(field, member, out);
+	} else {
+		return repeated_field_pack(field, *(const size_t *) qmember,
+			member, out);
+	}
+}
+
+/**@}*/
+
+/*
+ * Each sub-message is packed behind a one byte length prefix. When the frame
+ * is left the body is moved up if its length needs a longer prefix, as
+ * prefixed_message_pack() does. Returns PACK_FAILED if the walk cannot grow.
+ */
+static size_t
+message_pack(const ProtobufCMessage *message, uint8_t *out)
+{
+	PackWalk walk;
+	size_t rv = 0;
+
+	pack_walk_init(&walk);
+	pack_walk_push(&walk, message, 0);
+	while (walk.depth > 0) {
+		PackFrame *frame = walk.frames + walk.depth - 1;
+		const ProtobufCMessage *current = frame->message;
+		const ProtobufCMessageDescriptor *desc = current->descriptor;
+		const ProtobufCFieldHot *hot = frame->hot;
+		const ProtobufCFieldDescriptor *field = NULL;
+		const ProtobufCMessage *sub = NULL;
+		uint8_t *body;
+		uint32_t prefix_len;
+		size_t len;
+		unsigned i;
+
+		for (i = frame->field; i < desc->n_fields; i++) {
+			if (hot != NULL && !hot_field_maybe_present(current, hot + i))
+				continue;
+			field = desc->fields + i;
+			if (field->type != PROTOBUF_C_TYPE_MESSAGE) {
+				rv += field_pack(current, field, out + rv);
+				continue;
+			}
+			if (pack_frame_next_message(frame, i, field, &sub))
+				break;
+		}
+
+		if (i < desc->n_fields) {
+			len = tag_pack(field->id, out + rv);
+			out[rv] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+			rv += len;
+			if (sub == NULL)
+				out[rv++] = 0;
+			else if (pack_walk_push(&walk, sub, rv + 1) != NULL)
+				rv++;
+			else
+				break;
+			continue;
+		}
+
+		for (i = 0; i < current->n_unknown_fields; i++)
+			rv += unknown_field_pack(&current->unknown_fields[i],
+						 out + rv);
+		if (--walk.depth == 0)
+			break;
+		body = out + frame->size;
+		len = rv - frame->size;
+		prefix_len = uint32_size(len);
+		if (prefix_len != 1) {
+			memmove(body - 1 + prefix_len, body, len);
+			rv += prefix_len - 1;
+		}
+		uint32_pack(len, body - 1);
+	}
+	if (walk.depth > 0)
+		rv = PACK_FAILED;
+	pack_walk_clear(&walk);
+	return rv;
+}
+
+size_t
+protobuf_c_message_pack(const ProtobufCMessage *message, uint8_t *out)
+{
+	size_t rv = message_pack(message, out);
+
+	return rv == PACK_FAILED ? 0 : rv;
+}
+
+/* Fewest elements for which a repeated field is packed or unpacked in parallel. */
+#define DEFAULT_PARALLEL_MIN	256
+
+/** Shared by the tasks of one parallel pack. */
+typedef struct ParallelPack {
+	ProtobufCMessage * const *elements;
+	size_t *positions;         /**< Size of each element, then its offset. */
+	uint8_t *out;
+	AtomicCount failed;        /**< Elements that could not be packed. */
+} ParallelPack;
+
+static void
+pack_parallel_size_task(void *task_data, size_t i)
+{
+	ParallelPack *pp = task_data;
+	const ProtobufCMessage *element = pp->elements[i];
+
+	pp->positions[i] = element != NULL ?
+		protobuf_c_message_get_packed_size(element) : 0;
+}
+
+static void
+pack_parallel_task(void *task_data, size_t i)
+{
+	ParallelPack *pp = task_data;
+
+	if (pp->elements[i] != NULL &&
+	    message_pack(pp->elements[i], pp->out + pp->positions[i]) ==
+	    PACK_FAILED)
+		ATOMIC_ADD(&pp->failed, 1);
+}
+
+/*
+ * Pack the elements of a repeated message field with an executor: size every
+ * element in parallel, lay out the tags and length prefixes serially, then
+ * pack every element straight into its place in parallel. Falls back to a
+ * serial pack if the sizes cannot be allocated. Returns PACK_FAILED if some
+ * element cannot be packed.
+ */
+static size_t
+repeated_message_pack_parallel(const ProtobufCFieldDescriptor *field,
+			       size_t count, const void *member, uint8_t *out,
+			       ProtobufCExecutor *executor)
+{
+	ParallelPack pp;
+	size_t rv = 0;
+	size_t i;
+
+	pp.elements = *(ProtobufCMessage * const * const *) member;
+	pp.out = out;
+	pp.failed = 0;
+	pp.positions = do_alloc(&protobuf_c__allocator, count * sizeof(size_t));
+	if (pp.positions == NULL)
+		return repeated_field_pack(field, count, member, out);
+
+	executor->run(executor, count, pack_parallel_size_task, &pp);
+	for (i = 0; i < count; i++) {
+		size_t size = pp.positions[i];
+		size_t len;
+
+		if (size == PACK_FAILED) {
+			rv = PACK_FAILED;
+			goto done;
+		}
+		len = tag_pack(field->id, out + rv);
+		out[rv] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		rv += len;
+		rv += uint32_pack(size, out + rv);
+		pp.positions[i] = rv;
+		rv += size;
+	}
+	executor->run(executor, count, pack_parallel_task, &pp);
+	if (ATOMIC_LOAD(&pp.failed) != 0)
+		rv = PACK_FAILED;
+
+done:
+	do_free(&protobuf_c__allocator, pp.positions, count * sizeof(size_t));
+	return rv;
+}
+
+size_t
+protobuf_c_message_pack_parallel(const ProtobufCMessage *message,
+				 uint8_t *out, ProtobufCExecutor *executor)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	size_t rv = 0;
+	unsigned i;
+
+	ASSERT_IS_MESSAGE(message);
+	if (executor == NULL)
+		return protobuf_c_message_pack(message, out);
+	for (i = 0; i < desc->n_fields; i++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + i;
+		const char *base = (const char *) message;
+		size_t len;
+
+		if (field->label == PROTOBUF_C_LABEL_REPEATED &&
+		    field->type == PROTOBUF_C_TYPE_MESSAGE &&
+		    STRUCT_MEMBER(size_t, base, field->quantifier_offset) >=
+		    DEFAULT_PARALLEL_MIN)
+		{
+			len = repeated_message_pack_parallel(field,
+				STRUCT_MEMBER(size_t, base, field->quantifier_offset),
+				base + field->offset, out + rv, executor);
+		} else {
+			len = field_pack(message, field, out + rv);
+		}
+		if (len == PACK_FAILED)
+			return 0;
+		rv += len;
+	}
+	for (i = 0; i < message->n_unknown_fields; i++)
+		rv += unknown_field_pack(&message->unknown_fields[i], out + rv);
+	return rv;
+}
+
+/**
+ * \defgroup packbuf protobuf_c_message_pack_to_buffer() implementation
+ *
+ * Routines mainly used by protobuf_c_message_pack_to_buffer().
+ *
+ * \ingroup internal
+ * @{
+ */
+
+static size_t message_pack_to_buffer(const ProtobufCMessage *message,
+				     ProtobufCBuffer *buffer);
+
+/**
+ * Pack a required field to a virtual buffer.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param member
+ *      The element to be packed.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes packed, or PACK_FAILED.
+ */
+static size_t
+required_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
+			      const void *member, ProtobufCBuffer *buffer)
+{
+	size_t rv;
+	uint8_t scratch[MAX_UINT64_ENCODED_SIZE * 2];
+
+	rv = tag_pack(field->id, scratch);
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SINT32:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += sint32_pack(*(const int32_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += int32_pack(*(const int32_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += uint32_pack(*(const uint32_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_SINT64:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += sint64_pack(*(const int64_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += uint64_pack(*(const uint64_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_32BIT;
+		rv += fixed32_pack(*(const uint32_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_64BIT;
+		rv += fixed64_pack(*(const uint64_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += boolean_pack(*(const protobuf_c_boolean *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_STRING: {
+		const char *str = *(char *const *) member;
+		size_t sublen = str ? strlen(str) : 0;
+
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		rv += uint32_pack(sublen, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		buffer->append(buffer, sublen, (const uint8_t *) str);
+		rv += sublen;
+		break;
+	}
+	case PROTOBUF_C_TYPE_BYTES: {
+		const ProtobufCBinaryData *bd = ((const ProtobufCBinaryData *) member);
+		size_t sublen = bd->len;
+
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		rv += uint32_pack(sublen, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		buffer->append(buffer, sublen, bd->data);
+		rv += sublen;
+		break;
+	}
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
+		
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		if (msg == NULL) {
+			rv += uint32_pack(0, scratch + rv);
+			buffer->append(buffer, rv, scratch);
+		} else {
+			size_t sublen = protobuf_c_message_get_packed_size(msg);
+			if (sublen == PACK_FAILED)
+				return PACK_FAILED;
+			rv += uint32_pack(sublen, scratch + rv);
+			buffer->append(buffer, rv, scratch);
+			if (message_pack_to_buffer(msg, buffer) == PACK_FAILED)
+				return PACK_FAILED;
+			rv += sublen;
+		}
+		break;
+	}
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	return rv;
+}
+
+/**
+ * Pack a oneof field to a buffer. Only packs the field that is selected by the case enum.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param oneof_case
+ *      Enum value that selects the field in the oneof.
+ * \param member
+ *      The element to be packed.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes serialised to `buffer`.
+ */
+static size_t
+oneof_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
+			   uint32_t oneof_case,
+			   const void *member, ProtobufCBuffer *buffer)
+{
+	if (oneof_case != field->id) {
+		return 0;
+	}
+	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    field->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void *const *) member;
+		if (ptr == NULL || ptr == field->default_value)
+			return 0;
+	}
+	return required_field_pack_to_buffer(field, member, buffer);
+}
+
+/**
+ * Pack an optional field to a buffer.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param has
+ *      Whether the field is set.
+ * \param member
+ *      The element to be packed.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes serialised to `buffer`.
+ */
+static size_t
+optional_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
+			      const protobuf_c_boolean has,
+			      const void *member, ProtobufCBuffer *buffer)
+{
+	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    field->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void *const *) member;
+		if (ptr == NULL || ptr == field->default_value)
+			return 0;
+	} else {
+		if (!has)
+			return 0;
+	}
+	return required_field_pack_to_buffer(field, member, buffer);
+}
+
+/**
+ * Pack an unlabeled field to a buffer.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param member
+ *      The element to be packed.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes serialised to `buffer`.
+ */
+static size_t
+unlabeled_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
+			       const void *member, ProtobufCBuffer *buffer)
+{
+	if (field_is_zeroish(field->type, member))
+		return 0;
+	return required_field_pack_to_buffer(field, member, buffer);
+}
+
+/**
+ * Get the packed size of an array of same field type.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param count
+ *      Number of elements of this type.
+ * \param array
+ *      The elements to get the size of.
+ * \return
+ *      Number of bytes required.
+ */
+static size_t
+get_packed_payload_length(const ProtobufCFieldDescriptor *field,
+			  unsigned count, const void *array)
+{
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		return count * 4;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return count * 8;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		return varint_array_size(field->type, array, count);
+	case PROTOBUF_C_TYPE_BOOL:
+		return count;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	return 0;
+}
+
+/**
+ * Pack an array of same field type to a virtual buffer.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param count
+ *      Number of elements of this type.
+ * \param array
+ *      The elements to get the size of.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes packed.
+ */
+static size_t
+pack_buffer_packed_payload(const ProtobufCFieldDescriptor *field,
+			   unsigned count, const void *array,
+			   ProtobufCBuffer *buffer)
+{
+	uint8_t scratch[16];
+	size_t rv = 0;
+	unsigned i;
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+#if !defined(WORDS_BIGENDIAN)
+		rv = count * 4;
+		goto no_packing_needed;
+#else
+		for (i = 0; i < count; i++) {
+			unsigned len = fixed32_pack(((uint32_t *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+		}
+		break;
+#endif
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+#if !defined(WORDS_BIGENDIAN)
+		rv = count * 8;
+		goto no_packing_needed;
+#else
+		for (i = 0; i < count; i++) {
+			unsigned len = fixed64_pack(((uint64_t *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+		}
+		break;
+#endif
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64: {
+		/* encode into a stack chunk to append many varints at once */
+		uint8_t chunk[PACK_CHUNK_ELEMENTS * MAX_UINT64_ENCODED_SIZE];
+		size_t siz = sizeof_elt_in_repeated_array(field->type);
+
+		for (i = 0; i < count; i += PACK_CHUNK_ELEMENTS) {
+			unsigned n = count - i < PACK_CHUNK_ELEMENTS ?
+				count - i : PACK_CHUNK_ELEMENTS;
+			size_t len = varint_array_pack(field->type,
+				(const char *) array + i * siz, n, chunk);
+			buffer->append(buffer, len, chunk);
+			rv += len;
+		}
+		break;
+	}
+	case PROTOBUF_C_TYPE_BOOL:
+		for (i = 0; i < count; i++) {
+			unsigned len = boolean_pack(((protobuf_c_boolean *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+		}
+		return count;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	return rv;
+
+#if !defined(WORDS_BIGENDIAN)
+no_packing_needed:
+	buffer->append(buffer, rv, array);
+	return rv;
+#endif
+}
+
+static size_t
+repeated_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
+			      unsigned count, const void *member,
+			      ProtobufCBuffer *buffer)
+{
+	char *array = *(char * const *) member;
+
+	if (count == 0)
+		return 0;
+	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
+		uint8_t scratch[MAX_UINT64_ENCODED_SIZE * 2];
+		size_t rv = tag_pack(field->id, scratch);
+		size_t payload_len = get_packed_payload_length(field, count, array);
+		size_t tmp;
+
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		rv += uint32_pack(payload_len, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		tmp = pack_buffer_packed_payload(field, count, array, buffer);
+		assert(tmp == payload_len);
+		(void)tmp;
+		return rv + payload_len;
+	} else {
+		size_t siz;
+		unsigned i;
+		/* CONSIDER: optimize this case a bit (by putting the loop inside the switch) */
+		unsigned rv = 0;
+
+		siz = sizeof_elt_in_repeated_array(field->type);
+		for (i = 0; i < count; i++) {
+			size_t len = required_field_pack_to_buffer(field, array,
+								   buffer);
+			if (len == PACK_FAILED)
+				return PACK_FAILED;
+			rv += len;
+			array += siz;
+		}
+		return rv;
+	}
+}
+
+static size_t
+unknown_field_pack_to_buffer(const ProtobufCMessageUnknownField *field,
+			     ProtobufCBuffer *buffer)
+{
+	uint8_t header[MAX_UINT64_ENCODED_SIZE];
+	size_t rv = tag_pack(field->tag, header);
+
+	header[0] |= field->wire_type;
+	buffer->append(buffer, rv, header);
+	buffer->append(buffer, field->len, field->data);
+	return rv + field->len;
+}
+
+/**
+ * Pack a single field that is not a message to a virtual buffer.
+ */
+static inline size_t
+field_pack_to_buffer(const ProtobufCMessage *message,
+		     const ProtobufCFieldDescriptor *field,
+		     ProtobufCBuffer *buffer)
+{
+	const void *member = ((const char *) message) + field->offset;
+	const void *qmember = ((const char *) message) + field->quantifier_offset;
+
+	if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+		return required_field_pack_to_buffer(field, member, buffer);
+	} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
+		    field->label == PROTOBUF_C_LABEL_NONE) &&
+		   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
+		return oneof_field_pack_to_buffer(
+			field,
+			*(const uint32_t *) qmember,
+			member,
+			buffer
+		);
+	} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
+		return optional_field_pack_to_buffer(
+			field,
+			*(const protobuf_c_boolean *) qmember,
+			member,
+			buffer
+		);
+	} else if (field->label == PROTOBUF_C_LABEL_NONE) {
+		return unlabeled_field_pack_to_buffer(
+			field,
+			member,
+			buffer
+		);
+	} else {
+		return repeated_field_pack_to_buffer(
+			field,
+			*(const size_t *) qmember,
+			member,
+			buffer
+		);
+	}
+}
+
+/**@}*/
+
+/*
+ * Returns PACK_FAILED, having possibly appended part of the message, if the
+ * walk cannot grow.
+ */
+static size_t
+message_pack_to_buffer(const ProtobufCMessage *message,
+		       ProtobufCBuffer *buffer)
+{
+	PackWalk walk;
+	PackSizes sizes;
+	size_t rv = 0;
+
+	sizes.sizes = sizes.stack_sizes;
+	sizes.n_sizes = 0;
+	sizes.next = 0;
+	sizes.max_sizes = PACK_STACK_FRAMES;
+
+	pack_walk_init(&walk);
+	pack_walk_push(&walk, message, 0);
+	while (walk.depth > 0) {
+		PackFrame *frame = walk.frames + walk.depth - 1;
+		const ProtobufCMessage *current = frame->message;
+		const ProtobufCMessageDescriptor *desc = current->descriptor;
+		const ProtobufCFieldHot *hot = frame->hot;
+		const ProtobufCFieldDescriptor *field = NULL;
+		const ProtobufCMessage *sub = NULL;
+		uint8_t scratch[MAX_UINT64_ENCODED_SIZE * 2];
+		size_t len, sublen;
+		unsigned i;
+
+		for (i = frame->field; i < desc->n_fields; i++) {
+			if (hot != NULL && !hot_field_maybe_present(current, hot + i))
+				continue;
+			field = desc->fields + i;
+			if (field->type != PROTOBUF_C_TYPE_MESSAGE) {
+				rv += field_pack_to_buffer(current, field, buffer);
+				continue;
+			}
+			if (pack_frame_next_message(frame, i, field, &sub))
+				break;
+		}
+
+		if (i < desc->n_fields) {
+			if (sub == NULL) {
+				sublen = 0;
+			} else if (sizes.next < sizes.n_sizes) {
+				sublen = sizes.sizes[sizes.next++];
+			} else {
+				/* size the sub-tree once, recording its sub-messages */
+				sizes.n_sizes = 0;
+				sizes.next = 0;
+				sizes.failed = FALSE;
+				sublen = message_get_packed_size(sub, &sizes);
+				if (sublen == PACK_FAILED)
+					break;
+				if (sizes.failed)
+					sizes.n_sizes = 0;
+			}
+			len = tag_pack(field->id, scratch);
+			scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+			len += uint32_pack(sublen, scratch + len);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+			/* the body is counted as it is packed */
+			if (sub != NULL && pack_walk_push(&walk, sub, 0) == NULL)
+				break;
+			continue;
+		}
+
+		for (i = 0; i < current->n_unknown_fields; i++)
+			rv += unknown_field_pack_to_buffer(
+				&current->unknown_fields[i], buffer);
+		walk.depth--;
+	}
+	if (walk.depth > 0)
+		rv = PACK_FAILED;
+	pack_walk_clear(&walk);
+	if (sizes.sizes != sizes.stack_sizes)
+		do_free(&protobuf_c__allocator, sizes.sizes,
+			sizes.max_sizes * sizeof(size_t));
+	return rv;
+}
+
+size_t
+protobuf_c_message_pack_to_buffer(const ProtobufCMessage *message,
+				  ProtobufCBuffer *buffer)
+{
+	size_t rv = message_pack_to_buffer(message, buffer);
+
+	return rv == PACK_FAILED ? 0 : rv;
+}
+
+/* Elements of a generated packed field gathered into each packed member. */
+#define GENERATOR_PACKED_CHUNK	256
+
+/*
+ * Pack the elements produced by a generator as they come. A packed field is
+ * written as a run of packed members of up to GENERATOR_PACKED_CHUNK
+ * elements each, which parsers concatenate; any other field is written one
+ * element at a time, so the generator may reuse the storage of an element.
+ * Returns PACK_FAILED if a message element cannot be packed.
+ */
+static size_t
+generated_field_pack_to_buffer(ProtobufCFieldGenerator *generator,
+			       ProtobufCBuffer *buffer)
+{
+	const ProtobufCFieldDescriptor *field = generator->field;
+	size_t siz = sizeof_elt_in_repeated_array(field->type);
+	unsigned max = 0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ?
+		GENERATOR_PACKED_CHUNK : 1;
+	uint64_t chunk[GENERATOR_PACKED_CHUNK];
+	const void *array = chunk;
+	protobuf_c_boolean more = TRUE;
+	size_t rv = 0, len;
+	unsigned n;
+
+	assert(field->label == PROTOBUF_C_LABEL_REPEATED);
+	while (more) {
+		for (n = 0; n < max; n++) {
+			if (!generator->next(generator, (char *) chunk + n * siz)) {
+				more = FALSE;
+				break;
+			}
+		}
+		len = repeated_field_pack_to_buffer(field, n, &array, buffer);
+		if (len == PACK_FAILED)
+			return PACK_FAILED;
+		rv += len;
+	}
+	return rv;
+}
+
+size_t
+protobuf_c_message_pack_to_buffer_generated(const ProtobufCMessage *message,
+					    unsigned n_generators,
+					    ProtobufCFieldGenerator *generators,
+					    ProtobufCBuffer *buffer)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	size_t rv = 0;
+	unsigned i, g;
+
+	ASSERT_IS_MESSAGE(message);
+	for (i = 0; i < desc->n_fields; i++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + i;
+		size_t len;
+
+		for (g = 0; g < n_generators; g++)
+			if (generators[g].field == field)
+				break;
+		if (g < n_generators)
+			len = generated_field_pack_to_buffer(generators + g,
+							     buffer);
+		else
+			len = field_pack_to_buffer(message, field, buffer);
+		if (len == PACK_FAILED)
+			return 0;
+		rv += len;
+	}
+	for (i = 0; i < message->n_unknown_fields; i++)
+		rv += unknown_field_pack_to_buffer(&message->unknown_fields[i],
+						   buffer);
+	return rv;
+}
+
+/* Elements of a packed field an encoder stages at a time. */
+#define ENCODER_PACKED_BATCH	64
+
+/*
+ * An encoder walks the message like protobuf_c_message_pack_to_buffer(), but
+ * one piece at a time: each step stages a value, a batch of packed elements
+ * or the header of a sub-message in `pending`, the contents of a string,
+ * bytes or unknown field being written straight from the message afterwards.
+ */
+struct ProtobufCEncoder {
+	ProtobufCAllocator *allocator;
+	PackWalk walk;
+	PackSizes sizes;
+	size_t pending_len;        /**< Bytes staged. */
+	size_t pending_off;        /**< Staged bytes already written. */
+	const uint8_t *direct;     /**< Bytes to write after the staged ones. */
+	size_t direct_len;
+	uint8_t pending[ENCODER_PACKED_BATCH * MAX_UINT64_ENCODED_SIZE];
+};
+
+/** A ProtobufCBuffer that stages bytes in an encoder. */
+typedef struct {
+	ProtobufCBuffer base;
+	ProtobufCEncoder *encoder;
+} EncoderBuffer;
+
+static void
+encoder_buffer_append(ProtobufCBuffer *buffer, size_t len, const uint8_t *data)
+{
+	ProtobufCEncoder *encoder = ((EncoderBuffer *) buffer)->encoder;
+
+	assert(encoder->pending_len + len <= sizeof(encoder->pending));
+	memcpy(encoder->pending + encoder->pending_len, data, len);
+	encoder->pending_len += len;
+}
+
+static void
+encoder_stage_tag(ProtobufCEncoder *encoder, uint32_t id, uint8_t wire_type)
+{
+	uint8_t *at = encoder->pending + encoder->pending_len;
+
+	encoder->pending_len += tag_pack(id, at);
+	at[0] |= wire_type;
+}
+
+static void
+encoder_stage_length(ProtobufCEncoder *encoder, size_t len)
+{
+	encoder->pending_len += uint32_pack(len,
+		encoder->pending + encoder->pending_len);
+}
+
+/* Stage one value of a field that is not a message. */
+static void
+encoder_stage_value(ProtobufCEncoder *encoder,
+		    const ProtobufCFieldDescriptor *field, const void *member)
+{
+	if (field->type == PROTOBUF_C_TYPE_STRING) {
+		const char *str = *(char * const *) member;
+
+		encoder->direct = (const uint8_t *) str;
+		encoder->direct_len = str == NULL ? 0 : strlen(str);
+	} else if (field->type == PROTOBUF_C_TYPE_BYTES) {
+		const ProtobufCBinaryData *bd = member;
+
+		encoder->direct = bd->data;
+		encoder->direct_len = bd->len;
+	} else {
+		encoder->pending_len += required_field_pack(field, member,
+			encoder->pending + encoder->pending_len);
+		return;
+	}
+	encoder_stage_tag(encoder, field->id,
+			  PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED);
+	encoder_stage_length(encoder, encoder->direct_len);
+}
+
+/*
+ * Stage the next piece of the encoding, entering any sub-message whose header
+ * it is. Returns PROTOBUF_C_ENCODE_MORE if something was staged.
+ */
+static ProtobufCEncodeStatus
+encoder_step(ProtobufCEncoder *encoder)
+{
+	PackWalk *walk = &encoder->walk;
+	PackSizes *sizes = &encoder->sizes;
+	EncoderBuffer buffer;
+
+	while (walk->depth > 0) {
+		PackFrame *frame = walk->frames + walk->depth - 1;
+		const ProtobufCMessage *current = frame->message;
+		const ProtobufCMessageDescriptor *desc = current->descriptor;
+		const ProtobufCFieldDescriptor *field;
+		const ProtobufCMessage *sub = NULL;
+		const char *array;
+		unsigned i = frame->field;
+		size_t count, siz, n;
+
+		if (i >= desc->n_fields) {
+			const ProtobufCMessageUnknownField *unknown;
+
+			if (i - desc->n_fields == current->n_unknown_fields) {
+				walk->depth--;
+				continue;
+			}
+			unknown = current->unknown_fields + (i - desc->n_fields);
+			encoder_stage_tag(encoder, unknown->tag,
+					  unknown->wire_type);
+			encoder->direct = unknown->data;
+			encoder->direct_len = unknown->len;
+			frame->field++;
+			return PROTOBUF_C_ENCODE_MORE;
+		}
+		field = desc->fields + i;
+		if (frame->hot != NULL &&
+		    !hot_field_maybe_present(current, frame->hot + i))
+		{
+			frame->field++;
+			continue;
+		}
+
+		if (field->type == PROTOBUF_C_TYPE_MESSAGE) {
+			if (!pack_frame_next_message(frame, i, field, &sub)) {
+				if (field->label == PROTOBUF_C_LABEL_REPEATED)
+					frame->field++;
+				continue;
+			}
+			if (sub == NULL) {
+				n = 0;
+			} else if (sizes->next < sizes->n_sizes) {
+				n = sizes->sizes[sizes->next++];
+			} else {
+				/* size the sub-tree once, recording its sub-messages */
+				sizes->n_sizes = 0;
+				sizes->next = 0;
+				sizes->failed = FALSE;
+				n = message_get_packed_size(sub, sizes);
+				if (n == PACK_FAILED)
+					return PROTOBUF_C_ENCODE_ERROR;
+				if (sizes->failed)
+					sizes->n_sizes = 0;
+			}
+			encoder_stage_tag(encoder, field->id,
+					  PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED);
+			encoder_stage_length(encoder, n);
+			if (sub != NULL && pack_walk_push(walk, sub, 0) == NULL)
+				return PROTOBUF_C_ENCODE_ERROR;
+			return PROTOBUF_C_ENCODE_MORE;
+		}
+
+		if (field->label != PROTOBUF_C_LABEL_REPEATED) {
+			frame->field++;
+			if (field_get_packed_size(current, field) == 0)
+				continue;
+			encoder_stage_value(encoder, field,
+					    (const char *) current + field->offset);
+			return PROTOBUF_C_ENCODE_MORE;
+		}
+
+		count = STRUCT_MEMBER(size_t, current, field->quantifier_offset);
+		array = STRUCT_MEMBER(const char *, current, field->offset);
+		siz = sizeof_elt_in_repeated_array(field->type);
+		if (0 == (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
+			if (frame->elt == count) {
+				frame->elt = 0;
+				frame->field++;
+				continue;
+			}
+			/* scalars are staged in batches, with their tags */
+			do {
+				encoder_stage_value(encoder, field,
+						    array + frame->elt++ * siz);
+			} while (frame->elt < count &&
+				 encoder->direct_len == 0 &&
+				 encoder->pending_len + 2 * MAX_UINT64_ENCODED_SIZE <=
+				 sizeof(encoder->pending));
+			return PROTOBUF_C_ENCODE_MORE;
+		}
+
+		/* a packed field: its header first, then batches of elements */
+		if (count == 0 || frame->elt == count + 1) {
+			frame->elt = 0;
+			frame->field++;
+			continue;
+		}
+		if (frame->elt == 0) {
+			encoder_stage_tag(encoder, field->id,
+					  PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED);
+			encoder_stage_length(encoder,
+				get_packed_payload_length(field, count, array));
+			frame->elt = 1;
+			return PROTOBUF_C_ENCODE_MORE;
+		}
+		n = count + 1 - frame->elt;
+		if (n > ENCODER_PACKED_BATCH)
+			n = ENCODER_PACKED_BATCH;
+		buffer.base.append = encoder_buffer_append;
+		buffer.encoder = encoder;
+		pack_buffer_packed_payload(field, n,
+					   array + (frame->elt - 1) * siz,
+					   &buffer.base);
+		frame->elt += n;
+		return PROTOBUF_C_ENCODE_MORE;
+	}
+	return PROTOBUF_C_ENCODE_DONE;
+}
+
+ProtobufCEncoder *
+protobuf_c_encoder_new(const ProtobufCMessage *message,
+		       ProtobufCAllocator *allocator)
+{
+	ProtobufCEncoder *encoder;
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	encoder = do_alloc(allocator, sizeof(ProtobufCEncoder));
+	if (encoder == NULL)
+		return NULL;
+	encoder->allocator = allocator;
+	pack_walk_init(&encoder->walk);
+	pack_walk_push(&encoder->walk, message, 0);
+	encoder->sizes.sizes = encoder->sizes.stack_sizes;
+	encoder->sizes.n_sizes = 0;
+	encoder->sizes.next = 0;
+	encoder->sizes.max_sizes = PACK_STACK_FRAMES;
+	encoder->sizes.failed = FALSE;
+	encoder->pending_len = 0;
+	encoder->pending_off = 0;
+	encoder->direct = NULL;
+	encoder->direct_len = 0;
+	return encoder;
+}
+
+void
+protobuf_c_encoder_free(ProtobufCEncoder *encoder)
+{
+	if (encoder == NULL)
+		return;
+	pack_walk_clear(&encoder->walk);
+	if (encoder->sizes.sizes != encoder->sizes.stack_sizes)
+		do_free(&protobuf_c__allocator, encoder->sizes.sizes,
+			encoder->sizes.max_sizes * sizeof(size_t));
+	do_free(encoder->allocator, encoder, sizeof(ProtobufCEncoder));
+}
+
+ProtobufCEncodeStatus
+protobuf_c_encoder_next(ProtobufCEncoder *encoder, uint8_t *out,
+			size_t out_cap, size_t *written)
+{
+	ProtobufCEncodeStatus status = PROTOBUF_C_ENCODE_MORE;
+	size_t rv = 0;
+	size_t n;
+
+	for (;;) {
+		n = encoder->pending_len - encoder->pending_off;
+		if (n > out_cap - rv)
+			n = out_cap - rv;
+		memcpy(out + rv, encoder->pending + encoder->pending_off, n);
+		encoder->pending_off += n;
+		rv += n;
+		if (encoder->pending_off < encoder->pending_len)
+			break;
+
+		if (encoder->direct_len > 0) {
+			n = encoder->direct_len;
+			if (n > out_cap - rv)
+				n = out_cap - rv;
+			memcpy(out + rv, encoder->direct, n);
+			encoder->direct += n;
+			encoder->direct_len -= n;
+			rv += n;
+			if (encoder->direct_len > 0)
+				break;
+		}
+
+		/* stage the next piece even if `out` is full, to know if it is */
+		encoder->pending_len = 0;
+		encoder->pending_off = 0;
+		status = encoder_step(encoder);
+		if (status != PROTOBUF_C_ENCODE_MORE || rv == out_cap)
+			break;
+	}
+	*written = rv;
+	return status;
+}
+
+/**
+ * \defgroup unpack unpacking implementation
+ *
+ * Routines mainly used by the unpacking functions.
+ *
+ * \ingroup internal
+ * @{
+ */
+
+static inline int
+int_range_lookup(unsigned n_ranges, const ProtobufCIntRange *ranges, int value)
+{
+	unsigned n;
+	unsigned start;
+
+	if (n_ranges == 0)
+		return -1;
+	start = 0;
+	n = n_ranges;
+	while (n > 1) {
+		unsigned mid = start + n / 2;
+
+		if (value < ranges[mid].start_value) {
+			n = mid - start;
+		} else if (value >= ranges[mid].start_value +
+			   (int) (ranges[mid + 1].orig_index -
+				  ranges[mid].orig_index))
+		{
+			unsigned new_start = mid + 1;
+			n = start + n - new_start;
+			start = new_start;
+		} else
+			return (value - ranges[mid].start_value) +
+			    ranges[mid].orig_index;
+	}
+	if (n > 0) {
+		unsigned start_orig_index = ranges[start].orig_index;
+		unsigned range_size =
+			ranges[start + 1].orig_index - start_orig_index;
+
+		if (ranges[start].start_value <= value &&
+		    value < (int) (ranges[start].start_value + range_size))
+		{
+			return (value - ranges[start].start_value) +
+			    start_orig_index;
+		}
+	}
+	return -1;
+}
+
+static inline int
+dense_index_lookup(const ProtobufCDenseIndex *dense, int value)
+{
+	unsigned i = (unsigned) value - (unsigned) dense->base;
+
+	return i < dense->n_entries ? (int) dense->index[i] - 1 : -1;
+}
+
+/* Index into desc->fields of the field with the given id, or -1. */
+static inline int
+field_index_lookup(const ProtobufCMessageDescriptor *desc, int id)
+{
+	if (desc->field_index != NULL)
+		return dense_index_lookup(desc->field_index, id);
+	return int_range_lookup(desc->n_field_ranges, desc->field_ranges, id);
+}
+
+static size_t
+parse_tag_and_wiretype(size_t len,
+		       const uint8_t *data,
+		       uint32_t *tag_out,
+		       uint8_t *wiretype_out)
+{
+	unsigned max_rv = len > 5 ? 5 : len;
+	uint32_t tag = (data[0] & 0x7f) >> 3;
+	unsigned shift = 4;
+	unsigned rv;
+
+	/* 0 is not a valid tag value */
+	if ((data[0] & 0xf8) == 0) {
+		return 0;
+	}
+
+	*wiretype_out = data[0] & 7;
+	if ((data[0] & 0x80) == 0) {
+		*tag_out = tag;
+		return 1;
+	}
+	for (rv = 1; rv < max_rv; rv++) {
+		if (data[rv] & 0x80) {
+			tag |= (uint32_t) (data[rv] & 0x7f) << shift;
+			shift += 7;
+		} else {
+			tag |= (uint32_t) data[rv] << shift;
+			*tag_out = tag;
+			return rv + 1;
+		}
+	}
+	return 0; /* error: bad header */
+}
+
+/* sizeof(ScannedMember) must be <= (1UL<<BOUND_SIZEOF_SCANNED_MEMBER_LOG2) */
+#define BOUND_SIZEOF_SCANNED_MEMBER_LOG2 5
+typedef struct ScannedMember ScannedMember;
+/** Field as it's being read. */
+struct ScannedMember {
+	uint32_t tag;              /**< Field tag. */
+	uint8_t wire_type;         /**< Field type. */
+	uint8_t length_prefix_len; /**< Prefix length. */
+	uint8_t decoded;           /**< Already unpacked by a parallel task. */
+	const ProtobufCFieldDescriptor *field; /**< Field descriptor. */
+	size_t len;                /**< Field length. */
+	const uint8_t *data;       /**< Pointer to field data. */
+};
+
+typedef struct UnpackFrame UnpackFrame;
+typedef struct UnpackState UnpackState;
+
+/** Whole members of a message spread over several buffers. */
+typedef struct IovPiece {
+	size_t len;
+	const uint8_t *data;
+	protobuf_c_boolean copied; /**< Allocated to join a straddling member. */
+} IovPiece;
+
+/** Per-call state shared by every message of one unpack operation. */
+struct UnpackState {
+	ProtobufCAllocator *allocator; /**< Allocator for message memory. */
+	ProtobufCIntern *intern;   /**< Optional table for string/bytes values. */
+	protobuf_c_boolean shared; /**< Allocate reference-counted messages. */
+	ProtobufCAllocator *scratch; /**< Allocator for temporary memory. */
+	ProtobufCUnpackContext *context; /**< Optional cache of scratch memory. */
+	UnpackFrame **frames;      /**< Head of the frame chain. */
+	UnpackFrame *frame;        /**< Frame of the current message. */
+	UnpackFrame *spare_frame;  /**< Unused frame on the caller's stack. */
+	unsigned depth;            /**< Number of frames in use. */
+	unsigned max_depth;        /**< Deepest nesting accepted. */
+	ProtobufCMessage *submessage; /**< Unpacked value of a message member. */
+	protobuf_c_boolean validate_utf8; /**< Validate all string fields. */
+	ProtobufCExecutor *executor; /**< Runs parallel tasks, if any. */
+	size_t parallel_min;       /**< Fewest elements worth a parallel unpack. */
+	const IovPiece *pieces;    /**< Data of the top-level message, if split. */
+	size_t n_pieces;
+};
+
+static inline void
+init_unpack_state(UnpackState *state, ProtobufCAllocator *allocator)
+{
+	state->allocator = allocator ? allocator : &protobuf_c__allocator;
+	state->intern = NULL;
+	state->shared = FALSE;
+	state->scratch = state->allocator;
+	state->context = NULL;
+	state->frames = NULL;
+	state->frame = NULL;
+	state->spare_frame = NULL;
+	state->depth = 0;
+	state->max_depth = PROTOBUF_C_DEFAULT_MAX_DEPTH;
+	state->submessage = NULL;
+	state->validate_utf8 = FALSE;
+	state->executor = NULL;
+	state->parallel_min = 0;
+	state->pieces = NULL;
+	state->n_pieces = 0;
+}
+
+/*
+ * ScannedMember slabs (an unpacking implementation detail). Before doing real
+ * unpacking, we first scan through the elements to see how many there are (for
+ * repeated fields), and which field to use (for non-repeated fields given
+ * twice).
+ *
+ * In order to avoid allocations for small messages, every frame holds a slab
+ * of ScannedMembers of size FIRST_SCANNED_MEMBER_SLAB_SIZE (16). After we
+ * fill that up, we allocate each slab twice as large as the previous one.
+ */
+#define FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2 4
+
+/*
+ * The number of slabs, including the one in the frame; choose the number so
+ * that we would overflow if we needed a slab larger than provided.
+ */
+#define MAX_SCANNED_MEMBER_SLAB			\
+  (sizeof(unsigned int)*8 - 1			\
+   - BOUND_SIZEOF_SCANNED_MEMBER_LOG2		\
+   - FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)
+
+/* Size in bytes of slab `i`, for i >= 1. */
+#define SCANNED_MEMBER_SLAB_SIZE(i) \
+	(sizeof(ScannedMember) << ((i) + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2))
+
+/*
+ * One level of the explicit stack that unpack_message() and merge_messages()
+ * walk message trees with, so that the C stack does not grow with the depth
+ * of the tree. Frames form a chain that only ever grows: a frame is created
+ * the first time a message is that deep, and is reused by every later message
+ * at the same depth along with its heap-allocated ScannedMember slabs and
+ * required fields bitmap. An unpack context keeps the chain across calls.
+ */
+struct UnpackFrame {
+	UnpackFrame *prev;
+	UnpackFrame *next;
+
+	/* the message being unpacked at this depth */
+	const ProtobufCMessageDescriptor *desc;
+	ProtobufCMessage *rv;
+	size_t n_unknown;          /**< Unknown fields found by the scan. */
+	unsigned which_slab;       /**< The slab the scan populated last. */
+	unsigned in_slab_index;    /**< Number of members in that slab. */
+	unsigned i_slab;           /**< Slab of the member being parsed. */
+	unsigned j;                /**< Index of that member in its slab. */
+
+	/* the pair of messages merged at this depth */
+	ProtobufCMessage *earlier_msg;
+	ProtobufCMessage *latter_msg;
+	unsigned merge_field;      /**< Next field to merge. */
+
+	ScannedMember first_slab[1UL << FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2];
+	/* slabs[0] points to first_slab, the others are allocated on demand */
+	ScannedMember *slabs[MAX_SCANNED_MEMBER_SLAB + 1];
+	unsigned n_slabs;          /**< Slabs allocated so far. */
+	unsigned char bitmap_stack[16];
+	unsigned char *bitmap;     /**< Bitmap for more than 128 fields. */
+	size_t bitmap_len;
+};
+
+struct ProtobufCUnpackContext {
+	ProtobufCAllocator *allocator;
+	UnpackFrame *frames;
+	uint32_t flags;
+	unsigned max_depth;
+	ProtobufCExecutor *executor;
+	size_t parallel_min;
+};
+
+static void
+unpack_frame_init(UnpackFrame *frame, UnpackFrame *prev)
+{
+	frame->prev = prev;
+	frame->next = NULL;
+	frame->slabs[0] = frame->first_slab;
+	frame->n_slabs = 0;
+	frame->bitmap = NULL;
+	frame->bitmap_len = 0;
+}
+
+/* Free the memory cached by `frame`, but not the frame itself. */
+static void
+unpack_frame_release(ProtobufCAllocator *allocator, UnpackFrame *frame)
+{
+	unsigned i;
+
+	for (i = 1; i <= frame->n_slabs; i++)
+		do_free(allocator, frame->slabs[i], SCANNED_MEMBER_SLAB_SIZE(i));
+	do_free(allocator, frame->bitmap, frame->bitmap_len);
+}
+
+/* Free `frame`, every frame after it, and all their cached memory. */
+static void
+unpack_frames_free(ProtobufCAllocator *allocator, UnpackFrame *frame)
+{
+	while (frame != NULL) {
+		UnpackFrame *next = frame->next;
+
+		unpack_frame_release(allocator, frame);
+		do_free(allocator, frame, sizeof(UnpackFrame));
+		frame = next;
+	}
+}
+
+/*
+ * Push the frame one level deeper than the current one, creating it if this
+ * is the deepest level reached so far. Returns NULL if a new frame cannot be
+ * allocated.
+ */
+static UnpackFrame *
+unpack_frame_enter(UnpackState *state)
+{
+	UnpackFrame **slot = state->frame != NULL ?
+		&state->frame->next : state->frames;
+	UnpackFrame *frame = *slot;
+
+	if (frame == NULL) {
+		frame = state->spare_frame;
+		state->spare_frame = NULL;
+		if (frame == NULL)
+			frame = do_alloc(state->scratch, sizeof(UnpackFrame));
+		if (frame == NULL)
+			return NULL;
+		unpack_frame_init(frame, state->frame);
+		*slot = frame;
+	}
+	state->frame = frame;
+	state->depth++;
+	return frame;
+}
+
+static inline void
+unpack_frame_leave(UnpackState *state)
+{
+	state->frame = state->frame->prev;
+	state->depth--;
+}
+
+#define SHARED_MESSAGE_MAGIC	0x5ea3ed01
+
+/*
+ * Hidden header in front of every message allocated by
+ * protobuf_c_message_unpack_shared(). The union keeps the message that
+ * follows it suitably aligned.
+ */
+typedef union SharedHeader SharedHeader;
+union SharedHeader {
+	struct {
+		AtomicCount refcount;
+		ProtobufCAllocator *allocator;
+		uint32_t magic;
+	} h;
+	uint64_t align_u64;
+	double align_double;
+	void *align_ptr;
+};
+
+#define SHARED_HEADER(message)	((SharedHeader *) (message) - 1)
+
+/* Allocate the structure for an unpacked message. */
+static ProtobufCMessage *
+alloc_message(UnpackState *state, size_t size)
+{
+	SharedHeader *header;
+
+	if (!state->shared)
+		return do_alloc(state->allocator, size);
+	header = do_alloc(state->allocator, sizeof(SharedHeader) + size);
+	if (header == NULL)
+		return NULL;
+	header->h.refcount = 1;
+	header->h.allocator = state->allocator;
+	header->h.magic = SHARED_MESSAGE_MAGIC;
+	return (ProtobufCMessage *) (header + 1);
+}
+
+/* Free a structure of `size` bytes obtained from alloc_message(). */
+static void
+free_message_memory(UnpackState *state, ProtobufCMessage *message,
+		    size_t size)
+{
+	if (state->shared)
+		do_free(state->allocator, SHARED_HEADER(message),
+			sizeof(SharedHeader) + size);
+	else
+		do_free(state->allocator, message, size);
+}
+
+static void
+free_message(ProtobufCMessage *message, UnpackState *state);
+
+/**
+ * \defgroup utf8 UTF-8 validation
+ *
+ * Strings are validated while they are copied out of the wire data, so a
+ * checked string costs a single pass. `dst` may be NULL to validate without
+ * copying.
+ *
+ * \ingroup internal
+ * @{
+ */
+
+/**
+ * Return the length of the well-formed UTF-8 sequence starting with a
+ * non-ASCII byte at `data`, or 0 if it is malformed, overlong, a surrogate,
+ * above U+10FFFF or truncated.
+ */
+static size_t
+utf8_sequence_length(const uint8_t *data, size_t len)
+{
+	uint8_t c = data[0];
+	uint8_t lo = 0x80, hi = 0xbf;
+	size_t n, i;
+
+	if (c < 0xc2) {
+		return 0;
+	} else if (c < 0xe0) {
+		n = 2;
+	} else if (c < 0xf0) {
+		n = 3;
+		if (c == 0xe0)
+			lo = 0xa0;
+		else if (c == 0xed)
+			hi = 0x9f;
+	} else if (c < 0xf5) {
+		n = 4;
+		if (c == 0xf0)
+			lo = 0x90;
+		else if (c == 0xf4)
+			hi = 0x8f;
+	} else {
+		return 0;
+	}
+	if (len < n || data[1] < lo || data[1] > hi)
+		return 0;
+	for (i = 2; i < n; i++)
+		if ((data[i] & 0xc0) != 0x80)
+			return 0;
+	return n;
+}
+
+static protobuf_c_boolean
+utf8_copy_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i = 0;
+
+	for (;;) {
+		uint64_t word;
+		size_t n, k;
+
+		/* ASCII runs go a word at a time */
+		while (i + 8 <= len) {
+			memcpy(&word, src + i, 8);
+			if ((word & UINT64_C(0x8080808080808080)) != 0)
+				break;
+			if (dst != NULL)
+				memcpy(dst + i, &word, 8);
+			i += 8;
+		}
+		while (i < len && src[i] < 0x80) {
+			if (dst != NULL)
+				dst[i] = src[i];
+			i++;
+		}
+		if (i == len)
+			return TRUE;
+		n = utf8_sequence_length(src + i, len - i);
+		if (n == 0)
+			return FALSE;
+		if (dst != NULL)
+			for (k = 0; k < n; k++)
+				dst[i + k] = src[i + k];
+		i += n;
+	}
+}
+
+#ifdef SIMD_AVX2
+
+/* Error classes of a pair of consecutive bytes, see utf8_check_block(). */
+#define UTF8_TOO_SHORT		(1 << 0)
+#define UTF8_TOO_LONG		(1 << 1)
+#define UTF8_OVERLONG_3		(1 << 2)
+#define UTF8_TOO_LARGE		(1 << 3)
+#define UTF8_SURROGATE		(1 << 4)
+#define UTF8_OVERLONG_2		(1 << 5)
+#define UTF8_TOO_LARGE_1000	(1 << 6)
+#define UTF8_OVERLONG_4		(1 << 6)
+#define UTF8_TWO_CONTS		(1 << 7)
+#define UTF8_CARRY		(UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+/* The last `n` bytes of `prev` followed by the first 32 - `n` of `input`. */
+#define UTF8_PREV(input, prev, n)					\
+	_mm256_alignr_epi8((input),					\
+		_mm256_permute2x128_si256((prev), (input), 0x21), 16 - (n))
+
+SIMD_TARGET_AVX2 static inline __m256i
+utf8_lookup(__m256i nibbles, __m256i table)
+{
+	return _mm256_shuffle_epi8(table, nibbles);
+}
+
+SIMD_TARGET_AVX2 static inline __m256i
+utf8_high_nibbles(__m256i v)
+{
+	return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f));
+}
+
+/*
+ * Return a non-zero vector if the 32 bytes of `input`, preceded by those of
+ * `prev`, contain a malformed sequence. Every invalid pair of consecutive
+ * bytes is classified by three nibble lookups; sequences whose third or
+ * fourth byte is missing are caught by checking that exactly the bytes two
+ * or three positions after a 3- or 4-byte lead are continuations.
+ */
+SIMD_TARGET_AVX2 static inline __m256i
+utf8_check_block(__m256i input, __m256i prev)
+{
+	const __m256i byte_1_high_table = _mm256_setr_epi8(
+		UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+		UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+		UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+		UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+		UTF8_TOO_SHORT,
+		UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+		UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+			UTF8_OVERLONG_4,
+		UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+		UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+		UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+		UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+		UTF8_TOO_SHORT,
+		UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+		UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+			UTF8_OVERLONG_4);
+	const __m256i byte_1_low_table = _mm256_setr_epi8(
+		UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+		UTF8_CARRY | UTF8_OVERLONG_2,
+		UTF8_CARRY,
+		UTF8_CARRY,
+		UTF8_CARRY | UTF8_TOO_LARGE,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+			UTF8_SURROGATE,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+		UTF8_CARRY | UTF8_OVERLONG_2,
+		UTF8_CARRY,
+		UTF8_CARRY,
+		UTF8_CARRY | UTF8_TOO_LARGE,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+			UTF8_SURROGATE,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+		UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+	const __m256i byte_2_high_table = _mm256_setr_epi8(
+		UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+		UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+		UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+			UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+		UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+			UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+		UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+			UTF8_SURROGATE | UTF8_TOO_LARGE,
+		UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+			UTF8_SURROGATE | UTF8_TOO_LARGE,
+		UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+		UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+		UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+		UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+			UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+		UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+			UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+		UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+			UTF8_SURROGATE | UTF8_TOO_LARGE,
+		UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+			UTF8_SURROGATE | UTF8_TOO_LARGE,
+		UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+	__m256i prev1 = UTF8_PREV(input, prev, 1);
+	__m256i prev2 = UTF8_PREV(input, prev, 2);
+	__m256i prev3 = UTF8_PREV(input, prev, 3);
+	__m256i special, must23;
+
+	special = _mm256_and_si256(
+		_mm256_and_si256(
+			utf8_lookup(utf8_high_nibbles(prev1), byte_1_high_table),
+			utf8_lookup(_mm256_and_si256(prev1,
+						     _mm256_set1_epi8(0x0f)),
+				    byte_1_low_table)),
+		utf8_lookup(utf8_high_nibbles(input), byte_2_high_table));
+	must23 = _mm256_or_si256(
+		_mm256_subs_epu8(prev2, _mm256_set1_epi8((char) (0xe0 - 0x80))),
+		_mm256_subs_epu8(prev3, _mm256_set1_epi8((char) (0xf0 - 0x80))));
+	must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char) 0x80));
+	return _mm256_xor_si256(must23, special);
+}
+
+/*
+ * Non-zero in the last three bytes of `input` if they start a sequence that
+ * does not fit in the block.
+ */
+SIMD_TARGET_AVX2 static inline __m256i
+utf8_incomplete(__m256i input)
+{
+	const __m256i max = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, (char) (0xf0 - 1), (char) (0xe0 - 1),
+		(char) (0xc0 - 1));
+
+	return _mm256_subs_epu8(input, max);
+}
+
+SIMD_TARGET_AVX2 static protobuf_c_boolean
+utf8_copy_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	__m256i prev = _mm256_setzero_si256();
+	__m256i incomplete = _mm256_setzero_si256();
+	__m256i error = _mm256_setzero_si256();
+	uint8_t tail[32];
+	size_t i = 0;
+
+	/*
+	 * The tail is zero padded to a full block, so that a sequence cut
+	 * short by the end of the string is an error like any other.
+	 */
+	for (;;) {
+		const uint8_t *block = src + i;
+		__m256i input;
+
+		if (i + 32 > len) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, src + i, len - i);
+			block = tail;
+		}
+		input = _mm256_loadu_si256((const __m256i *) block);
+		if (_mm256_movemask_epi8(input) == 0) {
+			/* ASCII only needs the previous block to be complete */
+			error = _mm256_or_si256(error, incomplete);
+		} else {
+			error = _mm256_or_si256(error,
+						utf8_check_block(input, prev));
+			incomplete = utf8_incomplete(input);
+		}
+		if (block == tail)
+			break;
+		if (dst != NULL)
+			_mm256_storeu_si256((__m256i *) (dst + i), input);
+		prev = input;
+		i += 32;
+	}
+	if (!_mm256_testz_si256(error, error))
+		return FALSE;
+	if (dst != NULL)
+		memcpy(dst + i, tail, len - i);
+	return TRUE;
+}
+
+#endif /* SIMD_AVX2 */
+
+/**
+ * Copy `len` bytes from `src` to `dst`, which may be NULL, and check that
+ * they are valid UTF-8.
+ *
+ * \return
+ *      TRUE if `src` is valid UTF-8, FALSE otherwise. The contents of `dst`
+ *      are unspecified on failure.
+ */
+static protobuf_c_boolean
+utf8_copy(uint8_t *dst, const uint8_t *src, size_t len)
+{
+#ifdef SIMD_AVX2
+	if (len >= 32 && SIMD_HAVE_AVX2())
+		return utf8_copy_avx2(dst, src, len);
+#endif
+	return utf8_copy_scalar(dst, src, len);
+}
+
+/**@}*/
+
+/*
+ * Copy a string or bytes value out of the wire data. Strings get a trailing
+ * NUL; interned values always have one. With `validate_utf8`, NULL is also
+ * returned if a string is not valid UTF-8.
+ */
+static inline uint8_t *
+unpack_value(UnpackState *state, const uint8_t *data, size_t len,
+	     protobuf_c_boolean is_string, protobuf_c_boolean validate_utf8)
+{
+	uint8_t *rv;
+
+	if (state->intern != NULL) {
+		if (validate_utf8 && !utf8_copy(NULL, data, len))
+			return NULL;
+		return intern_value(state->intern, data, len);
+	}
+	rv = do_alloc(state->allocator, is_string ? len + 1 : len);
+	if (rv == NULL)
+		return NULL;
+	if (!validate_utf8) {
+		memcpy(rv, data, len);
+	} else if (!utf8_copy(rv, data, len)) {
+		do_free(state->allocator, rv, len + 1);
+		return NULL;
+	}
+	if (is_string)
+		rv[len] = 0;
+	return rv;
+}
+
+/* Release a `bytes` value of `len` bytes obtained from unpack_value(). */
+static inline void
+free_value(UnpackState *state, void *data, size_t len)
+{
+	if (data == NULL)
+		return;
+	if (state->intern != NULL)
+		intern_release(state->intern, data);
+	else
+		do_free(state->allocator, data, len);
+}
+
+/* Release a string obtained from unpack_value(). */
+static inline void
+free_string(UnpackState *state, char *str)
+{
+	if (str == NULL)
+		return;
+	if (state->intern != NULL)
+		intern_release(state->intern, str);
+	else
+		do_free_string(state->allocator, str);
+}
+
+static inline size_t
+scan_length_prefixed_data(size_t len, const uint8_t *data,
+			  size_t *prefix_len_out)
+{
+	unsigned hdr_max = len < 5 ? len : 5;
+	unsigned hdr_len;
+	size_t val = 0;
+	unsigned i;
+	unsigned shift = 0;
+
+	for (i = 0; i < hdr_max; i++) {
+		val |= ((size_t)data[i] & 0x7f) << shift;
+		shift += 7;
+		if ((data[i] & 0x80) == 0)
+			break;
+	}
+	if (i == hdr_max) {
+		PROTOBUF_C_UNPACK_ERROR("error parsing length for length-prefixed data");
+		return 0;
+	}
+	hdr_len = i + 1;
+	*prefix_len_out = hdr_len;
+	if (val > INT_MAX) {
+		// Protobuf messages should always be less than 2 GiB in size.
+		// We also want to return early here so that hdr_len + val does
+		// not overflow on 32-bit systems.
+		PROTOBUF_C_UNPACK_ERROR("length prefix of %lu is too large",
+			(unsigned long int)val);
+		return 0;
+	}
+	if (hdr_len + val > len) {
+		PROTOBUF_C_UNPACK_ERROR("data too short after length-prefix of %lu",
+			(unsigned long int)val);
+		return 0;
+	}
+	return hdr_len + val;
+}
+
+static size_t
+max_b128_numbers(size_t len, const uint8_t *data)
+{
+	size_t rv = 0;
+	while (len--)
+		if ((*data++ & 0x80) == 0)
+			++rv;
+	return rv;
+}
+
+/**@}*/
+
+/**
+ * Merge field `i` of an earlier message into a latter message, see
+ * merge_messages(). If both messages have a sub-message in the field, they
+ * are returned in `nested` for the caller to merge.
+ */
+static protobuf_c_boolean
+merge_field(ProtobufCMessage *earlier_msg,
+	    ProtobufCMessage *latter_msg,
+	    unsigned i,
+	    ProtobufCAllocator *allocator,
+	    ProtobufCMessage **nested)
+{
+	const ProtobufCFieldDescriptor *fields =
+		latter_msg->descriptor->fields;
+
+	if (fields[i].label == PROTOBUF_C_LABEL_REPEATED) {
+		size_t *n_earlier =
+			STRUCT_MEMBER_PTR(size_t, earlier_msg,
+					  fields[i].quantifier_offset);
+		uint8_t **p_earlier =
+			STRUCT_MEMBER_PTR(uint8_t *, earlier_msg,
+					  fields[i].offset);
+		size_t *n_latter =
+			STRUCT_MEMBER_PTR(size_t, latter_msg,
+					  fields[i].quantifier_offset);
+		uint8_t **p_latter =
+			STRUCT_MEMBER_PTR(uint8_t *, latter_msg,
+					  fields[i].offset);
+
+		if (*n_earlier > 0) {
+			if (*n_latter > 0) {
+				/* Concatenate the repeated field */
+				size_t el_size =
+					sizeof_elt_in_repeated_array(fields[i].type);
+				uint8_t *new_field;
+
+				/* grow the earlier array in place if possible */
+				new_field = do_realloc(allocator, *p_earlier,
+					*n_earlier * el_size,
+					(*n_earlier + *n_latter) * el_size);
+				if (!new_field)
+					return FALSE;
+				*p_earlier = new_field;
+
+				memcpy(new_field +
+				       *n_earlier * el_size,
+				       *p_latter,
+				       *n_latter * el_size);
+
+				do_free(allocator, *p_latter,
+					*n_latter * el_size);
+				*p_latter = new_field;
+				*n_latter = *n_earlier + *n_latter;
+			} else {
+				/* Zero copy the repeated field from the earlier message */
+				*n_latter = *n_earlier;
+				*p_latter = *p_earlier;
+			}
+			/* Make sure the field does not get double freed */
+			*n_earlier = 0;
+			*p_earlier = 0;
+		}
+	} else if (fields[i].label == PROTOBUF_C_LABEL_OPTIONAL ||
+		   fields[i].label == PROTOBUF_C_LABEL_NONE) {
+		const ProtobufCFieldDescriptor *field;
+		uint32_t *earlier_case_p = STRUCT_MEMBER_PTR(uint32_t,
+							     earlier_msg,
+							     fields[i].
+							     quantifier_offset);
+		uint32_t *latter_case_p = STRUCT_MEMBER_PTR(uint32_t,
+							    latter_msg,
+							    fields[i].
+							    quantifier_offset);
+		protobuf_c_boolean need_to_merge = FALSE;
+		void *earlier_elem;
+		void *latter_elem;
+		const void *def_val;
+
+		if (fields[i].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) {
+			if (*latter_case_p == 0) {
+				/* lookup correct oneof field */
+				int field_index;
+
+				if (*earlier_case_p == 0)
+					/* Oneof is in neither message */
+					return TRUE;
+				field_index = field_index_lookup(
+					latter_msg->descriptor,
+					*earlier_case_p);
+				if (field_index < 0)
+					return FALSE;
+				field = latter_msg->descriptor->fields +
+					field_index;
+			} else {
+				/* Oneof is present in the latter message, move on */
+				return TRUE;
+			}
+		} else {
+			field = &fields[i];
+		}
+
+		earlier_elem = STRUCT_MEMBER_P(earlier_msg, field->offset);
+		latter_elem = STRUCT_MEMBER_P(latter_msg, field->offset);
+		def_val = field->default_value;
+
+		switch (field->type) {
+		case PROTOBUF_C_TYPE_MESSAGE: {
+			ProtobufCMessage *em = *(ProtobufCMessage **) earlier_elem;
+			ProtobufCMessage *lm = *(ProtobufCMessage **) latter_elem;
+			if (em != NULL) {
+				if (lm != NULL) {
+					/* Merged by the caller */
+					nested[0] = em;
+					nested[1] = lm;
+					need_to_merge = FALSE;
+				} else {
+					/* Zero copy the message */
+					need_to_merge = TRUE;
+				}
+			}
+			break;
+		}
+		case PROTOBUF_C_TYPE_BYTES: {
+			uint8_t *e_data =
+				((ProtobufCBinaryData *) earlier_elem)->data;
+			uint8_t *l_data =
+				((ProtobufCBinaryData *) latter_elem)->data;
+			const ProtobufCBinaryData *d_bd =
+				(ProtobufCBinaryData *) def_val;
+
+			need_to_merge =
+				(e_data != NULL &&
+				 (d_bd == NULL ||
+				  e_data != d_bd->data)) &&
+				(l_data == NULL ||
+				 (d_bd != NULL &&
+				  l_data == d_bd->data));
+			break;
+		}
+		case PROTOBUF_C_TYPE_STRING: {
+			char *e_str = *(char **) earlier_elem;
+			char *l_str = *(char **) latter_elem;
+			const char *d_str = def_val;
+
+			need_to_merge = e_str != d_str && l_str == d_str;
+			break;
+		}
+		default: {
+			/* Could be has field or case enum, the logic is
+			 * equivalent, since 0 (FALSE) means not set for
+			 * oneof */
+			need_to_merge = (*earlier_case_p != 0) &&
+					(*latter_case_p == 0);
+			break;
+		}
+		}
+
+		if (need_to_merge) {
+			size_t el_size =
+				sizeof_elt_in_repeated_array(field->type);
+			memcpy(latter_elem, earlier_elem, el_size);
+			/*
+			 * Reset the element from the old message to 0
+			 * to make sure earlier message deallocation
+			 * doesn't corrupt zero-copied data in the new
+			 * message, earlier message will be freed after
+			 * this function is called anyway
+			 */
+			memset(earlier_elem, 0, el_size);
+
+			if (field->quantifier_offset != 0) {
+				/* Set the has field or the case enum,
+				 * if applicable */
+				*latter_case_p = *earlier_case_p;
+				*earlier_case_p = 0;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * Merge earlier message into a latter message.
+ *
+ * For numeric types and strings, if the same value appears multiple
+ * times, the parser accepts the last value it sees. For embedded
+ * message fields, the parser merges multiple instances of the same
+ * field. That is, all singular scalar fields in the latter instance
+ * replace those in the former, singular embedded messages are merged,
+ * and repeated fields are concatenated.
+ *
+ * Nested pairs of embedded messages are merged on the frame stack one level
+ * below the current frame, rather than by recursion.
+ *
+ * The earlier message should be freed after calling this function, as
+ * some of its fields may have been reused and changed to their default
+ * values during the merge.
+ */
+static protobuf_c_boolean
+merge_messages(ProtobufCMessage *earlier_msg,
+	       ProtobufCMessage *latter_msg,
+	       UnpackState *state)
+{
+	UnpackFrame *base = state->frame;
+	UnpackFrame *frame = unpack_frame_enter(state);
+
+	if (frame == NULL)
+		return FALSE;
+	frame->earlier_msg = earlier_msg;
+	frame->latter_msg = latter_msg;
+	frame->merge_field = 0;
+	while (state->frame != base) {
+		ProtobufCMessage *nested[2] = { NULL, NULL };
+
+		frame = state->frame;
+		if (frame->merge_field == frame->latter_msg->descriptor->n_fields) {
+			unpack_frame_leave(state);
+			continue;
+		}
+		if (!merge_field(frame->earlier_msg, frame->latter_msg,
+				 frame->merge_field++, state->allocator, nested))
+			break;
+		if (nested[0] != NULL) {
+			frame = unpack_frame_enter(state);
+			if (frame == NULL)
+				break;
+			frame->earlier_msg = nested[0];
+			frame->latter_msg = nested[1];
+			frame->merge_field = 0;
+		}
+	}
+	if (state->frame == base)
+		return TRUE;
+	while (state->frame != base)
+		unpack_frame_leave(state);
+	return FALSE;
+}
+
+/**
+ * Count packed elements.
+ *
+ * Given a raw slab of packed-repeated values, determine the number of
+ * elements. This function detects certain kinds of errors but not
+ * others; the remaining error checking is done by
+ * parse_packed_repeated_member().
+ */
+static protobuf_c_boolean
+count_packed_elements(ProtobufCType type,
+		      size_t len, const uint8_t *data, size_t *count_out)
+{
+	switch (type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		if (len % 4 != 0) {
+			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 4 for fixed-length 32-bit types");
+			return FALSE;
+		}
+		*count_out = len / 4;
+		return TRUE;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		if (len % 8 != 0) {
+			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 8 for fixed-length 64-bit types");
+			return FALSE;
+		}
+		*count_out = len / 8;
+		return TRUE;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_BOOL:
+		/* bools are varints too, so one may take several bytes */
+		*count_out = max_b128_numbers(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_STRING:
+	case PROTOBUF_C_TYPE_BYTES:
+	case PROTOBUF_C_TYPE_MESSAGE:
+	default:
+		PROTOBUF_C_UNPACK_ERROR("bad protobuf-c type %u for packed-repeated", type);
+		return FALSE;
+	}
+}
+
+static inline uint32_t
+parse_uint32(unsigned len, const uint8_t *data)
+{
+	uint32_t rv = data[0] & 0x7f;
+	if (len > 1) {
+		rv |= ((uint32_t) (data[1] & 0x7f) << 7);
+		if (len > 2) {
+			rv |= ((uint32_t) (data[2] & 0x7f) << 14);
+			if (len > 3) {
+				rv |= ((uint32_t) (data[3] & 0x7f) << 21);
+				if (len > 4)
+					rv |= ((uint32_t) (data[4]) << 28);
+			}
+		}
+	}
+	return rv;
+}
+
+static inline uint32_t
+parse_int32(unsigned len, const uint8_t *data)
+{
+	return parse_uint32(len, data);
+}
+
+static inline int32_t
+unzigzag32(uint32_t v)
+{
+	// Note:  Using unsigned types prevents undefined behavior
+	return (int32_t)((v >> 1) ^ -(v & 1));
+}
+
+static inline uint32_t
+parse_fixed_uint32(const uint8_t *data)
+{
+#if !defined(WORDS_BIGENDIAN)
+	uint32_t t;
+	memcpy(&t, data, 4);
+	return t;
+#else
+	return data[0] |
+		((uint32_t) (data[1]) << 8) |
+		((uint32_t) (data[2]) << 16) |
+		((uint32_t) (data[3]) << 24);
+#endif
+}
+
+#ifdef VARINT_WORD_DECODE
+/**
+ * Decode a varint starting with eight bytes loaded as one little-endian word.
+ * The bytes after the terminating one are masked off, and the 7-bit groups
+ * are then packed together in three steps instead of eight shifts.
+ *
+ * \param len
+ *      Number of readable bytes at `data`, at least 8.
+ * \param data
+ *      Start of the varint.
+ * \param[out] value
+ *      Decoded value.
+ * \return
+ *      Length of the varint, or 0 if it is unterminated or longer than 10
+ *      bytes.
+ */
+static inline unsigned
+parse_varint_word(size_t len, const uint8_t *data, uint64_t *value)
+{
+	uint64_t x, stop;
+	unsigned rv;
+
+	memcpy(&x, data, 8);
+	stop = ~x & 0x8080808080808080ULL;
+	rv = stop != 0 ? CTZ64(stop) / 8 + 1 : 8;
+	x &= ~(uint64_t) 0 >> (64 - 8 * rv);
+	x &= 0x7f7f7f7f7f7f7f7fULL;
+	x = (x & 0x007f007f007f007fULL) | ((x & 0x7f007f007f007f00ULL) >> 1);
+	x = (x & 0x00003fff00003fffULL) | ((x & 0x3fff00003fff0000ULL) >> 2);
+	x = (x & 0x000000000fffffffULL) | ((x & 0x0fffffff00000000ULL) >> 4);
+	if (stop == 0) {
+		/* bytes 8 and 9 */
+		if (len < 9)
+			return 0;
+		x |= (uint64_t) (data[8] & 0x7f) << 56;
+		rv = 9;
+		if (data[8] & 0x80) {
+			if (len < 10 || (data[9] & 0x80))
+				return 0;
+			x |= (uint64_t) data[9] << 63;
+			rv = 10;
+		}
+	}
+	*value = x;
+	return rv;
+}
+#endif
+
+static uint64_t
+parse_uint64(unsigned len, const uint8_t *data)
+{
+	uint64_t rv = 0;
+
+#ifdef VARINT_WORD_DECODE
+	if (len >= 8) {
+		parse_varint_word(len, data, &rv);
+		return rv;
+	}
+#endif
+	switch (len) {
+	case 10: rv |= (uint64_t) (data[9] & 0x7f) << 63; /* FALLTHROUGH */
+	case 9: rv |= (uint64_t) (data[8] & 0x7f) << 56; /* FALLTHROUGH */
+	case 8: rv |= (uint64_t) (data[7] & 0x7f) << 49; /* FALLTHROUGH */
+	case 7: rv |= (uint64_t) (data[6] & 0x7f) << 42; /* FALLTHROUGH */
+	case 6: rv |= (uint64_t) (data[5] & 0x7f) << 35; /* FALLTHROUGH */
+	case 5: rv |= (uint64_t) (data[4] & 0x7f) << 28; /* FALLTHROUGH */
+	case 4: rv |= (uint64_t) (data[3] & 0x7f) << 21; /* FALLTHROUGH */
+	case 3: rv |= (uint64_t) (data[2] & 0x7f) << 14; /* FALLTHROUGH */
+	case 2: rv |= (uint64_t) (data[1] & 0x7f) << 7; /* FALLTHROUGH */
+	case 1: rv |= (uint64_t) (data[0] & 0x7f);
+	}
+	return rv;
+}
+
+static inline int64_t
+unzigzag64(uint64_t v)
+{
+	// Note:  Using unsigned types prevents undefined behavior
+	return (int64_t)((v >> 1) ^ -(v & 1));
+}
+
+static inline uint64_t
+parse_fixed_uint64(const uint8_t *data)
+{
+#if !defined(WORDS_BIGENDIAN)
+	uint64_t t;
+	memcpy(&t, data, 8);
+	return t;
+#else
+	return (uint64_t) parse_fixed_uint32(data) |
+		(((uint64_t) parse_fixed_uint32(data + 4)) << 32);
+#endif
+}
+
+static protobuf_c_boolean
+parse_boolean(unsigned len, const uint8_t *data)
+{
+	unsigned i;
+	for (i = 0; i < len; i++)
+		if (data[i] & 0x7f)
+			return TRUE;
+	return FALSE;
+}
+
+static protobuf_c_boolean
+parse_required_member(ScannedMember *scanned_member,
+		      void *member,
+		      UnpackState *state,
+		      protobuf_c_boolean maybe_clear)
+{
+	unsigned len = scanned_member->len;
+	const uint8_t *data = scanned_member->data;
+	uint8_t wire_type = scanned_member->wire_type;
+
+	switch (scanned_member->field->type) {
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(int32_t *) member = parse_int32(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_UINT32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(uint32_t *) member = parse_uint32(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_SINT32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(int32_t *) member = unzigzag32(parse_uint32(len, data));
+		return TRUE;
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_32BIT)
+			return FALSE;
+		*(uint32_t *) member = parse_fixed_uint32(data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(uint64_t *) member = parse_uint64(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_SINT64:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(int64_t *) member = unzigzag64(parse_uint64(len, data));
+		return TRUE;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_64BIT)
+			return FALSE;
+		*(uint64_t *) member = parse_fixed_uint64(data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_BOOL:
+		*(protobuf_c_boolean *) member = parse_boolean(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_STRING: {
+		char **pstr = member;
+		unsigned pref_len = scanned_member->length_prefix_len;
+
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+
+		if (maybe_clear && *pstr != NULL) {
+			const char *def = scanned_member->field->default_value;
+			if (*pstr != def)
+				free_string(state, *pstr);
+		}
+		*pstr = (char *) unpack_value(state, data + pref_len,
+					      len - pref_len, TRUE,
+					      state->validate_utf8 ||
+					      (scanned_member->field->flags &
+					       PROTOBUF_C_FIELD_FLAG_VALIDATE_UTF8));
+		if (*pstr == NULL)
+			return FALSE;
+		return TRUE;
+	}
+	case PROTOBUF_C_TYPE_BYTES: {
+		ProtobufCBinaryData *bd = member;
+		const ProtobufCBinaryData *def_bd;
+		unsigned pref_len = scanned_member->length_prefix_len;
+
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+
+		def_bd = scanned_member->field->default_value;
+		if (maybe_clear &&
+		    bd->data != NULL &&
+		    (def_bd == NULL || bd->data != def_bd->data))
+		{
+			free_value(state, bd->data, bd->len);
+		}
+		if (len > pref_len) {
+			bd->data = unpack_value(state, data + pref_len,
+						len - pref_len, FALSE, FALSE);
+			if (bd->data == NULL)
+				return FALSE;
+		} else {
+			bd->data = NULL;
+		}
+		bd->len = len - pref_len;
+		return TRUE;
+	}
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		ProtobufCMessage **pmessage = member;
+		ProtobufCMessage *subm;
+		const ProtobufCMessage *def_mess;
+		protobuf_c_boolean merge_successful = TRUE;
+
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+
+		/* unpack_message() has already unpacked the sub-message */
+		def_mess = scanned_member->field->default_value;
+		subm = state->submessage;
+		state->submessage = NULL;
+
+		if (maybe_clear &&
+		    *pmessage != NULL &&
+		    *pmessage != def_mess)
+		{
+			if (subm != NULL)
+				merge_successful = merge_messages(*pmessage, subm,
+								  state);
+			/* Delete the previous message */
+			free_message(*pmessage, state);
+		}
+		*pmessage = subm;
+		if (subm == NULL || !merge_successful)
+			return FALSE;
+		return TRUE;
+	}
+	}
+	return FALSE;
+}
+
+static protobuf_c_boolean
+parse_oneof_member (ScannedMember *scanned_member,
+		    void *member,
+		    ProtobufCMessage *message,
+		    UnpackState *state)
+{
+	uint32_t *oneof_case = STRUCT_MEMBER_PTR(uint32_t, message,
+					       scanned_member->field->quantifier_offset);
+
+	/* If we have already parsed a member of this oneof, free it. */
+	if (*oneof_case != 0) {
+		const ProtobufCFieldDescriptor *old_field;
+		size_t el_size;
+		/* lookup field */
+		int field_index =
+			field_index_lookup(message->descriptor, *oneof_case);
+		if (field_index < 0)
+			return FALSE;
+		old_field = message->descriptor->fields + field_index;
+		el_size = sizeof_elt_in_repeated_array(old_field->type);
+
+		switch (old_field->type) {
+	        case PROTOBUF_C_TYPE_STRING: {
+			char **pstr = member;
+			const char *def = old_field->default_value;
+			if (*pstr != NULL && *pstr != def)
+				free_string(state, *pstr);
+			break;
+	        }
+		case PROTOBUF_C_TYPE_BYTES: {
+			ProtobufCBinaryData *bd = member;
+			const ProtobufCBinaryData *def_bd = old_field->default_value;
+			if (bd->data != NULL &&
+			   (def_bd == NULL || bd->data != def_bd->data))
+			{
+				free_value(state, bd->data, bd->len);
+			}
+			break;
+	        }
+		case PROTOBUF_C_TYPE_MESSAGE: {
+			ProtobufCMessage **pmessage = member;
+			const ProtobufCMessage *def_mess = old_field->default_value;
+			if (*pmessage != NULL && *pmessage != def_mess)
+				free_message(*pmessage, state);
+			break;
+	        }
+		default:
+			break;
+		}
+
+		memset (member, 0, el_size);
+	}
+	if (!parse_required_member (scanned_member, member, state, TRUE))
+		return FALSE;
+
+	*oneof_case = scanned_member->tag;
+	return TRUE;
+}
+
+
+static protobuf_c_boolean
+parse_optional_member(ScannedMember *scanned_member,
+		      void *member,
+		      ProtobufCMessage *message,
+		      UnpackState *state)
+{
+	if (!parse_required_member(scanned_member, member, state, TRUE))
+		return FALSE;
+	if (scanned_member->field->quantifier_offset != 0)
+		STRUCT_MEMBER(protobuf_c_boolean,
+			      message,
+			      scanned_member->field->quantifier_offset) = TRUE;
+	return TRUE;
+}
+
+static protobuf_c_boolean
+parse_repeated_member(ScannedMember *scanned_member,
+		      void *member,
+		      ProtobufCMessage *message,
+		      UnpackState *state)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
+	size_t siz = sizeof_elt_in_repeated_array(field->type);
+	char *array = *(char **) member;
+
+	if (!parse_required_member(scanned_member, array + siz * (*p_n),
+				   state, FALSE))
+	{
+		return FALSE;
+	}
+	*p_n += 1;
+	return TRUE;
+}
+
+static unsigned
+scan_varint(size_t len, const uint8_t *data)
+{
+	unsigned i;
+
+#ifdef VARINT_WORD_DECODE
+	if (len >= 8) {
+		uint64_t x, stop;
+
+		memcpy(&x, data, 8);
+		stop = ~x & 0x8080808080808080ULL;
+		if (stop != 0)
+			return CTZ64(stop) / 8 + 1;
+		if (len > 8 && (data[8] & 0x80) == 0)
+			return 9;
+		if (len > 9 && (data[9] & 0x80) == 0)
+			return 10;
+		return 0;
+	}
+#endif
+	if (len > 10)
+		len = 10;
+	for (i = 0; i < len; i++)
+		if ((data[i] & 0x80) == 0)
+			break;
+	if (i == len)
+		return 0;
+	return i + 1;
+}
+
+/**
+ * Scan and decode a varint in one pass.
+ *
+ * \return
+ *      Length of the varint, or 0 if it is unterminated or longer than 10
+ *      bytes.
+ */
+static inline unsigned
+parse_varint(size_t len, const uint8_t *data, uint64_t *value)
+{
+	unsigned rv;
+
+#ifdef VARINT_WORD_DECODE
+	if (len >= 8)
+		return parse_varint_word(len, data, value);
+#endif
+	rv = scan_varint(len, data);
+	if (rv != 0)
+		*value = parse_uint64(rv, data);
+	return rv;
+}
+
+static protobuf_c_boolean
+parse_packed_repeated_member(ScannedMember *scanned_member,
+			     void *member,
+			     ProtobufCMessage *message)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
+	size_t siz = sizeof_elt_in_repeated_array(field->type);
+	void *array = *(char **) member + siz * (*p_n);
+	const uint8_t *at = scanned_member->data + scanned_member->length_prefix_len;
+	size_t rem = scanned_member->len - scanned_member->length_prefix_len;
+	size_t count = 0;
+#if defined(WORDS_BIGENDIAN)
+	unsigned i;
+#endif
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		count = (scanned_member->len - scanned_member->length_prefix_len) / 4;
+#if !defined(WORDS_BIGENDIAN)
+		goto no_unpacking_needed;
+#else
+		for (i = 0; i < count; i++) {
+			((uint32_t *) array)[i] = parse_fixed_uint32(at);
+			at += 4;
+		}
+		break;
+#endif
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		count = (scanned_member->len - scanned_member->length_prefix_len) / 8;
+#if !defined(WORDS_BIGENDIAN)
+		goto no_unpacking_needed;
+#else
+		for (i = 0; i < count; i++) {
+			((uint64_t *) array)[i] = parse_fixed_uint64(at);
+			at += 8;
+		}
+		break;
+#endif
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		while (rem > 0) {
+			uint64_t v;
+			unsigned s = parse_varint(rem, at, &v);
+			if (s == 0) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int32 value");
+				return FALSE;
+			}
+			((int32_t *) array)[count++] = (int32_t) (uint32_t) v;
+			at += s;
+			rem -= s;
+		}
+		break;
+	case PROTOBUF_C_TYPE_SINT32:
+		while (rem > 0) {
+			uint64_t v;
+			unsigned s = parse_varint(rem, at, &v);
+			if (s == 0) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint32 value");
+				return FALSE;
+			}
+			((int32_t *) array)[count++] = unzigzag32((uint32_t) v);
+			at += s;
+			rem -= s;
+		}
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+		while (rem > 0) {
+			uint64_t v;
+			unsigned s = parse_varint(rem, at, &v);
+			if (s == 0) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated enum or uint32 value");
+				return FALSE;
+			}
+			((uint32_t *) array)[count++] = (uint32_t) v;
+			at += s;
+			rem -= s;
+		}
+		break;
+
+	case PROTOBUF_C_TYPE_SINT64:
+		while (rem > 0) {
+			uint64_t v;
+			unsigned s = parse_varint(rem, at, &v);
+			if (s == 0) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint64 value");
+				return FALSE;
+			}
+			((int64_t *) array)[count++] = unzigzag64(v);
+			at += s;
+			rem -= s;
+		}
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		while (rem > 0) {
+			uint64_t v;
+			unsigned s = parse_varint(rem, at, &v);
+			if (s == 0) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int64/uint64 value");
+				return FALSE;
+			}
+			((int64_t *) array)[count++] = (int64_t) v;
+			at += s;
+			rem -= s;
+		}
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		while (rem > 0) {
+			unsigned s = scan_varint(rem, at);
+			if (s == 0) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated boolean value");
+				return FALSE;
+			}
+			((protobuf_c_boolean *) array)[count++] = parse_boolean(s, at);
+			at += s;
+			rem -= s;
+		}
+		break;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	*p_n += count;
+	return TRUE;
+
+#if !defined(WORDS_BIGENDIAN)
+no_unpacking_needed:
+	memcpy(array, at, count * siz);
+	*p_n += count;
+	return TRUE;
+#endif
+}
+
+static protobuf_c_boolean
+is_packable_type(ProtobufCType type)
+{
+	return
+		type != PROTOBUF_C_TYPE_STRING &&
+		type != PROTOBUF_C_TYPE_BYTES &&
+		type != PROTOBUF_C_TYPE_MESSAGE;
+}
+
+static protobuf_c_boolean
+parse_member(ScannedMember *scanned_member,
+	     ProtobufCMessage *message,
+	     UnpackState *state)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+	void *member;
+
+	if (field == NULL) {
+		ProtobufCMessageUnknownField *ufield =
+			message->unknown_fields +
+			(message->n_unknown_fields++);
+		ufield->tag = scanned_member->tag;
+		ufield->wire_type = scanned_member->wire_type;
+		ufield->len = scanned_member->len;
+		ufield->data = do_alloc(state->allocator, scanned_member->len);
+		if (ufield->data == NULL)
+			return FALSE;
+		memcpy(ufield->data, scanned_member->data, ufield->len);
+		return TRUE;
+	}
+	member = (char *) message + field->offset;
+	switch (field->label) {
+	case PROTOBUF_C_LABEL_REQUIRED:
+		return parse_required_member(scanned_member, member,
+					     state, TRUE);
+	case PROTOBUF_C_LABEL_OPTIONAL:
+	case PROTOBUF_C_LABEL_NONE:
+		if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)) {
+			return parse_oneof_member(scanned_member, member,
+						  message, state);
+		} else {
+			return parse_optional_member(scanned_member, member,
+						     message, state);
+		}
+	case PROTOBUF_C_LABEL_REPEATED:
+		if (scanned_member->wire_type ==
+		    PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+		    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+		     is_packable_type(field->type)))
+		{
+			return parse_packed_repeated_member(scanned_member,
+							    member, message);
+		} else {
+			return parse_repeated_member(scanned_member,
+						     member, message,
+						     state);
+		}
+	}
+	PROTOBUF_C__ASSERT_NOT_REACHED();
+	return 0;
+}
+
+/**
+ * Initialise messages generated by old code.
+ *
+ * This function is used if desc->message_init == NULL (which occurs
+ * for old code, and which would be useful to support allocating
+ * descriptors dynamically).
+ */
+static void
+message_init_generic(const ProtobufCMessageDescriptor *desc,
+		     ProtobufCMessage *message)
+{
+	unsigned i;
+
+	memset(message, 0, desc->sizeof_message);
+	message->descriptor = desc;
+	for (i = 0; i < desc->n_fields; i++) {
+		if (desc->fields[i].default_value != NULL &&
+		    desc->fields[i].label != PROTOBUF_C_LABEL_REPEATED)
+		{
+			void *field =
+				STRUCT_MEMBER_P(message, desc->fields[i].offset);
+			const void *dv = desc->fields[i].default_value;
+
+			switch (desc->fields[i].type) {
+			case PROTOBUF_C_TYPE_INT32:
+			case PROTOBUF_C_TYPE_SINT32:
+			case PROTOBUF_C_TYPE_SFIXED32:
+			case PROTOBUF_C_TYPE_UINT32:
+			case PROTOBUF_C_TYPE_FIXED32:
+			case PROTOBUF_C_TYPE_FLOAT:
+			case PROTOBUF_C_TYPE_ENUM:
+				memcpy(field, dv, 4);
+				break;
+			case PROTOBUF_C_TYPE_INT64:
+			case PROTOBUF_C_TYPE_SINT64:
+			case PROTOBUF_C_TYPE_SFIXED64:
+			case PROTOBUF_C_TYPE_UINT64:
+			case PROTOBUF_C_TYPE_FIXED64:
+			case PROTOBUF_C_TYPE_DOUBLE:
+				memcpy(field, dv, 8);
+				break;
+			case PROTOBUF_C_TYPE_BOOL:
+				memcpy(field, dv, sizeof(protobuf_c_boolean));
+				break;
+			case PROTOBUF_C_TYPE_BYTES:
+				memcpy(field, dv, sizeof(ProtobufCBinaryData));
+				break;
+
+			case PROTOBUF_C_TYPE_STRING:
+			case PROTOBUF_C_TYPE_MESSAGE:
+				/*
+				 * The next line essentially implements a cast
+				 * from const, which is totally unavoidable.
+				 */
+				*(const void **) field = dv;
+				break;
+			}
+		}
+	}
+}
+
+/**@}*/
+
+/*
+ * After a failed unpack, bring every repeated field array and the unknown
+ * fields back to the number of elements they were allocated with, zeroing
+ * the elements that were never parsed, so that free_message() passes the
+ * allocated sizes to the allocator. Parsing stopped at member `j` of slab
+ * `i_slab`.
+ */
+static void
+restore_allocated_counts(ProtobufCMessage *rv, ScannedMember **slabs,
+			 unsigned which_slab, unsigned in_slab_index,
+			 unsigned i_slab, unsigned j, size_t n_unknown)
+{
+	for (; i_slab <= which_slab; i_slab++, j = 0) {
+		unsigned max = (i_slab == which_slab) ?
+			in_slab_index : (1UL << (i_slab + 4));
+
+		for (; j < max; j++) {
+			const ScannedMember *sm = slabs[i_slab] + j;
+			const ProtobufCFieldDescriptor *field = sm->field;
+			size_t siz, count = 1;
+			size_t *n;
+			uint8_t *array;
+
+			if (field == NULL ||
+			    field->label != PROTOBUF_C_LABEL_REPEATED ||
+			    sm->decoded)
+				continue;
+			array = STRUCT_MEMBER(uint8_t *, rv, field->offset);
+			if (array == NULL)
+				continue;
+			if (sm->wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+			    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+			     is_packable_type(field->type)))
+			{
+				/* already validated by the scan */
+				count_packed_elements(field->type,
+					sm->len - sm->length_prefix_len,
+					sm->data + sm->length_prefix_len,
+					&count);
+			}
+			n = STRUCT_MEMBER_PTR(size_t, rv, field->quantifier_offset);
+			siz = sizeof_elt_in_repeated_array(field->type);
+			memset(array + *n * siz, 0, count * siz);
+			*n += count;
+		}
+	}
+	if (rv->unknown_fields != NULL) {
+		memset(rv->unknown_fields + rv->n_unknown_fields, 0,
+		       (n_unknown - rv->n_unknown_fields) *
+		       sizeof(ProtobufCMessageUnknownField));
+		rv->n_unknown_fields = n_unknown;
+	}
+}
+
+/**
+ * Check the unpacker's bitmap of seen fields against the required mask of the
+ * descriptor's layout.
+ */
+static protobuf_c_boolean
+unpack_check_required(const ProtobufCMessageDescriptor *desc,
+		      const unsigned char *seen)
+{
+	const uint8_t *mask = desc->layout->required_mask;
+	unsigned i;
+
+	if (mask == NULL)
+		return TRUE;
+	for (i = 0; i < (desc->n_fields + 7) / 8; i++) {
+		unsigned missing = mask[i] & ~seen[i];
+		unsigned b = 0;
+
+		if (missing == 0)
+			continue;
+		while ((missing & (1U << b)) == 0)
+			b++;
+		PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
+					desc->name, desc->fields[i * 8 + b].name);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * Reset the element counts left by the scan in the repeated fields from
+ * `layout->owning[first]` onwards, whose arrays have not been allocated.
+ */
+static void
+clear_repeated_counts(ProtobufCMessage *rv,
+		      const ProtobufCMessageLayout *layout, unsigned first)
+{
+	unsigned k;
+
+	for (k = first; k < layout->n_owning; k++) {
+		const ProtobufCFieldHot *hot = layout->fields + layout->owning[k];
+
+		if (hot->label == PROTOBUF_C_LABEL_REPEATED)
+			STRUCT_MEMBER(size_t, rv, hot->quantifier_offset) = 0;
+	}
+}
+
+/**
+ * Allocate the arrays of the repeated fields, visiting only the fields listed
+ * as owning memory in the descriptor's layout.
+ */
+static protobuf_c_boolean
+unpack_alloc_repeated(ProtobufCMessage *rv,
+		      const ProtobufCMessageLayout *layout,
+		      ProtobufCAllocator *allocator)
+{
+	unsigned k;
+
+	if (0 == (layout->flags & PROTOBUF_C_MESSAGE_LAYOUT_HAS_REPEATED))
+		return TRUE;
+	for (k = 0; k < layout->n_owning; k++) {
+		const ProtobufCFieldHot *hot = layout->fields + layout->owning[k];
+		size_t *n_ptr;
+		size_t n;
+		void *a;
+
+		if (hot->label != PROTOBUF_C_LABEL_REPEATED)
+			continue;
+		n_ptr = STRUCT_MEMBER_PTR(size_t, rv, hot->quantifier_offset);
+		n = *n_ptr;
+		if (n == 0)
+			continue;
+		*n_ptr = 0;
+		a = do_alloc(allocator,
+			     n * sizeof_elt_in_repeated_array((ProtobufCType) hot->type));
+		if (a == NULL) {
+			clear_repeated_counts(rv, layout, k + 1);
+			return FALSE;
+		}
+		STRUCT_MEMBER(void *, rv, hot->offset) = a;
+	}
+	return TRUE;
+}
+
+#define REQUIRED_FIELD_BITMAP_SET(index)	\
+	(required_fields_bitmap[(index)/8] |= (1UL<<((index)%8)))
+
+#define REQUIRED_FIELD_BITMAP_IS_SET(index)	\
+	(required_fields_bitmap[(index)/8] & (1UL<<((index)%8)))
+
+/*
+ * Push a frame for a message of type `desc` serialised in `data`, allocate the
+ * message and scan the wire data: count the elements of repeated fields,
+ * check that required fields are present and allocate the arrays. The members
+ * are parsed afterwards by unpack_message(). On failure the frame is popped
+ * again.
+ */
+static ProtobufCMessage *
+unpack_message(const ProtobufCMessageDescriptor *desc,
+	       UnpackState *state,
+	       size_t len, const uint8_t *data);
+
+/** Shared by the tasks of one parallel unpack. */
+typedef struct ParallelUnpack {
+	const UnpackState *state;  /**< The state of the caller. */
+	const ProtobufCFieldDescriptor *field;
+	ScannedMember **members;   /**< The members, in order. */
+	ProtobufCMessage **out;    /**< Their messages, in the same order. */
+} ParallelUnpack;
+
+static void
+unpack_parallel_task(void *task_data, size_t i)
+{
+	const ParallelUnpack *pu = task_data;
+	const ScannedMember *member = pu->members[i];
+	UnpackState state;
+
+	/* each task unpacks on its own stack, with no context to share */
+	init_unpack_state(&state, pu->state->allocator);
+	state.scratch = pu->state->scratch;
+	state.max_depth = pu->state->max_depth - pu->state->depth;
+	state.validate_utf8 = pu->state->validate_utf8;
+	pu->out[i] = unpack_message(pu->field->descriptor, &state,
+				    member->len - member->length_prefix_len,
+				    member->data + member->length_prefix_len);
+}
+
+/*
+ * Unpack the elements of a repeated message field with the executor of the
+ * unpack, if there are enough of them, straight into the array allocated
+ * for the field. The members are marked as decoded so that unpack_tree()
+ * skips them. On failure, the array is left empty.
+ */
+static protobuf_c_boolean
+unpack_parallel(UnpackState *state, const ProtobufCFieldDescriptor *field,
+		ProtobufCMessage *rv, ScannedMember **slabs,
+		unsigned which_slab, unsigned in_slab_index)
+{
+	size_t *p_n = STRUCT_MEMBER_PTR(size_t, rv, field->quantifier_offset);
+	ProtobufCMessage **array = STRUCT_MEMBER(ProtobufCMessage **, rv,
+						 field->offset);
+	ParallelUnpack pu;
+	size_t n = 0;
+	size_t i;
+	unsigned i_slab, j;
+
+	/* the array was allocated for every member of the field */
+	for (i_slab = 0; i_slab <= which_slab; i_slab++) {
+		unsigned max = (i_slab == which_slab) ? in_slab_index :
+			(1U << (i_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2));
+
+		for (j = 0; j < max; j++)
+			if (slabs[i_slab][j].field == field &&
+			    slabs[i_slab][j].wire_type ==
+			    PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+				n++;
+	}
+	if (n < state->parallel_min)
+		return TRUE;
+
+	pu.state = state;
+	pu.field = field;
+	pu.out = array;
+	pu.members = do_alloc(state->scratch, n * sizeof(ScannedMember *));
+	if (pu.members == NULL)
+		return FALSE;
+	n = 0;
+	for (i_slab = 0; i_slab <= which_slab; i_slab++) {
+		unsigned max = (i_slab == which_slab) ? in_slab_index :
+			(1U << (i_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2));
+
+		for (j = 0; j < max; j++)
+			if (slabs[i_slab][j].field == field &&
+			    slabs[i_slab][j].wire_type ==
+			    PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+				pu.members[n++] = slabs[i_slab] + j;
+	}
+
+	state->executor->run(state->executor, n, unpack_parallel_task, &pu);
+
+	for (i = 0; i < n && array[i] != NULL; i++)
+		;
+	if (i < n) {
+		for (i = 0; i < n; i++)
+			if (array[i] != NULL)
+				free_message(array[i], state);
+		memset(array, 0, n * sizeof(ProtobufCMessage *));
+	} else {
+		for (i = 0; i < n; i++)
+			pu.members[i]->decoded = 1;
+		*p_n = n;
+	}
+	do_free(state->scratch, pu.members, n * sizeof(ScannedMember *));
+	return *p_n == n;
+}
+
+static protobuf_c_boolean
+unpack_begin(UnpackState *state,
+	     const ProtobufCMessageDescriptor *desc,
+	     size_t len, const uint8_t *data)
+{
+	ProtobufCAllocator *allocator = state->allocator;
+	ProtobufCAllocator *scratch = state->scratch;
+	ProtobufCMessage *rv;
+	size_t rem = len;
+	const uint8_t *at = data;
+	const ProtobufCFieldDescriptor *last_field = desc->fields + 0;
+	ScannedMember **scanned_member_slabs;
+	unsigned which_slab = 0; /* the slab we are currently populating */
+	unsigned in_slab_index = 0; /* number of members in the slab */
+	size_t n_unknown = 0;
+	unsigned f;
+	unsigned last_field_index = 0;
+	unsigned required_fields_bitmap_len;
+	unsigned char *required_fields_bitmap;
+	const ProtobufCMessageLayout *layout = desc->layout;
+	const IovPiece *piece = state->pieces;
+	const IovPiece *pieces_end = piece + state->n_pieces;
+	UnpackFrame *frame;
+
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+	/* only the top-level message is split into pieces */
+	state->pieces = NULL;
+	state->n_pieces = 0;
+
+	if (state->depth == state->max_depth) {
+		PROTOBUF_C_UNPACK_ERROR("message '%s' is nested deeper than %u levels",
+					desc->name, state->max_depth);
+		return FALSE;
+	}
+	frame = unpack_frame_enter(state);
+	if (frame == NULL)
+		return FALSE;
+	scanned_member_slabs = frame->slabs;
+
+	rv = alloc_message(state, desc->sizeof_message);
+	if (!rv) {
+		unpack_frame_leave(state);
+		return FALSE;
+	}
+
+	required_fields_bitmap_len = (desc->n_fields + 7) / 8;
+	required_fields_bitmap = frame->bitmap_stack;
+	if (required_fields_bitmap_len > sizeof(frame->bitmap_stack)) {
+		if (frame->bitmap_len < required_fields_bitmap_len) {
+			do_free(scratch, frame->bitmap, frame->bitmap_len);
+			frame->bitmap = do_alloc(scratch, required_fields_bitmap_len);
+			frame->bitmap_len = frame->bitmap ?
+				required_fields_bitmap_len : 0;
+		}
+		required_fields_bitmap = frame->bitmap;
+		if (!required_fields_bitmap) {
+			free_message_memory(state, rv, desc->sizeof_message);
+			unpack_frame_leave(state);
+			return FALSE;
+		}
+	}
+	memset(required_fields_bitmap, 0, required_fields_bitmap_len);
+
+	/*
+	 * Generated code always defines "message_init". However, we provide a
+	 * fallback for (1) users of old protobuf-c generated-code that do not
+	 * provide the function, and (2) descriptors constructed from some other
+	 * source (most likely, direct construction from the .proto file).
+	 */
+	if (desc->message_init != NULL)
+		protobuf_c_message_init(desc, rv);
+	else
+		message_init_generic(desc, rv);
+
+next_piece:
+	while (rem > 0) {
+		uint32_t tag;
+		uint8_t wire_type;
+		size_t used = parse_tag_and_wiretype(rem, at, &tag, &wire_type);
+		const ProtobufCFieldDescriptor *field;
+		ScannedMember tmp;
+
+		if (used == 0) {
+			PROTOBUF_C_UNPACK_ERROR("error parsing tag/wiretype at offset %u",
+						(unsigned) (at - data));
+			goto error_cleanup_during_scan;
+		}
+		/*
+		 * \todo Consider optimizing for field[1].id == tag, if field[1]
+		 * exists!
+		 */
+		if (last_field == NULL || last_field->id != tag) {
+			/* lookup field */
+			int field_index =
+			    layout != NULL && tag > layout->max_field_id ?
+			    -1 : field_index_lookup(desc, tag);
+			if (field_index < 0) {
+				field = NULL;
+				n_unknown++;
+			} else {
+				field = desc->fields + field_index;
+				last_field = field;
+				last_field_index = field_index;
+			}
+		} else {
+			field = last_field;
+		}
+
+		if (field != NULL && field->label == PROTOBUF_C_LABEL_REQUIRED)
+			REQUIRED_FIELD_BITMAP_SET(last_field_index);
+
+		at += used;
+		rem -= used;
+		tmp.tag = tag;
+		tmp.wire_type = wire_type;
+		tmp.field = field;
+		tmp.data = at;
+		tmp.length_prefix_len = 0;
+		tmp.decoded = 0;
+
+		switch (wire_type) {
+		case PROTOBUF_C_WIRE_TYPE_VARINT:
+			tmp.len = scan_varint(rem, at);
+			if (tmp.len == 0) {
+				PROTOBUF_C_UNPACK_ERROR("unterminated varint at offset %u",
+							(unsigned) (at - data));
+				goto error_cleanup_during_scan;
+			}
+			break;
+		case PROTOBUF_C_WIRE_TYPE_64BIT:
+			if (rem < 8) {
+				PROTOBUF_C_UNPACK_ERROR("too short after 64bit wiretype at offset %u",
+							(unsigned) (at - data));
+				goto error_cleanup_during_scan;
+			}
+			tmp.len = 8;
+			break;
+		case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED: {
+			size_t pref_len;
+
+			tmp.len = scan_length_prefixed_data(rem, at, &pref_len);
+			if (tmp.len == 0) {
+				/* NOTE: scan_length_prefixed_data calls UNPACK_ERROR */
+				goto error_cleanup_during_scan;
+			}
+			tmp.length_prefix_len = pref_len;
+			break;
+		}
+		case PROTOBUF_C_WIRE_TYPE_32BIT:
+			if (rem < 4) {
+				PROTOBUF_C_UNPACK_ERROR("too short after 32bit wiretype at offset %u",
+					      (unsigned) (at - data));
+				goto error_cleanup_during_scan;
+			}
+			tmp.len = 4;
+			break;
+		default:
+			PROTOBUF_C_UNPACK_ERROR("unsupported tag %u at offset %u",
+						wire_type, (unsigned) (at - data));
+			goto error_cleanup_during_scan;
+		}
+
+		if (in_slab_index == (1UL <<
+			(which_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)))
+		{
+			size_t size;
+
+			in_slab_index = 0;
+			if (which_slab == MAX_SCANNED_MEMBER_SLAB) {
+				PROTOBUF_C_UNPACK_ERROR("too many fields");
+				goto error_cleanup_during_scan;
+			}
+			which_slab++;
+			/* slabs stay cached in the frame */
+			if (which_slab > frame->n_slabs) {
+				size = SCANNED_MEMBER_SLAB_SIZE(which_slab);
+				scanned_member_slabs[which_slab] = do_alloc(scratch, size);
+				if (scanned_member_slabs[which_slab] == NULL)
+					goto error_cleanup_during_scan;
+				frame->n_slabs = which_slab;
+			}
+		}
+		scanned_member_slabs[which_slab][in_slab_index++] = tmp;
+
+		if (field != NULL && field->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t *n = STRUCT_MEMBER_PTR(size_t, rv,
+						      field->quantifier_offset);
+			if (wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+			    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+			     is_packable_type(field->type)))
+			{
+				size_t count;
+				if (!count_packed_elements(field->type,
+							   tmp.len -
+							   tmp.length_prefix_len,
+							   tmp.data +
+							   tmp.length_prefix_len,
+							   &count))
+				{
+					PROTOBUF_C_UNPACK_ERROR("counting packed elements");
+					goto error_cleanup_during_scan;
+				}
+				*n += count;
+			} else {
+				*n += 1;
+			}
+		}
+
+		at += tmp.len;
+		rem -= tmp.len;
+	}
+	if (piece != pieces_end) {
+		data = at = piece->data;
+		rem = piece->len;
+		piece++;
+		goto next_piece;
+	}
+
+	if (layout != NULL) {
+		if (!unpack_check_required(desc, required_fields_bitmap)) {
+			clear_repeated_counts(rv, layout, 0);
+			goto error_cleanup;
+		}
+		if (!unpack_alloc_repeated(rv, layout, allocator))
+			goto error_cleanup;
+		goto parse;
+	}
+
+	/* allocate space for repeated fields, also check that all required fields have been set */
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+		if (field == NULL) {
+			continue;
+		}
+		if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t siz =
+			    sizeof_elt_in_repeated_array(field->type);
+			size_t *n_ptr =
+			    STRUCT_MEMBER_PTR(size_t, rv,
+					      field->quantifier_offset);
+			if (*n_ptr != 0) {
+				unsigned n = *n_ptr;
+				void *a;
+				*n_ptr = 0;
+				assert(rv->descriptor != NULL);
+#define CLEAR_REMAINING_N_PTRS()                                              \
+              for(f++;f < desc->n_fields; f++)                                \
+                {                                                             \
+                  field = desc->fields + f;                                   \
+                  if (field->label == PROTOBUF_C_LABEL_REPEATED)              \
+                    STRUCT_MEMBER (size_t, rv, field->quantifier_offset) = 0; \
+                }
+				a = do_alloc(allocator, siz * n);
+				if (!a) {
+					CLEAR_REMAINING_N_PTRS();
+					goto error_cleanup;
+				}
+				STRUCT_MEMBER(void *, rv, field->offset) = a;
+			}
+		} else if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+			if (field->default_value == NULL &&
+			    !REQUIRED_FIELD_BITMAP_IS_SET(f))
+			{
+				CLEAR_REMAINING_N_PTRS();
+				PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
+							desc->name, field->name);
+				goto error_cleanup;
+			}
+		}
+	}
+#undef CLEAR_REMAINING_N_PTRS
+
+parse:
+	/* allocate space for unknown fields */
+	if (n_unknown) {
+		rv->unknown_fields = do_alloc(allocator,
+					      n_unknown * sizeof(ProtobufCMessageUnknownField));
+		if (rv->unknown_fields == NULL)
+			goto error_cleanup;
+	} else {
+		rv->unknown_fields = NULL;
+	}
+
+	if (state->executor != NULL) {
+		for (f = 0; f < desc->n_fields; f++) {
+			const ProtobufCFieldDescriptor *field = desc->fields + f;
+
+			if (field->label == PROTOBUF_C_LABEL_REPEATED &&
+			    field->type == PROTOBUF_C_TYPE_MESSAGE &&
+			    STRUCT_MEMBER(size_t, rv, field->quantifier_offset) == 0 &&
+			    STRUCT_MEMBER(void *, rv, field->offset) != NULL &&
+			    !unpack_parallel(state, field, rv, scanned_member_slabs,
+					     which_slab, in_slab_index))
+				goto error_cleanup;
+		}
+	}
+
+	frame->desc = desc;
+	frame->rv = rv;
+	frame->n_unknown = n_unknown;
+	frame->which_slab = which_slab;
+	frame->in_slab_index = in_slab_index;
+	frame->i_slab = 0;
+	frame->j = 0;
+	return TRUE;
+
+error_cleanup:
+	restore_allocated_counts(rv, scanned_member_slabs, which_slab,
+				 in_slab_index, 0, 0, n_unknown);
+	free_message(rv, state);
+	unpack_frame_leave(state);
+	return FALSE;
+
+error_cleanup_during_scan:
+	free_message_memory(state, rv, desc->sizeof_message);
+	unpack_frame_leave(state);
+	return FALSE;
+}
+
+/*
+ * Unpack a message tree without recursion. Whenever a member holds a
+ * sub-message, a frame for it is pushed with unpack_begin(); once all its
+ * members are parsed the frame is popped, and parse_member() of the parent's
+ * member picks the finished sub-message up from `state->submessage`. A
+ * sub-message that fails leaves NULL there, which fails the parent in turn.
+ *
+ * The frames come from `state->frames`, set up by unpack_stack_begin().
+ */
+static ProtobufCMessage *
+unpack_tree(const ProtobufCMessageDescriptor *desc,
+	    UnpackState *state,
+	    size_t len, const uint8_t *data)
+{
+	protobuf_c_boolean resume = FALSE;
+	ProtobufCMessage *rv;
+
+	if (unpack_begin(state, desc, len, data)) {
+		while (state->frame != NULL) {
+			UnpackFrame *frame = state->frame;
+			unsigned i_slab = frame->i_slab;
+			unsigned j = frame->j;
+			ScannedMember *member;
+
+			for (; i_slab <= frame->which_slab; i_slab++, j = 0) {
+				unsigned max = (i_slab == frame->which_slab) ?
+					frame->in_slab_index :
+					(1U << (i_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2));
+				ScannedMember *slab = frame->slabs[i_slab];
+
+				for (; j < max; j++) {
+					member = slab + j;
+					if (member->decoded)
+						continue;
+					if (!resume && member->field != NULL &&
+					    member->field->type == PROTOBUF_C_TYPE_MESSAGE &&
+					    member->wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+						goto descend;
+					resume = FALSE;
+					if (!parse_member(member, frame->rv, state))
+						goto failed;
+				}
+			}
+
+			/* complete, hand the message to the parent */
+			state->submessage = frame->rv;
+			unpack_frame_leave(state);
+			resume = TRUE;
+			continue;
+
+		descend:
+			frame->i_slab = i_slab;
+			frame->j = j;
+			/* on failure, parse_member() fails for lack of the value */
+			resume = !unpack_begin(state, member->field->descriptor,
+					       member->len - member->length_prefix_len,
+					       member->data + member->length_prefix_len);
+			continue;
+
+		failed:
+			if (state->submessage != NULL) {
+				/* not taken by the failed parse_member() */
+				free_message(state->submessage, state);
+				state->submessage = NULL;
+			}
+			PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
+						member->field ? member->field->name : "*unknown-field*",
+						frame->desc->name);
+			restore_allocated_counts(frame->rv, frame->slabs,
+						 frame->which_slab,
+						 frame->in_slab_index,
+						 i_slab, j, frame->n_unknown);
+			free_message(frame->rv, state);
+			unpack_frame_leave(state);
+			resume = TRUE;
+		}
+	}
+	rv = state->submessage;
+	state->submessage = NULL;
+	return rv;
+}
+
+/*
+ * Frames on the caller's stack for the first two levels of nesting, used
+ * when there is no unpack context to keep them.
+ */
+typedef struct UnpackStack {
+	UnpackFrame root;
+	UnpackFrame child;
+	UnpackFrame *head;
+} UnpackStack;
+
+static void
+unpack_stack_begin(UnpackState *state, UnpackStack *stack)
+{
+	if (state->context != NULL) {
+		state->frames = &state->context->frames;
+	} else {
+		unpack_frame_init(&stack->root, NULL);
+		stack->head = &stack->root;
+		state->frames = &stack->head;
+		state->spare_frame = &stack->child;
 	}
+}
+
+static void
+unpack_stack_end(UnpackState *state, UnpackStack *stack)
+{
+	if (state->context == NULL) {
+		unpack_frame_release(state->scratch, &stack->root);
+		if (stack->root.next != NULL) {
+			unpack_frame_release(state->scratch, &stack->child);
+			unpack_frames_free(state->scratch, stack->child.next);
+		}
+		state->spare_frame = NULL;
+	}
+}
+
+static ProtobufCMessage *
+unpack_message(const ProtobufCMessageDescriptor *desc,
+	       UnpackState *state,
+	       size_t len, const uint8_t *data)
+{
+	UnpackStack stack;
+	ProtobufCMessage *rv;
+
+	unpack_stack_begin(state, &stack);
+	rv = unpack_tree(desc, state, len, data);
+	unpack_stack_end(state, &stack);
 	return rv;
 }
 
-/**
- * Pack an array of same field type to a virtual buffer.
- *
- * \param field
- *      Field descriptor.
- * \param count
- *      Number of elements of this type.
- * \param array
- *      The elements to get the size of.
- * \param[out] buffer
- *      Virtual buffer to append data to.
- * \return
- *      Number of bytes packed.
- */
-static size_t
-pack_buffer_packed_payload(const ProtobufCFieldDescriptor *field,
-			   unsigned count, const void *array,
-			   ProtobufCBuffer *buffer)
+ProtobufCMessage *
+protobuf_c_message_unpack(const ProtobufCMessageDescriptor *desc,
+			  ProtobufCAllocator *allocator,
+			  size_t len, const uint8_t *data)
 {
-	uint8_t scratch[16];
-	size_t rv = 0;
-	unsigned i;
+	UnpackState state;
 
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-#if !defined(WORDS_BIGENDIAN)
-		rv = count * 4;
-		goto no_packing_needed;
-#else
-		for (i = 0; i < count; i++) {
-			unsigned len = fixed32_pack(((uint32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-#endif
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-#if !defined(WORDS_BIGENDIAN)
-		rv = count * 8;
-		goto no_packing_needed;
+	init_unpack_state(&state, allocator);
+	return unpack_message(desc, &state, len, data);
+}
+
+/*
+ * PREFETCH() asks for the cache line holding `p` ahead of its use, where the
+ * compiler offers a way to.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+# define PREFETCH(p)	__builtin_prefetch((p), 0, 3)
 #else
-		for (i = 0; i < count; i++) {
-			unsigned len = fixed64_pack(((uint64_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
+# define PREFETCH(p)	((void) (p))
 #endif
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		for (i = 0; i < count; i++) {
-			unsigned len = int32_pack(((int32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_SINT32:
-		for (i = 0; i < count; i++) {
-			unsigned len = sint32_pack(((int32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_UINT32:
-		for (i = 0; i < count; i++) {
-			unsigned len = uint32_pack(((uint32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_SINT64:
-		for (i = 0; i < count; i++) {
-			unsigned len = sint64_pack(((int64_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		for (i = 0; i < count; i++) {
-			unsigned len = uint64_pack(((uint64_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_BOOL:
-		for (i = 0; i < count; i++) {
-			unsigned len = boolean_pack(((protobuf_c_boolean *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
+
+/* How much of the next buffer of a batch is prefetched, in bytes. */
+#define UNPACK_BATCH_PREFETCH	256
+
+size_t
+protobuf_c_message_unpack_batch(const ProtobufCMessageDescriptor *desc,
+				ProtobufCAllocator *allocator,
+				size_t n,
+				const size_t *lens,
+				const uint8_t *const *datas,
+				ProtobufCMessage **out)
+{
+	UnpackState state;
+	UnpackStack stack;
+	size_t n_unpacked = 0;
+	size_t i;
+
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+	init_unpack_state(&state, allocator);
+	/* the frames and their slabs serve the whole batch */
+	unpack_stack_begin(&state, &stack);
+	for (i = 0; i < n; i++) {
+		if (i + 1 < n) {
+			size_t off;
+
+			for (off = 0; off < lens[i + 1] &&
+			     off < UNPACK_BATCH_PREFETCH; off += 64)
+				PREFETCH(datas[i + 1] + off);
 		}
-		return count;
-	default:
-		PROTOBUF_C__ASSERT_NOT_REACHED();
+		out[i] = unpack_tree(desc, &state, lens[i], datas[i]);
+		if (out[i] != NULL)
+			n_unpacked++;
 	}
-	return rv;
+	unpack_stack_end(&state, &stack);
+	return n_unpacked;
+}
 
-#if !defined(WORDS_BIGENDIAN)
-no_packing_needed:
-	buffer->append(buffer, rv, array);
-	return rv;
-#endif
+/* Records whose boundaries are found before they are unpacked together. */
+#define DELIMITED_WINDOW	1024
+
+/* Records unpacked by each task, as one batch. */
+#define DELIMITED_TASK_RECORDS	64
+
+/** A window of records of protobuf_c_message_unpack_delimited(). */
+typedef struct DelimitedUnpack {
+	const ProtobufCMessageDescriptor *desc;
+	ProtobufCAllocator *allocator;
+	ProtobufCRecordFunc func;
+	void *func_data;
+	protobuf_c_boolean ordered;
+	size_t first;              /**< Index of the first record in the stream. */
+	size_t n;                  /**< Records in the window. */
+	size_t *lens;
+	const uint8_t **datas;
+	ProtobufCMessage **out;
+} DelimitedUnpack;
+
+static void
+unpack_delimited_task(void *task_data, size_t k)
+{
+	const DelimitedUnpack *du = task_data;
+	size_t i = k * DELIMITED_TASK_RECORDS;
+	size_t n = du->n - i;
+	size_t j;
+
+	if (n > DELIMITED_TASK_RECORDS)
+		n = DELIMITED_TASK_RECORDS;
+	protobuf_c_message_unpack_batch(du->desc, du->allocator, n,
+					du->lens + i, du->datas + i,
+					du->out + i);
+	if (!du->ordered)
+		for (j = i; j < i + n; j++)
+			du->func(du->out[j], du->first + j, du->func_data);
 }
 
-static size_t
-repeated_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			      unsigned count, const void *member,
-			      ProtobufCBuffer *buffer)
+size_t
+protobuf_c_message_unpack_delimited(const ProtobufCMessageDescriptor *desc,
+				    ProtobufCAllocator *allocator,
+				    ProtobufCExecutor *executor,
+				    size_t len, const uint8_t *data,
+				    protobuf_c_boolean ordered,
+				    ProtobufCRecordFunc func, void *func_data)
 {
-	char *array = *(char * const *) member;
+	const size_t size = DELIMITED_WINDOW *
+		(sizeof(size_t) + sizeof(uint8_t *) + sizeof(ProtobufCMessage *));
+	DelimitedUnpack du;
+	size_t at = 0;
+	size_t i;
 
-	if (count == 0)
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+	du.lens = do_alloc(&protobuf_c__allocator, size);
+	if (du.lens == NULL)
 		return 0;
-	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
-		uint8_t scratch[MAX_UINT64_ENCODED_SIZE * 2];
-		size_t rv = tag_pack(field->id, scratch);
-		size_t payload_len = get_packed_payload_length(field, count, array);
-		size_t tmp;
-
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		rv += uint32_pack(payload_len, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		tmp = pack_buffer_packed_payload(field, count, array, buffer);
-		assert(tmp == payload_len);
-		(void)tmp;
-		return rv + payload_len;
-	} else {
-		size_t siz;
-		unsigned i;
-		/* CONSIDER: optimize this case a bit (by putting the loop inside the switch) */
-		unsigned rv = 0;
+	du.datas = (const uint8_t **) (du.lens + DELIMITED_WINDOW);
+	du.out = (ProtobufCMessage **) (du.datas + DELIMITED_WINDOW);
+	du.desc = desc;
+	du.allocator = allocator;
+	du.func = func;
+	du.func_data = func_data;
+	du.ordered = ordered || executor == NULL;
+	du.first = 0;
+
+	for (;;) {
+		size_t n_tasks;
+
+		/* the boundaries are found serially, reading only the prefixes */
+		for (du.n = 0; du.n < DELIMITED_WINDOW && at < len; du.n++) {
+			size_t pref_len;
+			size_t rec_len = scan_length_prefixed_data(len - at,
+								   data + at,
+								   &pref_len);
+			if (rec_len == 0)
+				break;
+			du.datas[du.n] = data + at + pref_len;
+			du.lens[du.n] = rec_len - pref_len;
+			at += rec_len;
+		}
+		if (du.n == 0)
+			break;
 
-		siz = sizeof_elt_in_repeated_array(field->type);
-		for (i = 0; i < count; i++) {
-			rv += required_field_pack_to_buffer(field, array, buffer);
-			array += siz;
+		n_tasks = (du.n + DELIMITED_TASK_RECORDS - 1) /
+			DELIMITED_TASK_RECORDS;
+		if (executor != NULL) {
+			executor->run(executor, n_tasks, unpack_delimited_task,
+				      &du);
+		} else {
+			for (i = 0; i < n_tasks; i++)
+				unpack_delimited_task(&du, i);
 		}
-		return rv;
+		if (du.ordered)
+			for (i = 0; i < du.n; i++)
+				func(du.out[i], du.first + i, func_data);
+		du.first += du.n;
 	}
+
+	do_free(&protobuf_c__allocator, du.lens, size);
+	return at;
 }
 
+/*
+ * Copy up to `n` bytes from position `*seg`, `*off` of `iov`, advancing the
+ * position past them. Returns the number of bytes copied.
+ */
 static size_t
-unknown_field_pack_to_buffer(const ProtobufCMessageUnknownField *field,
-			     ProtobufCBuffer *buffer)
+iov_read(const ProtobufCBinaryData *iov, size_t iovcnt,
+	 size_t *seg, size_t *off, size_t n, uint8_t *out)
 {
-	uint8_t header[MAX_UINT64_ENCODED_SIZE];
-	size_t rv = tag_pack(field->tag, header);
+	size_t rv = 0;
 
-	header[0] |= field->wire_type;
-	buffer->append(buffer, rv, header);
-	buffer->append(buffer, field->len, field->data);
-	return rv + field->len;
+	while (rv < n && *seg < iovcnt) {
+		size_t avail = iov[*seg].len - *off;
+
+		if (avail > n - rv)
+			avail = n - rv;
+		if (avail > 0)
+			memcpy(out + rv, iov[*seg].data + *off, avail);
+		rv += avail;
+		*off += avail;
+		if (*off == iov[*seg].len) {
+			(*seg)++;
+			*off = 0;
+		}
+	}
+	return rv;
 }
 
-/**@}*/
+/*
+ * Return the length of the member, tag included, at the start of `hdr`,
+ * which holds its first `n_hdr` bytes; 0 if it is malformed.
+ */
+static size_t
+iov_member_len(size_t n_hdr, const uint8_t *hdr)
+{
+	uint32_t tag;
+	uint8_t wire_type;
+	size_t used = parse_tag_and_wiretype(n_hdr, hdr, &tag, &wire_type);
+	size_t pref_len, val;
 
-size_t
-protobuf_c_message_pack_to_buffer(const ProtobufCMessage *message,
-				  ProtobufCBuffer *buffer)
+	if (used == 0)
+		return 0;
+	switch (wire_type) {
+	case PROTOBUF_C_WIRE_TYPE_VARINT:
+		val = scan_varint(n_hdr - used, hdr + used);
+		return val == 0 ? 0 : used + val;
+	case PROTOBUF_C_WIRE_TYPE_64BIT:
+		return used + 8;
+	case PROTOBUF_C_WIRE_TYPE_32BIT:
+		return used + 4;
+	case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED:
+		pref_len = scan_varint(n_hdr - used, hdr + used);
+		if (pref_len == 0 || pref_len > 5)
+			return 0;
+		val = parse_uint32(pref_len, hdr + used);
+		if (val > INT_MAX)
+			return 0;
+		return used + pref_len + val;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Split the members of a message spread over `iov` into pieces of whole
+ * members: each run of members inside one buffer is used in place, and each
+ * member that straddles buffers is copied into a piece of its own. `pieces`
+ * has room for 2 * `iovcnt` pieces, which is the most there can be, since a
+ * buffer holds at most one run. Returns FALSE if the data is truncated or
+ * memory could not be allocated, having freed any copies.
+ */
+static protobuf_c_boolean
+iov_split(const ProtobufCBinaryData *iov, size_t iovcnt,
+	  ProtobufCAllocator *allocator, IovPiece *pieces, size_t *n_pieces)
 {
-	unsigned i;
-	size_t rv = 0;
+	IovPiece *run = NULL;
+	size_t seg = 0, off = 0;
+	size_t n = 0;
+	size_t rem = 0;		/* bytes left from seg, off on */
+
+	for (seg = 0; seg < iovcnt; seg++)
+		rem += iov[seg].len;
+	seg = 0;
+	while (seg < iovcnt) {
+		uint8_t hdr[MAX_UINT64_ENCODED_SIZE * 2];
+		size_t hdr_seg = seg, hdr_off = off;
+		size_t n_hdr, len;
+		uint8_t *copy;
+
+		if (off == iov[seg].len) {
+			seg++;
+			off = 0;
+			run = NULL;
+			continue;
+		}
+		n_hdr = iov_read(iov, iovcnt, &hdr_seg, &hdr_off,
+				 sizeof(hdr), hdr);
+		len = iov_member_len(n_hdr, hdr);
+		if (len == 0)
+			goto fail;
+
+		if (len <= iov[seg].len - off) {
+			if (run == NULL) {
+				run = pieces + n++;
+				run->len = 0;
+				run->data = iov[seg].data + off;
+				run->copied = FALSE;
+			}
+			run->len += len;
+			off += len;
+			rem -= len;
+			continue;
+		}
 
-	ASSERT_IS_MESSAGE(message);
-	for (i = 0; i < message->descriptor->n_fields; i++) {
-		const ProtobufCFieldDescriptor *field =
-			message->descriptor->fields + i;
-		const void *member =
-			((const char *) message) + field->offset;
-		const void *qmember =
-			((const char *) message) + field->quantifier_offset;
-
-		if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			rv += required_field_pack_to_buffer(field, member, buffer);
-		} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
-			    field->label == PROTOBUF_C_LABEL_NONE) &&
-			   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
-			rv += oneof_field_pack_to_buffer(
-				field,
-				*(const uint32_t *) qmember,
-				member,
-				buffer
-			);
-		} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
-			rv += optional_field_pack_to_buffer(
-				field,
-				*(const protobuf_c_boolean *) qmember,
-				member,
-				buffer
-			);
-		} else if (field->label == PROTOBUF_C_LABEL_NONE) {
-			rv += unlabeled_field_pack_to_buffer(
-				field,
-				member,
-				buffer
-			);
-		} else {
-			rv += repeated_field_pack_to_buffer(
-				field,
-				*(const size_t *) qmember,
-				member,
-				buffer
-			);
+		/* the member straddles buffers */
+		if (len > rem) {
+			PROTOBUF_C_UNPACK_ERROR("data too short for member");
+			goto fail;
 		}
+		copy = do_alloc(allocator, len);
+		if (copy == NULL)
+			goto fail;
+		pieces[n].len = len;
+		pieces[n].data = copy;
+		pieces[n].copied = TRUE;
+		n++;
+		iov_read(iov, iovcnt, &seg, &off, len, copy);
+		rem -= len;
+		run = NULL;
 	}
-	for (i = 0; i < message->n_unknown_fields; i++)
-		rv += unknown_field_pack_to_buffer(&message->unknown_fields[i], buffer);
+	*n_pieces = n;
+	return TRUE;
 
-	return rv;
+fail:
+	while (n > 0)
+		if (pieces[--n].copied)
+			do_free(allocator, (uint8_t *) pieces[n].data,
+				pieces[n].len);
+	return FALSE;
 }
 
-/**
- * \defgroup unpack unpacking implementation
- *
- * Routines mainly used by the unpacking functions.
- *
- * \ingroup internal
- * @{
- */
+ProtobufCMessage *
+protobuf_c_message_unpack_iov(const ProtobufCMessageDescriptor *desc,
+			      ProtobufCAllocator *allocator,
+			      const ProtobufCBinaryData *iov, size_t iovcnt)
+{
+	UnpackState state;
+	IovPiece *pieces;
+	size_t n_pieces, i;
+	ProtobufCMessage *rv = NULL;
 
-static inline int
-int_range_lookup(unsigned n_ranges, const ProtobufCIntRange *ranges, int value)
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+	init_unpack_state(&state, allocator);
+	if (iovcnt <= 1)
+		return unpack_message(desc, &state,
+				      iovcnt == 0 ? 0 : iov[0].len,
+				      iovcnt == 0 ? NULL : iov[0].data);
+
+	pieces = do_alloc(state.scratch, 2 * iovcnt * sizeof(IovPiece));
+	if (pieces == NULL)
+		return NULL;
+	if (iov_split(iov, iovcnt, state.scratch, pieces, &n_pieces)) {
+		state.pieces = pieces;
+		state.n_pieces = n_pieces;
+		rv = unpack_message(desc, &state, 0, NULL);
+		for (i = 0; i < n_pieces; i++)
+			if (pieces[i].copied)
+				do_free(state.scratch, (uint8_t *) pieces[i].data,
+					pieces[i].len);
+	}
+	do_free(state.scratch, pieces, 2 * iovcnt * sizeof(IovPiece));
+	return rv;
+}
+
+ProtobufCUnpackContext *
+protobuf_c_unpack_context_new(ProtobufCAllocator *allocator)
 {
-	unsigned n;
-	unsigned start;
+	ProtobufCUnpackContext *context;
 
-	if (n_ranges == 0)
-		return -1;
-	start = 0;
-	n = n_ranges;
-	while (n > 1) {
-		unsigned mid = start + n / 2;
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	context = do_alloc(allocator, sizeof(ProtobufCUnpackContext));
+	if (context == NULL)
+		return NULL;
+	context->allocator = allocator;
+	context->frames = NULL;
+	context->flags = 0;
+	context->max_depth = PROTOBUF_C_DEFAULT_MAX_DEPTH;
+	context->executor = NULL;
+	context->parallel_min = DEFAULT_PARALLEL_MIN;
+	return context;
+}
 
-		if (value < ranges[mid].start_value) {
-			n = mid - start;
-		} else if (value >= ranges[mid].start_value +
-			   (int) (ranges[mid + 1].orig_index -
-				  ranges[mid].orig_index))
-		{
-			unsigned new_start = mid + 1;
-			n = start + n - new_start;
-			start = new_start;
-		} else
-			return (value - ranges[mid].start_value) +
-			    ranges[mid].orig_index;
-	}
-	if (n > 0) {
-		unsigned start_orig_index = ranges[start].orig_index;
-		unsigned range_size =
-			ranges[start + 1].orig_index - start_orig_index;
+void
+protobuf_c_unpack_context_free(ProtobufCUnpackContext *context)
+{
+	if (context == NULL)
+		return;
+	unpack_frames_free(context->allocator, context->frames);
+	do_free(context->allocator, context, sizeof(ProtobufCUnpackContext));
+}
 
-		if (ranges[start].start_value <= value &&
-		    value < (int) (ranges[start].start_value + range_size))
-		{
-			return (value - ranges[start].start_value) +
-			    start_orig_index;
-		}
-	}
-	return -1;
+void
+protobuf_c_unpack_context_set_flags(ProtobufCUnpackContext *context,
+				    uint32_t flags)
+{
+	context->flags = flags;
 }
 
-static size_t
-parse_tag_and_wiretype(size_t len,
-		       const uint8_t *data,
-		       uint32_t *tag_out,
-		       uint8_t *wiretype_out)
+void
+protobuf_c_unpack_context_set_max_depth(ProtobufCUnpackContext *context,
+					unsigned max_depth)
 {
-	unsigned max_rv = len > 5 ? 5 : len;
-	uint32_t tag = (data[0] & 0x7f) >> 3;
-	unsigned shift = 4;
-	unsigned rv;
+	context->max_depth = max_depth != 0 ?
+		max_depth : PROTOBUF_C_DEFAULT_MAX_DEPTH;
+}
 
-	/* 0 is not a valid tag value */
-	if ((data[0] & 0xf8) == 0) {
-		return 0;
-	}
+void
+protobuf_c_unpack_context_set_executor(ProtobufCUnpackContext *context,
+				       ProtobufCExecutor *executor,
+				       size_t min_elements)
+{
+	context->executor = executor;
+	context->parallel_min = min_elements != 0 ?
+		min_elements : DEFAULT_PARALLEL_MIN;
+}
 
-	*wiretype_out = data[0] & 7;
-	if ((data[0] & 0x80) == 0) {
-		*tag_out = tag;
-		return 1;
-	}
-	for (rv = 1; rv < max_rv; rv++) {
-		if (data[rv] & 0x80) {
-			tag |= (data[rv] & 0x7f) << shift;
-			shift += 7;
-		} else {
-			tag |= data[rv] << shift;
-			*tag_out = tag;
-			return rv + 1;
-		}
+ProtobufCMessage *
+protobuf_c_message_unpack_with_context(const ProtobufCMessageDescriptor *desc,
+				       ProtobufCAllocator *allocator,
+				       ProtobufCUnpackContext *context,
+				       size_t len, const uint8_t *data)
+{
+	UnpackState state;
+
+	init_unpack_state(&state, allocator);
+	if (context != NULL) {
+		state.scratch = context->allocator;
+		state.context = context;
+		state.max_depth = context->max_depth;
+		state.validate_utf8 =
+			!!(context->flags & PROTOBUF_C_UNPACK_VALIDATE_UTF8);
+		state.executor = context->executor;
+		state.parallel_min = context->parallel_min;
 	}
-	return 0; /* error: bad header */
+	return unpack_message(desc, &state, len, data);
 }
 
-/* sizeof(ScannedMember) must be <= (1UL<<BOUND_SIZEOF_SCANNED_MEMBER_LOG2) */
-#define BOUND_SIZEOF_SCANNED_MEMBER_LOG2 5
-typedef struct ScannedMember ScannedMember;
-/** Field as it's being read. */
-struct ScannedMember {
-	uint32_t tag;              /**< Field tag. */
-	uint8_t wire_type;         /**< Field type. */
-	uint8_t length_prefix_len; /**< Prefix length. */
-	const ProtobufCFieldDescriptor *field; /**< Field descriptor. */
-	size_t len;                /**< Field length. */
-	const uint8_t *data;       /**< Pointer to field data. */
-};
-
-static inline size_t
-scan_length_prefixed_data(size_t len, const uint8_t *data,
-			  size_t *prefix_len_out)
+ProtobufCMessage *
+protobuf_c_message_unpack_interned(const ProtobufCMessageDescriptor *desc,
+				   ProtobufCAllocator *allocator,
+				   ProtobufCIntern *intern,
+				   size_t len, const uint8_t *data)
 {
-	unsigned hdr_max = len < 5 ? len : 5;
-	unsigned hdr_len;
-	size_t val = 0;
-	unsigned i;
-	unsigned shift = 0;
+	UnpackState state;
 
-	for (i = 0; i < hdr_max; i++) {
-		val |= ((size_t)data[i] & 0x7f) << shift;
-		shift += 7;
-		if ((data[i] & 0x80) == 0)
-			break;
-	}
-	if (i == hdr_max) {
-		PROTOBUF_C_UNPACK_ERROR("error parsing length for length-prefixed data");
-		return 0;
-	}
-	hdr_len = i + 1;
-	*prefix_len_out = hdr_len;
-	if (val > INT_MAX) {
-		// Protobuf messages should always be less than 2 GiB in size.
-		// We also want to return early here so that hdr_len + val does
-		// not overflow on 32-bit systems.
-		PROTOBUF_C_UNPACK_ERROR("length prefix of %lu is too large",
-			(unsigned long int)val);
-		return 0;
-	}
-	if (hdr_len + val > len) {
-		PROTOBUF_C_UNPACK_ERROR("data too short after length-prefix of %lu",
-			(unsigned long int)val);
-		return 0;
-	}
-	return hdr_len + val;
+	init_unpack_state(&state, allocator);
+	state.intern = intern;
+	return unpack_message(desc, &state, len, data);
 }
 
-static size_t
-max_b128_numbers(size_t len, const uint8_t *data)
+ProtobufCMessage *
+protobuf_c_message_unpack_shared(const ProtobufCMessageDescriptor *desc,
+				 ProtobufCAllocator *allocator,
+				 size_t len, const uint8_t *data)
 {
-	size_t rv = 0;
-	while (len--)
-		if ((*data++ & 0x80) == 0)
-			++rv;
-	return rv;
+	UnpackState state;
+
+	init_unpack_state(&state, allocator);
+	state.shared = TRUE;
+	return unpack_message(desc, &state, len, data);
 }
 
-/**@}*/
+/*
+ * Flat unpacking. A sizing pass over the wire data computes an upper bound
+ * for all the memory of the unpacked tree, which is then carved out of a
+ * single block by a bump allocator. The block starts with a FlatHeader,
+ * immediately followed by the top-level message.
+ */
 
-/**
- * Merge earlier message into a latter message.
- *
- * For numeric types and strings, if the same value appears multiple
- * times, the parser accepts the last value it sees. For embedded
- * message fields, the parser merges multiple instances of the same
- * field. That is, all singular scalar fields in the latter instance
- * replace those in the former, singular embedded messages are merged,
- * and repeated fields are concatenated.
- *
- * The earlier message should be freed after calling this function, as
- * some of its fields may have been reused and changed to their default
- * values during the merge.
+/* Alignment of every allocation carved out of a flat block. */
+typedef union {
+	uint64_t u64;
+	double d;
+	void *p;
+} FlatAlign;
+
+#define FLAT_ALIGN(size) \
+	(((size) + sizeof(FlatAlign) - 1) & ~(sizeof(FlatAlign) - 1))
+
+#define FLAT_MESSAGE_MAGIC	0xf1a7b10c
+
+/*
+ * Allocations the sizing pass cannot foresee (the arrays concatenated when a
+ * sub-message occurs more than once) go to separately allocated chunks.
  */
-static protobuf_c_boolean
-merge_messages(ProtobufCMessage *earlier_msg,
-	       ProtobufCMessage *latter_msg,
-	       ProtobufCAllocator *allocator)
-{
-	unsigned i;
-	const ProtobufCFieldDescriptor *fields =
-		latter_msg->descriptor->fields;
-	for (i = 0; i < latter_msg->descriptor->n_fields; i++) {
-		if (fields[i].label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t *n_earlier =
-				STRUCT_MEMBER_PTR(size_t, earlier_msg,
-						  fields[i].quantifier_offset);
-			uint8_t **p_earlier =
-				STRUCT_MEMBER_PTR(uint8_t *, earlier_msg,
-						  fields[i].offset);
-			size_t *n_latter =
-				STRUCT_MEMBER_PTR(size_t, latter_msg,
-						  fields[i].quantifier_offset);
-			uint8_t **p_latter =
-				STRUCT_MEMBER_PTR(uint8_t *, latter_msg,
-						  fields[i].offset);
-
-			if (*n_earlier > 0) {
-				if (*n_latter > 0) {
-					/* Concatenate the repeated field */
-					size_t el_size =
-						sizeof_elt_in_repeated_array(fields[i].type);
-					uint8_t *new_field;
-
-					new_field = do_alloc(allocator,
-						(*n_earlier + *n_latter) * el_size);
-					if (!new_field)
-						return FALSE;
+typedef union FlatChunk FlatChunk;
+union FlatChunk {
+	struct {
+		FlatChunk *next;
+		size_t size;
+	} c;
+	FlatAlign align;
+};
 
-					memcpy(new_field, *p_earlier,
-					       *n_earlier * el_size);
-					memcpy(new_field +
-					       *n_earlier * el_size,
-					       *p_latter,
-					       *n_latter * el_size);
-
-					do_free(allocator, *p_latter);
-					do_free(allocator, *p_earlier);
-					*p_latter = new_field;
-					*n_latter = *n_earlier + *n_latter;
-				} else {
-					/* Zero copy the repeated field from the earlier message */
-					*n_latter = *n_earlier;
-					*p_latter = *p_earlier;
-				}
-				/* Make sure the field does not get double freed */
-				*n_earlier = 0;
-				*p_earlier = 0;
-			}
-		} else if (fields[i].label == PROTOBUF_C_LABEL_OPTIONAL ||
-			   fields[i].label == PROTOBUF_C_LABEL_NONE) {
-			const ProtobufCFieldDescriptor *field;
-			uint32_t *earlier_case_p = STRUCT_MEMBER_PTR(uint32_t,
-								     earlier_msg,
-								     fields[i].
-								     quantifier_offset);
-			uint32_t *latter_case_p = STRUCT_MEMBER_PTR(uint32_t,
-								    latter_msg,
-								    fields[i].
-								    quantifier_offset);
-			protobuf_c_boolean need_to_merge = FALSE;
-			void *earlier_elem;
-			void *latter_elem;
-			const void *def_val;
-
-			if (fields[i].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) {
-				if (*latter_case_p == 0) {
-					/* lookup correct oneof field */
-					int field_index =
-						int_range_lookup(
-							latter_msg->descriptor
-							->n_field_ranges,
-							latter_msg->descriptor
-							->field_ranges,
-							*earlier_case_p);
-					if (field_index < 0)
-						return FALSE;
-					field = latter_msg->descriptor->fields +
-						field_index;
-				} else {
-					/* Oneof is present in the latter message, move on */
-					continue;
-				}
-			} else {
-				field = &fields[i];
-			}
+typedef union {
+	struct {
+		ProtobufCAllocator *allocator;
+		FlatChunk *overflow;
+		size_t size;
+		uint32_t magic;
+	} h;
+	FlatAlign align;
+} FlatHeader;
+
+typedef struct {
+	ProtobufCAllocator base;
+	FlatHeader *header;
+	uint8_t *at;
+	uint8_t *end;
+} FlatArena;
 
-			earlier_elem = STRUCT_MEMBER_P(earlier_msg, field->offset);
-			latter_elem = STRUCT_MEMBER_P(latter_msg, field->offset);
-			def_val = field->default_value;
+static void *
+flat_alloc(void *allocator_data, size_t size)
+{
+	FlatArena *arena = allocator_data;
+	FlatChunk *chunk;
 
-			switch (field->type) {
-			case PROTOBUF_C_TYPE_MESSAGE: {
-				ProtobufCMessage *em = *(ProtobufCMessage **) earlier_elem;
-				ProtobufCMessage *lm = *(ProtobufCMessage **) latter_elem;
-				if (em != NULL) {
-					if (lm != NULL) {
-						if (!merge_messages(em, lm, allocator))
-							return FALSE;
-						/* Already merged */
-						need_to_merge = FALSE;
-					} else {
-						/* Zero copy the message */
-						need_to_merge = TRUE;
-					}
-				}
-				break;
-			}
-			case PROTOBUF_C_TYPE_BYTES: {
-				uint8_t *e_data =
-					((ProtobufCBinaryData *) earlier_elem)->data;
-				uint8_t *l_data =
-					((ProtobufCBinaryData *) latter_elem)->data;
-				const ProtobufCBinaryData *d_bd =
-					(ProtobufCBinaryData *) def_val;
-
-				need_to_merge =
-					(e_data != NULL &&
-					 (d_bd == NULL ||
-					  e_data != d_bd->data)) &&
-					(l_data == NULL ||
-					 (d_bd != NULL &&
-					  l_data == d_bd->data));
-				break;
-			}
-			case PROTOBUF_C_TYPE_STRING: {
-				char *e_str = *(char **) earlier_elem;
-				char *l_str = *(char **) latter_elem;
-				const char *d_str = def_val;
+	size = FLAT_ALIGN(size);
+	if (size <= (size_t) (arena->end - arena->at)) {
+		void *rv = arena->at;
+		arena->at += size;
+		return rv;
+	}
+	chunk = do_alloc(arena->header->h.allocator, sizeof(FlatChunk) + size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->c.next = arena->header->h.overflow;
+	chunk->c.size = sizeof(FlatChunk) + size;
+	arena->header->h.overflow = chunk;
+	return chunk + 1;
+}
 
-				need_to_merge = e_str != d_str && l_str == d_str;
-				break;
-			}
-			default: {
-				/* Could be has field or case enum, the logic is
-				 * equivalent, since 0 (FALSE) means not set for
-				 * oneof */
-				need_to_merge = (*earlier_case_p != 0) &&
-						(*latter_case_p == 0);
-				break;
-			}
-			}
+static void
+flat_free(void *allocator_data, void *data)
+{
+	/* everything is released along with the block */
+	(void) allocator_data;
+	(void) data;
+}
 
-			if (need_to_merge) {
-				size_t el_size =
-					sizeof_elt_in_repeated_array(field->type);
-				memcpy(latter_elem, earlier_elem, el_size);
-				/*
-				 * Reset the element from the old message to 0
-				 * to make sure earlier message deallocation
-				 * doesn't corrupt zero-copied data in the new
-				 * message, earlier message will be freed after
-				 * this function is called anyway
-				 */
-				memset(earlier_elem, 0, el_size);
+static void
+free_flat_block(FlatHeader *header)
+{
+	ProtobufCAllocator *allocator = header->h.allocator;
+	FlatChunk *chunk = header->h.overflow;
 
-				if (field->quantifier_offset != 0) {
-					/* Set the has field or the case enum,
-					 * if applicable */
-					*latter_case_p = *earlier_case_p;
-					*earlier_case_p = 0;
-				}
-			}
-		}
+	while (chunk != NULL) {
+		FlatChunk *next = chunk->c.next;
+		do_free(allocator, chunk, chunk->c.size);
+		chunk = next;
 	}
-	return TRUE;
+	do_free(allocator, header, header->h.size);
 }
 
-/**
- * Count packed elements.
- *
- * Given a raw slab of packed-repeated values, determine the number of
- * elements. This function detects certain kinds of errors but not
- * others; the remaining error checking is done by
- * parse_packed_repeated_member().
+/*
+ * Add to `*size_out` an upper bound for the memory that unpacking the message
+ * in `data` will allocate. Every occurrence of a non-repeated member is
+ * counted, since each one is allocated before later ones replace it.
+ * Sub-messages recurse, at most `depth` levels deep, which is as deep as
+ * unpack_message() accepts anyway.
  */
 static protobuf_c_boolean
-count_packed_elements(ProtobufCType type,
-		      size_t len, const uint8_t *data, size_t *count_out)
+flat_message_size(const ProtobufCMessageDescriptor *desc,
+		  size_t len, const uint8_t *data, size_t *size_out,
+		  unsigned depth)
 {
-	switch (type) {
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		if (len % 4 != 0) {
-			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 4 for fixed-length 32-bit types");
+	const ProtobufCFieldDescriptor *last_repeated = NULL;
+	size_t size = FLAT_ALIGN(desc->sizeof_message);
+	size_t n_unknown = 0;
+
+	if (depth == 0)
+		return FALSE;
+	while (len > 0) {
+		const ProtobufCFieldDescriptor *field;
+		uint32_t tag;
+		uint8_t wire_type;
+		size_t pref_len = 0;
+		size_t field_len;
+		int field_index;
+		size_t used = parse_tag_and_wiretype(len, data, &tag, &wire_type);
+
+		if (used == 0)
 			return FALSE;
+		data += used;
+		len -= used;
+
+		switch (wire_type) {
+		case PROTOBUF_C_WIRE_TYPE_VARINT:
+			field_len = scan_varint(len < 10 ? len : 10, data);
+			break;
+		case PROTOBUF_C_WIRE_TYPE_64BIT:
+			field_len = len < 8 ? 0 : 8;
+			break;
+		case PROTOBUF_C_WIRE_TYPE_32BIT:
+			field_len = len < 4 ? 0 : 4;
+			break;
+		case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED:
+			field_len = scan_length_prefixed_data(len, data, &pref_len);
+			break;
+		default:
+			field_len = 0;
+			break;
 		}
-		*count_out = len / 4;
-		return TRUE;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		if (len % 8 != 0) {
-			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 8 for fixed-length 64-bit types");
+		if (field_len == 0)
 			return FALSE;
+
+		field_index = field_index_lookup(desc, tag);
+		if (field_index < 0) {
+			n_unknown++;
+			size += FLAT_ALIGN(field_len);
+			data += field_len;
+			len -= field_len;
+			continue;
 		}
-		*count_out = len / 8;
-		return TRUE;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-	case PROTOBUF_C_TYPE_SINT32:
-	case PROTOBUF_C_TYPE_UINT32:
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_SINT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		*count_out = max_b128_numbers(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_BOOL:
-		*count_out = len;
-		return TRUE;
-	case PROTOBUF_C_TYPE_STRING:
-	case PROTOBUF_C_TYPE_BYTES:
-	case PROTOBUF_C_TYPE_MESSAGE:
-	default:
-		PROTOBUF_C_UNPACK_ERROR("bad protobuf-c type %u for packed-repeated", type);
-		return FALSE;
-	}
-}
+		field = desc->fields + field_index;
 
-static inline uint32_t
-parse_uint32(unsigned len, const uint8_t *data)
-{
-	uint32_t rv = data[0] & 0x7f;
-	if (len > 1) {
-		rv |= ((uint32_t) (data[1] & 0x7f) << 7);
-		if (len > 2) {
-			rv |= ((uint32_t) (data[2] & 0x7f) << 14);
-			if (len > 3) {
-				rv |= ((uint32_t) (data[3] & 0x7f) << 21);
-				if (len > 4)
-					rv |= ((uint32_t) (data[4]) << 28);
+		if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t n = 1;
+
+			if (wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+			    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+			     is_packable_type(field->type)))
+			{
+				if (!count_packed_elements(field->type,
+							   field_len - pref_len,
+							   data + pref_len, &n))
+					return FALSE;
+			}
+			size += n * sizeof_elt_in_repeated_array(field->type);
+			/* each repeated array is rounded up once */
+			if (field != last_repeated) {
+				size += sizeof(FlatAlign) - 1;
+				last_repeated = field;
+			}
+		}
+		if (wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED) {
+			size_t payload_len = field_len - pref_len;
+
+			switch (field->type) {
+			case PROTOBUF_C_TYPE_STRING:
+				size += FLAT_ALIGN(payload_len + 1);
+				break;
+			case PROTOBUF_C_TYPE_BYTES:
+				size += FLAT_ALIGN(payload_len);
+				break;
+			case PROTOBUF_C_TYPE_MESSAGE:
+				if (!flat_message_size(field->descriptor,
+						       payload_len,
+						       data + pref_len, &size,
+						       depth - 1))
+					return FALSE;
+				break;
+			default:
+				break;
 			}
 		}
+		data += field_len;
+		len -= field_len;
 	}
-	return rv;
-}
-
-static inline uint32_t
-parse_int32(unsigned len, const uint8_t *data)
-{
-	return parse_uint32(len, data);
+	if (n_unknown > 0)
+		size += FLAT_ALIGN(n_unknown *
+				   sizeof(ProtobufCMessageUnknownField));
+	*size_out += size;
+	return TRUE;
 }
 
-static inline int32_t
-unzigzag32(uint32_t v)
+ProtobufCMessage *
+protobuf_c_message_unpack_flat(const ProtobufCMessageDescriptor *desc,
+			       ProtobufCAllocator *allocator,
+			       size_t len, const uint8_t *data)
 {
-	// Note:  Using unsigned types prevents undefined behavior
-	return (int32_t)((v >> 1) ^ -(v & 1));
-}
+	ProtobufCMessage *rv;
+	UnpackState state;
+	FlatArena arena;
+	size_t size = 0;
 
-static inline uint32_t
-parse_fixed_uint32(const uint8_t *data)
-{
-#if !defined(WORDS_BIGENDIAN)
-	uint32_t t;
-	memcpy(&t, data, 4);
-	return t;
-#else
-	return data[0] |
-		((uint32_t) (data[1]) << 8) |
-		((uint32_t) (data[2]) << 16) |
-		((uint32_t) (data[3]) << 24);
-#endif
-}
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
 
-static uint64_t
-parse_uint64(unsigned len, const uint8_t *data)
-{
-	unsigned shift, i;
-	uint64_t rv;
-
-	if (len < 5)
-		return parse_uint32(len, data);
-	rv = ((uint64_t) (data[0] & 0x7f)) |
-		((uint64_t) (data[1] & 0x7f) << 7) |
-		((uint64_t) (data[2] & 0x7f) << 14) |
-		((uint64_t) (data[3] & 0x7f) << 21);
-	shift = 28;
-	for (i = 4; i < len; i++) {
-		rv |= (((uint64_t) (data[i] & 0x7f)) << shift);
-		shift += 7;
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	if (!flat_message_size(desc, len, data, &size,
+			       PROTOBUF_C_DEFAULT_MAX_DEPTH))
+		return NULL;
+	arena.header = do_alloc(allocator, sizeof(FlatHeader) + size);
+	if (arena.header == NULL)
+		return NULL;
+	arena.header->h.allocator = allocator;
+	arena.header->h.overflow = NULL;
+	arena.header->h.size = sizeof(FlatHeader) + size;
+	arena.header->h.magic = FLAT_MESSAGE_MAGIC;
+	arena.at = (uint8_t *) (arena.header + 1);
+	arena.end = arena.at + size;
+	arena.base.alloc = flat_alloc;
+	arena.base.free = flat_free;
+	arena.base.allocator_data = &arena;
+
+	init_unpack_state(&state, &arena.base);
+	state.scratch = allocator;
+	rv = unpack_message(desc, &state, len, data);
+	if (rv == NULL) {
+		free_flat_block(arena.header);
+		return NULL;
 	}
+	/* the top-level message is the first allocation in the block */
+	assert(rv == (ProtobufCMessage *) (arena.header + 1));
 	return rv;
 }
 
-static inline int64_t
-unzigzag64(uint64_t v)
+void
+protobuf_c_message_free_flat(ProtobufCMessage *message)
 {
-	// Note:  Using unsigned types prevents undefined behavior
-	return (int64_t)((v >> 1) ^ -(v & 1));
-}
+	FlatHeader *header;
 
-static inline uint64_t
-parse_fixed_uint64(const uint8_t *data)
-{
-#if !defined(WORDS_BIGENDIAN)
-	uint64_t t;
-	memcpy(&t, data, 8);
-	return t;
-#else
-	return (uint64_t) parse_fixed_uint32(data) |
-		(((uint64_t) parse_fixed_uint32(data + 4)) << 32);
-#endif
+	if (message == NULL)
+		return;
+	header = (FlatHeader *) message - 1;
+	assert(header->h.magic == FLAT_MESSAGE_MAGIC);
+	free_flat_block(header);
 }
 
+/* The number of members the slabs of one unpack frame can hold. */
+#define MAX_SCANNED_MEMBERS						\
+	((1UL << (MAX_SCANNED_MEMBER_SLAB + 1 +				\
+		  FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)) -		\
+	 (1UL << FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2))
+
+/* Required fields below this index are tracked in a bitmap when validating. */
+#define VALIDATE_SEEN_FIELDS	128
+
 static protobuf_c_boolean
-parse_boolean(unsigned len, const uint8_t *data)
+validate_message(const ProtobufCMessageDescriptor *desc,
+		 size_t len, const uint8_t *data, uint32_t flags,
+		 unsigned depth);
+
+/*
+ * Return the length of the member after a tag with `wire_type`, including
+ * the length prefix of `*pref_len` bytes, if any; 0 if the member is
+ * truncated or the wire type unknown.
+ */
+static size_t
+scan_wire_member(uint8_t wire_type, size_t len, const uint8_t *data,
+		 size_t *pref_len)
 {
-	unsigned i;
-	for (i = 0; i < len; i++)
-		if (data[i] & 0x7f)
-			return TRUE;
-	return FALSE;
+	*pref_len = 0;
+	switch (wire_type) {
+	case PROTOBUF_C_WIRE_TYPE_VARINT:
+		return scan_varint(len, data);
+	case PROTOBUF_C_WIRE_TYPE_64BIT:
+		return len < 8 ? 0 : 8;
+	case PROTOBUF_C_WIRE_TYPE_32BIT:
+		return len < 4 ? 0 : 4;
+	case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED:
+		return scan_length_prefixed_data(len, data, pref_len);
+	default:
+		return 0;
+	}
 }
 
+/*
+ * Check the payload of a packed repeated member the way count_packed_elements()
+ * and parse_packed_repeated_member() do.
+ */
 static protobuf_c_boolean
-parse_required_member(ScannedMember *scanned_member,
-		      void *member,
-		      ProtobufCAllocator *allocator,
-		      protobuf_c_boolean maybe_clear)
+validate_packed(ProtobufCType type, size_t len, const uint8_t *data)
 {
-	unsigned len = scanned_member->len;
-	const uint8_t *data = scanned_member->data;
-	uint8_t wire_type = scanned_member->wire_type;
+	size_t count;
 
-	switch (scanned_member->field->type) {
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(int32_t *) member = parse_int32(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_UINT32:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(uint32_t *) member = parse_uint32(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_SINT32:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(int32_t *) member = unzigzag32(parse_uint32(len, data));
-		return TRUE;
+	if (!count_packed_elements(type, len, data, &count))
+		return FALSE;
+	switch (type) {
 	case PROTOBUF_C_TYPE_SFIXED32:
 	case PROTOBUF_C_TYPE_FIXED32:
 	case PROTOBUF_C_TYPE_FLOAT:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_32BIT)
-			return FALSE;
-		*(uint32_t *) member = parse_fixed_uint32(data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(uint64_t *) member = parse_uint64(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_SINT64:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(int64_t *) member = unzigzag64(parse_uint64(len, data));
-		return TRUE;
 	case PROTOBUF_C_TYPE_SFIXED64:
 	case PROTOBUF_C_TYPE_FIXED64:
 	case PROTOBUF_C_TYPE_DOUBLE:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_64BIT)
-			return FALSE;
-		*(uint64_t *) member = parse_fixed_uint64(data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_BOOL:
-		*(protobuf_c_boolean *) member = parse_boolean(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_STRING: {
-		char **pstr = member;
-		unsigned pref_len = scanned_member->length_prefix_len;
-
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
-			return FALSE;
-
-		if (maybe_clear && *pstr != NULL) {
-			const char *def = scanned_member->field->default_value;
-			if (*pstr != def)
-				do_free(allocator, *pstr);
-		}
-		*pstr = do_alloc(allocator, len - pref_len + 1);
-		if (*pstr == NULL)
-			return FALSE;
-		memcpy(*pstr, data + pref_len, len - pref_len);
-		(*pstr)[len - pref_len] = 0;
 		return TRUE;
-	}
-	case PROTOBUF_C_TYPE_BYTES: {
-		ProtobufCBinaryData *bd = member;
-		const ProtobufCBinaryData *def_bd;
-		unsigned pref_len = scanned_member->length_prefix_len;
-
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
-			return FALSE;
+	default:
+		while (len > 0) {
+			unsigned s = scan_varint(len, data);
 
-		def_bd = scanned_member->field->default_value;
-		if (maybe_clear &&
-		    bd->data != NULL &&
-		    (def_bd == NULL || bd->data != def_bd->data))
-		{
-			do_free(allocator, bd->data);
-		}
-		if (len > pref_len) {
-			bd->data = do_alloc(allocator, len - pref_len);
-			if (bd->data == NULL)
+			if (s == 0)
 				return FALSE;
-			memcpy(bd->data, data + pref_len, len - pref_len);
-		} else {
-			bd->data = NULL;
-		}
-		bd->len = len - pref_len;
-		return TRUE;
-	}
-	case PROTOBUF_C_TYPE_MESSAGE: {
-		ProtobufCMessage **pmessage = member;
-		ProtobufCMessage *subm;
-		const ProtobufCMessage *def_mess;
-		protobuf_c_boolean merge_successful = TRUE;
-		unsigned pref_len = scanned_member->length_prefix_len;
-
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
-			return FALSE;
-
-		def_mess = scanned_member->field->default_value;
-		if (len >= pref_len)
-			subm = protobuf_c_message_unpack(scanned_member->field->descriptor,
-							 allocator,
-							 len - pref_len,
-							 data + pref_len);
-		else
-			subm = NULL;
-
-		if (maybe_clear &&
-		    *pmessage != NULL &&
-		    *pmessage != def_mess)
-		{
-			if (subm != NULL)
-				merge_successful = merge_messages(*pmessage, subm, allocator);
-			/* Delete the previous message */
-			protobuf_c_message_free_unpacked(*pmessage, allocator);
+			data += s;
+			len -= s;
 		}
-		*pmessage = subm;
-		if (subm == NULL || !merge_successful)
-			return FALSE;
 		return TRUE;
 	}
-	}
-	return FALSE;
 }
 
+/*
+ * Check one member of a message the way parse_member() would unpack it.
+ * `data` and `len` cover the whole member after its tag, including the length
+ * prefix of `pref_len` bytes, if any. A sub-message is checked `depth` - 1
+ * levels deep; with a `depth` of 0 only its wire type is checked.
+ */
 static protobuf_c_boolean
-parse_oneof_member (ScannedMember *scanned_member,
-		    void *member,
-		    ProtobufCMessage *message,
-		    ProtobufCAllocator *allocator)
+validate_member(const ProtobufCFieldDescriptor *field, uint8_t wire_type,
+		size_t len, const uint8_t *data, size_t pref_len,
+		uint32_t flags, unsigned depth)
 {
-	uint32_t *oneof_case = STRUCT_MEMBER_PTR(uint32_t, message,
-					       scanned_member->field->quantifier_offset);
+	if (field->label == PROTOBUF_C_LABEL_REPEATED &&
+	    wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+	    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+	     is_packable_type(field->type)))
+		return validate_packed(field->type, len - pref_len,
+				       data + pref_len);
 
-	/* If we have already parsed a member of this oneof, free it. */
-	if (*oneof_case != 0) {
-		const ProtobufCFieldDescriptor *old_field;
-		size_t el_size;
-		/* lookup field */
-		int field_index =
-			int_range_lookup(message->descriptor->n_field_ranges,
-					 message->descriptor->field_ranges,
-					 *oneof_case);
-		if (field_index < 0)
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_SINT64:
+		return wire_type == PROTOBUF_C_WIRE_TYPE_VARINT;
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		return wire_type == PROTOBUF_C_WIRE_TYPE_32BIT;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return wire_type == PROTOBUF_C_WIRE_TYPE_64BIT;
+	case PROTOBUF_C_TYPE_BOOL:
+		/* parse_boolean() accepts any wire type */
+		return TRUE;
+	case PROTOBUF_C_TYPE_BYTES:
+		return wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+	case PROTOBUF_C_TYPE_STRING:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
 			return FALSE;
-		old_field = message->descriptor->fields + field_index;
-		el_size = sizeof_elt_in_repeated_array(old_field->type);
-
-		switch (old_field->type) {
-	        case PROTOBUF_C_TYPE_STRING: {
-			char **pstr = member;
-			const char *def = old_field->default_value;
-			if (*pstr != NULL && *pstr != def)
-				do_free(allocator, *pstr);
-			break;
-	        }
-		case PROTOBUF_C_TYPE_BYTES: {
-			ProtobufCBinaryData *bd = member;
-			const ProtobufCBinaryData *def_bd = old_field->default_value;
-			if (bd->data != NULL &&
-			   (def_bd == NULL || bd->data != def_bd->data))
-			{
-				do_free(allocator, bd->data);
-			}
-			break;
-	        }
-		case PROTOBUF_C_TYPE_MESSAGE: {
-			ProtobufCMessage **pmessage = member;
-			const ProtobufCMessage *def_mess = old_field->default_value;
-			if (*pmessage != NULL && *pmessage != def_mess)
-				protobuf_c_message_free_unpacked(*pmessage, allocator);
-			break;
-	        }
-		default:
-			break;
-		}
-
-		memset (member, 0, el_size);
+		if (0 != (flags & PROTOBUF_C_UNPACK_VALIDATE_UTF8) ||
+		    0 != (field->flags & PROTOBUF_C_FIELD_FLAG_VALIDATE_UTF8))
+			return utf8_copy(NULL, data + pref_len, len - pref_len);
+		return TRUE;
+	case PROTOBUF_C_TYPE_MESSAGE:
+		return wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+			(depth == 0 ||
+			 validate_message(field->descriptor, len - pref_len,
+					  data + pref_len, flags, depth - 1));
 	}
-	if (!parse_required_member (scanned_member, member, allocator, TRUE))
-		return FALSE;
-
-	*oneof_case = scanned_member->tag;
-	return TRUE;
+	return FALSE;
 }
 
-
+/*
+ * Look for a member with the given tag in message data that has already been
+ * validated.
+ */
 static protobuf_c_boolean
-parse_optional_member(ScannedMember *scanned_member,
-		      void *member,
-		      ProtobufCMessage *message,
-		      ProtobufCAllocator *allocator)
+validate_find_tag(uint32_t id, size_t len, const uint8_t *data)
 {
-	if (!parse_required_member(scanned_member, member, allocator, TRUE))
-		return FALSE;
-	if (scanned_member->field->quantifier_offset != 0)
-		STRUCT_MEMBER(protobuf_c_boolean,
-			      message,
-			      scanned_member->field->quantifier_offset) = TRUE;
-	return TRUE;
+	while (len > 0) {
+		uint32_t tag;
+		uint8_t wire_type;
+		size_t used = parse_tag_and_wiretype(len, data, &tag, &wire_type);
+		size_t pref_len;
+
+		if (tag == id)
+			return TRUE;
+		data += used;
+		len -= used;
+		used = scan_wire_member(wire_type, len, data, &pref_len);
+		data += used;
+		len -= used;
+	}
+	return FALSE;
 }
 
+/*
+ * Check that `data` would unpack as a message of type `desc`, with the same
+ * checks as the scan in unpack_begin() followed by parse_member() for every
+ * member, but without allocating anything. Sub-messages recurse, at most
+ * `depth` levels deep, as in flat_message_size().
+ */
 static protobuf_c_boolean
-parse_repeated_member(ScannedMember *scanned_member,
-		      void *member,
-		      ProtobufCMessage *message,
-		      ProtobufCAllocator *allocator)
+validate_message(const ProtobufCMessageDescriptor *desc,
+		 size_t len, const uint8_t *data, uint32_t flags,
+		 unsigned depth)
 {
-	const ProtobufCFieldDescriptor *field = scanned_member->field;
-	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
-	size_t siz = sizeof_elt_in_repeated_array(field->type);
-	char *array = *(char **) member;
+	const ProtobufCMessageLayout *layout = desc->layout;
+	uint64_t seen[VALIDATE_SEEN_FIELDS / 64] = { 0 };
+	const uint8_t *at = data;
+	size_t rem = len;
+	size_t n_members = 0;
+	unsigned f;
 
-	if (!parse_required_member(scanned_member, array + siz * (*p_n),
-				   allocator, FALSE))
-	{
+	if (depth == 0)
+		return FALSE;
+	while (rem > 0) {
+		uint32_t tag;
+		uint8_t wire_type;
+		size_t pref_len;
+		size_t field_len;
+		int field_index;
+		size_t used = parse_tag_and_wiretype(rem, at, &tag, &wire_type);
+
+		if (used == 0)
+			return FALSE;
+		at += used;
+		rem -= used;
+
+		field_len = scan_wire_member(wire_type, rem, at, &pref_len);
+		if (field_len == 0 || ++n_members > MAX_SCANNED_MEMBERS)
+			return FALSE;
+
+		field_index = layout != NULL && tag > layout->max_field_id ?
+			-1 : field_index_lookup(desc, tag);
+		if (field_index >= 0) {
+			if (field_index < VALIDATE_SEEN_FIELDS)
+				seen[field_index / 64] |=
+					(uint64_t) 1 << (field_index % 64);
+			if (!validate_member(desc->fields + field_index,
+					     wire_type, field_len, at, pref_len,
+					     flags, depth))
+				return FALSE;
+		}
+		at += field_len;
+		rem -= field_len;
+	}
+
+	if (layout != NULL && layout->required_mask == NULL)
+		return TRUE;
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+
+		if (field->label != PROTOBUF_C_LABEL_REQUIRED ||
+		    field->default_value != NULL)
+			continue;
+		if (f < VALIDATE_SEEN_FIELDS ?
+		    ((seen[f / 64] >> (f % 64)) & 1) != 0 :
+		    validate_find_tag(field->id, len, data))
+			continue;
 		return FALSE;
 	}
-	*p_n += 1;
 	return TRUE;
 }
 
-static unsigned
-scan_varint(unsigned len, const uint8_t *data)
+protobuf_c_boolean
+protobuf_c_message_validate(const ProtobufCMessageDescriptor *desc,
+			    size_t len, const uint8_t *data, uint32_t flags)
 {
-	unsigned i;
-	if (len > 10)
-		len = 10;
-	for (i = 0; i < len; i++)
-		if ((data[i] & 0x80) == 0)
-			break;
-	if (i == len)
-		return 0;
-	return i + 1;
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+	return validate_message(desc, len, data, flags,
+				PROTOBUF_C_DEFAULT_MAX_DEPTH);
 }
 
-static protobuf_c_boolean
-parse_packed_repeated_member(ScannedMember *scanned_member,
-			     void *member,
-			     ProtobufCMessage *message)
+/** A field path compiled by protobuf_c_wire_path_new(). */
+struct ProtobufCWirePath {
+	ProtobufCAllocator *allocator;
+	const ProtobufCMessageDescriptor *descriptor;
+	size_t alloc_size;
+	unsigned n_fields;
+	/** One field per component, each one in the message of the previous. */
+	const ProtobufCFieldDescriptor **fields;
+};
+
+/* What wire_path_find() saw of the path in one message. */
+#define WIRE_PATH_MALFORMED	(-1)
+#define WIRE_PATH_ABSENT	0
+#define WIRE_PATH_FOUND		1
+#define WIRE_PATH_CLEARED	2
+
+ProtobufCWirePath *
+protobuf_c_wire_path_new(const ProtobufCMessageDescriptor *desc,
+			 const char *path,
+			 ProtobufCAllocator *allocator)
 {
-	const ProtobufCFieldDescriptor *field = scanned_member->field;
-	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
-	size_t siz = sizeof_elt_in_repeated_array(field->type);
-	void *array = *(char **) member + siz * (*p_n);
-	const uint8_t *at = scanned_member->data + scanned_member->length_prefix_len;
-	size_t rem = scanned_member->len - scanned_member->length_prefix_len;
-	size_t count = 0;
-#if defined(WORDS_BIGENDIAN)
+	ProtobufCWirePath *rv;
+	size_t path_len = strlen(path);
+	size_t alloc_size;
+	unsigned n_fields = 1;
 	unsigned i;
-#endif
+	char *name;
 
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		count = (scanned_member->len - scanned_member->length_prefix_len) / 4;
-#if !defined(WORDS_BIGENDIAN)
-		goto no_unpacking_needed;
-#else
-		for (i = 0; i < count; i++) {
-			((uint32_t *) array)[i] = parse_fixed_uint32(at);
-			at += 4;
-		}
-		break;
-#endif
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		count = (scanned_member->len - scanned_member->length_prefix_len) / 8;
-#if !defined(WORDS_BIGENDIAN)
-		goto no_unpacking_needed;
-#else
-		for (i = 0; i < count; i++) {
-			((uint64_t *) array)[i] = parse_fixed_uint64(at);
-			at += 8;
-		}
-		break;
-#endif
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int32 value");
-				return FALSE;
-			}
-			((int32_t *) array)[count++] = parse_int32(s, at);
-			at += s;
-			rem -= s;
-		}
-		break;
-	case PROTOBUF_C_TYPE_SINT32:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint32 value");
-				return FALSE;
-			}
-			((int32_t *) array)[count++] = unzigzag32(parse_uint32(s, at));
-			at += s;
-			rem -= s;
-		}
-		break;
-	case PROTOBUF_C_TYPE_UINT32:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated enum or uint32 value");
-				return FALSE;
-			}
-			((uint32_t *) array)[count++] = parse_uint32(s, at);
-			at += s;
-			rem -= s;
-		}
-		break;
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	for (i = 0; i < path_len; i++)
+		if (path[i] == '.')
+			n_fields++;
+	/* a path is no deeper than the messages unpacking accepts */
+	if (n_fields > PROTOBUF_C_DEFAULT_MAX_DEPTH)
+		return NULL;
 
-	case PROTOBUF_C_TYPE_SINT64:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint64 value");
-				return FALSE;
-			}
-			((int64_t *) array)[count++] = unzigzag64(parse_uint64(s, at));
-			at += s;
-			rem -= s;
-		}
-		break;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int64/uint64 value");
-				return FALSE;
-			}
-			((int64_t *) array)[count++] = parse_uint64(s, at);
-			at += s;
-			rem -= s;
-		}
-		break;
-	case PROTOBUF_C_TYPE_BOOL:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated boolean value");
-				return FALSE;
-			}
-			((protobuf_c_boolean *) array)[count++] = parse_boolean(s, at);
-			at += s;
-			rem -= s;
+	alloc_size = sizeof(ProtobufCWirePath) +
+		n_fields * sizeof(ProtobufCFieldDescriptor *) + path_len + 1;
+	rv = do_alloc(allocator, alloc_size);
+	if (rv == NULL)
+		return NULL;
+	rv->allocator = allocator;
+	rv->descriptor = desc;
+	rv->alloc_size = alloc_size;
+	rv->n_fields = n_fields;
+	rv->fields = (const ProtobufCFieldDescriptor **) (rv + 1);
+
+	/* look the components up one by one in a copy split at the dots */
+	name = (char *) (rv->fields + n_fields);
+	memcpy(name, path, path_len + 1);
+	for (i = 0; i < n_fields; i++) {
+		const ProtobufCFieldDescriptor *field;
+		size_t name_len = strcspn(name, ".");
+
+		name[name_len] = '\0';
+		field = protobuf_c_message_descriptor_get_field_by_name(desc,
+									name);
+		if (field == NULL ||
+		    field->label == PROTOBUF_C_LABEL_REPEATED ||
+		    (i + 1 < n_fields && field->type != PROTOBUF_C_TYPE_MESSAGE))
+		{
+			do_free(allocator, rv, alloc_size);
+			return NULL;
 		}
-		break;
-	default:
-		PROTOBUF_C__ASSERT_NOT_REACHED();
+		rv->fields[i] = field;
+		desc = field->descriptor;
+		name += name_len + 1;
 	}
-	*p_n += count;
-	return TRUE;
-
-#if !defined(WORDS_BIGENDIAN)
-no_unpacking_needed:
-	memcpy(array, at, count * siz);
-	*p_n += count;
-	return TRUE;
-#endif
+	return rv;
 }
 
-static protobuf_c_boolean
-is_packable_type(ProtobufCType type)
+void
+protobuf_c_wire_path_free(ProtobufCWirePath *path)
 {
-	return
-		type != PROTOBUF_C_TYPE_STRING &&
-		type != PROTOBUF_C_TYPE_BYTES &&
-		type != PROTOBUF_C_TYPE_MESSAGE;
+	if (path == NULL)
+		return;
+	do_free(path->allocator, path, path->alloc_size);
 }
 
+/*
+ * Decode a member the way parse_required_member() would, but leave string,
+ * bytes and message values in the wire data. UTF-8 is not checked.
+ */
 static protobuf_c_boolean
-parse_member(ScannedMember *scanned_member,
-	     ProtobufCMessage *message,
-	     ProtobufCAllocator *allocator)
+wire_path_decode(const ProtobufCFieldDescriptor *field, uint8_t wire_type,
+		 size_t len, const uint8_t *data, size_t pref_len,
+		 ProtobufCWireValue *value)
 {
-	const ProtobufCFieldDescriptor *field = scanned_member->field;
-	void *member;
+	ScannedMember member;
 
-	if (field == NULL) {
-		ProtobufCMessageUnknownField *ufield =
-			message->unknown_fields +
-			(message->n_unknown_fields++);
-		ufield->tag = scanned_member->tag;
-		ufield->wire_type = scanned_member->wire_type;
-		ufield->len = scanned_member->len;
-		ufield->data = do_alloc(allocator, scanned_member->len);
-		if (ufield->data == NULL)
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_STRING:
+	case PROTOBUF_C_TYPE_BYTES:
+	case PROTOBUF_C_TYPE_MESSAGE:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
 			return FALSE;
-		memcpy(ufield->data, scanned_member->data, ufield->len);
+		value->value.v_binary.len = len - pref_len;
+		value->value.v_binary.data = (uint8_t *) data + pref_len;
 		return TRUE;
+	default:
+		member.tag = field->id;
+		member.wire_type = wire_type;
+		member.length_prefix_len = pref_len;
+		member.field = field;
+		member.len = len;
+		member.data = data;
+		return parse_required_member(&member, &value->value, NULL, FALSE);
 	}
-	member = (char *) message + field->offset;
-	switch (field->label) {
-	case PROTOBUF_C_LABEL_REQUIRED:
-		return parse_required_member(scanned_member, member,
-					     allocator, TRUE);
-	case PROTOBUF_C_LABEL_OPTIONAL:
-	case PROTOBUF_C_LABEL_NONE:
-		if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)) {
-			return parse_oneof_member(scanned_member, member,
-						  message, allocator);
-		} else {
-			return parse_optional_member(scanned_member, member,
-						     message, allocator);
-		}
-	case PROTOBUF_C_LABEL_REPEATED:
-		if (scanned_member->wire_type ==
-		    PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
-		    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
-		     is_packable_type(field->type)))
-		{
-			return parse_packed_repeated_member(scanned_member,
-							    member, message);
-		} else {
-			return parse_repeated_member(scanned_member,
-						     member, message,
-						     allocator);
-		}
-	}
-	PROTOBUF_C__ASSERT_NOT_REACHED();
-	return 0;
 }
 
-/**
- * Initialise messages generated by old code.
- *
- * This function is used if desc->message_init == NULL (which occurs
- * for old code, and which would be useful to support allocating
- * descriptors dynamically).
+/*
+ * Look for the path `fields[0..n_fields-1]` in one message of type `desc`,
+ * skipping every other member by its wire type and length. The last
+ * occurrence of a field wins, and sub-messages that occur more than once are
+ * searched in turn, as if they were merged. A later member of the same oneof
+ * clears the field.
  */
-static void
-message_init_generic(const ProtobufCMessageDescriptor *desc,
-		     ProtobufCMessage *message)
+static int
+wire_path_find(const ProtobufCMessageDescriptor *desc,
+	       const ProtobufCFieldDescriptor *const *fields,
+	       unsigned n_fields, size_t len, const uint8_t *data,
+	       ProtobufCWireValue *value)
 {
-	unsigned i;
-
-	memset(message, 0, desc->sizeof_message);
-	message->descriptor = desc;
-	for (i = 0; i < desc->n_fields; i++) {
-		if (desc->fields[i].default_value != NULL &&
-		    desc->fields[i].label != PROTOBUF_C_LABEL_REPEATED)
-		{
-			void *field =
-				STRUCT_MEMBER_P(message, desc->fields[i].offset);
-			const void *dv = desc->fields[i].default_value;
-
-			switch (desc->fields[i].type) {
-			case PROTOBUF_C_TYPE_INT32:
-			case PROTOBUF_C_TYPE_SINT32:
-			case PROTOBUF_C_TYPE_SFIXED32:
-			case PROTOBUF_C_TYPE_UINT32:
-			case PROTOBUF_C_TYPE_FIXED32:
-			case PROTOBUF_C_TYPE_FLOAT:
-			case PROTOBUF_C_TYPE_ENUM:
-				memcpy(field, dv, 4);
-				break;
-			case PROTOBUF_C_TYPE_INT64:
-			case PROTOBUF_C_TYPE_SINT64:
-			case PROTOBUF_C_TYPE_SFIXED64:
-			case PROTOBUF_C_TYPE_UINT64:
-			case PROTOBUF_C_TYPE_FIXED64:
-			case PROTOBUF_C_TYPE_DOUBLE:
-				memcpy(field, dv, 8);
-				break;
-			case PROTOBUF_C_TYPE_BOOL:
-				memcpy(field, dv, sizeof(protobuf_c_boolean));
-				break;
-			case PROTOBUF_C_TYPE_BYTES:
-				memcpy(field, dv, sizeof(ProtobufCBinaryData));
-				break;
+	const ProtobufCFieldDescriptor *field = fields[0];
+	int rv = WIRE_PATH_ABSENT;
 
-			case PROTOBUF_C_TYPE_STRING:
-			case PROTOBUF_C_TYPE_MESSAGE:
-				/*
-				 * The next line essentially implements a cast
-				 * from const, which is totally unavoidable.
-				 */
-				*(const void **) field = dv;
-				break;
+	while (len > 0) {
+		uint32_t tag;
+		uint8_t wire_type;
+		size_t pref_len;
+		size_t field_len;
+		size_t used = parse_tag_and_wiretype(len, data, &tag, &wire_type);
+
+		if (used == 0)
+			return WIRE_PATH_MALFORMED;
+		data += used;
+		len -= used;
+
+		field_len = scan_wire_member(wire_type, len, data, &pref_len);
+		if (field_len == 0)
+			return WIRE_PATH_MALFORMED;
+
+		if (tag == field->id) {
+			if (n_fields == 1) {
+				if (!wire_path_decode(field, wire_type,
+						      field_len, data,
+						      pref_len, value) ||
+				    (field->type == PROTOBUF_C_TYPE_STRING &&
+				     0 != (field->flags &
+					   PROTOBUF_C_FIELD_FLAG_VALIDATE_UTF8) &&
+				     !utf8_copy(NULL, data + pref_len,
+						field_len - pref_len)))
+					return WIRE_PATH_MALFORMED;
+				rv = WIRE_PATH_FOUND;
+			} else {
+				int sub;
+
+				if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+					return WIRE_PATH_MALFORMED;
+				sub = wire_path_find(field->descriptor,
+						     fields + 1, n_fields - 1,
+						     field_len - pref_len,
+						     data + pref_len, value);
+				if (sub == WIRE_PATH_MALFORMED)
+					return sub;
+				if (sub != WIRE_PATH_ABSENT)
+					rv = sub;
 			}
+		} else if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)) {
+			int field_index = field_index_lookup(desc, tag);
+
+			if (field_index >= 0 &&
+			    desc->fields[field_index].quantifier_offset ==
+			    field->quantifier_offset)
+				rv = WIRE_PATH_CLEARED;
 		}
+		data += field_len;
+		len -= field_len;
 	}
+	return rv;
 }
 
-/**@}*/
+/* An absent field reads as its default, as after unpacking. */
+static void
+wire_value_default(const ProtobufCFieldDescriptor *field,
+		   ProtobufCWireValue *value)
+{
+	memset(&value->value, 0, sizeof(value->value));
+	if (field->default_value == NULL)
+		return;
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_STRING:
+		value->value.v_binary.len = strlen(field->default_value);
+		value->value.v_binary.data = (uint8_t *) field->default_value;
+		break;
+	case PROTOBUF_C_TYPE_MESSAGE:
+		break;
+	default:
+		memcpy(&value->value, field->default_value,
+		       sizeof_elt_in_repeated_array(field->type));
+		break;
+	}
+}
 
-/*
- * ScannedMember slabs (an unpacking implementation detail). Before doing real
- * unpacking, we first scan through the elements to see how many there are (for
- * repeated fields), and which field to use (for non-repeated fields given
- * twice).
- *
- * In order to avoid allocations for small messages, we keep a stack-allocated
- * slab of ScannedMembers of size FIRST_SCANNED_MEMBER_SLAB_SIZE (16). After we
- * fill that up, we allocate each slab twice as large as the previous one.
- */
-#define FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2 4
+protobuf_c_boolean
+protobuf_c_wire_find_field(const ProtobufCWirePath *path,
+			   size_t len, const uint8_t *data,
+			   ProtobufCWireValue *value)
+{
+	const ProtobufCFieldDescriptor *field = path->fields[path->n_fields - 1];
+	int rv = wire_path_find(path->descriptor, path->fields, path->n_fields,
+				len, data, value);
+
+	if (rv == WIRE_PATH_MALFORMED)
+		return FALSE;
+	value->field = field;
+	value->present = rv == WIRE_PATH_FOUND;
+	if (!value->present)
+		wire_value_default(field, value);
+	return TRUE;
+}
+
+/** Where the members of one field are in the data of a view. */
+typedef struct ViewSlot {
+	size_t first;              /**< Offset of the tag of the first member. */
+	size_t last;               /**< Offset of the tag of the last member. */
+	size_t count;              /**< Number of values; 0 if absent. */
+} ViewSlot;
+
+struct ProtobufCView {
+	ProtobufCAllocator *allocator;
+	const ProtobufCMessageDescriptor *descriptor;
+	size_t len;
+	const uint8_t *data;
+	/** One slot per field, in the order of `descriptor->fields`. */
+	ViewSlot *slots;
+};
 
 /*
- * The number of slabs, including the stack-allocated ones; choose the number so
- * that we would overflow if we needed a slab larger than provided.
+ * Index the members of the message in a view, checking them as
+ * validate_message() would, but without descending into sub-messages.
  */
-#define MAX_SCANNED_MEMBER_SLAB			\
-  (sizeof(unsigned int)*8 - 1			\
-   - BOUND_SIZEOF_SCANNED_MEMBER_LOG2		\
-   - FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)
+static protobuf_c_boolean
+view_scan(ProtobufCView *view)
+{
+	const ProtobufCMessageDescriptor *desc = view->descriptor;
+	const ProtobufCMessageLayout *layout = desc->layout;
+	const uint8_t *at = view->data;
+	size_t rem = view->len;
+	size_t n_members = 0;
+	unsigned f;
 
-#define REQUIRED_FIELD_BITMAP_SET(index)	\
-	(required_fields_bitmap[(index)/8] |= (1UL<<((index)%8)))
+	while (rem > 0) {
+		const ProtobufCFieldDescriptor *field;
+		ViewSlot *slot;
+		uint32_t tag;
+		uint8_t wire_type;
+		size_t pref_len;
+		size_t field_len;
+		int field_index;
+		size_t used = parse_tag_and_wiretype(rem, at, &tag, &wire_type);
 
-#define REQUIRED_FIELD_BITMAP_IS_SET(index)	\
-	(required_fields_bitmap[(index)/8] & (1UL<<((index)%8)))
+		if (used == 0)
+			return FALSE;
+		field_len = scan_wire_member(wire_type, rem - used, at + used,
+					     &pref_len);
+		if (field_len == 0 || ++n_members > MAX_SCANNED_MEMBERS)
+			return FALSE;
 
-ProtobufCMessage *
-protobuf_c_message_unpack(const ProtobufCMessageDescriptor *desc,
-			  ProtobufCAllocator *allocator,
-			  size_t len, const uint8_t *data)
-{
-	ProtobufCMessage *rv;
-	size_t rem = len;
-	const uint8_t *at = data;
-	const ProtobufCFieldDescriptor *last_field = desc->fields + 0;
-	ScannedMember first_member_slab[1UL <<
-					FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2];
+		field_index = layout != NULL && tag > layout->max_field_id ?
+			-1 : field_index_lookup(desc, tag);
+		if (field_index >= 0) {
+			field = desc->fields + field_index;
+			if (!validate_member(field, wire_type, field_len,
+					     at + used, pref_len, 0, 0))
+				return FALSE;
+			slot = view->slots + field_index;
+			if (slot->count == 0)
+				slot->first = at - view->data;
+			slot->last = at - view->data;
+			if (field->label != PROTOBUF_C_LABEL_REPEATED) {
+				slot->count = 1;
+			} else if (wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+				   is_packable_type(field->type))
+			{
+				size_t count;
 
-	/*
-	 * scanned_member_slabs[i] is an array of arrays of ScannedMember.
-	 * The first slab (scanned_member_slabs[0] is just a pointer to
-	 * first_member_slab), above. All subsequent slabs will be allocated
-	 * using the allocator.
-	 */
-	ScannedMember *scanned_member_slabs[MAX_SCANNED_MEMBER_SLAB + 1];
-	unsigned which_slab = 0; /* the slab we are currently populating */
-	unsigned in_slab_index = 0; /* number of members in the slab */
-	size_t n_unknown = 0;
-	unsigned f;
-	unsigned j;
-	unsigned i_slab;
-	unsigned last_field_index = 0;
-	unsigned required_fields_bitmap_len;
-	unsigned char required_fields_bitmap_stack[16];
-	unsigned char *required_fields_bitmap = required_fields_bitmap_stack;
-	protobuf_c_boolean required_fields_bitmap_alloced = FALSE;
+				count_packed_elements(field->type,
+						      field_len - pref_len,
+						      at + used + pref_len,
+						      &count);
+				slot->count += count;
+			} else {
+				slot->count++;
+			}
+			/* a member of a oneof clears the others */
+			if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)) {
+				for (f = 0; f < desc->n_fields; f++)
+					if (f != (unsigned) field_index &&
+					    desc->fields[f].quantifier_offset ==
+					    field->quantifier_offset &&
+					    0 != (desc->fields[f].flags &
+						  PROTOBUF_C_FIELD_FLAG_ONEOF))
+						view->slots[f].count = 0;
+			}
+		}
+		at += used + field_len;
+		rem -= used + field_len;
+	}
 
-	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+
+		if (field->label == PROTOBUF_C_LABEL_REQUIRED &&
+		    field->default_value == NULL && view->slots[f].count == 0)
+			return FALSE;
+	}
+	return TRUE;
+}
 
+ProtobufCView *
+protobuf_c_view_new(const ProtobufCMessageDescriptor *desc,
+		    ProtobufCAllocator *allocator,
+		    size_t len, const uint8_t *data)
+{
+	ProtobufCView *view;
+
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
 	if (allocator == NULL)
 		allocator = &protobuf_c__allocator;
+	view = do_alloc(allocator, sizeof(ProtobufCView) +
+			desc->n_fields * sizeof(ViewSlot));
+	if (view == NULL)
+		return NULL;
+	view->allocator = allocator;
+	view->descriptor = desc;
+	view->len = len;
+	view->data = data;
+	view->slots = (ViewSlot *) (view + 1);
+	memset(view->slots, 0, desc->n_fields * sizeof(ViewSlot));
+	if (!view_scan(view)) {
+		protobuf_c_view_free(view);
+		return NULL;
+	}
+	return view;
+}
 
-	rv = do_alloc(allocator, desc->sizeof_message);
-	if (!rv)
-		return (NULL);
-	scanned_member_slabs[0] = first_member_slab;
+void
+protobuf_c_view_free(ProtobufCView *view)
+{
+	if (view == NULL)
+		return;
+	do_free(view->allocator, view, sizeof(ProtobufCView) +
+		view->descriptor->n_fields * sizeof(ViewSlot));
+}
 
-	required_fields_bitmap_len = (desc->n_fields + 7) / 8;
-	if (required_fields_bitmap_len > sizeof(required_fields_bitmap_stack)) {
-		required_fields_bitmap = do_alloc(allocator, required_fields_bitmap_len);
-		if (!required_fields_bitmap) {
-			do_free(allocator, rv);
-			return (NULL);
-		}
-		required_fields_bitmap_alloced = TRUE;
-	}
-	memset(required_fields_bitmap, 0, required_fields_bitmap_len);
+/*
+ * Decode the member whose tag is at `offset` in the data of a view. The view
+ * has already checked it.
+ */
+static void
+view_decode_member(const ProtobufCView *view,
+		   const ProtobufCFieldDescriptor *field, size_t offset,
+		   ProtobufCWireValue *value)
+{
+	const uint8_t *at = view->data + offset;
+	size_t rem = view->len - offset;
+	uint32_t tag;
+	uint8_t wire_type;
+	size_t pref_len;
+	size_t used = parse_tag_and_wiretype(rem, at, &tag, &wire_type);
+	size_t field_len = scan_wire_member(wire_type, rem - used, at + used,
+					    &pref_len);
+
+	wire_path_decode(field, wire_type, field_len, at + used, pref_len,
+			 value);
+}
 
-	/*
-	 * Generated code always defines "message_init". However, we provide a
-	 * fallback for (1) users of old protobuf-c generated-code that do not
-	 * provide the function, and (2) descriptors constructed from some other
-	 * source (most likely, direct construction from the .proto file).
-	 */
-	if (desc->message_init != NULL)
-		protobuf_c_message_init(desc, rv);
+protobuf_c_boolean
+protobuf_c_view_get(const ProtobufCView *view, unsigned field_index,
+		    ProtobufCWireValue *value)
+{
+	const ProtobufCFieldDescriptor *field =
+		view->descriptor->fields + field_index;
+	const ViewSlot *slot = view->slots + field_index;
+
+	assert(field_index < view->descriptor->n_fields);
+	assert(field->label != PROTOBUF_C_LABEL_REPEATED);
+	value->field = field;
+	value->present = slot->count != 0;
+	if (value->present)
+		view_decode_member(view, field, slot->last, value);
 	else
-		message_init_generic(desc, rv);
+		wire_value_default(field, value);
+	return value->present;
+}
 
-	while (rem > 0) {
+size_t
+protobuf_c_view_get_count(const ProtobufCView *view, unsigned field_index)
+{
+	assert(field_index < view->descriptor->n_fields);
+	return view->slots[field_index].count;
+}
+
+void
+protobuf_c_view_iter_init(const ProtobufCView *view, unsigned field_index,
+			  ProtobufCViewIter *iter)
+{
+	const ViewSlot *slot = view->slots + field_index;
+
+	assert(field_index < view->descriptor->n_fields);
+	iter->view = view;
+	iter->field = view->descriptor->fields + field_index;
+	iter->offset = slot->first;
+	iter->packed_end = 0;
+	iter->remaining = slot->count;
+}
+
+protobuf_c_boolean
+protobuf_c_view_iter_next(ProtobufCViewIter *iter, ProtobufCWireValue *value)
+{
+	const ProtobufCView *view = iter->view;
+	const ProtobufCFieldDescriptor *field = iter->field;
+
+	if (iter->remaining == 0)
+		return FALSE;
+	value->field = field;
+	value->present = TRUE;
+
+	/* find the next member of the field, unless inside a packed one */
+	while (iter->offset >= iter->packed_end) {
+		const uint8_t *at = view->data + iter->offset;
+		size_t rem = view->len - iter->offset;
 		uint32_t tag;
 		uint8_t wire_type;
+		size_t pref_len;
 		size_t used = parse_tag_and_wiretype(rem, at, &tag, &wire_type);
-		const ProtobufCFieldDescriptor *field;
-		ScannedMember tmp;
+		size_t field_len = scan_wire_member(wire_type, rem - used,
+						    at + used, &pref_len);
 
-		if (used == 0) {
-			PROTOBUF_C_UNPACK_ERROR("error parsing tag/wiretype at offset %u",
-						(unsigned) (at - data));
-			goto error_cleanup_during_scan;
-		}
-		/*
-		 * \todo Consider optimizing for field[1].id == tag, if field[1]
-		 * exists!
-		 */
-		if (last_field == NULL || last_field->id != tag) {
-			/* lookup field */
-			int field_index =
-			    int_range_lookup(desc->n_field_ranges,
-					     desc->field_ranges,
-					     tag);
-			if (field_index < 0) {
-				field = NULL;
-				n_unknown++;
-			} else {
-				field = desc->fields + field_index;
-				last_field = field;
-				last_field_index = field_index;
-			}
+		if (tag != field->id) {
+			iter->offset += used + field_len;
+		} else if (wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+			   is_packable_type(field->type))
+		{
+			iter->offset += used + pref_len;
+			iter->packed_end = iter->offset + field_len - pref_len;
 		} else {
-			field = last_field;
+			wire_path_decode(field, wire_type, field_len,
+					 at + used, pref_len, value);
+			iter->offset += used + field_len;
+			iter->remaining--;
+			return TRUE;
 		}
+	}
 
-		if (field != NULL && field->label == PROTOBUF_C_LABEL_REQUIRED)
-			REQUIRED_FIELD_BITMAP_SET(last_field_index);
-
-		at += used;
-		rem -= used;
-		tmp.tag = tag;
-		tmp.wire_type = wire_type;
-		tmp.field = field;
-		tmp.data = at;
-		tmp.length_prefix_len = 0;
-
-		switch (wire_type) {
-		case PROTOBUF_C_WIRE_TYPE_VARINT: {
-			unsigned max_len = rem < 10 ? rem : 10;
-			unsigned i;
-
-			for (i = 0; i < max_len; i++)
-				if ((at[i] & 0x80) == 0)
-					break;
-			if (i == max_len) {
-				PROTOBUF_C_UNPACK_ERROR("unterminated varint at offset %u",
-							(unsigned) (at - data));
-				goto error_cleanup_during_scan;
-			}
-			tmp.len = i + 1;
-			break;
-		}
-		case PROTOBUF_C_WIRE_TYPE_64BIT:
-			if (rem < 8) {
-				PROTOBUF_C_UNPACK_ERROR("too short after 64bit wiretype at offset %u",
-							(unsigned) (at - data));
-				goto error_cleanup_during_scan;
-			}
-			tmp.len = 8;
-			break;
-		case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED: {
-			size_t pref_len;
+	/* the next element of a packed member */
+	{
+		const uint8_t *at = view->data + iter->offset;
+		uint8_t wire_type;
+		size_t elt_len;
 
-			tmp.len = scan_length_prefixed_data(rem, at, &pref_len);
-			if (tmp.len == 0) {
-				/* NOTE: scan_length_prefixed_data calls UNPACK_ERROR */
-				goto error_cleanup_during_scan;
-			}
-			tmp.length_prefix_len = pref_len;
+		switch (field->type) {
+		case PROTOBUF_C_TYPE_SFIXED32:
+		case PROTOBUF_C_TYPE_FIXED32:
+		case PROTOBUF_C_TYPE_FLOAT:
+			wire_type = PROTOBUF_C_WIRE_TYPE_32BIT;
+			elt_len = 4;
 			break;
-		}
-		case PROTOBUF_C_WIRE_TYPE_32BIT:
-			if (rem < 4) {
-				PROTOBUF_C_UNPACK_ERROR("too short after 32bit wiretype at offset %u",
-					      (unsigned) (at - data));
-				goto error_cleanup_during_scan;
-			}
-			tmp.len = 4;
+		case PROTOBUF_C_TYPE_SFIXED64:
+		case PROTOBUF_C_TYPE_FIXED64:
+		case PROTOBUF_C_TYPE_DOUBLE:
+			wire_type = PROTOBUF_C_WIRE_TYPE_64BIT;
+			elt_len = 8;
 			break;
 		default:
-			PROTOBUF_C_UNPACK_ERROR("unsupported tag %u at offset %u",
-						wire_type, (unsigned) (at - data));
-			goto error_cleanup_during_scan;
+			wire_type = PROTOBUF_C_WIRE_TYPE_VARINT;
+			elt_len = scan_varint(iter->packed_end - iter->offset,
+					      at);
+			break;
 		}
+		wire_path_decode(field, wire_type, elt_len, at, 0, value);
+		iter->offset += elt_len;
+		iter->remaining--;
+		return TRUE;
+	}
+}
 
-		if (in_slab_index == (1UL <<
-			(which_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)))
-		{
-			size_t size;
-
-			in_slab_index = 0;
-			if (which_slab == MAX_SCANNED_MEMBER_SLAB) {
-				PROTOBUF_C_UNPACK_ERROR("too many fields");
-				goto error_cleanup_during_scan;
-			}
-			which_slab++;
-			size = sizeof(ScannedMember)
-				<< (which_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2);
-			scanned_member_slabs[which_slab] = do_alloc(allocator, size);
-			if (scanned_member_slabs[which_slab] == NULL)
-				goto error_cleanup_during_scan;
-		}
-		scanned_member_slabs[which_slab][in_slab_index++] = tmp;
+/* How visit_packed() ended. */
+#define VISIT_MALFORMED		0
+#define VISIT_CONTINUE		1
+#define VISIT_STOPPED		2
 
-		if (field != NULL && field->label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t *n = STRUCT_MEMBER_PTR(size_t, rv,
-						      field->quantifier_offset);
-			if (wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
-			    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
-			     is_packable_type(field->type)))
-			{
-				size_t count;
-				if (!count_packed_elements(field->type,
-							   tmp.len -
-							   tmp.length_prefix_len,
-							   tmp.data +
-							   tmp.length_prefix_len,
-							   &count))
-				{
-					PROTOBUF_C_UNPACK_ERROR("counting packed elements");
-					goto error_cleanup_during_scan;
-				}
-				*n += count;
-			} else {
-				*n += 1;
-			}
-		}
+/*
+ * Report every element of a packed member to a visitor, checking each one as
+ * it is decoded.
+ */
+static int
+visit_packed(const ProtobufCFieldDescriptor *field, size_t len,
+	     const uint8_t *data, const ProtobufCVisitor *visitor,
+	     ProtobufCWireValue *value)
+{
+	uint8_t wire_type;
+	size_t elt_len = 0;
 
-		at += tmp.len;
-		rem -= tmp.len;
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		wire_type = PROTOBUF_C_WIRE_TYPE_32BIT;
+		elt_len = 4;
+		break;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		wire_type = PROTOBUF_C_WIRE_TYPE_64BIT;
+		elt_len = 8;
+		break;
+	default:
+		wire_type = PROTOBUF_C_WIRE_TYPE_VARINT;
+		break;
 	}
-
-	/* allocate space for repeated fields, also check that all required fields have been set */
-	for (f = 0; f < desc->n_fields; f++) {
-		const ProtobufCFieldDescriptor *field = desc->fields + f;
-		if (field == NULL) {
-			continue;
-		}
-		if (field->label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t siz =
-			    sizeof_elt_in_repeated_array(field->type);
-			size_t *n_ptr =
-			    STRUCT_MEMBER_PTR(size_t, rv,
-					      field->quantifier_offset);
-			if (*n_ptr != 0) {
-				unsigned n = *n_ptr;
-				void *a;
-				*n_ptr = 0;
-				assert(rv->descriptor != NULL);
-#define CLEAR_REMAINING_N_PTRS()                                              \
-              for(f++;f < desc->n_fields; f++)                                \
-                {                                                             \
-                  field = desc->fields + f;                                   \
-                  if (field->label == PROTOBUF_C_LABEL_REPEATED)              \
-                    STRUCT_MEMBER (size_t, rv, field->quantifier_offset) = 0; \
-                }
-				a = do_alloc(allocator, siz * n);
-				if (!a) {
-					CLEAR_REMAINING_N_PTRS();
-					goto error_cleanup;
-				}
-				STRUCT_MEMBER(void *, rv, field->offset) = a;
-			}
-		} else if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			if (field->default_value == NULL &&
-			    !REQUIRED_FIELD_BITMAP_IS_SET(f))
-			{
-				CLEAR_REMAINING_N_PTRS();
-				PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
-							desc->name, field->name);
-				goto error_cleanup;
-			}
+	if (elt_len != 0 && len % elt_len != 0)
+		return VISIT_MALFORMED;
+
+	while (len > 0) {
+		if (wire_type == PROTOBUF_C_WIRE_TYPE_VARINT) {
+			elt_len = scan_varint(len, data);
+			if (elt_len == 0)
+				return VISIT_MALFORMED;
 		}
+		wire_path_decode(field, wire_type, elt_len, data, 0, value);
+		if (visitor->field != NULL &&
+		    !visitor->field(value, visitor->visitor_data))
+			return VISIT_STOPPED;
+		data += elt_len;
+		len -= elt_len;
 	}
-#undef CLEAR_REMAINING_N_PTRS
+	return VISIT_CONTINUE;
+}
 
-	/* allocate space for unknown fields */
-	if (n_unknown) {
-		rv->unknown_fields = do_alloc(allocator,
-					      n_unknown * sizeof(ProtobufCMessageUnknownField));
-		if (rv->unknown_fields == NULL)
-			goto error_cleanup;
-	} else {
-		rv->unknown_fields = NULL;
-	}
+protobuf_c_boolean
+protobuf_c_message_visit(const ProtobufCMessageDescriptor *desc,
+			 size_t len, const uint8_t *data,
+			 const ProtobufCVisitor *visitor)
+{
+	const ProtobufCMessageLayout *layout = desc->layout;
+	ProtobufCWireValue value;
 
-	/* do real parsing */
-	for (i_slab = 0; i_slab <= which_slab; i_slab++) {
-		unsigned max = (i_slab == which_slab) ?
-			in_slab_index : (1UL << (i_slab + 4));
-		ScannedMember *slab = scanned_member_slabs[i_slab];
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+	value.present = TRUE;
+	while (len > 0) {
+		const ProtobufCFieldDescriptor *field;
+		uint32_t tag;
+		uint8_t wire_type;
+		size_t pref_len;
+		size_t field_len;
+		int field_index;
+		size_t used = parse_tag_and_wiretype(len, data, &tag, &wire_type);
 
-		for (j = 0; j < max; j++) {
-			if (!parse_member(slab + j, rv, allocator)) {
-				PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
-							slab->field ? slab->field->name : "*unknown-field*",
-					desc->name);
-				goto error_cleanup;
+		if (used == 0)
+			return FALSE;
+		field_len = scan_wire_member(wire_type, len - used, data + used,
+					     &pref_len);
+		if (field_len == 0)
+			return FALSE;
+
+		field_index = layout != NULL && tag > layout->max_field_id ?
+			-1 : field_index_lookup(desc, tag);
+		if (field_index < 0) {
+			ProtobufCMessageUnknownField unknown;
+
+			unknown.tag = tag;
+			unknown.wire_type = wire_type;
+			unknown.len = field_len;
+			unknown.data = (uint8_t *) data + used;
+			if (visitor->unknown != NULL &&
+			    !visitor->unknown(&unknown, visitor->visitor_data))
+				return TRUE;
+		} else {
+			field = desc->fields + field_index;
+			value.field = field;
+			if (field->label == PROTOBUF_C_LABEL_REPEATED &&
+			    wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+			    is_packable_type(field->type))
+			{
+				switch (visit_packed(field, field_len - pref_len,
+						     data + used + pref_len,
+						     visitor, &value)) {
+				case VISIT_MALFORMED:
+					return FALSE;
+				case VISIT_STOPPED:
+					return TRUE;
+				}
+			} else {
+				if (!validate_member(field, wire_type, field_len,
+						     data + used, pref_len, 0, 0) ||
+				    !wire_path_decode(field, wire_type, field_len,
+						      data + used, pref_len,
+						      &value))
+					return FALSE;
+				if (visitor->field != NULL &&
+				    !visitor->field(&value, visitor->visitor_data))
+					return TRUE;
 			}
 		}
+		data += used + field_len;
+		len -= used + field_len;
 	}
+	return TRUE;
+}
 
-	/* cleanup */
-	for (j = 1; j <= which_slab; j++)
-		do_free(allocator, scanned_member_slabs[j]);
-	if (required_fields_bitmap_alloced)
-		do_free(allocator, required_fields_bitmap);
-	return rv;
-
-error_cleanup:
-	protobuf_c_message_free_unpacked(rv, allocator);
-	for (j = 1; j <= which_slab; j++)
-		do_free(allocator, scanned_member_slabs[j]);
-	if (required_fields_bitmap_alloced)
-		do_free(allocator, required_fields_bitmap);
-	return NULL;
+/**
+ * Decide from the hot field data alone whether a field may point to memory
+ * that free_message() has to release.
+ */
+static inline protobuf_c_boolean
+hot_field_owns_memory(const ProtobufCMessage *message,
+		      const ProtobufCFieldHot *hot)
+{
+	const char *member = ((const char *) message) + hot->offset;
 
-error_cleanup_during_scan:
-	do_free(allocator, rv);
-	for (j = 1; j <= which_slab; j++)
-		do_free(allocator, scanned_member_slabs[j]);
-	if (required_fields_bitmap_alloced)
-		do_free(allocator, required_fields_bitmap);
-	return NULL;
+	if (0 != (hot->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) &&
+	    STRUCT_MEMBER(uint32_t, message, hot->quantifier_offset) != hot->id)
+		return FALSE;
+	if (hot->label == PROTOBUF_C_LABEL_REPEATED)
+		return *(void * const *) member != NULL;
+	switch (hot->type) {
+	case PROTOBUF_C_TYPE_STRING:
+	case PROTOBUF_C_TYPE_MESSAGE:
+		return *(void * const *) member != NULL;
+	case PROTOBUF_C_TYPE_BYTES:
+		return ((const ProtobufCBinaryData *) member)->data != NULL;
+	default:
+		return FALSE;
+	}
 }
 
-void
-protobuf_c_message_free_unpacked(ProtobufCMessage *message,
-				 ProtobufCAllocator *allocator)
+/*
+ * Messages still to be freed by free_message() are kept on a list threaded
+ * through their `unknown_fields` member, which is released when the message
+ * is queued.
+ */
+static inline void
+free_message_push(ProtobufCMessage **pending, ProtobufCMessage *message,
+		  ProtobufCAllocator *allocator)
 {
-	const ProtobufCMessageDescriptor *desc;
 	unsigned f;
 
-	if (message == NULL)
-		return;
+	ASSERT_IS_MESSAGE(message);
+	for (f = 0; f < message->n_unknown_fields; f++)
+		do_free(allocator, message->unknown_fields[f].data,
+			message->unknown_fields[f].len);
+	do_free(allocator, message->unknown_fields,
+		message->n_unknown_fields * sizeof(ProtobufCMessageUnknownField));
+	message->n_unknown_fields = 0;
+	message->unknown_fields = (ProtobufCMessageUnknownField *) (void *) *pending;
+	*pending = message;
+}
 
-	desc = message->descriptor;
+/* The allocator a message is freed with. */
+static inline ProtobufCAllocator *
+message_allocator(const ProtobufCMessage *message, const UnpackState *state)
+{
+	if (state->shared)
+		return SHARED_HEADER(message)->h.allocator;
+	return state->allocator;
+}
 
-	ASSERT_IS_MESSAGE(message);
+/*
+ * Drop a parent's hold on a sub-message: shared sub-messages may have other
+ * owners, so only their reference is released.
+ */
+static inline void
+release_message(ProtobufCMessage *message, ProtobufCMessage **pending,
+		UnpackState *state)
+{
+	if (message == NULL)
+		return;
+	if (state->shared &&
+	    ATOMIC_SUB(&SHARED_HEADER(message)->h.refcount, 1) != 0)
+		return;
+	free_message_push(pending, message, message_allocator(message, state));
+}
 
-	if (allocator == NULL)
-		allocator = &protobuf_c__allocator;
+/*
+ * Free the fields of a message taken off the pending list and the message
+ * itself, queueing its sub-messages.
+ */
+static void
+free_message_fields(ProtobufCMessage *message, ProtobufCMessage **pending,
+		    UnpackState *state)
+{
+	ProtobufCAllocator *allocator;
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	const ProtobufCMessageLayout *layout;
+	unsigned f, k;
+
+	/* shared sub-messages may come from other unpacks and allocators */
+	allocator = state->allocator = message_allocator(message, state);
+	layout = desc->layout;
 	message->descriptor = NULL;
-	for (f = 0; f < desc->n_fields; f++) {
+	for (k = 0; k < (layout != NULL ? layout->n_owning : desc->n_fields); k++) {
+		f = layout != NULL ? layout->owning[k] : k;
+		if (layout != NULL &&
+		    !hot_field_owns_memory(message, layout->fields + f))
+			continue;
 		if (0 != (desc->fields[f].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) &&
 		    desc->fields[f].id !=
 		    STRUCT_MEMBER(uint32_t, message, desc->fields[f].quantifier_offset))
@@ -3360,38 +8064,43 @@ protobuf_c_message_free_unpacked(ProtobufCMessage *message,
 				if (desc->fields[f].type == PROTOBUF_C_TYPE_STRING) {
 					unsigned i;
 					for (i = 0; i < n; i++)
-						do_free(allocator, ((char **) arr)[i]);
+						free_string(state, ((char **) arr)[i]);
 				} else if (desc->fields[f].type == PROTOBUF_C_TYPE_BYTES) {
 					unsigned i;
-					for (i = 0; i < n; i++)
-						do_free(allocator, ((ProtobufCBinaryData *) arr)[i].data);
+					for (i = 0; i < n; i++) {
+						ProtobufCBinaryData *bd =
+							(ProtobufCBinaryData *) arr + i;
+						free_value(state, bd->data, bd->len);
+					}
 				} else if (desc->fields[f].type == PROTOBUF_C_TYPE_MESSAGE) {
 					unsigned i;
 					for (i = 0; i < n; i++)
-						protobuf_c_message_free_unpacked(
+						release_message(
 							((ProtobufCMessage **) arr)[i],
-							allocator
+							pending, state
 						);
 				}
-				do_free(allocator, arr);
+				do_free(allocator, arr,
+					n * sizeof_elt_in_repeated_array(desc->fields[f].type));
 			}
 		} else if (desc->fields[f].type == PROTOBUF_C_TYPE_STRING) {
 			char *str = STRUCT_MEMBER(char *, message,
 						  desc->fields[f].offset);
 
 			if (str && str != desc->fields[f].default_value)
-				do_free(allocator, str);
+				free_string(state, str);
 		} else if (desc->fields[f].type == PROTOBUF_C_TYPE_BYTES) {
-			void *data = STRUCT_MEMBER(ProtobufCBinaryData, message,
-						   desc->fields[f].offset).data;
+			ProtobufCBinaryData *bd =
+				STRUCT_MEMBER_PTR(ProtobufCBinaryData, message,
+						  desc->fields[f].offset);
 			const ProtobufCBinaryData *default_bd;
 
 			default_bd = desc->fields[f].default_value;
-			if (data != NULL &&
+			if (bd->data != NULL &&
 			    (default_bd == NULL ||
-			     default_bd->data != data))
+			     default_bd->data != bd->data))
 			{
-				do_free(allocator, data);
+				free_value(state, bd->data, bd->len);
 			}
 		} else if (desc->fields[f].type == PROTOBUF_C_TYPE_MESSAGE) {
 			ProtobufCMessage *sm;
@@ -3399,16 +8108,79 @@ protobuf_c_message_free_unpacked(ProtobufCMessage *message,
 			sm = STRUCT_MEMBER(ProtobufCMessage *, message,
 					   desc->fields[f].offset);
 			if (sm && sm != desc->fields[f].default_value)
-				protobuf_c_message_free_unpacked(sm, allocator);
+				release_message(sm, pending, state);
 		}
 	}
 
-	for (f = 0; f < message->n_unknown_fields; f++)
-		do_free(allocator, message->unknown_fields[f].data);
-	if (message->unknown_fields != NULL)
-		do_free(allocator, message->unknown_fields);
+	free_message_memory(state, message, desc->sizeof_message);
+}
+
+/*
+ * Free a message tree without recursion: sub-messages are queued on a list
+ * rather than freed as they are found, so the order in which messages are
+ * released does not follow the tree.
+ */
+static void
+free_message(ProtobufCMessage *message, UnpackState *state)
+{
+	ProtobufCMessage *pending = NULL;
+
+	if (message == NULL)
+		return;
+	free_message_push(&pending, message, message_allocator(message, state));
+	while (pending != NULL) {
+		message = pending;
+		pending = (ProtobufCMessage *) (void *) message->unknown_fields;
+		free_message_fields(message, &pending, state);
+	}
+}
+
+void
+protobuf_c_message_free_unpacked(ProtobufCMessage *message,
+				 ProtobufCAllocator *allocator)
+{
+	UnpackState state;
+
+	init_unpack_state(&state, allocator);
+	free_message(message, &state);
+}
+
+void
+protobuf_c_message_free_unpacked_interned(ProtobufCMessage *message,
+					  ProtobufCAllocator *allocator,
+					  ProtobufCIntern *intern)
+{
+	UnpackState state;
+
+	init_unpack_state(&state, allocator);
+	state.intern = intern;
+	free_message(message, &state);
+}
+
+ProtobufCMessage *
+protobuf_c_message_ref(ProtobufCMessage *message)
+{
+	assert(SHARED_HEADER(message)->h.magic == SHARED_MESSAGE_MAGIC);
+	ATOMIC_ADD(&SHARED_HEADER(message)->h.refcount, 1);
+	return message;
+}
+
+void
+protobuf_c_message_unref(ProtobufCMessage *message)
+{
+	SharedHeader *header;
+	UnpackState state;
 
-	do_free(allocator, message);
+	if (message == NULL)
+		return;
+	header = SHARED_HEADER(message);
+	assert(header->h.magic == SHARED_MESSAGE_MAGIC);
+	/* shared trees can be released from any thread */
+	if (ATOMIC_SUB(&header->h.refcount, 1) != 0)
+		return;
+	init_unpack_state(&state, header->h.allocator);
+	state.shared = TRUE;
+	free_message(message, &state);
 }
 
 void
@@ -3421,7 +8193,8 @@ protobuf_c_message_init(const ProtobufCMessageDescriptor * descriptor,
 protobuf_c_boolean
 protobuf_c_message_check(const ProtobufCMessage *message)
 {
-	unsigned i;
+	const ProtobufCMessageLayout *layout;
+	unsigned k, n;
 
 	if (!message ||
 	    !message->descriptor ||
@@ -3430,8 +8203,12 @@ protobuf_c_message_check(const ProtobufCMessage *message)
 		return FALSE;
 	}
 
-	for (i = 0; i < message->descriptor->n_fields; i++) {
-		const ProtobufCFieldDescriptor *f = message->descriptor->fields + i;
+	layout = message->descriptor->layout;
+	n = layout != NULL ? layout->n_owning : message->descriptor->n_fields;
+	/* only strings, bytes, messages and repeated fields need checking */
+	for (k = 0; k < n; k++) {
+		const ProtobufCFieldDescriptor *f = message->descriptor->fields +
+			(layout != NULL ? layout->owning[k] : k);
 		ProtobufCType type = f->type;
 		ProtobufCLabel label = f->label;
 		void *field = STRUCT_MEMBER_P (message, f->offset);
@@ -3555,6 +8332,40 @@ void protobuf_c_service_destroy(ProtobufCService *service)
 
 /* --- querying the descriptors --- */
 
+/*
+ * Seeded FNV-1a with a final mix, so that the low bits used for the modulo
+ * depend on every byte. protoc-gen-c computes the same function when it
+ * builds a ProtobufCNameHash.
+ */
+static uint32_t
+name_hash(const char *name, uint32_t seed)
+{
+	uint32_t h = 2166136261U ^ seed;
+
+	while (*name != '\0') {
+		h ^= (uint8_t) *name++;
+		h *= 16777619U;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	return h;
+}
+
+/* The only index `name` can have in the hashed set; to be confirmed. */
+static inline unsigned
+name_hash_lookup(const ProtobufCNameHash *hash, const char *name)
+{
+	int32_t d = hash->displacements[name_hash(name, 0) % hash->n];
+	unsigned slot;
+
+	if (d < 0)
+		slot = (unsigned) (-1 - d);
+	else
+		slot = name_hash(name, (uint32_t) d) % hash->n;
+	return hash->index[slot];
+}
+
 const ProtobufCEnumValue *
 protobuf_c_enum_descriptor_get_value_by_name(const ProtobufCEnumDescriptor *desc,
 					     const char *name)
@@ -3565,6 +8376,15 @@ protobuf_c_enum_descriptor_get_value_by_name(const ProtobufCEnumDescriptor *desc
 	if (desc == NULL || desc->values_by_name == NULL)
 		return NULL;
 
+	if (desc->value_name_hash != NULL) {
+		const ProtobufCEnumValueIndex *vi = desc->values_by_name +
+			name_hash_lookup(desc->value_name_hash, name);
+
+		if (strcmp(vi->name, name) != 0)
+			return NULL;
+		return desc->values + vi->index;
+	}
+
 	count = desc->n_value_names;
 
 	while (count > 1) {
@@ -3589,7 +8409,13 @@ const ProtobufCEnumValue *
 protobuf_c_enum_descriptor_get_value(const ProtobufCEnumDescriptor *desc,
 				     int value)
 {
-	int rv = int_range_lookup(desc->n_value_ranges, desc->value_ranges, value);
+	int rv;
+
+	if (desc->value_index != NULL)
+		rv = dense_index_lookup(desc->value_index, value);
+	else
+		rv = int_range_lookup(desc->n_value_ranges,
+				      desc->value_ranges, value);
 	if (rv < 0)
 		return NULL;
 	return desc->values + rv;
@@ -3606,6 +8432,12 @@ protobuf_c_message_descriptor_get_field_by_name(const ProtobufCMessageDescriptor
 	if (desc == NULL || desc->fields_sorted_by_name == NULL)
 		return NULL;
 
+	if (desc->field_name_hash != NULL) {
+		field = desc->fields +
+			name_hash_lookup(desc->field_name_hash, name);
+		return strcmp(field->name, name) == 0 ? field : NULL;
+	}
+
 	count = desc->n_fields;
 
 	while (count > 1) {
@@ -3633,7 +8465,7 @@ const ProtobufCFieldDescriptor *
 protobuf_c_message_descriptor_get_field(const ProtobufCMessageDescriptor *desc,
 					unsigned value)
 {
-	int rv = int_range_lookup(desc->n_field_ranges,desc->field_ranges, value);
+	int rv = field_index_lookup(desc, value);
 	if (rv < 0)
 		return NULL;
 	return desc->fields + rv;
@@ -3649,6 +8481,15 @@ protobuf_c_service_descriptor_get_method_by_name(const ProtobufCServiceDescripto
 	if (desc == NULL || desc->method_indices_by_name == NULL)
 		return NULL;
 
+	if (desc->magic == PROTOBUF_C__SERVICE_DESCRIPTOR_HASHED_MAGIC &&
+	    desc->method_name_hash != NULL)
+	{
+		const ProtobufCMethodDescriptor *method = desc->methods +
+			name_hash_lookup(desc->method_name_hash, name);
+
+		return strcmp(method->name, name) == 0 ? method : NULL;
+	}
+
 	count = desc->n_methods;
 
 	while (count > 1) {
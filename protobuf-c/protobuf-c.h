@@ -235,6 +235,8 @@ PROTOBUF_C__BEGIN_DECLS
 #endif
 
 #define PROTOBUF_C__SERVICE_DESCRIPTOR_MAGIC    0x14159bc3
+/* A service descriptor that ends with `method_name_hash`. */
+#define PROTOBUF_C__SERVICE_DESCRIPTOR_HASHED_MAGIC 0x14159bc4
 #define PROTOBUF_C__MESSAGE_DESCRIPTOR_MAGIC    0x28aaeef9
 #define PROTOBUF_C__ENUM_DESCRIPTOR_MAGIC       0x114315af
 
@@ -266,8 +268,43 @@ typedef enum {
 
 	/** Set if the field is a member of a oneof (union). */
 	PROTOBUF_C_FIELD_FLAG_ONEOF		= (1 << 2),
+
+	/**
+	 * Set if the string field must be valid UTF-8, as enabled with the
+	 * `validate_utf8` file or message option.
+	 */
+	PROTOBUF_C_FIELD_FLAG_VALIDATE_UTF8	= (1 << 3),
 } ProtobufCFieldFlag;
 
+/**
+ * Values for the `flags` word in `ProtobufCMessageLayout`.
+ */
+typedef enum {
+	/** Set if the message has at least one repeated field. */
+	PROTOBUF_C_MESSAGE_LAYOUT_HAS_REPEATED	= (1 << 0),
+
+	/** Set if the message has at least one required field. */
+	PROTOBUF_C_MESSAGE_LAYOUT_HAS_REQUIRED	= (1 << 1),
+
+	/** Set if the message has at least one oneof member. */
+	PROTOBUF_C_MESSAGE_LAYOUT_HAS_ONEOF	= (1 << 2),
+
+	/** Set if no field of the message owns heap memory once unpacked. */
+	PROTOBUF_C_MESSAGE_LAYOUT_ALL_SCALAR	= (1 << 3),
+} ProtobufCMessageLayoutFlag;
+
+/**
+ * Values for the flags set with protobuf_c_unpack_context_set_flags() and
+ * passed to protobuf_c_message_validate().
+ */
+typedef enum {
+	/**
+	 * Validate every string field as UTF-8, not only the fields marked with
+	 * `PROTOBUF_C_FIELD_FLAG_VALIDATE_UTF8`.
+	 */
+	PROTOBUF_C_UNPACK_VALIDATE_UTF8		= (1 << 0),
+} ProtobufCUnpackFlag;
+
 /**
  * Message field rules.
  *
@@ -344,42 +381,90 @@ typedef enum {
 	PROTOBUF_C_WIRE_TYPE_32BIT = 5,
 } ProtobufCWireType;
 
+/**
+ * Results of protobuf_c_encoder_next().
+ */
+typedef enum {
+	/** The encoding is complete. */
+	PROTOBUF_C_ENCODE_DONE,
+	/** The output is full and more of the encoding remains. */
+	PROTOBUF_C_ENCODE_MORE,
+	/** Memory could not be allocated; the encoder can only be freed. */
+	PROTOBUF_C_ENCODE_ERROR,
+} ProtobufCEncodeStatus;
+
 struct ProtobufCAllocator;
+struct ProtobufCAllocatorExt;
 struct ProtobufCBinaryData;
 struct ProtobufCBuffer;
 struct ProtobufCBufferSimple;
+struct ProtobufCDenseIndex;
+struct ProtobufCEncoder;
 struct ProtobufCEnumDescriptor;
 struct ProtobufCEnumValue;
 struct ProtobufCEnumValueIndex;
+struct ProtobufCExecutor;
 struct ProtobufCFieldDescriptor;
+struct ProtobufCFieldGenerator;
+struct ProtobufCFieldHot;
 struct ProtobufCIntRange;
+struct ProtobufCIntern;
 struct ProtobufCMessage;
 struct ProtobufCMessageDescriptor;
+struct ProtobufCMessageLayout;
 struct ProtobufCMessageUnknownField;
 struct ProtobufCMethodDescriptor;
+struct ProtobufCNameHash;
+struct ProtobufCPool;
+struct ProtobufCPoolStats;
 struct ProtobufCService;
 struct ProtobufCServiceDescriptor;
+struct ProtobufCUnpackContext;
+struct ProtobufCView;
+struct ProtobufCViewIter;
+struct ProtobufCVisitor;
+struct ProtobufCWirePath;
+struct ProtobufCWireValue;
 
 typedef struct ProtobufCAllocator ProtobufCAllocator;
+typedef struct ProtobufCAllocatorExt ProtobufCAllocatorExt;
 typedef struct ProtobufCBinaryData ProtobufCBinaryData;
 typedef struct ProtobufCBuffer ProtobufCBuffer;
 typedef struct ProtobufCBufferSimple ProtobufCBufferSimple;
+typedef struct ProtobufCDenseIndex ProtobufCDenseIndex;
+typedef struct ProtobufCEncoder ProtobufCEncoder;
 typedef struct ProtobufCEnumDescriptor ProtobufCEnumDescriptor;
 typedef struct ProtobufCEnumValue ProtobufCEnumValue;
 typedef struct ProtobufCEnumValueIndex ProtobufCEnumValueIndex;
+typedef struct ProtobufCExecutor ProtobufCExecutor;
 typedef struct ProtobufCFieldDescriptor ProtobufCFieldDescriptor;
+typedef struct ProtobufCFieldGenerator ProtobufCFieldGenerator;
+typedef struct ProtobufCFieldHot ProtobufCFieldHot;
 typedef struct ProtobufCIntRange ProtobufCIntRange;
+typedef struct ProtobufCIntern ProtobufCIntern;
 typedef struct ProtobufCMessage ProtobufCMessage;
 typedef struct ProtobufCMessageDescriptor ProtobufCMessageDescriptor;
+typedef struct ProtobufCMessageLayout ProtobufCMessageLayout;
 typedef struct ProtobufCMessageUnknownField ProtobufCMessageUnknownField;
 typedef struct ProtobufCMethodDescriptor ProtobufCMethodDescriptor;
+typedef struct ProtobufCNameHash ProtobufCNameHash;
+typedef struct ProtobufCPool ProtobufCPool;
+typedef struct ProtobufCPoolStats ProtobufCPoolStats;
 typedef struct ProtobufCService ProtobufCService;
 typedef struct ProtobufCServiceDescriptor ProtobufCServiceDescriptor;
+typedef struct ProtobufCUnpackContext ProtobufCUnpackContext;
+typedef struct ProtobufCView ProtobufCView;
+typedef struct ProtobufCViewIter ProtobufCViewIter;
+typedef struct ProtobufCVisitor ProtobufCVisitor;
+typedef struct ProtobufCWirePath ProtobufCWirePath;
+typedef struct ProtobufCWireValue ProtobufCWireValue;
 
 /** Boolean type. */
 typedef int protobuf_c_boolean;
 
 typedef void (*ProtobufCClosure)(const ProtobufCMessage *, void *closure_data);
+typedef void (*ProtobufCRecordFunc)(ProtobufCMessage *message, size_t index,
+				    void *func_data);
 typedef void (*ProtobufCMessageInit)(ProtobufCMessage *);
 typedef void (*ProtobufCServiceDestroy)(ProtobufCService *);
 
@@ -397,6 +482,66 @@ struct ProtobufCAllocator {
 	void		*allocator_data;
 };
 
+/** Version of `ProtobufCAllocatorExt` described by this header. */
+#define PROTOBUF_C_ALLOCATOR_EXT_VERSION	1
+
+/**
+ * Structure for defining a custom memory allocator with sized deallocation,
+ * reallocation and aligned allocation.
+ *
+ * Fill in `version` and the functions, call protobuf_c_allocator_ext_init(),
+ * then pass `&ext.base` wherever a `ProtobufCAllocator` is expected. The
+ * library recognises the extended allocator through `base` and always passes
+ * the size of the block to `free_sized`; code that only knows the
+ * `ProtobufCAllocator` interface keeps working through `base`.
+ *
+ * Sizes passed to `free_sized` and `realloc` are the sizes the blocks were
+ * allocated with, so `bytes` members must keep their `len` until they are
+ * freed. The one exception is strings, which carry no length: they are freed
+ * with a size of `strlen() + 1`, which is smaller than the allocation if the
+ * string was unpacked from data with an embedded `NUL`. Such strings are
+ * still decoded in full, exactly as with any other allocator.
+ */
+struct ProtobufCAllocatorExt {
+	/** Plain interface, set up by protobuf_c_allocator_ext_init(). */
+	ProtobufCAllocator	base;
+
+	/** Must be `PROTOBUF_C_ALLOCATOR_EXT_VERSION`. */
+	unsigned		version;
+
+	/** Function to allocate memory. */
+	void		*(*alloc)(void *allocator_data, size_t size);
+
+	/**
+	 * Function to free memory of unknown size, used only through `base`.
+	 * May be NULL, in which case `free_sized` is called with a size of 0.
+	 */
+	void		(*free)(void *allocator_data, void *pointer);
+
+	/** Function to free a block of `size` bytes. */
+	void		(*free_sized)(void *allocator_data, void *pointer,
+				      size_t size);
+
+	/**
+	 * Function to resize a block, preserving its contents up to the
+	 * smaller of the two sizes. May be NULL, in which case the library
+	 * allocates, copies and frees.
+	 */
+	void		*(*realloc)(void *allocator_data, void *pointer,
+				    size_t old_size, size_t new_size);
+
+	/**
+	 * Function to allocate memory aligned to `alignment`, a power of two.
+	 * Blocks are released with `free_sized`. May be NULL if no caller
+	 * needs more than the alignment of `alloc`.
+	 */
+	void		*(*alloc_aligned)(void *allocator_data,
+					  size_t alignment, size_t size);
+
+	/** Opaque pointer passed to the functions above. */
+	void		*allocator_data;
+};
+
 /**
  * Structure for the protobuf `bytes` scalar type.
  *
@@ -525,10 +670,13 @@ struct ProtobufCEnumDescriptor {
 	/** Value ranges, for faster lookups by numeric value. */
 	const ProtobufCIntRange		*value_ranges;
 
-	/** Reserved for future use. */
-	void				*reserved1;
-	/** Reserved for future use. */
-	void				*reserved2;
+	/** Direct-index table for looking up values by number, or NULL. */
+	const ProtobufCDenseIndex	*value_index;
+	/**
+	 * Perfect hash for looking up values by name, or NULL. Its indices
+	 * refer to `values_by_name`.
+	 */
+	const ProtobufCNameHash		*value_name_hash;
 	/** Reserved for future use. */
 	void				*reserved3;
 	/** Reserved for future use. */
@@ -636,6 +784,86 @@ struct ProtobufCIntRange {
 	 */
 };
 
+/**
+ * Direct-index table for int => index lookups, generated alongside the
+ * `ProtobufCIntRange` array when the keys are dense enough that a table
+ * covering all of them is small.
+ */
+struct ProtobufCDenseIndex {
+	/** Smallest key in the table. */
+	int		base;
+	/** Number of entries in `index`, covering keys `base` onwards. */
+	unsigned	n_entries;
+	/** One plus the index for each key, or 0 if the key is not present. */
+	const uint16_t	*index;
+};
+
+/**
+ * Minimal perfect hash for name => index lookups.
+ *
+ * A name hashed with seed 0 selects one of `n` buckets. A negative
+ * displacement -1-s for that bucket means slot `s`; otherwise the name hashed
+ * with the displacement as seed, modulo `n`, gives the slot. Every name of
+ * the set lands in a distinct slot; other names land anywhere, so the result
+ * has to be confirmed with a single string comparison.
+ */
+struct ProtobufCNameHash {
+	/** Number of names, buckets and slots. */
+	unsigned	n;
+	/** Displacement for each bucket. */
+	const int32_t	*displacements;
+	/** Index of the name in each slot. */
+	const unsigned	*index;
+};
+
+/**
+ * The members of a `ProtobufCFieldDescriptor` that pack, get_packed_size and
+ * free consult for every field, packed into 16 bytes so that a message's
+ * fields can be scanned without touching the full descriptors.
+ */
+struct ProtobufCFieldHot {
+	/** The tag number of this field. */
+	uint32_t	id;
+	/** A `ProtobufCLabel`. */
+	uint8_t		label;
+	/** A `ProtobufCType`. */
+	uint8_t		type;
+	/** A flags word. Zero or more of the bits defined in the
+	 * `ProtobufCFieldFlag` enum may be set. */
+	uint16_t	flags;
+	/** Same as `ProtobufCFieldDescriptor::quantifier_offset`. */
+	uint32_t	quantifier_offset;
+	/** Same as `ProtobufCFieldDescriptor::offset`. */
+	uint32_t	offset;
+};
+
+/**
+ * Compact per-message data generated alongside the field descriptors: the hot
+ * field array and a summary of the message's structure, so that the generic
+ * routines need not rediscover it on every call.
+ */
+struct ProtobufCMessageLayout {
+	/** Hot members of each field descriptor, in the same order. */
+	const ProtobufCFieldHot	*fields;
+	/** Zero or more of the bits in `ProtobufCMessageLayoutFlag`. */
+	uint32_t		flags;
+	/** Largest field number of the message. */
+	uint32_t		max_field_id;
+	/**
+	 * One bit per field index, in the layout of the unpacker's bitmap, set
+	 * for required fields that have no default value; NULL if there are
+	 * none.
+	 */
+	const uint8_t		*required_mask;
+	/** Number of elements in `owning`. */
+	unsigned		n_owning;
+	/**
+	 * Indices of the fields that may own heap memory once unpacked:
+	 * repeated fields and string, bytes and message fields.
+	 */
+	const unsigned		*owning;
+};
+
 /**
  * An instance of a message.
  *
@@ -697,12 +925,12 @@ struct ProtobufCMessageDescriptor {
 	/** Message initialisation function. */
 	ProtobufCMessageInit		message_init;
 
-	/** Reserved for future use. */
-	void				*reserved1;
-	/** Reserved for future use. */
-	void				*reserved2;
-	/** Reserved for future use. */
-	void				*reserved3;
+	/** Direct-index table for looking up fields by id, or NULL. */
+	const ProtobufCDenseIndex	*field_index;
+	/** Perfect hash for looking up fields by name, or NULL. */
+	const ProtobufCNameHash		*field_name_hash;
+	/** Compact field data for the runtime's per-field loops, or NULL. */
+	const ProtobufCMessageLayout	*layout;
 };
 
 /**
@@ -731,6 +959,119 @@ struct ProtobufCMethodDescriptor {
 	const ProtobufCMessageDescriptor	*output;
 };
 
+/**
+ * Produces the elements of a repeated field while a message is packed.
+ *
+ * \see protobuf_c_message_pack_to_buffer_generated()
+ */
+struct ProtobufCFieldGenerator {
+	/** The repeated field, from the descriptor of the packed message. */
+	const ProtobufCFieldDescriptor	*field;
+	/**
+	 * Store the next element at `element`, as it would be stored in the
+	 * field's array: an `int32_t` for an `int32` field, a `char *` for a
+	 * string, a `ProtobufCMessage *` for a message, and so on. Return
+	 * FALSE, storing nothing, once there are no more elements.
+	 */
+	protobuf_c_boolean		(*next)(ProtobufCFieldGenerator *generator,
+						void *element);
+	/** Opaque pointer for use by the generator. */
+	void				*generator_data;
+};
+
+/**
+ * Runs independent tasks, possibly in parallel, on behalf of the library.
+ *
+ * \see protobuf_c_unpack_context_set_executor()
+ */
+struct ProtobufCExecutor {
+	/**
+	 * Call `task(task_data, i)` once for every `i` below `n`, in any order
+	 * and on any threads, and return when all the calls have returned.
+	 */
+	void		(*run)(ProtobufCExecutor *executor, size_t n,
+			       void (*task)(void *task_data, size_t i),
+			       void *task_data);
+	/** Opaque pointer for use by the executor. */
+	void		*executor_data;
+};
+
+/**
+ * Pool allocator statistics.
+ */
+struct ProtobufCPoolStats {
+	/** Allocations served from a free list. */
+	size_t			hits;
+	/** Times a free list was empty and a new chunk of blocks was needed. */
+	size_t			misses;
+	/** Allocations that fit no size class and used the backing allocator. */
+	size_t			bypasses;
+};
+
+/**
+ * A field found in serialised data by protobuf_c_wire_find_field().
+ */
+struct ProtobufCWireValue {
+	/** The last field of the path. */
+	const ProtobufCFieldDescriptor	*field;
+	/** Whether the field is set in the data; if not, `value` is its default. */
+	protobuf_c_boolean		present;
+	/** The value, in the member for the type of `field`. */
+	union {
+		int32_t			v_int32;
+		uint32_t		v_uint32;
+		int64_t			v_int64;
+		uint64_t		v_uint64;
+		float			v_float;
+		double			v_double;
+		protobuf_c_boolean	v_boolean;
+		int			v_enum;
+		/**
+		 * For string, `bytes` and message fields: the serialised
+		 * value, pointing into the data that was searched.
+		 */
+		ProtobufCBinaryData	v_binary;
+	} value;
+};
+
+/**
+ * Position of an iteration over the values of a repeated field in a view.
+ *
+ * \see protobuf_c_view_iter_init()
+ */
+struct ProtobufCViewIter {
+	/** The view. */
+	const ProtobufCView		*view;
+	/** The field. */
+	const ProtobufCFieldDescriptor	*field;
+	/** Offset of the next member or packed element to look at. */
+	size_t				offset;
+	/** End of the packed member being read, if any. */
+	size_t				packed_end;
+	/** Values left. */
+	size_t				remaining;
+};
+
+/**
+ * Callbacks of protobuf_c_message_visit(). Either may be NULL.
+ */
+struct ProtobufCVisitor {
+	/**
+	 * Called with every value of a field in the descriptor, including
+	 * each element of a repeated field. Return FALSE to stop the visit.
+	 */
+	protobuf_c_boolean	(*field)(const ProtobufCWireValue *value,
+					 void *visitor_data);
+	/**
+	 * Called with every member whose tag is not in the descriptor, its
+	 * data pointing into the visited data. Return FALSE to stop the visit.
+	 */
+	protobuf_c_boolean	(*unknown)(const ProtobufCMessageUnknownField *field,
+					   void *visitor_data);
+	/** Opaque pointer passed to the callbacks. */
+	void			*visitor_data;
+};
+
 /**
  * Service.
  */
@@ -768,6 +1109,11 @@ struct ProtobufCServiceDescriptor {
 	const ProtobufCMethodDescriptor	*methods;
 	/** Sort index of methods. */
 	const unsigned			*method_indices_by_name;
+	/**
+	 * Perfect hash for looking up methods by name, or NULL. Only present
+	 * if `magic` is `PROTOBUF_C__SERVICE_DESCRIPTOR_HASHED_MAGIC`.
+	 */
+	const ProtobufCNameHash		*method_name_hash;
 };
 
 /**
@@ -795,13 +1141,13 @@ protobuf_c_version_number(void);
  * The version of the protobuf-c headers, represented as a string using the same
  * format as protobuf_c_version().
  */
-#define PROTOBUF_C_VERSION		"1.5.1"
+#define PROTOBUF_C_VERSION		"1.6.0"
 
 /**
  * The version of the protobuf-c headers, represented as an integer using the
  * same format as protobuf_c_version_number().
  */
-#define PROTOBUF_C_VERSION_NUMBER	1005001
+#define PROTOBUF_C_VERSION_NUMBER	1006000
 
 /**
  * The minimum protoc-gen-c version which works with the current version of the
@@ -893,7 +1239,8 @@ protobuf_c_message_descriptor_get_field(
  * \param message
  *      The message object to serialise.
  * \return
- *      Number of bytes.
+ *      Number of bytes, or SIZE_MAX if the message is nested too deeply for
+ *      the memory needed to walk it to be allocated.
  */
 PROTOBUF_C__API
 size_t
@@ -913,12 +1260,39 @@ protobuf_c_message_get_packed_size(const ProtobufCMessage *message);
  *      protobuf_c_message_get_packed_size() to determine the number of bytes
  *      required.
  * \return
- *      Number of bytes stored in `out`.
+ *      Number of bytes stored in `out`, or 0 if the memory needed to walk
+ *      the message could not be allocated; `out` then holds a partial
+ *      encoding.
  */
 PROTOBUF_C__API
 size_t
 protobuf_c_message_pack(const ProtobufCMessage *message, uint8_t *out);
 
+/**
+ * Serialise a message, packing large repeated message fields in parallel.
+ *
+ * Produces the same bytes as protobuf_c_message_pack(). Every repeated message
+ * field of `message` itself with at least 256 elements is packed with the
+ * executor: the elements are first sized in parallel, then each one is packed
+ * straight into its final position in `out` by its own task. The rest of the
+ * message is packed serially.
+ *
+ * \param message
+ *      The message object to serialise.
+ * \param[out] out
+ *      Buffer to store the bytes of the serialised message, of at least
+ *      protobuf_c_message_get_packed_size() bytes.
+ * \param executor
+ *      The executor to run the tasks. May be NULL to pack serially.
+ * \return
+ *      Number of bytes stored in `out`, or 0 on the same failure as
+ *      protobuf_c_message_pack().
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_message_pack_parallel(const ProtobufCMessage *message,
+				 uint8_t *out, ProtobufCExecutor *executor);
+
 /**
  * Serialise a message from its in-memory representation to a virtual buffer.
  *
@@ -930,7 +1304,9 @@ protobuf_c_message_pack(const ProtobufCMessage *message, uint8_t *out);
  * \param buffer
  *      The virtual buffer object.
  * \return
- *      Number of bytes passed to the virtual buffer.
+ *      Number of bytes passed to the virtual buffer, or 0 if the memory
+ *      needed to walk the message could not be allocated, in which case
+ *      part of the message may already have been appended.
  */
 PROTOBUF_C__API
 size_t
@@ -938,9 +1314,108 @@ protobuf_c_message_pack_to_buffer(
 	const ProtobufCMessage *message,
 	ProtobufCBuffer *buffer);
 
+/**
+ * Serialise a message to a virtual buffer, taking the elements of some
+ * repeated fields from generators instead of the message.
+ *
+ * Behaves like protobuf_c_message_pack_to_buffer(), except that the array of
+ * each field that has a generator is ignored; its elements are requested from
+ * the generator one by one and appended to the buffer as they come, so a
+ * field of any length is packed in constant memory. An element other than a
+ * packed scalar is packed before the next one is requested, so a generator
+ * may reuse the storage of an element, such as one message filled in from
+ * each row of a database cursor. Packed scalars are appended in runs of 256
+ * elements, each a separate packed member, which parsers concatenate.
+ *
+ * \param message
+ *      The message object to serialise.
+ * \param n_generators
+ *      Number of generators.
+ * \param generators
+ *      A generator for each repeated field of `message` to stream.
+ * \param buffer
+ *      The virtual buffer object.
+ * \return
+ *      Number of bytes passed to the virtual buffer, or 0 on the same
+ *      failure as protobuf_c_message_pack_to_buffer().
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_message_pack_to_buffer_generated(
+	const ProtobufCMessage *message,
+	unsigned n_generators,
+	ProtobufCFieldGenerator *generators,
+	ProtobufCBuffer *buffer);
+
+/**
+ * Create an encoder that serialises a message in chunks.
+ *
+ * The encoder produces the same bytes as protobuf_c_message_pack(), as much
+ * as fits in each output buffer passed to protobuf_c_encoder_next(), and
+ * resumes where it stopped on the next call; for instance, to write a message
+ * to a non-blocking socket without serialising all of it first. It holds
+ * only a stack of the messages being packed, the sizes of the sub-messages of
+ * the top-level field being packed, and a few hundred bytes of staged output.
+ * Strings, bytes and unknown fields are copied straight from the message.
+ *
+ * \param message
+ *      The message to serialise. It must not change, nor be freed, until the
+ *      encoder is done with it.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the encoder. May be NULL to specify the
+ *      default allocator.
+ * \return
+ *      A new encoder.
+ * \retval NULL
+ *      If memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCEncoder *
+protobuf_c_encoder_new(
+	const ProtobufCMessage *message,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Write the next chunk of an encoding.
+ *
+ * \param encoder
+ *      The encoder.
+ * \param[out] out
+ *      Buffer to write to.
+ * \param out_cap
+ *      Number of bytes available at `out`.
+ * \param[out] written
+ *      Number of bytes written to `out`, which is `out_cap` unless the
+ *      encoding is complete or has failed.
+ * \return
+ *      `PROTOBUF_C_ENCODE_MORE` if the encoding continues on the next call,
+ *      `PROTOBUF_C_ENCODE_DONE` once the last byte has been written, and
+ *      `PROTOBUF_C_ENCODE_ERROR` if memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCEncodeStatus
+protobuf_c_encoder_next(
+	ProtobufCEncoder *encoder,
+	uint8_t *out,
+	size_t out_cap,
+	size_t *written);
+
+/**
+ * Free an encoder, whether or not its encoding is complete.
+ *
+ * \param encoder
+ *      The encoder to free. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_encoder_free(ProtobufCEncoder *encoder);
+
 /**
  * Unpack a serialised message into an in-memory representation.
  *
+ * Messages nested more than `PROTOBUF_C_DEFAULT_MAX_DEPTH` levels deep are
+ * rejected.
+ *
  * \param descriptor
  *      The message descriptor.
  * \param allocator
@@ -969,6 +1444,12 @@ protobuf_c_message_unpack(
  * This function should be used to deallocate the memory used by a call to
  * protobuf_c_message_unpack().
  *
+ * It must not be given a message from protobuf_c_message_unpack_flat() or
+ * protobuf_c_message_unpack_shared(): such messages cannot be recognised
+ * from their contents, and their members would be freed one by one from the
+ * middle of the block they live in. Use protobuf_c_message_free_flat() and
+ * protobuf_c_message_unref() instead.
+ *
  * \param message
  *      The message object to free. May be NULL.
  * \param allocator
@@ -981,6 +1462,916 @@ protobuf_c_message_free_unpacked(
 	ProtobufCMessage *message,
 	ProtobufCAllocator *allocator);
 
+/**
+ * Set up the `base` interface of an extended allocator.
+ *
+ * \param allocator
+ *      The extended allocator, with `version` and its functions filled in.
+ *      It must stay valid as long as `base` is in use.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_allocator_ext_init(ProtobufCAllocatorExt *allocator);
+
+/**
+ * Allocate memory with an alignment larger than a plain allocator provides.
+ *
+ * Uses `alloc_aligned` of an extended allocator that has one, and otherwise
+ * over-allocates from `alloc`. The block must be freed with
+ * protobuf_c_allocator_free_aligned().
+ *
+ * \param allocator
+ *      `ProtobufCAllocator` to use. May be NULL to specify the default
+ *      allocator.
+ * \param alignment
+ *      Required alignment, a power of two.
+ * \param size
+ *      Number of bytes to allocate.
+ * \return
+ *      The aligned block.
+ * \retval NULL
+ *      If memory could not be allocated.
+ */
+PROTOBUF_C__API
+void *
+protobuf_c_allocator_alloc_aligned(
+	ProtobufCAllocator *allocator,
+	size_t alignment,
+	size_t size);
+
+/**
+ * Free memory obtained from protobuf_c_allocator_alloc_aligned().
+ *
+ * \param allocator
+ *      The allocator the block was obtained from. May be NULL to specify the
+ *      default allocator.
+ * \param pointer
+ *      The block to free. May be NULL.
+ * \param alignment
+ *      The alignment the block was allocated with.
+ * \param size
+ *      The size the block was allocated with.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_allocator_free_aligned(
+	ProtobufCAllocator *allocator,
+	void *pointer,
+	size_t alignment,
+	size_t size);
+
+/**
+ * Create a pool allocator.
+ *
+ * A pool keeps freed blocks on free lists, one per size class, and reuses
+ * them for later allocations of the same class. Size classes are set up by
+ * registering message descriptors with protobuf_c_pool_register(); any
+ * allocation that fits no class is passed to the backing allocator.
+ *
+ * The pool's allocator, returned by protobuf_c_pool_get_allocator(), may be
+ * used from several threads at once. Each thread caches a few free blocks of
+ * each of the last few pools it used, so most allocations take no lock; see
+ * protobuf_c_pool_thread_flush().
+ *
+ * \param backing
+ *      `ProtobufCAllocator` from which the pool and its blocks are allocated.
+ *      May be NULL to specify the default allocator.
+ * \return
+ *      A new pool.
+ * \retval NULL
+ *      If memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCPool *
+protobuf_c_pool_new(ProtobufCAllocator *backing);
+
+/**
+ * Add a size class for a message type to a pool.
+ *
+ * Must be called before the pool's allocator is used.
+ *
+ * \param pool
+ *      The pool.
+ * \param descriptor
+ *      The message descriptor whose `sizeof_message` gets a size class.
+ * \retval TRUE
+ *      If the pool has a size class for the message type.
+ * \retval FALSE
+ *      If the pool already has the maximum number of size classes.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_pool_register(
+	ProtobufCPool *pool,
+	const ProtobufCMessageDescriptor *descriptor);
+
+/**
+ * Get the allocator of a pool.
+ *
+ * \param pool
+ *      The pool.
+ * \return
+ *      A `ProtobufCAllocator` that can be passed to any function taking one.
+ *      It stays valid until the pool is freed.
+ */
+PROTOBUF_C__API
+ProtobufCAllocator *
+protobuf_c_pool_get_allocator(ProtobufCPool *pool);
+
+/**
+ * Get the hit and miss statistics of a pool.
+ *
+ * Hits counted by other threads' caches are published in batches, so they
+ * may lag behind slightly.
+ *
+ * \param pool
+ *      The pool.
+ * \param[out] stats
+ *      Filled in with the pool's statistics.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_pool_get_stats(ProtobufCPool *pool, ProtobufCPoolStats *stats);
+
+/**
+ * Free a pool and all of its blocks.
+ *
+ * Every allocation made with the pool's allocator is invalid afterwards.
+ *
+ * \param pool
+ *      The pool to free. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_pool_free(ProtobufCPool *pool);
+
+/**
+ * Return the free blocks cached by the calling thread to their pools.
+ *
+ * A thread that has used pool allocators should call this before it exits;
+ * otherwise the blocks it cached cannot be reused until their pools are
+ * freed, and its hits since the last batch are missing from the statistics.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_pool_thread_flush(void);
+
+/**
+ * Default limit on the nesting of unpacked messages, counting the top-level
+ * message as the first level. Deeper messages make unpacking fail.
+ *
+ * \see protobuf_c_unpack_context_set_max_depth()
+ */
+#define PROTOBUF_C_DEFAULT_MAX_DEPTH	100
+
+/**
+ * Create a reusable unpack context.
+ *
+ * Unpacking walks nested messages with an explicit stack of heap-allocated
+ * frames rather than recursion, one frame per level of nesting. Each frame
+ * holds the temporary memory used to scan a message before parsing it: slabs
+ * of scanned fields for messages with more than 16 fields on the wire, and a
+ * bitmap of required fields for message types with more than 128 fields.
+ * Normally the frames are allocated and freed by every unpack call. An unpack
+ * context keeps them cached for all calls to
+ * protobuf_c_message_unpack_with_context() that use the same context.
+ *
+ * A context must not be used by more than one thread at a time; keep one per
+ * thread.
+ *
+ * \param allocator
+ *      `ProtobufCAllocator` used for the context and its cached memory. May be
+ *      NULL to specify the default allocator.
+ * \return
+ *      A new unpack context.
+ * \retval NULL
+ *      If memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCUnpackContext *
+protobuf_c_unpack_context_new(ProtobufCAllocator *allocator);
+
+/**
+ * Free an unpack context and all the memory it has cached.
+ *
+ * \param context
+ *      The unpack context to free. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_unpack_context_free(ProtobufCUnpackContext *context);
+
+/**
+ * Set the options applied by every unpack call that uses a context.
+ *
+ * \param context
+ *      The unpack context.
+ * \param flags
+ *      Bitwise OR of `ProtobufCUnpackFlag` values, replacing the flags set
+ *      previously. A new context has no flags set.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_unpack_context_set_flags(ProtobufCUnpackContext *context,
+				    uint32_t flags);
+
+/**
+ * Set the deepest nesting of messages accepted by unpack calls that use a
+ * context.
+ *
+ * \param context
+ *      The unpack context.
+ * \param max_depth
+ *      Number of levels of nested messages, counting the top-level message.
+ *      0 restores the default, `PROTOBUF_C_DEFAULT_MAX_DEPTH`.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_unpack_context_set_max_depth(ProtobufCUnpackContext *context,
+					unsigned max_depth);
+
+/**
+ * Unpack the elements of large repeated message fields in parallel.
+ *
+ * When a message being unpacked with the context has a repeated message field
+ * with at least `min_elements` elements, the elements are handed to the
+ * executor, one task each, once the message has been scanned. Every task
+ * unpacks its element, including everything nested in it, into its own slot
+ * of the field's array, so the result is the same as a serial unpack whatever
+ * order the tasks run in. If any element fails to unpack, the whole unpack
+ * fails.
+ *
+ * The tasks allocate from the allocator passed to
+ * protobuf_c_message_unpack_with_context() and from the context's allocator
+ * concurrently, so both must be thread-safe, as the default allocator is.
+ * Elements nested inside an element that is already being unpacked by a task
+ * are unpacked serially within that task.
+ *
+ * \param context
+ *      The unpack context.
+ * \param executor
+ *      The executor to run the tasks, which must outlive its use by the
+ *      context, or NULL to unpack serially, as a new context does.
+ * \param min_elements
+ *      The fewest elements for which a field is unpacked in parallel. 0
+ *      selects a default of 256.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_unpack_context_set_executor(ProtobufCUnpackContext *context,
+				       ProtobufCExecutor *executor,
+				       size_t min_elements);
+
+/**
+ * Unpack a serialised message, taking temporary memory from an unpack
+ * context.
+ *
+ * Behaves like protobuf_c_message_unpack(), with the options set by
+ * protobuf_c_unpack_context_set_flags(). The result does not refer to the
+ * context and is freed with protobuf_c_message_free_unpacked() as usual.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the unpacked message. May be NULL to
+ *      specify the default allocator.
+ * \param context
+ *      The unpack context. May be NULL, which is the same as calling
+ *      protobuf_c_message_unpack().
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      An unpacked message object.
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack_with_context(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	ProtobufCUnpackContext *context,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Unpack many serialised messages of the same type.
+ *
+ * Behaves like calling protobuf_c_message_unpack() on each buffer in turn,
+ * but the temporary memory used to scan messages is set up once and reused
+ * for the whole batch, and the next buffer is prefetched while the current
+ * one is unpacked. Each message is independent and is freed with
+ * protobuf_c_message_free_unpacked(). To allocate all of them from a shared
+ * arena, pass the allocator of a pool; see protobuf_c_pool_get_allocator().
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the unpacked messages. May be NULL to
+ *      specify the default allocator.
+ * \param n
+ *      Number of messages.
+ * \param lens
+ *      Length in bytes of each serialised message.
+ * \param datas
+ *      Pointer to each serialised message.
+ * \param[out] out
+ *      Array of `n` messages to fill in. A message that fails to unpack is
+ *      set to NULL; the others are unpacked regardless.
+ * \return
+ *      Number of messages unpacked successfully.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_message_unpack_batch(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	size_t n,
+	const size_t *lens,
+	const uint8_t *const *datas,
+	ProtobufCMessage **out);
+
+/**
+ * Unpack a stream of length-delimited messages of the same type.
+ *
+ * `data` holds consecutive records, each a serialised message preceded by its
+ * length as a varint, as written by protobuf's `writeDelimitedTo()`. The
+ * record boundaries are found first, a window of records at a time, reading
+ * only the length prefixes. The records of each window are then unpacked in
+ * batches, one executor task per batch, and handed to `func`.
+ *
+ * Each message passed to `func` belongs to it and is freed with
+ * protobuf_c_message_free_unpacked() and `allocator`. A record that fails to
+ * unpack is passed as NULL, and the stream carries on with the next record.
+ * With an executor, the tasks allocate concurrently, so `allocator` must be
+ * thread-safe; to give each thread its own arena, pass an allocator that
+ * allocates from a pool belonging to the calling thread.
+ *
+ * \param descriptor
+ *      The message descriptor of every record.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the unpacked messages. May be NULL to
+ *      specify the default allocator.
+ * \param executor
+ *      The executor to run the tasks. May be NULL to unpack serially.
+ * \param len
+ *      Length in bytes of the stream.
+ * \param data
+ *      The stream, for instance a memory-mapped file.
+ * \param ordered
+ *      If TRUE, or if `executor` is NULL, `func` is called on the calling
+ *      thread for every record in stream order. Otherwise it is called by the
+ *      tasks as soon as their batch is unpacked, on any thread and in any
+ *      order, and must be thread-safe.
+ * \param func
+ *      Called with every message and its index in the stream.
+ * \param func_data
+ *      Passed to `func`.
+ * \return
+ *      Number of bytes of `data` taken up by whole records. It is less than
+ *      `len` if the stream ends in an incomplete record, which is not passed
+ *      to `func`, and 0 if memory could not be allocated.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_message_unpack_delimited(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	ProtobufCExecutor *executor,
+	size_t len,
+	const uint8_t *data,
+	protobuf_c_boolean ordered,
+	ProtobufCRecordFunc func,
+	void *func_data);
+
+/**
+ * Unpack a serialised message spread over several buffers.
+ *
+ * Behaves like protobuf_c_message_unpack() on the concatenation of the
+ * buffers, without concatenating them: the fields of the message are parsed
+ * where they lie, and only a field that straddles two or more buffers is
+ * copied, into a temporary buffer of its own, before it is parsed.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the unpacked message and the
+ *      temporary memory. May be NULL to specify the default allocator.
+ * \param iov
+ *      The buffers, in order. Any of them may be empty.
+ * \param iovcnt
+ *      Number of buffers.
+ * \return
+ *      An unpacked message object.
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack_iov(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	const ProtobufCBinaryData *iov,
+	size_t iovcnt);
+
+/**
+ * Create a string interning table.
+ *
+ * An interning table lets string and `bytes` values with identical contents
+ * share one allocation across all messages unpacked with
+ * protobuf_c_message_unpack_interned(). Shared values are reference counted
+ * and released by protobuf_c_message_free_unpacked_interned().
+ *
+ * The table is not thread-safe: calls that use the same table must be
+ * serialised by the caller.
+ *
+ * \param allocator
+ *      `ProtobufCAllocator` used for the table and the values it owns. May be
+ *      NULL to specify the default allocator.
+ * \return
+ *      A new interning table.
+ * \retval NULL
+ *      If memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCIntern *
+protobuf_c_intern_new(ProtobufCAllocator *allocator);
+
+/**
+ * Get the number of distinct values currently held by an interning table.
+ *
+ * \param intern
+ *      The interning table.
+ * \return
+ *      Number of distinct string and `bytes` values.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_intern_get_n_values(const ProtobufCIntern *intern);
+
+/**
+ * Free an interning table.
+ *
+ * All messages unpacked with the table must have been freed first; any value
+ * still referenced is released along with the table.
+ *
+ * \param intern
+ *      The interning table to free. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_intern_free(ProtobufCIntern *intern);
+
+/**
+ * Unpack a serialised message, sharing string and `bytes` values through an
+ * interning table.
+ *
+ * Behaves like protobuf_c_message_unpack(), except that the `data` of every
+ * string and `bytes` member is owned by `intern` rather than allocated
+ * separately. Interned values must be treated as read-only, and the result
+ * must be freed with protobuf_c_message_free_unpacked_interned().
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for all other memory allocation. May be
+ *      NULL to specify the default allocator.
+ * \param intern
+ *      The interning table. May be NULL, which is the same as calling
+ *      protobuf_c_message_unpack().
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      An unpacked message object.
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack_interned(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	ProtobufCIntern *intern,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Free a message object unpacked with protobuf_c_message_unpack_interned().
+ *
+ * String and `bytes` values are released back to `intern`, which frees each
+ * of them once no message refers to it any more.
+ *
+ * \param message
+ *      The message object to free. May be NULL.
+ * \param allocator
+ *      `ProtobufCAllocator` that was passed to the unpack call. May be NULL to
+ *      specify the default allocator.
+ * \param intern
+ *      The interning table that was passed to the unpack call.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_free_unpacked_interned(
+	ProtobufCMessage *message,
+	ProtobufCAllocator *allocator,
+	ProtobufCIntern *intern);
+
+/**
+ * Unpack a serialised message into a reference-counted message tree.
+ *
+ * Behaves like protobuf_c_message_unpack(), except that the result and every
+ * sub-message in it carry an atomic reference count, starting at one. Shared
+ * messages are meant to be treated as immutable: they can be handed to other
+ * threads with protobuf_c_message_ref(), and a sub-message can be stored in
+ * several parents at once, each parent holding its own reference.
+ *
+ * The result must be released with protobuf_c_message_unref(), never with
+ * protobuf_c_message_free_unpacked(). Only messages obtained from this
+ * function may be stored into a shared message tree; each message is freed
+ * with the allocator it was unpacked with.
+ *
+ * Reference counts are only atomic when the compiler provides atomic
+ * operations (GCC, Clang, MSVC or C11 `<stdatomic.h>`). Otherwise the counts
+ * are plain integers, and a shared tree must not be referenced or released
+ * from more than one thread at a time.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator. It must remain valid until the last
+ *      reference is dropped, and must be safe to call from whichever thread
+ *      does so.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      An unpacked message object with a reference count of one.
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack_shared(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Take a reference on a message from protobuf_c_message_unpack_shared().
+ *
+ * This may be called on the root of a shared tree or on any sub-message in
+ * it, for example to keep a sub-message alive after its parent is released,
+ * or to store it into another shared parent.
+ *
+ * \param message
+ *      The shared message object.
+ * \return
+ *      `message`.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_ref(ProtobufCMessage *message);
+
+/**
+ * Drop a reference on a message from protobuf_c_message_unpack_shared().
+ *
+ * When the last reference is dropped the message is freed, and the
+ * references it holds on its sub-messages are dropped in turn.
+ *
+ * \param message
+ *      The shared message object. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_unref(ProtobufCMessage *message);
+
+/**
+ * Unpack a serialised message into a single block of memory.
+ *
+ * A sizing pass over `data` first computes the memory needed by the whole
+ * message tree: the message structures, repeated arrays, string and `bytes`
+ * copies and unknown fields. Everything is then laid out contiguously in one
+ * allocation, which gives good locality when the message is walked later.
+ * Only a sub-message that occurs more than once in `data` can cause extra
+ * allocations, for the repeated arrays its occurrences are merged into.
+ *
+ * The result must be freed with protobuf_c_message_free_flat(). Passing it
+ * to protobuf_c_message_free_unpacked() instead corrupts the heap, since that
+ * function cannot tell a flat message from an ordinary one and frees each
+ * member separately. For the same reason, its members must not be replaced
+ * individually.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator. It must remain valid until the message
+ *      is freed.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      An unpacked message object.
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack_flat(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Free a message object unpacked with protobuf_c_message_unpack_flat().
+ *
+ * The whole tree is released with one call to the allocator, plus one for
+ * each overflow chunk. Only flat messages may be passed here; ordinary
+ * messages are freed with protobuf_c_message_free_unpacked().
+ *
+ * \param message
+ *      The message object to free. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_free_flat(ProtobufCMessage *message);
+
+/**
+ * Check that serialised data would unpack successfully, without unpacking it.
+ *
+ * The data is checked exactly as protobuf_c_message_unpack() would: tags,
+ * wire types, length prefixes and varints, required fields, the nesting
+ * limit of `PROTOBUF_C_DEFAULT_MAX_DEPTH` and UTF-8 in the string fields
+ * marked for it. Nothing is allocated; only failing allocations make an
+ * unpack of valid data fail.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \param flags
+ *      Zero or more of the bits in `ProtobufCUnpackFlag`.
+ * \retval TRUE
+ *      The data unpacks successfully.
+ * \retval FALSE
+ *      The data is invalid.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_validate(
+	const ProtobufCMessageDescriptor *descriptor,
+	size_t len,
+	const uint8_t *data,
+	uint32_t flags);
+
+/**
+ * Compile a path to a field for protobuf_c_wire_find_field().
+ *
+ * The path names a field of the message, or a field of a sub-message such as
+ * `"header.tenant_id"`. Every component must be a singular field, and all but
+ * the last one must be messages. A compiled path can be used for any number
+ * of searches, from any number of threads.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param path
+ *      Field names separated by dots.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the compiled path. May be NULL to
+ *      specify the default allocator.
+ * \return
+ *      A new compiled path.
+ * \retval NULL
+ *      If the path does not name a suitable field, or memory could not be
+ *      allocated.
+ */
+PROTOBUF_C__API
+ProtobufCWirePath *
+protobuf_c_wire_path_new(
+	const ProtobufCMessageDescriptor *descriptor,
+	const char *path,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Free a compiled field path.
+ *
+ * \param path
+ *      The path to free. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_wire_path_free(ProtobufCWirePath *path);
+
+/**
+ * Read one field from a serialised message without unpacking it.
+ *
+ * Members off the path are skipped by their length; only the field itself is
+ * decoded. The last occurrence wins, occurrences of the enclosing messages are
+ * searched as if merged, and an absent field reads as its default. String,
+ * `bytes` and message values are not copied: `value->value.v_binary` points
+ * into `data`. A message that occurs more than once is returned as its last
+ * occurrence.
+ *
+ * This is the value protobuf_c_message_unpack() would store, except where an
+ * enclosing message occurs more than once and unpacking merges the
+ * occurrences differently:
+ *  - a required field with a default that the last occurrence omits is
+ *    found in an earlier occurrence, where unpacking keeps the default;
+ *  - an empty `bytes` value in a later occurrence is returned, where
+ *    unpacking keeps the value of the earlier occurrence.
+ *
+ * Only the members on the path are checked, so data that passes may still
+ * fail to unpack; see protobuf_c_message_validate().
+ *
+ * \param path
+ *      A path compiled for the type of the message.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \param[out] value
+ *      The field and its value.
+ * \retval TRUE
+ *      The data was searched; `value->present` tells whether the field is set.
+ * \retval FALSE
+ *      The data is malformed.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_wire_find_field(
+	const ProtobufCWirePath *path,
+	size_t len,
+	const uint8_t *data,
+	ProtobufCWireValue *value);
+
+/**
+ * Create a read-only view of a serialised message.
+ *
+ * A view reads fields straight from the serialised data, which must outlive
+ * it and stay unchanged. Creating a view scans the top level of the message
+ * once, checking it as protobuf_c_message_validate() would, and records
+ * where the members of each field are. Reading a singular field then decodes
+ * one member. Sub-messages are returned in serialised form and are only
+ * checked when a view is made of them.
+ *
+ * Views are usually accessed through the typed functions generated for
+ * messages with the `gen_views` option.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the view. May be NULL to specify the
+ *      default allocator.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      A new view.
+ * \retval NULL
+ *      If the data is malformed or memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCView *
+protobuf_c_view_new(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Free a view. The data it refers to is not touched.
+ *
+ * \param view
+ *      The view to free. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_view_free(ProtobufCView *view);
+
+/**
+ * Read a singular field of a view.
+ *
+ * The value is the one protobuf_c_message_unpack() would store, except that
+ * a message occurring more than once is returned as its last occurrence
+ * rather than merged. String, `bytes` and message values point into the data
+ * of the view.
+ *
+ * \param view
+ *      The view.
+ * \param field_index
+ *      Index of the field in the `fields` of the message descriptor.
+ * \param[out] value
+ *      The field and its value, or its default if it is absent.
+ * \return
+ *      Whether the field is present.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_view_get(
+	const ProtobufCView *view,
+	unsigned field_index,
+	ProtobufCWireValue *value);
+
+/**
+ * Get the number of values of a repeated field in a view.
+ *
+ * \param view
+ *      The view.
+ * \param field_index
+ *      Index of the field in the `fields` of the message descriptor.
+ * \return
+ *      Number of values, counting each element of packed members.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_view_get_count(
+	const ProtobufCView *view,
+	unsigned field_index);
+
+/**
+ * Start iterating over the values of a repeated field in a view.
+ *
+ * \param view
+ *      The view.
+ * \param field_index
+ *      Index of the field in the `fields` of the message descriptor.
+ * \param[out] iter
+ *      The iteration to start.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_view_iter_init(
+	const ProtobufCView *view,
+	unsigned field_index,
+	ProtobufCViewIter *iter);
+
+/**
+ * Read the next value of a repeated field in a view.
+ *
+ * \param iter
+ *      An iteration started by protobuf_c_view_iter_init().
+ * \param[out] value
+ *      The field and the value.
+ * \retval TRUE
+ *      A value was read.
+ * \retval FALSE
+ *      All the values have been read.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_view_iter_next(
+	ProtobufCViewIter *iter,
+	ProtobufCWireValue *value);
+
+/**
+ * Walk serialised data, reporting every field value to a visitor.
+ *
+ * The members are decoded one at a time, in wire order, and nothing is
+ * allocated, so repeated fields of any size are visited in constant memory.
+ * Scalars are decoded; strings, bytes and sub-messages are passed as slices
+ * of `data`, and a sub-message can be visited in turn with the descriptor of
+ * its field. Every occurrence of a field is reported, so for a field that is
+ * not repeated the last value reported is the one protobuf_c_message_unpack()
+ * would keep. Missing required fields are not detected; see
+ * protobuf_c_message_validate().
+ *
+ * The data is checked as it is visited, so the callbacks may have been called
+ * for the members before a malformed one.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      The serialised message.
+ * \param visitor
+ *      The callbacks.
+ * \retval TRUE
+ *      The data was well-formed up to where the visit ended, at the end of
+ *      the data or when a callback returned FALSE.
+ * \retval FALSE
+ *      The data is malformed.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_visit(
+	const ProtobufCMessageDescriptor *descriptor,
+	size_t len,
+	const uint8_t *data,
+	const ProtobufCVisitor *visitor);
+
 /**
  * Check the validity of a message object.
  *
@@ -150,9 +150,9 @@ void BytesFieldGenerator::GenerateStaticInit(google::protobuf::io::Printer* prin
       break;
   }
 }
-void BytesFieldGenerator::GenerateDescriptorInitializer(google::protobuf::io::Printer* printer) const
+std::map<std::string, std::string> BytesFieldGenerator::DescriptorInitializerVariables() const
 {
-  GenerateDescriptorInitializerGeneric(printer, true, "BYTES", "NULL");
+  return DescriptorInitializerVariablesGeneric(true, "BYTES", "NULL");
 }
 
 }  // namespace protobuf_c
@@ -62,6 +62,7 @@
 // Modified to implement C code by Dave Benson.
 
 #include <map>
+#include <vector>
 
 #include <google/protobuf/io/printer.h>
 
@@ -274,6 +275,17 @@ void EnumGenerator::GenerateEnumDescriptor(google::protobuf::io::Printer* printe
   }
   vars["n_ranges"] = SimpleItoa(n_ranges);
 
+  std::vector<int> unique_values;
+  for (int j = 0; j < descriptor_->value_count(); j++) {
+    if (j == 0 || value_index[j-1].value != value_index[j].value)
+      unique_values.push_back(value_index[j].value);
+  }
+  if (WriteDenseIndex(printer, unique_values.size(), unique_values.data(),
+		      vars["lcclassname"] + "__value_index"))
+    vars["value_index"] = "&" + vars["lcclassname"] + "__value_index";
+  else
+    vars["value_index"] = "NULL";
+
   if (!optimize_code_size) {
     qsort(value_index, descriptor_->value_count(),
         sizeof(ValueIndex), compare_value_indices_by_name);
@@ -286,6 +298,18 @@ void EnumGenerator::GenerateEnumDescriptor(google::protobuf::io::Printer* printe
       printer->Print (vars, "  { \"$name$\", $index$ },\n");
     }
     printer->Print(vars, "};\n");
+
+    std::vector<std::string> names;
+    std::vector<unsigned> indices;
+    for (int j = 0; j < descriptor_->value_count(); j++) {
+      names.push_back(value_index[j].name);
+      indices.push_back(j);
+    }
+    if (WriteNameHash(printer, names, indices,
+		      vars["lcclassname"] + "__value_name_hash"))
+      vars["value_name_hash"] = "&" + vars["lcclassname"] + "__value_name_hash";
+    else
+      vars["value_name_hash"] = "NULL";
   }
 
   if (optimize_code_size) {
@@ -299,7 +323,9 @@ void EnumGenerator::GenerateEnumDescriptor(google::protobuf::io::Printer* printe
         "  0, NULL, /* CODE_SIZE */\n"
         "  $n_ranges$,\n"
         "  $lcclassname$__value_ranges,\n"
-        "  NULL,NULL,NULL,NULL   /* reserved[1234] */\n"
+        "  $value_index$,\n"
+        "  NULL, /* CODE_SIZE */\n"
+        "  NULL,NULL   /* reserved[34] */\n"
         "};\n");
   } else {
     printer->Print(vars,
@@ -316,7 +342,9 @@ void EnumGenerator::GenerateEnumDescriptor(google::protobuf::io::Printer* printe
         "  $lcclassname$__enum_values_by_name,\n"
         "  $n_ranges$,\n"
         "  $lcclassname$__value_ranges,\n"
-        "  NULL,NULL,NULL,NULL   /* reserved[1234] */\n"
+        "  $value_index$,\n"
+        "  $value_name_hash$,\n"
+        "  NULL,NULL   /* reserved[34] */\n"
         "};\n");
   }
 
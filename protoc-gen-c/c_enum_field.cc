@@ -133,10 +133,10 @@ void EnumFieldGenerator::GenerateStaticInit(google::protobuf::io::Printer* print
   }
 }
 
-void EnumFieldGenerator::GenerateDescriptorInitializer(google::protobuf::io::Printer* printer) const
+std::map<std::string, std::string> EnumFieldGenerator::DescriptorInitializerVariables() const
 {
   std::string addr = "&" + FullNameToLower(descriptor_->enum_type()->full_name(), descriptor_->enum_type()->file()) + "__descriptor";
-  GenerateDescriptorInitializerGeneric(printer, true, "ENUM", addr);
+  return DescriptorInitializerVariablesGeneric(true, "ENUM", addr);
 }
 
 }  // namespace protobuf_c
@@ -103,10 +103,10 @@ static bool is_packable_type(google::protobuf::FieldDescriptor::Type type)
     //TYPE_MESSAGE
 }
 
-void FieldGenerator::GenerateDescriptorInitializerGeneric(google::protobuf::io::Printer* printer,
-							  bool optional_uses_has,
-							  const std::string &type_macro,
-							  const std::string &descriptor_addr) const
+std::map<std::string, std::string>
+FieldGenerator::DescriptorInitializerVariablesGeneric(bool optional_uses_has,
+						      const std::string &type_macro,
+						      const std::string &descriptor_addr) const
 {
   std::map<std::string, std::string> variables;
   const google::protobuf::OneofDescriptor *oneof = descriptor_->containing_oneof();
@@ -161,40 +161,58 @@ void FieldGenerator::GenerateDescriptorInitializerGeneric(google::protobuf::io::
   if (oneof != NULL)
     variables["flags"] += " | PROTOBUF_C_FIELD_FLAG_ONEOF";
 
+  if (type_macro == "STRING") {
+    const google::protobuf::Descriptor *message = descriptor_->containing_type();
+    const ProtobufCMessageOptions msg_opt = message->options().GetExtension(pb_c_msg);
+    if (msg_opt.has_validate_utf8() ? msg_opt.validate_utf8() : opt.validate_utf8())
+      variables["flags"] += " | PROTOBUF_C_FIELD_FLAG_VALIDATE_UTF8";
+  }
+
   // Eliminate codesmell "or with 0"
   if (variables["flags"].find("0 | ") == 0) {
    variables["flags"].erase(0, 4);
   }
 
-  printer->Print("{\n");
-  if (descriptor_->file()->options().has_optimize_for() &&
-        descriptor_->file()->options().optimize_for() ==
-        google::protobuf::FileOptions_OptimizeMode_CODE_SIZE) {
-     printer->Print("  NULL, /* CODE_SIZE */\n");
-  } else {
-     printer->Print(variables, "  \"$proto_name$\",\n");
-  }
-  printer->Print(variables,
-    "  $value$,\n"
-    "  PROTOBUF_C_LABEL_$LABEL$,\n"
-    "  PROTOBUF_C_TYPE_$TYPE$,\n");
   switch (descriptor_->label()) {
     case google::protobuf::FieldDescriptor::LABEL_REQUIRED:
-      printer->Print(variables, "  0,   /* quantifier_offset */\n");
+      variables["quantifier_offset"] = "0";
       break;
     case google::protobuf::FieldDescriptor::LABEL_OPTIONAL:
       if (oneof != NULL) {
-        printer->Print(variables, "  offsetof($classname$, $oneofname$_case),\n");
+        variables["quantifier_offset"] = "offsetof(" + variables["classname"] + ", " + variables["oneofname"] + "_case)";
       } else if (optional_uses_has) {
-	printer->Print(variables, "  offsetof($classname$, has_$name$),\n");
+        variables["quantifier_offset"] = "offsetof(" + variables["classname"] + ", has_" + variables["name"] + ")";
       } else {
-	printer->Print(variables, "  0,   /* quantifier_offset */\n");
+        variables["quantifier_offset"] = "0";
       }
       break;
     case google::protobuf::FieldDescriptor::LABEL_REPEATED:
-      printer->Print(variables, "  offsetof($classname$, n_$name$),\n");
+      variables["quantifier_offset"] = "offsetof(" + variables["classname"] + ", n_" + variables["name"] + ")";
       break;
   }
+  return variables;
+}
+
+void FieldGenerator::GenerateDescriptorInitializer(google::protobuf::io::Printer* printer) const
+{
+  std::map<std::string, std::string> variables = DescriptorInitializerVariables();
+
+  printer->Print("{\n");
+  if (descriptor_->file()->options().has_optimize_for() &&
+        descriptor_->file()->options().optimize_for() ==
+        google::protobuf::FileOptions_OptimizeMode_CODE_SIZE) {
+     printer->Print("  NULL, /* CODE_SIZE */\n");
+  } else {
+     printer->Print(variables, "  \"$proto_name$\",\n");
+  }
+  printer->Print(variables,
+    "  $value$,\n"
+    "  PROTOBUF_C_LABEL_$LABEL$,\n"
+    "  PROTOBUF_C_TYPE_$TYPE$,\n");
+  if (variables["quantifier_offset"] == "0")
+    printer->Print(variables, "  0,   /* quantifier_offset */\n");
+  else
+    printer->Print(variables, "  $quantifier_offset$,\n");
   printer->Print(variables, "  offsetof($classname$, $name$),\n");
   printer->Print(variables, "  $descriptor_addr$,\n");
   printer->Print(variables, "  $default_value$,\n");
@@ -203,6 +221,15 @@ void FieldGenerator::GenerateDescriptorInitializerGeneric(google::protobuf::io::
   printer->Print("},\n");
 }
 
+void FieldGenerator::GenerateHotInitializer(google::protobuf::io::Printer* printer) const
+{
+  std::map<std::string, std::string> variables = DescriptorInitializerVariables();
+
+  printer->Print(variables,
+    "  { $value$, PROTOBUF_C_LABEL_$LABEL$, PROTOBUF_C_TYPE_$TYPE$, $flags$, "
+    "$quantifier_offset$, offsetof($classname$, $name$) },\n");
+}
+
 FieldGeneratorMap::FieldGeneratorMap(const google::protobuf::Descriptor* descriptor)
   : descriptor_(descriptor),
     field_generators_(
@@ -64,7 +64,9 @@
 #ifndef PROTOBUF_C_PROTOC_GEN_C_C_FIELD_H__
 #define PROTOBUF_C_PROTOC_GEN_C_C_FIELD_H__
 
+#include <map>
 #include <memory>
+#include <string>
 
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/io/printer.h>
@@ -81,7 +83,10 @@ class FieldGenerator {
   virtual void GenerateStructMembers(google::protobuf::io::Printer* printer) const = 0;
 
   // Generate a static initializer for this field.
-  virtual void GenerateDescriptorInitializer(google::protobuf::io::Printer* printer) const = 0;
+  void GenerateDescriptorInitializer(google::protobuf::io::Printer* printer) const;
+
+  // Generate a static initializer for this field's ProtobufCFieldHot.
+  void GenerateHotInitializer(google::protobuf::io::Printer* printer) const;
 
   virtual void GenerateDefaultValueDeclarations(google::protobuf::io::Printer* printer) const { }
   virtual void GenerateDefaultValueImplementations(google::protobuf::io::Printer* printer) const { }
@@ -92,10 +97,13 @@ class FieldGenerator {
 
 
  protected:
-  void GenerateDescriptorInitializerGeneric(google::protobuf::io::Printer* printer,
-                                            bool optional_uses_has,
-                                            const std::string &type_macro,
-                                            const std::string &descriptor_addr) const;
+  // Variables for the full and the hot descriptor initializers of this field.
+  virtual std::map<std::string, std::string> DescriptorInitializerVariables() const = 0;
+
+  std::map<std::string, std::string>
+  DescriptorInitializerVariablesGeneric(bool optional_uses_has,
+                                        const std::string &type_macro,
+                                        const std::string &descriptor_addr) const;
   const google::protobuf::FieldDescriptor *descriptor_;
 };
 
@@ -116,7 +116,7 @@ FileGenerator::~FileGenerator() {}
 void FileGenerator::GenerateHeader(google::protobuf::io::Printer* printer) {
   std::string filename_identifier = FilenameIdentifier(file_->name());
 
-  const int min_header_version = 1003000;
+  const int min_header_version = 1006000;
 
   // Generate top of header.
   printer->Print(
@@ -191,6 +191,9 @@ void FileGenerator::GenerateHeader(google::protobuf::io::Printer* printer) {
 						opt.gen_pack_helpers(),
 						opt.gen_init_helpers());
   }
+  for (int i = 0; i < file_->message_type_count(); i++) {
+    message_generators_[i]->GenerateViewDeclarations(printer);
+  }
 
   printer->Print("/* --- per-message closures --- */\n\n");
   for (int i = 0; i < file_->message_type_count(); i++) {
@@ -249,6 +252,9 @@ void FileGenerator::GenerateSource(google::protobuf::io::Printer* printer) {
 						opt.gen_pack_helpers(),
 						opt.gen_init_helpers());
   }
+  for (int i = 0; i < file_->message_type_count(); i++) {
+    message_generators_[i]->GenerateViewDefinitions(printer);
+  }
   for (int i = 0; i < file_->message_type_count(); i++) {
     message_generators_[i]->GenerateMessageDescriptor(printer,
 						      opt.gen_init_helpers());
@@ -61,6 +61,7 @@
 
 // Modified to implement C code by Dave Benson.
 
+#include <algorithm>
 #include <cstdint>
 #include <memory>
 #include <set>
@@ -390,6 +391,146 @@ WriteIntRanges(google::protobuf::io::Printer* printer, int n_values, const int *
     return 0;
   }
 }
+
+// A direct-index table is emitted when it replaces a binary search over more
+// than one range and has at most two entries per value.
+#define DENSE_INDEX_MAX_ENTRIES 4096
+
+bool
+WriteDenseIndex(google::protobuf::io::Printer* printer, int n_values, const int *values, const std::string &name)
+{
+  if (n_values < 2 || n_values >= 0xffff)
+    return false;
+  int64_t span = (int64_t) values[n_values-1] - values[0] + 1;
+  // Fully contiguous numbers (e.g. 1..64) get no table on purpose: they form
+  // a single range, which int_range_lookup() in protobuf-c.c already resolves
+  // with one subtraction. A missing table does not imply the numbers have gaps.
+  if (span == n_values)
+    return false;
+  if (span > 2 * (int64_t) n_values || span > DENSE_INDEX_MAX_ENTRIES)
+    return false;
+
+  std::map<std::string, std::string> vars;
+  vars["name"] = name;
+  vars["base"] = SimpleItoa(values[0]);
+  vars["n_entries"] = SimpleItoa((int) span);
+  printer->Print(vars, "static const uint16_t $name$_entries[$n_entries$] =\n"
+                       "{\n");
+  int i = 0;
+  for (int64_t v = values[0]; v <= values[n_values-1]; v++) {
+    if (values[i] == v) {
+      vars["entry"] = SimpleItoa(i + 1);
+      i++;
+    } else {
+      vars["entry"] = "0";
+    }
+    printer->Print(vars, "  $entry$,\n");
+  }
+  printer->Print(vars, "};\n"
+                       "static const ProtobufCDenseIndex $name$ =\n"
+                       "{\n"
+                       "  $base$, $n_entries$, $name$_entries\n"
+                       "};\n");
+  return true;
+}
+
+// Must match name_hash() in protobuf-c.c.
+static uint32_t
+NameHash(const std::string &name, uint32_t seed)
+{
+  uint32_t h = 2166136261U ^ seed;
+  for (unsigned char c : name) {
+    h ^= c;
+    h *= 16777619U;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  return h;
+}
+
+// Below this many names a binary search is as fast as hashing.
+#define NAME_HASH_MIN_NAMES 8
+#define NAME_HASH_MAX_SEED 0x100000
+
+bool
+WriteNameHash(google::protobuf::io::Printer* printer, const std::vector<std::string> &names, const std::vector<unsigned> &indices, const std::string &name)
+{
+  unsigned n = names.size();
+  if (n < NAME_HASH_MIN_NAMES)
+    return false;
+
+  // hash and displace: place the largest buckets first, searching for a
+  // seed that sends all their names to free slots
+  std::vector<std::vector<unsigned> > buckets(n);
+  for (unsigned i = 0; i < n; i++)
+    buckets[NameHash(names[i], 0) % n].push_back(i);
+  std::vector<unsigned> order(n);
+  for (unsigned b = 0; b < n; b++)
+    order[b] = b;
+  std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  std::vector<int32_t> displacements(n, 0);
+  std::vector<int> slots(n, -1);
+  unsigned next_free = 0;
+  for (unsigned b : order) {
+    const std::vector<unsigned> &bucket = buckets[b];
+    if (bucket.empty())
+      break;
+    if (bucket.size() == 1) {
+      while (slots[next_free] >= 0)
+        next_free++;
+      slots[next_free] = bucket[0];
+      displacements[b] = -1 - (int32_t) next_free;
+      continue;
+    }
+    uint32_t seed;
+    std::vector<unsigned> placed;
+    for (seed = 1; seed < NAME_HASH_MAX_SEED; seed++) {
+      placed.clear();
+      for (unsigned i : bucket) {
+        unsigned slot = NameHash(names[i], seed) % n;
+        if (slots[slot] >= 0 ||
+            std::find(placed.begin(), placed.end(), slot) != placed.end())
+          break;
+        placed.push_back(slot);
+      }
+      if (placed.size() == bucket.size())
+        break;
+    }
+    if (seed == NAME_HASH_MAX_SEED)
+      return false;
+    for (unsigned k = 0; k < bucket.size(); k++)
+      slots[placed[k]] = bucket[k];
+    displacements[b] = seed;
+  }
+
+  std::map<std::string, std::string> vars;
+  vars["name"] = name;
+  vars["n"] = SimpleItoa(n);
+  printer->Print(vars, "static const int32_t $name$_displacements[$n$] =\n"
+                       "{\n");
+  for (unsigned b = 0; b < n; b++) {
+    vars["d"] = SimpleItoa(displacements[b]);
+    printer->Print(vars, "  $d$,\n");
+  }
+  printer->Print(vars, "};\n"
+                       "static const unsigned $name$_index[$n$] =\n"
+                       "{\n");
+  for (unsigned s = 0; s < n; s++) {
+    vars["index"] = SimpleItoa(indices[slots[s]]);
+    vars["entry"] = names[slots[s]];
+    printer->Print(vars, "  $index$,   /* $entry$ */\n");
+  }
+  printer->Print(vars, "};\n"
+                       "static const ProtobufCNameHash $name$ =\n"
+                       "{\n"
+                       "  $n$, $name$_displacements, $name$_index\n"
+                       "};\n");
+  return true;
+}
     
 
 
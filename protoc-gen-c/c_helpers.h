@@ -161,6 +161,16 @@ std::string GetLabelName(google::protobuf::FieldDescriptor::Label label);
 // returns the number of ranges there are to bsearch.
 unsigned WriteIntRanges(google::protobuf::io::Printer* printer, int n_values, const int *values, const std::string &name);
 
+// write a ProtobufCDenseIndex for a bunch of sorted, distinct values if they
+// are dense enough for a direct-index table to pay off.
+// returns false, writing nothing, otherwise.
+bool WriteDenseIndex(google::protobuf::io::Printer* printer, int n_values, const int *values, const std::string &name);
+
+// write a ProtobufCNameHash, a minimal perfect hash mapping names[i] to
+// indices[i], if there are enough names for it to beat a binary search.
+// returns false, writing nothing, otherwise.
+bool WriteNameHash(google::protobuf::io::Printer* printer, const std::vector<std::string> &names, const std::vector<unsigned> &indices, const std::string &name);
+
 struct NameIndex
 {
   unsigned index;
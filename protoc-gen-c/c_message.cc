@@ -115,6 +115,10 @@ void MessageGenerator::
 GenerateStructTypedef(google::protobuf::io::Printer* printer) {
   printer->Print("typedef struct $classname$ $classname$;\n",
                  "classname", FullNameToC(descriptor_->full_name(), descriptor_->file()));
+  if (HasViews()) {
+    printer->Print("typedef struct $classname$View $classname$View;\n",
+                   "classname", FullNameToC(descriptor_->full_name(), descriptor_->file()));
+  }
 
   for (int i = 0; i < descriptor_->nested_type_count(); i++) {
     nested_generators_[i]->GenerateStructTypedef(printer);
@@ -367,6 +371,95 @@ void MessageGenerator::GenerateClosureTypedef(google::protobuf::io::Printer* pri
 		 "                  void *closure_data);\n");
 }
 
+bool MessageGenerator::HasViews()
+{
+  const ProtobufCMessageOptions opt =
+	  descriptor_->options().GetExtension(pb_c_msg);
+
+  if (opt.has_gen_views())
+    return opt.gen_views();
+  return descriptor_->file()->options().GetExtension(pb_c_file).gen_views();
+}
+
+// The C type a view accessor returns for a field, and the member of
+// ProtobufCWireValue holding it.
+static void
+GetViewValueType(const google::protobuf::FieldDescriptor *field,
+		 std::string *c_type, std::string *member)
+{
+  switch (field->type()) {
+    case google::protobuf::FieldDescriptor::TYPE_SINT32  :
+    case google::protobuf::FieldDescriptor::TYPE_SFIXED32:
+    case google::protobuf::FieldDescriptor::TYPE_INT32   : *c_type = "int32_t"; *member = "v_int32"; break;
+    case google::protobuf::FieldDescriptor::TYPE_SINT64  :
+    case google::protobuf::FieldDescriptor::TYPE_SFIXED64:
+    case google::protobuf::FieldDescriptor::TYPE_INT64   : *c_type = "int64_t"; *member = "v_int64"; break;
+    case google::protobuf::FieldDescriptor::TYPE_UINT32  :
+    case google::protobuf::FieldDescriptor::TYPE_FIXED32 : *c_type = "uint32_t"; *member = "v_uint32"; break;
+    case google::protobuf::FieldDescriptor::TYPE_UINT64  :
+    case google::protobuf::FieldDescriptor::TYPE_FIXED64 : *c_type = "uint64_t"; *member = "v_uint64"; break;
+    case google::protobuf::FieldDescriptor::TYPE_FLOAT   : *c_type = "float"; *member = "v_float"; break;
+    case google::protobuf::FieldDescriptor::TYPE_DOUBLE  : *c_type = "double"; *member = "v_double"; break;
+    case google::protobuf::FieldDescriptor::TYPE_BOOL    : *c_type = "protobuf_c_boolean"; *member = "v_boolean"; break;
+    case google::protobuf::FieldDescriptor::TYPE_ENUM    :
+      *c_type = FullNameToC(field->enum_type()->full_name(), field->enum_type()->file());
+      *member = "v_enum";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_STRING  :
+    case google::protobuf::FieldDescriptor::TYPE_BYTES   :
+    case google::protobuf::FieldDescriptor::TYPE_GROUP   :
+    case google::protobuf::FieldDescriptor::TYPE_MESSAGE : *c_type = "ProtobufCBinaryData"; *member = "v_binary"; break;
+  }
+}
+
+void MessageGenerator::
+GenerateViewDeclarations(google::protobuf::io::Printer* printer)
+{
+  for (int i = 0; i < descriptor_->nested_type_count(); i++) {
+    nested_generators_[i]->GenerateViewDeclarations(printer);
+  }
+  if (!HasViews())
+    return;
+
+  std::map<std::string, std::string> vars;
+  vars["classname"] = FullNameToC(descriptor_->full_name(), descriptor_->file());
+  vars["lcclassname"] = FullNameToLower(descriptor_->full_name(), descriptor_->file());
+  printer->Print(vars,
+		 "/* $classname$ views */\n"
+		 "$classname$View *\n"
+		 "       $lcclassname$_view__new\n"
+		 "                     (ProtobufCAllocator  *allocator,\n"
+		 "                      size_t               len,\n"
+		 "                      const uint8_t       *data);\n"
+		 "void   $lcclassname$_view__free\n"
+		 "                     ($classname$View *view);\n"
+		);
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    const google::protobuf::FieldDescriptor *field = descriptor_->field(i);
+
+    vars["name"] = FieldName(field);
+    GetViewValueType(field, &vars["c_type"], &vars["member"]);
+    if (field->label() == google::protobuf::FieldDescriptor::LABEL_REPEATED) {
+      printer->Print(vars,
+		     "size_t $lcclassname$_view__n_$name$\n"
+		     "                     (const $classname$View *view);\n"
+		     "void   $lcclassname$_view__iter_$name$\n"
+		     "                     (const $classname$View *view,\n"
+		     "                      ProtobufCViewIter *iter);\n"
+		     "protobuf_c_boolean $lcclassname$_view__next_$name$\n"
+		     "                     (ProtobufCViewIter *iter,\n"
+		     "                      $c_type$ *value);\n"
+		    );
+    } else {
+      printer->Print(vars,
+		     "protobuf_c_boolean $lcclassname$_view__get_$name$\n"
+		     "                     (const $classname$View *view,\n"
+		     "                      $c_type$ *value);\n"
+		    );
+    }
+  }
+}
+
 static int
 compare_pfields_by_number (const void *a, const void *b)
 {
@@ -458,6 +551,95 @@ GenerateHelperFunctionDefinitions(google::protobuf::io::Printer* printer,
   }
 }
 
+void MessageGenerator::
+GenerateViewDefinitions(google::protobuf::io::Printer* printer)
+{
+  for (int i = 0; i < descriptor_->nested_type_count(); i++) {
+    nested_generators_[i]->GenerateViewDefinitions(printer);
+  }
+  if (!HasViews())
+    return;
+
+  std::map<std::string, std::string> vars;
+  vars["classname"] = FullNameToC(descriptor_->full_name(), descriptor_->file());
+  vars["lcclassname"] = FullNameToLower(descriptor_->full_name(), descriptor_->file());
+  printer->Print(vars,
+		 "$classname$View *\n"
+		 "       $lcclassname$_view__new\n"
+		 "                     (ProtobufCAllocator  *allocator,\n"
+		 "                      size_t               len,\n"
+		 "                      const uint8_t       *data)\n"
+		 "{\n"
+		 "  return ($classname$View *)\n"
+		 "     protobuf_c_view_new (&$lcclassname$__descriptor,\n"
+		 "                          allocator, len, data);\n"
+		 "}\n"
+		 "void   $lcclassname$_view__free\n"
+		 "                     ($classname$View *view)\n"
+		 "{\n"
+		 "  protobuf_c_view_free ((ProtobufCView *) view);\n"
+		 "}\n"
+		);
+
+  // accessors use the index of the field in the descriptor's sorted fields
+  std::vector<const google::protobuf::FieldDescriptor *> sorted_fields;
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    sorted_fields.push_back(descriptor_->field(i));
+  }
+  std::sort(sorted_fields.begin(), sorted_fields.end(),
+	    [](const google::protobuf::FieldDescriptor *a,
+	       const google::protobuf::FieldDescriptor *b) {
+	      return a->number() < b->number();
+	    });
+  for (unsigned i = 0; i < sorted_fields.size(); i++) {
+    const google::protobuf::FieldDescriptor *field = sorted_fields[i];
+
+    vars["name"] = FieldName(field);
+    vars["index"] = SimpleItoa(i);
+    GetViewValueType(field, &vars["c_type"], &vars["member"]);
+    vars["cast"] = field->type() == google::protobuf::FieldDescriptor::TYPE_ENUM ?
+      "(" + vars["c_type"] + ") " : "";
+    if (field->label() == google::protobuf::FieldDescriptor::LABEL_REPEATED) {
+      printer->Print(vars,
+		     "size_t $lcclassname$_view__n_$name$\n"
+		     "                     (const $classname$View *view)\n"
+		     "{\n"
+		     "  return protobuf_c_view_get_count ((const ProtobufCView *) view, $index$);\n"
+		     "}\n"
+		     "void   $lcclassname$_view__iter_$name$\n"
+		     "                     (const $classname$View *view,\n"
+		     "                      ProtobufCViewIter *iter)\n"
+		     "{\n"
+		     "  protobuf_c_view_iter_init ((const ProtobufCView *) view, $index$, iter);\n"
+		     "}\n"
+		     "protobuf_c_boolean $lcclassname$_view__next_$name$\n"
+		     "                     (ProtobufCViewIter *iter,\n"
+		     "                      $c_type$ *value)\n"
+		     "{\n"
+		     "  ProtobufCWireValue v;\n"
+		     "  if (!protobuf_c_view_iter_next (iter, &v))\n"
+		     "    return 0;\n"
+		     "  *value = $cast$v.value.$member$;\n"
+		     "  return 1;\n"
+		     "}\n"
+		    );
+    } else {
+      printer->Print(vars,
+		     "protobuf_c_boolean $lcclassname$_view__get_$name$\n"
+		     "                     (const $classname$View *view,\n"
+		     "                      $c_type$ *value)\n"
+		     "{\n"
+		     "  ProtobufCWireValue v;\n"
+		     "  protobuf_c_boolean present =\n"
+		     "     protobuf_c_view_get ((const ProtobufCView *) view, $index$, &v);\n"
+		     "  *value = $cast$v.value.$member$;\n"
+		     "  return present;\n"
+		     "}\n"
+		    );
+    }
+  }
+}
+
 void MessageGenerator::
 GenerateMessageDescriptor(google::protobuf::io::Printer* printer, bool gen_init) {
     std::map<std::string, std::string> vars;
@@ -579,6 +761,84 @@ GenerateMessageDescriptor(google::protobuf::io::Printer* printer, bool gen_init)
   }
   printer->Outdent();
   printer->Print(vars, "};\n");
+  printer->Print(vars,
+	"static const ProtobufCFieldHot $lcclassname$__hot_fields[$n_fields$] =\n"
+	"{\n");
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    field_generators_.get(sorted_fields[i]).GenerateHotInitializer(printer);
+  }
+  printer->Print("};\n");
+
+  // summarize the message's structure for the runtime
+  std::vector<int> owning;
+  std::vector<unsigned> required_mask((descriptor_->field_count() + 7) / 8);
+  std::string layout_flags;
+  bool has_repeated = false, has_required = false, has_oneof = false;
+  bool any_required_bits = false;
+  int max_field_id = 0;
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    const google::protobuf::FieldDescriptor* field = sorted_fields[i];
+    if (field->is_repeated() ||
+        field->type() == google::protobuf::FieldDescriptor::TYPE_STRING ||
+        field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES ||
+        field->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE)
+      owning.push_back(i);
+    if (field->is_repeated())
+      has_repeated = true;
+    if (field->is_required()) {
+      has_required = true;
+      if (!field->has_default_value()) {
+        required_mask[i / 8] |= 1u << (i % 8);
+        any_required_bits = true;
+      }
+    }
+    if (field->containing_oneof() != NULL)
+      has_oneof = true;
+    max_field_id = std::max(max_field_id, field->number());
+  }
+  if (has_repeated)
+    layout_flags += " | PROTOBUF_C_MESSAGE_LAYOUT_HAS_REPEATED";
+  if (has_required)
+    layout_flags += " | PROTOBUF_C_MESSAGE_LAYOUT_HAS_REQUIRED";
+  if (has_oneof)
+    layout_flags += " | PROTOBUF_C_MESSAGE_LAYOUT_HAS_ONEOF";
+  if (owning.empty())
+    layout_flags += " | PROTOBUF_C_MESSAGE_LAYOUT_ALL_SCALAR";
+  vars["layout_flags"] = layout_flags.empty() ? "0" : layout_flags.substr(3);
+  vars["max_field_id"] = SimpleItoa(max_field_id);
+  vars["n_owning"] = SimpleItoa(owning.size());
+
+  vars["required_mask"] = "NULL";
+  if (any_required_bits) {
+    printer->Print(vars, "static const uint8_t $lcclassname$__required_mask[] = {");
+    for (size_t i = 0; i < required_mask.size(); i++) {
+      vars["bits"] = SimpleItoa(required_mask[i]);
+      printer->Print(vars, i ? ", $bits$" : " $bits$");
+    }
+    printer->Print(" };\n");
+    vars["required_mask"] = vars["lcclassname"] + "__required_mask";
+  }
+  vars["owning"] = "NULL";
+  if (!owning.empty()) {
+    printer->Print(vars, "static const unsigned $lcclassname$__owning_fields[] = {");
+    for (size_t i = 0; i < owning.size(); i++) {
+      vars["index"] = SimpleItoa(owning[i]);
+      printer->Print(vars, i ? ", $index$" : " $index$");
+    }
+    printer->Print(" };\n");
+    vars["owning"] = vars["lcclassname"] + "__owning_fields";
+  }
+  printer->Print(vars,
+	"static const ProtobufCMessageLayout $lcclassname$__layout =\n"
+	"{\n"
+	"  $lcclassname$__hot_fields,\n"
+	"  $layout_flags$,\n"
+	"  $max_field_id$,\n"
+	"  $required_mask$,\n"
+	"  $n_owning$,\n"
+	"  $owning$\n"
+	"};\n");
+  vars["layout"] = "&" + vars["lcclassname"] + "__layout";
 
   if (!optimize_code_size) {
     NameIndex *field_indices = new NameIndex [descriptor_->field_count()];
@@ -598,6 +858,19 @@ GenerateMessageDescriptor(google::protobuf::io::Printer* printer, bool gen_init)
     delete[] field_indices;
   }
 
+  vars["field_name_hash"] = "NULL";
+  if (!optimize_code_size) {
+    std::vector<std::string> names;
+    std::vector<unsigned> indices;
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      names.push_back(sorted_fields[i]->name());
+      indices.push_back(i);
+    }
+    if (WriteNameHash(printer, names, indices,
+		      vars["lcclassname"] + "__field_name_hash"))
+      vars["field_name_hash"] = "&" + vars["lcclassname"] + "__field_name_hash";
+  }
+
   // create range initializers
   int *values = new int[descriptor_->field_count()];
   for (int i = 0; i < descriptor_->field_count(); i++) {
@@ -606,6 +879,11 @@ GenerateMessageDescriptor(google::protobuf::io::Printer* printer, bool gen_init)
   int n_ranges = WriteIntRanges(printer,
 				descriptor_->field_count(), values,
 				vars["lcclassname"] + "__number_ranges");
+  if (WriteDenseIndex(printer, descriptor_->field_count(), values,
+		      vars["lcclassname"] + "__number_index"))
+    vars["number_index"] = "&" + vars["lcclassname"] + "__number_index";
+  else
+    vars["number_index"] = "NULL";
   delete [] values;
   delete [] sorted_fields;
 
@@ -615,6 +893,9 @@ GenerateMessageDescriptor(google::protobuf::io::Printer* printer, bool gen_init)
        * initialization list. Furthermore it is an extension of GCC only but
        * not a standard. */
       vars["n_ranges"] = "0";
+      vars["number_index"] = "NULL";
+      vars["field_name_hash"] = "NULL";
+      vars["layout"] = "NULL";
   printer->Print(vars,
         "#define $lcclassname$__field_descriptors NULL\n"
         "#define $lcclassname$__field_indices_by_name NULL\n"
@@ -655,7 +936,9 @@ GenerateMessageDescriptor(google::protobuf::io::Printer* printer, bool gen_init)
       "  NULL, /* gen_init_helpers = false */\n");
   }
   printer->Print(vars,
-      "  NULL,NULL,NULL    /* reserved[123] */\n"
+      "  $number_index$,\n"
+      "  $field_name_hash$,\n"
+      "  $layout$\n"
       "};\n");
 }
 
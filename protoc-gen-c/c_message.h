@@ -120,10 +120,17 @@ class MessageGenerator {
 					 bool gen_pack,
 					 bool gen_init);
 
+  // Generate the read-only view accessors of this message and its nested
+  // types, for those with the gen_views option.
+  void GenerateViewDeclarations(google::protobuf::io::Printer* printer);
+  void GenerateViewDefinitions(google::protobuf::io::Printer* printer);
+
  private:
 
   int GetOneofUnionOrder(const google::protobuf::FieldDescriptor *fd);
 
+  bool HasViews();
+
   const google::protobuf::Descriptor* descriptor_;
   std::string dllexport_decl_;
   FieldGeneratorMap field_generators_;
@@ -113,10 +113,10 @@ void MessageFieldGenerator::GenerateStaticInit(google::protobuf::io::Printer* pr
       break;
   }
 }
-void MessageFieldGenerator::GenerateDescriptorInitializer(google::protobuf::io::Printer* printer) const
+std::map<std::string, std::string> MessageFieldGenerator::DescriptorInitializerVariables() const
 {
   std::string addr = "&" + FullNameToLower(descriptor_->message_type()->full_name(), descriptor_->message_type()->file()) + "__descriptor";
-  GenerateDescriptorInitializerGeneric(printer, false, "MESSAGE", addr);
+  return DescriptorInitializerVariablesGeneric(false, "MESSAGE", addr);
 }
 
 }  // namespace protobuf_c
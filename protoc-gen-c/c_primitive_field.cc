@@ -170,7 +170,7 @@ void PrimitiveFieldGenerator::GenerateStaticInit(google::protobuf::io::Printer*
   }
 }
 
-void PrimitiveFieldGenerator::GenerateDescriptorInitializer(google::protobuf::io::Printer* printer) const
+std::map<std::string, std::string> PrimitiveFieldGenerator::DescriptorInitializerVariables() const
 {
   std::string c_type_macro;
   switch (descriptor_->type()) {
@@ -202,7 +202,7 @@ void PrimitiveFieldGenerator::GenerateDescriptorInitializer(google::protobuf::io
     // No default because we want the compiler to complain if any new
     // types are added.
   }
-  GenerateDescriptorInitializerGeneric(printer, true, c_type_macro, "NULL");
+  return DescriptorInitializerVariablesGeneric(true, c_type_macro, "NULL");
 }
 
 }  // namespace protobuf_c
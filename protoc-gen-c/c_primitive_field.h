@@ -78,7 +78,7 @@ class PrimitiveFieldGenerator : public FieldGenerator {
 
   // implements FieldGenerator ---------------------------------------
   void GenerateStructMembers(google::protobuf::io::Printer* printer) const;
-  void GenerateDescriptorInitializer(google::protobuf::io::Printer* printer) const;
+  std::map<std::string, std::string> DescriptorInitializerVariables() const;
   std::string GetDefaultValue(void) const;
   void GenerateStaticInit(google::protobuf::io::Printer* printer) const;
 };
@@ -234,28 +234,42 @@ void ServiceGenerator::GenerateServiceDescriptor(google::protobuf::io::Printer*
     }
     printer->Print(vars_, "};\n");
     vars_["name"] = descriptor_->name();
+
+    std::vector<std::string> names;
+    std::vector<unsigned> indices;
+    for (int i = 0; i < n_methods; i++) {
+      names.push_back(descriptor_->method(i)->name());
+      indices.push_back(i);
+    }
+    if (WriteNameHash(printer, names, indices,
+		      vars_["lcfullname"] + "__method_name_hash"))
+      vars_["method_name_hash"] = "&" + vars_["lcfullname"] + "__method_name_hash";
+    else
+      vars_["method_name_hash"] = "NULL";
   }
 
   if (optimize_code_size) {
     printer->Print(vars_, "const ProtobufCServiceDescriptor $lcfullname$__descriptor =\n"
         "{\n"
-        "  PROTOBUF_C__SERVICE_DESCRIPTOR_MAGIC,\n"
+        "  PROTOBUF_C__SERVICE_DESCRIPTOR_HASHED_MAGIC,\n"
         "  NULL,NULL,NULL,NULL, /* CODE_SIZE */\n"
         "  $n_methods$,\n"
         "  $lcfullname$__method_descriptors,\n"
+        "  NULL, /* CODE_SIZE */\n"
         "  NULL /* CODE_SIZE */\n"
         "};\n");
   } else {
     printer->Print(vars_, "const ProtobufCServiceDescriptor $lcfullname$__descriptor =\n"
         "{\n"
-        "  PROTOBUF_C__SERVICE_DESCRIPTOR_MAGIC,\n"
+        "  PROTOBUF_C__SERVICE_DESCRIPTOR_HASHED_MAGIC,\n"
         "  \"$fullname$\",\n"
         "  \"$name$\",\n"
         "  \"$cname$\",\n"
         "  \"$package$\",\n"
         "  $n_methods$,\n"
         "  $lcfullname$__method_descriptors,\n"
-        "  $lcfullname$__method_indices_by_name\n"
+        "  $lcfullname$__method_indices_by_name,\n"
+        "  $method_name_hash$\n"
         "};\n");
   }
 
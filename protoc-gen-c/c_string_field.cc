@@ -148,9 +148,9 @@ void StringFieldGenerator::GenerateStaticInit(google::protobuf::io::Printer* pri
       break;
   }
 }
-void StringFieldGenerator::GenerateDescriptorInitializer(google::protobuf::io::Printer* printer) const
+std::map<std::string, std::string> StringFieldGenerator::DescriptorInitializerVariables() const
 {
-  GenerateDescriptorInitializerGeneric(printer, false, "STRING", "NULL");
+  return DescriptorInitializerVariablesGeneric(false, "STRING", "NULL");
 }
 
 }  // namespace protobuf_c
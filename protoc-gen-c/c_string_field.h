@@ -78,7 +78,7 @@ class StringFieldGenerator : public FieldGenerator {
 
   // implements FieldGenerator ---------------------------------------
   void GenerateStructMembers(google::protobuf::io::Printer* printer) const;
-  void GenerateDescriptorInitializer(google::protobuf::io::Printer* printer) const;
+  std::map<std::string, std::string> DescriptorInitializerVariables() const;
   void GenerateDefaultValueDeclarations(google::protobuf::io::Printer* printer) const;
   void GenerateDefaultValueImplementations(google::protobuf::io::Printer* printer) const;
   std::string GetDefaultValue(void) const;
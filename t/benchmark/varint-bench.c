@@ -0,0 +1,154 @@
+/*
+ * Micro-benchmark for the varint size, pack and parse paths.
+ *
+ * Packs, sizes and unpacks messages whose repeated 64- and 32-bit varint
+ * fields hold values of every encoded length, both packed and unpacked, and
+ * prints the time per value for each operation. Not run as part of the test
+ * suite; compare its output before and after a change to the varint code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "t/test-full.pb-c.h"
+
+#define N_VALUES	4096
+#define N_DELTAS	50000
+#define N_ROUNDS	200
+
+static int64_t int64_values[N_VALUES];
+static int64_t delta_values[N_DELTAS];
+static uint64_t uint64_values[N_VALUES];
+static int32_t int32_values[N_VALUES];
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+fill_values(void)
+{
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	unsigned i;
+
+	for (i = 0; i < N_VALUES; i++) {
+		unsigned bits;
+
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		/* spread the values evenly over all varint lengths */
+		bits = 1 + (unsigned) (x % 64);
+		uint64_values[i] = x >> (64 - bits);
+		int64_values[i] = (x & 1) ? -(int64_t) (uint64_values[i] >> 1) :
+			(int64_t) uint64_values[i];
+		int32_values[i] = (int32_t) int64_values[i];
+	}
+	/* small signed steps, as in a time series */
+	for (i = 0; i < N_DELTAS; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		delta_values[i] = (int64_t) (x % 2000001) - 1000000;
+	}
+}
+
+static void
+report(const char *what, double seconds, size_t n_values)
+{
+	printf("%-28s %8.2f ns/value\n", what, seconds * 1e9 / n_values);
+}
+
+static void
+bench_message(const char *name, ProtobufCMessage *msg, size_t n_values)
+{
+	char what[64];
+	size_t len = protobuf_c_message_get_packed_size(msg);
+	uint8_t *buf = malloc(len);
+	volatile size_t sink = 0;
+	double t;
+	unsigned r;
+
+	if (buf == NULL)
+		abort();
+
+	t = now();
+	for (r = 0; r < N_ROUNDS; r++)
+		sink += protobuf_c_message_get_packed_size(msg);
+	snprintf(what, sizeof(what), "%s get_packed_size", name);
+	report(what, now() - t, n_values * N_ROUNDS);
+
+	t = now();
+	for (r = 0; r < N_ROUNDS; r++)
+		sink += protobuf_c_message_pack(msg, buf);
+	snprintf(what, sizeof(what), "%s pack", name);
+	report(what, now() - t, n_values * N_ROUNDS);
+
+	t = now();
+	for (r = 0; r < N_ROUNDS; r++) {
+		ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT(buf);
+
+		bs.alloced = len;
+		sink += protobuf_c_message_pack_to_buffer(msg, &bs.base);
+		PROTOBUF_C_BUFFER_SIMPLE_CLEAR(&bs);
+	}
+	snprintf(what, sizeof(what), "%s pack_to_buffer", name);
+	report(what, now() - t, n_values * N_ROUNDS);
+
+	t = now();
+	for (r = 0; r < N_ROUNDS; r++) {
+		ProtobufCMessage *out =
+			protobuf_c_message_unpack(msg->descriptor, NULL, len, buf);
+		if (out == NULL)
+			abort();
+		sink += out->descriptor->n_fields;
+		protobuf_c_message_free_unpacked(out, NULL);
+	}
+	snprintf(what, sizeof(what), "%s unpack", name);
+	report(what, now() - t, n_values * N_ROUNDS);
+
+	(void) sink;
+	free(buf);
+}
+
+int
+main(void)
+{
+	Foo__TestMessPacked packed = FOO__TEST_MESS_PACKED__INIT;
+	Foo__TestMess unpacked = FOO__TEST_MESS__INIT;
+
+	fill_values();
+
+	packed.n_test_int64 = N_VALUES;
+	packed.test_int64 = int64_values;
+	packed.n_test_sint64 = N_VALUES;
+	packed.test_sint64 = int64_values;
+	packed.n_test_uint64 = N_VALUES;
+	packed.test_uint64 = uint64_values;
+	packed.n_test_int32 = N_VALUES;
+	packed.test_int32 = int32_values;
+	bench_message("packed", &packed.base, 4 * N_VALUES);
+
+	unpacked.n_test_int64 = N_VALUES;
+	unpacked.test_int64 = int64_values;
+	unpacked.n_test_sint64 = N_VALUES;
+	unpacked.test_sint64 = int64_values;
+	unpacked.n_test_uint64 = N_VALUES;
+	unpacked.test_uint64 = uint64_values;
+	unpacked.n_test_int32 = N_VALUES;
+	unpacked.test_int32 = int32_values;
+	bench_message("unpacked", &unpacked.base, 4 * N_VALUES);
+
+	packed = (Foo__TestMessPacked) FOO__TEST_MESS_PACKED__INIT;
+	packed.n_test_sint64 = N_DELTAS;
+	packed.test_sint64 = delta_values;
+	bench_message("sint64 deltas", &packed.base, N_DELTAS);
+
+	return EXIT_SUCCESS;
+}
@@ -2033,6 +2033,2327 @@ test_alloc_fail (void)
   free (packed);
 }
 
+static void
+test_intern_values (void)
+{
+  const char *strings[] = { "host-a", "host-b", "host-a", "host-a" };
+  uint8_t bytes[] = "host-b";
+  Foo__DefaultRequiredValues req = FOO__DEFAULT_REQUIRED_VALUES__INIT;
+  Foo__AllocValues mess = FOO__ALLOC_VALUES__INIT;
+  Foo__AllocValues *m1, *m2;
+  ProtobufCIntern *intern;
+  uint8_t *packed;
+  size_t len;
+
+  mess.a_string = "host-b";
+  mess.r_string = strings;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.a_bytes.len = 6;
+  mess.a_bytes.data = bytes;
+  mess.a_mess = &req;
+  len = foo__alloc_values__get_packed_size (&mess);
+  packed = malloc (len);
+  assert (packed);
+  assert (len == foo__alloc_values__pack (&mess, packed));
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  intern = protobuf_c_intern_new (&test_allocator);
+  assert (intern);
+
+  m1 = (Foo__AllocValues *) protobuf_c_message_unpack_interned
+    (&foo__alloc_values__descriptor, &test_allocator, intern, len, packed);
+  m2 = (Foo__AllocValues *) protobuf_c_message_unpack_interned
+    (&foo__alloc_values__descriptor, &test_allocator, intern, len, packed);
+  assert (m1 && m2);
+  /* "host-a", "host-b" and the two string/bytes members of a_mess */
+  assert (protobuf_c_intern_get_n_values (intern) == 4);
+
+  /* identical values share storage, within and across messages */
+  assert (strcmp (m1->r_string[0], "host-a") == 0);
+  assert (m1->r_string[0] == m1->r_string[2]);
+  assert (m1->r_string[0] == m2->r_string[3]);
+  assert (m1->a_string == m1->r_string[1]);
+  assert (m1->a_bytes.len == 6);
+  assert ((char *) m1->a_bytes.data == m2->a_string);
+  assert (strcmp ((char *) m2->a_bytes.data, "host-b") == 0);
+
+  protobuf_c_message_free_unpacked_interned (&m1->base, &test_allocator,
+                                             intern);
+  assert (protobuf_c_intern_get_n_values (intern) == 4);
+  assert (strcmp (m2->r_string[0], "host-a") == 0);
+  protobuf_c_message_free_unpacked_interned (&m2->base, &test_allocator,
+                                             intern);
+  assert (protobuf_c_intern_get_n_values (intern) == 0);
+
+  protobuf_c_intern_free (intern);
+  assert (test_allocator_data.alloc_count == 0);
+  free (packed);
+}
+
+static void
+test_intern_alloc_fail (void)
+{
+  int i = 0;
+  SETUP_TEST_ALLOC_BUFFER (packed, len);
+  do {
+    ProtobufCIntern *intern;
+    ProtobufCMessage *m;
+
+    test_allocator_data.alloc_count = 0;
+    test_allocator_data.allocs_left = INT32_MAX;
+    intern = protobuf_c_intern_new (&test_allocator);
+    assert (intern);
+    test_allocator_data.allocs_left = i++;
+    m = protobuf_c_message_unpack_interned (&foo__alloc_values__descriptor,
+                                            &test_allocator, intern,
+                                            len, packed);
+    assert (test_allocator_data.allocs_left < 0 ? !m : !!m);
+    protobuf_c_message_free_unpacked_interned (m, &test_allocator, intern);
+    assert (protobuf_c_intern_get_n_values (intern) == 0);
+    protobuf_c_intern_free (intern);
+    assert (test_allocator_data.alloc_count == 0);
+  } while (test_allocator_data.allocs_left < 0);
+  free (packed);
+}
+
+static void
+test_shared_messages (void)
+{
+  Foo__AllocValues *m1, *m2;
+  Foo__DefaultRequiredValues *sub;
+  SETUP_TEST_ALLOC_BUFFER (packed, len);
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  m1 = (Foo__AllocValues *) protobuf_c_message_unpack_shared
+    (&foo__alloc_values__descriptor, &test_allocator, len, packed);
+  m2 = (Foo__AllocValues *) protobuf_c_message_unpack_shared
+    (&foo__alloc_values__descriptor, &test_allocator, len, packed);
+  assert (m1 && m2);
+
+  /* splice m1's sub-message into m2, replacing m2's own */
+  protobuf_c_message_unref (&m2->a_mess->base);
+  m2->a_mess = (Foo__DefaultRequiredValues *)
+    protobuf_c_message_ref (&m1->a_mess->base);
+
+  /* keep the sub-message alive past both parents */
+  sub = (Foo__DefaultRequiredValues *)
+    protobuf_c_message_ref (&m1->a_mess->base);
+  protobuf_c_message_unref (&m1->base);
+  assert (foo__alloc_values__get_packed_size (m2) == len);
+  protobuf_c_message_unref (&m2->base);
+
+  assert (strcmp (sub->v_string, "hi mom\n") == 0);
+  protobuf_c_message_unref (&sub->base);
+  assert (test_allocator_data.alloc_count == 0);
+
+  free (packed);
+}
+
+/* A second counting allocator, to tell which one frees a block. */
+static struct alloc_data other_allocator_data;
+
+static ProtobufCAllocator other_allocator = {
+  .alloc = test_alloc,
+  .free = test_free,
+  .allocator_data = &other_allocator_data,
+};
+
+static void
+test_shared_mixed_allocators (void)
+{
+  Foo__AllocValues *m1, *m2;
+  SETUP_TEST_ALLOC_BUFFER (packed, len);
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  other_allocator_data.alloc_count = 0;
+  other_allocator_data.allocs_left = INT32_MAX;
+  m1 = (Foo__AllocValues *) protobuf_c_message_unpack_shared
+    (&foo__alloc_values__descriptor, &other_allocator, len, packed);
+  m2 = (Foo__AllocValues *) protobuf_c_message_unpack_shared
+    (&foo__alloc_values__descriptor, &test_allocator, len, packed);
+  assert (m1 && m2);
+
+  /* m2 ends up holding the last reference on m1's sub-message */
+  protobuf_c_message_unref (&m2->a_mess->base);
+  m2->a_mess = (Foo__DefaultRequiredValues *)
+    protobuf_c_message_ref (&m1->a_mess->base);
+  protobuf_c_message_unref (&m1->base);
+  assert (other_allocator_data.alloc_count > 0);
+
+  /* each message goes back to the allocator it came from */
+  protobuf_c_message_unref (&m2->base);
+  assert (test_allocator_data.alloc_count == 0);
+  assert (other_allocator_data.alloc_count == 0);
+
+  free (packed);
+}
+
+static void
+test_shared_alloc_fail (void)
+{
+  int i = 0;
+  SETUP_TEST_ALLOC_BUFFER (packed, len);
+  do {
+    ProtobufCMessage *m;
+
+    test_allocator_data.alloc_count = 0;
+    test_allocator_data.allocs_left = i++;
+    m = protobuf_c_message_unpack_shared (&foo__alloc_values__descriptor,
+                                          &test_allocator, len, packed);
+    assert (test_allocator_data.allocs_left < 0 ? !m : !!m);
+    protobuf_c_message_unref (m);
+    assert (test_allocator_data.alloc_count == 0);
+  } while (test_allocator_data.allocs_left < 0);
+  free (packed);
+}
+
+static void
+test_flat_unpack (void)
+{
+  Foo__AllocValues *mess;
+  Foo__TestMessSubMess *merged;
+  size_t size;
+  uint8_t *repacked;
+  SETUP_TEST_ALLOC_BUFFER (packed, len);
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  mess = (Foo__AllocValues *) protobuf_c_message_unpack_flat
+    (&foo__alloc_values__descriptor, &test_allocator, len, packed);
+  assert (mess);
+  /* the whole tree lives in a single allocation */
+  assert (test_allocator_data.alloc_count == 1);
+  assert (strcmp (mess->a_string, "some string") == 0);
+  assert (mess->n_r_string == N_ELEMENTS (repeated_strings_2));
+  assert (strcmp (mess->r_string[1], repeated_strings_2[1]) == 0);
+  assert (mess->a_bytes.len == sizeof (bytes));
+  assert (memcmp (mess->a_bytes.data, bytes, sizeof (bytes)) == 0);
+  assert (mess->a_mess->v_int32 == -42);
+  assert (foo__alloc_values__get_packed_size (mess) == len);
+  protobuf_c_message_free_flat (&mess->base);
+  assert (test_allocator_data.alloc_count == 0);
+  free (packed);
+
+  /* duplicated sub-messages are merged into overflow chunks */
+  merged = (Foo__TestMessSubMess *) protobuf_c_message_unpack_flat
+    (&foo__test_mess_sub_mess__descriptor, &test_allocator,
+     sizeof (test_submess_unmerged2), test_submess_unmerged2);
+  assert (merged);
+  size = foo__test_mess_sub_mess__get_packed_size (merged);
+  repacked = malloc (size);
+  foo__test_mess_sub_mess__pack (merged, repacked);
+  assert (size == sizeof (test_submess_merged2));
+  assert (memcmp (repacked, test_submess_merged2, size) == 0);
+  protobuf_c_message_free_flat (&merged->base);
+  assert (test_allocator_data.alloc_count == 0);
+  free (repacked);
+}
+
+static void
+test_flat_unpack_truncated (void)
+{
+  size_t i;
+  SETUP_TEST_ALLOC_BUFFER (packed, len);
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  for (i = 0; i < len; i++)
+    assert (protobuf_c_message_unpack_flat (&foo__alloc_values__descriptor,
+                                            &test_allocator,
+                                            i, packed) == NULL);
+  assert (test_allocator_data.alloc_count == 0);
+  free (packed);
+}
+
+static void
+test_unpack_context (void)
+{
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  Foo__SubMess subs[40], *psubs[40];
+  const char *strings[100];
+  ProtobufCUnpackContext *context;
+  uint8_t *packed;
+  size_t len;
+  int32_t allocs[3];
+  unsigned i, pass;
+
+  for (i = 0; i < N_ELEMENTS (strings); i++)
+    strings[i] = i % 2 ? "odd" : "even";
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__sub_mess__init (&subs[i]);
+      subs[i].test = i;
+      psubs[i] = &subs[i];
+    }
+  mess.n_test_string = N_ELEMENTS (strings);
+  mess.test_string = strings;
+  mess.n_test_message = N_ELEMENTS (psubs);
+  mess.test_message = psubs;
+  len = foo__test_mess__get_packed_size (&mess);
+  packed = malloc (len);
+  assert (len == foo__test_mess__pack (&mess, packed));
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  context = protobuf_c_unpack_context_new (&test_allocator);
+  assert (context);
+
+  /* the first pass warms up the context, later ones reuse its slabs */
+  for (pass = 0; pass < N_ELEMENTS (allocs); pass++)
+    {
+      int32_t before = test_allocator_data.allocs_left;
+      Foo__TestMess *m = (Foo__TestMess *)
+        protobuf_c_message_unpack_with_context (&foo__test_mess__descriptor,
+                                                &test_allocator, context,
+                                                len, packed);
+      assert (m);
+      allocs[pass] = before - test_allocator_data.allocs_left;
+      assert (m->n_test_string == N_ELEMENTS (strings));
+      assert (strcmp (m->test_string[99], "odd") == 0);
+      assert (m->n_test_message == N_ELEMENTS (subs));
+      assert (m->test_message[39]->test == 39);
+      foo__test_mess__free_unpacked (m, &test_allocator);
+    }
+  assert (allocs[1] < allocs[0]);
+  assert (allocs[2] == allocs[1]);
+
+  /* messages with more than 128 fields use a cached bitmap */
+  {
+    const uint8_t source[] = {
+      (1 << 3) | PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED, 1, 'a',
+      /* field 129, length-prefixed: a two-byte tag */
+      0x8a, 0x08, 1, 'b',
+    };
+    ProtobufCMessage *m;
+
+    m = protobuf_c_message_unpack_with_context
+      (&foo__test_required_fields_bitmap__descriptor, &test_allocator,
+       context, sizeof (source), source);
+    assert (m);
+    protobuf_c_message_free_unpacked (m, &test_allocator);
+    m = protobuf_c_message_unpack_with_context
+      (&foo__test_required_fields_bitmap__descriptor, &test_allocator,
+       context, 3, source);
+    assert (m == NULL);
+  }
+
+  protobuf_c_unpack_context_free (context);
+  assert (test_allocator_data.alloc_count == 0);
+  free (packed);
+}
+
+static void
+test_pool_allocator (void)
+{
+  ProtobufCPool *pool;
+  ProtobufCAllocator *allocator;
+  ProtobufCPoolStats stats;
+  size_t hits = 0, misses = 0;
+  unsigned i;
+  SETUP_TEST_ALLOC_BUFFER (packed, len);
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  pool = protobuf_c_pool_new (&test_allocator);
+  assert (pool);
+  assert (protobuf_c_pool_register (pool, &foo__alloc_values__descriptor));
+  assert (protobuf_c_pool_register (pool, &foo__default_required_values__descriptor));
+  allocator = protobuf_c_pool_get_allocator (pool);
+
+  for (i = 0; i < 10; i++)
+    {
+      Foo__AllocValues *mess = foo__alloc_values__unpack (allocator, len, packed);
+      assert (mess);
+      assert (strcmp (mess->a_string, "some string") == 0);
+      assert (mess->a_mess->v_int32 == -42);
+      foo__alloc_values__free_unpacked (mess, allocator);
+      protobuf_c_pool_get_stats (pool, &stats);
+      if (i == 0)
+        {
+          misses = stats.misses;
+          hits = stats.hits;
+        }
+      /* after the first round every pooled block comes off a free list */
+      assert (stats.misses == misses);
+      assert (i == 0 || stats.hits > hits);
+      hits = stats.hits;
+    }
+  assert (misses >= 1 && misses <= 2);
+  /* strings and arrays are smaller than any class */
+  assert (stats.bypasses > 0);
+
+  protobuf_c_pool_free (pool);
+  assert (test_allocator_data.alloc_count == 0);
+  free (packed);
+}
+
+/* One thread alternating between pools must keep reusing their blocks. */
+static void
+check_pool_switching (unsigned n_pools)
+{
+  ProtobufCPool *pools[8];
+  void *blocks[8];
+  ProtobufCPoolStats stats;
+  unsigned i, p;
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  for (p = 0; p < n_pools; p++)
+    {
+      pools[p] = protobuf_c_pool_new (&test_allocator);
+      assert (pools[p]);
+      assert (protobuf_c_pool_register (pools[p], &foo__alloc_values__descriptor));
+    }
+
+  for (i = 0; i < 10000; i++)
+    {
+      for (p = 0; p < n_pools; p++)
+        {
+          ProtobufCAllocator *allocator = protobuf_c_pool_get_allocator (pools[p]);
+          blocks[p] = allocator->alloc (allocator->allocator_data,
+                                        sizeof (Foo__AllocValues));
+          assert (blocks[p]);
+        }
+      for (p = 0; p < n_pools; p++)
+        {
+          ProtobufCAllocator *allocator = protobuf_c_pool_get_allocator (pools[p]);
+          allocator->free (allocator->allocator_data, blocks[p]);
+        }
+    }
+
+  /* one backing allocation per pool and one per chunk, carved once */
+  assert (INT32_MAX - test_allocator_data.allocs_left == (int32_t) n_pools * 2);
+  for (p = 0; p < n_pools; p++)
+    {
+      protobuf_c_pool_get_stats (pools[p], &stats);
+      assert (stats.misses == 1);
+      assert (stats.hits + stats.misses == 10000);
+      assert (stats.bypasses == 0);
+    }
+
+  /* flushed blocks go back to the shared lists and are reused from there */
+  protobuf_c_pool_thread_flush ();
+  for (p = 0; p < n_pools; p++)
+    {
+      ProtobufCAllocator *allocator = protobuf_c_pool_get_allocator (pools[p]);
+      void *block = allocator->alloc (allocator->allocator_data,
+                                      sizeof (Foo__AllocValues));
+      assert (block);
+      allocator->free (allocator->allocator_data, block);
+      protobuf_c_pool_get_stats (pools[p], &stats);
+      assert (stats.misses == 1);
+      assert (stats.hits == 10000);
+    }
+
+  for (p = 0; p < n_pools; p++)
+    protobuf_c_pool_free (pools[p]);
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+static void
+test_pool_switching (void)
+{
+  check_pool_switching (2);
+  /* more pools than a thread has cache slots */
+  check_pool_switching (7);
+}
+
+/* Blocks of the sized allocator carry their size, checked on every free. */
+static unsigned sized_realloc_count;
+
+static void *test_sized_alloc (void *allocator_data, size_t size)
+{
+  size_t *block = test_alloc (allocator_data, sizeof (size_t) * 2 + size);
+  if (block == NULL)
+    return NULL;
+  block[0] = size;
+  return block + 2;
+}
+
+static void test_sized_free (void *allocator_data, void *data, size_t size)
+{
+  size_t *block = (size_t *) data - 2;
+  assert (block[0] == size);
+  test_free (allocator_data, block);
+}
+
+static void *test_sized_realloc (void *allocator_data, void *data,
+                                 size_t old_size, size_t new_size)
+{
+  size_t *block = (size_t *) data - 2;
+  (void) allocator_data;
+  assert (block[0] == old_size);
+  block = realloc (block, sizeof (size_t) * 2 + new_size);
+  if (block == NULL)
+    return NULL;
+  block[0] = new_size;
+  sized_realloc_count++;
+  return block + 2;
+}
+
+static void
+test_sized_allocator (void)
+{
+  ProtobufCAllocatorExt ext = {
+    .version = PROTOBUF_C_ALLOCATOR_EXT_VERSION,
+    .alloc = test_sized_alloc,
+    .free_sized = test_sized_free,
+    .realloc = test_sized_realloc,
+    .allocator_data = &test_allocator_data,
+  };
+  Foo__TestMessSubMess *merged;
+  Foo__AllocValues *mess;
+  ProtobufCAllocator *allocator = &ext.base;
+  int i = 0;
+  SETUP_TEST_ALLOC_BUFFER (packed, len);
+
+  protobuf_c_allocator_ext_init (&ext);
+
+  /* every partially unpacked message is freed with accurate sizes */
+  do {
+    test_allocator_data.alloc_count = 0;
+    test_allocator_data.allocs_left = i++;
+    mess = foo__alloc_values__unpack (allocator, len, packed);
+    assert (test_allocator_data.allocs_left < 0 ? !mess : !!mess);
+    foo__alloc_values__free_unpacked (mess, allocator);
+    assert (test_allocator_data.alloc_count == 0);
+  } while (test_allocator_data.allocs_left < 0);
+  free (packed);
+
+  /* repeated fields of merged sub-messages are grown with realloc */
+  test_allocator_data.allocs_left = INT32_MAX;
+  sized_realloc_count = 0;
+  merged = foo__test_mess_sub_mess__unpack
+    (allocator, sizeof (test_submess_unmerged2), test_submess_unmerged2);
+  assert (merged);
+  assert (sized_realloc_count > 0);
+  assert (foo__test_mess_sub_mess__get_packed_size (merged) ==
+          sizeof (test_submess_merged2));
+  foo__test_mess_sub_mess__free_unpacked (merged, allocator);
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+/* Packed bools are varints: arrays must match their count, not their bytes. */
+static void
+test_sized_allocator_packed_bool (void)
+{
+  static const uint8_t packed[] = { 0x6a, 0x03, 0x81, 0x00, 0x01 };
+  static const uint8_t merged[] = {
+    0x0a, 0x05, 0x6a, 0x03, 0x81, 0x00, 0x01,
+    0x0a, 0x05, 0x6a, 0x03, 0x81, 0x00, 0x01,
+    0x12, 0x00, 0x1a, 0x00, 0x22, 0x02, 0x20, 0x00, 0x2a, 0x00
+  };
+  ProtobufCAllocatorExt ext = {
+    .version = PROTOBUF_C_ALLOCATOR_EXT_VERSION,
+    .alloc = test_sized_alloc,
+    .free_sized = test_sized_free,
+    .realloc = test_sized_realloc,
+    .allocator_data = &test_allocator_data,
+  };
+  ProtobufCAllocator *allocator = &ext.base;
+  Foo__TestMess *mess;
+  Foo__TestMessSubMess *sub_mess;
+
+  protobuf_c_allocator_ext_init (&ext);
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  mess = foo__test_mess__unpack (allocator, sizeof (packed), packed);
+  assert (mess);
+  assert (mess->n_test_boolean == 2);
+  assert (mess->test_boolean[0] && mess->test_boolean[1]);
+  foo__test_mess__free_unpacked (mess, allocator);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* the merged arrays are grown and freed with their element counts */
+  sized_realloc_count = 0;
+  sub_mess = foo__test_mess_sub_mess__unpack (allocator, sizeof (merged),
+                                              merged);
+  assert (sub_mess);
+  assert (sized_realloc_count > 0);
+  assert (sub_mess->rep_mess->n_test_boolean == 4);
+  foo__test_mess_sub_mess__free_unpacked (sub_mess, allocator);
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+/* Strings are freed by their strlen(), short of any embedded NUL. */
+static void test_sized_free_string (void *allocator_data, void *data,
+                                    size_t size)
+{
+  size_t *block = (size_t *) data - 2;
+  assert (size > 0 && size <= block[0]);
+  test_free (allocator_data, block);
+}
+
+static void
+test_sized_allocator_embedded_nul (void)
+{
+  static const uint8_t packed[] = { 0x0a, 5, 'a', 'b', 0, 'c', 'd' };
+  ProtobufCAllocatorExt ext = {
+    .version = PROTOBUF_C_ALLOCATOR_EXT_VERSION,
+    .alloc = test_sized_alloc,
+    .free_sized = test_sized_free_string,
+    .allocator_data = &test_allocator_data,
+  };
+  ProtobufCAllocator *allocators[] = { &test_allocator, &ext.base };
+  unsigned i;
+
+  protobuf_c_allocator_ext_init (&ext);
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  /* the decoded bytes do not depend on the kind of allocator */
+  for (i = 0; i < N_ELEMENTS (allocators); i++)
+    {
+      Foo__TestMessRequiredString *mess =
+        foo__test_mess_required_string__unpack (allocators[i],
+                                                sizeof (packed), packed);
+      assert (mess);
+      assert (memcmp (mess->test, "ab\0cd", 6) == 0);
+      foo__test_mess_required_string__free_unpacked (mess, allocators[i]);
+      assert (test_allocator_data.alloc_count == 0);
+    }
+}
+
+static void
+test_aligned_alloc (void)
+{
+  ProtobufCAllocatorExt ext = {
+    .version = PROTOBUF_C_ALLOCATOR_EXT_VERSION,
+    .alloc = test_sized_alloc,
+    .free_sized = test_sized_free,
+    .allocator_data = &test_allocator_data,
+  };
+  ProtobufCAllocator *allocators[] = { NULL, &test_allocator, &ext.base };
+  size_t alignments[] = { 1, 16, 64, 4096 };
+  unsigned i, j;
+
+  protobuf_c_allocator_ext_init (&ext);
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  for (i = 0; i < N_ELEMENTS (allocators); i++)
+    for (j = 0; j < N_ELEMENTS (alignments); j++)
+      {
+        uint8_t *p = protobuf_c_allocator_alloc_aligned (allocators[i],
+                                                         alignments[j], 100);
+        assert (p);
+        assert (((uintptr_t) p & (alignments[j] - 1)) == 0);
+        memset (p, 0xa5, 100);
+        protobuf_c_allocator_free_aligned (allocators[i], p,
+                                           alignments[j], 100);
+      }
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+static void
+test_dense_index (void)
+{
+  const ProtobufCEnumDescriptor *edesc = &foo__test_enum_dense__descriptor;
+  const ProtobufCMessageDescriptor *mdesc = &foo__sub_mess__descriptor;
+  const ProtobufCEnumValue *ev;
+  int v;
+
+  assert (edesc->value_index != NULL);
+  for (v = -4; v <= 6; v++)
+    {
+      ev = protobuf_c_enum_descriptor_get_value (edesc, v);
+      if (v == -2 || v == 0 || v == 1 || v == 3 || v == 4)
+        assert (ev && ev->value == v);
+      else
+        assert (ev == NULL);
+    }
+  assert (protobuf_c_enum_descriptor_get_value (edesc, INT32_MIN) == NULL);
+  assert (protobuf_c_enum_descriptor_get_value (edesc, INT32_MAX) == NULL);
+
+  /* SubMess numbers its fields 4, 6..10 */
+  assert (mdesc->field_index != NULL);
+  assert (protobuf_c_message_descriptor_get_field (mdesc, 3) == NULL);
+  assert (protobuf_c_message_descriptor_get_field (mdesc, 4)->id == 4);
+  assert (protobuf_c_message_descriptor_get_field (mdesc, 5) == NULL);
+  assert (protobuf_c_message_descriptor_get_field (mdesc, 10)->id == 10);
+  assert (protobuf_c_message_descriptor_get_field (mdesc, 11) == NULL);
+}
+
+static void
+test_name_hash (void)
+{
+  const ProtobufCMessageDescriptor *mdesc = &foo__test_mess__descriptor;
+  const ProtobufCEnumDescriptor *edesc = &foo__test_enum__descriptor;
+  const ProtobufCServiceDescriptor *sdesc = &foo__test_service__descriptor;
+  unsigned i;
+
+  assert (mdesc->field_name_hash != NULL);
+  for (i = 0; i < mdesc->n_fields; i++)
+    assert (protobuf_c_message_descriptor_get_field_by_name
+              (mdesc, mdesc->fields[i].name) == mdesc->fields + i);
+  assert (protobuf_c_message_descriptor_get_field_by_name (mdesc, "") == NULL);
+  assert (protobuf_c_message_descriptor_get_field_by_name (mdesc, "test_int") == NULL);
+
+  assert (edesc->value_name_hash != NULL);
+  for (i = 0; i < edesc->n_value_names; i++)
+    {
+      const ProtobufCEnumValue *ev = protobuf_c_enum_descriptor_get_value_by_name
+        (edesc, edesc->values_by_name[i].name);
+      assert (ev == edesc->values + edesc->values_by_name[i].index);
+    }
+  assert (protobuf_c_enum_descriptor_get_value_by_name (edesc, "VALUE2") == NULL);
+
+  assert (sdesc->magic == PROTOBUF_C__SERVICE_DESCRIPTOR_HASHED_MAGIC);
+  assert (sdesc->method_name_hash != NULL);
+  for (i = 0; i < sdesc->n_methods; i++)
+    assert (protobuf_c_service_descriptor_get_method_by_name
+              (sdesc, sdesc->methods[i].name) == sdesc->methods + i);
+  assert (protobuf_c_service_descriptor_get_method_by_name (sdesc, "Put2") == NULL);
+}
+
+static void
+check_hot_fields (const ProtobufCMessageDescriptor *desc)
+{
+  unsigned i;
+
+  assert (desc->layout != NULL);
+  for (i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldHot *hot = desc->layout->fields + i;
+      const ProtobufCFieldDescriptor *field = desc->fields + i;
+      assert (hot->id == field->id);
+      assert (hot->label == field->label);
+      assert (hot->type == field->type);
+      assert (hot->flags == field->flags);
+      assert (hot->quantifier_offset == field->quantifier_offset);
+      assert (hot->offset == field->offset);
+    }
+}
+
+static void
+test_hot_fields (void)
+{
+  Foo__TestMessOptional opt = FOO__TEST_MESS_OPTIONAL__INIT;
+  Foo__TestMessOneof oneof = FOO__TEST_MESS_ONEOF__INIT;
+  Foo__TestMessOneof *oneof2;
+  Foo__TestMessOptional *opt2;
+  ProtobufCBinaryData bytes = { 3, (uint8_t *) "abc" };
+  uint8_t scratch[64];
+  uint8_t buf[64];
+  ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  size_t len;
+
+  check_hot_fields (&foo__test_mess__descriptor);
+  check_hot_fields (&foo__test_mess_optional__descriptor);
+  check_hot_fields (&foo__test_mess_oneof__descriptor);
+  assert (foo__empty_mess__descriptor.layout == NULL);
+
+  /* Unset fields are skipped without affecting the output */
+  assert (protobuf_c_message_get_packed_size ((ProtobufCMessage *) &opt) == 0);
+  opt.has_test_sint64 = 1;
+  opt.test_sint64 = -5;
+  opt.test_bytes = bytes;
+  opt.test_string = "x";
+  len = protobuf_c_message_get_packed_size ((ProtobufCMessage *) &opt);
+  assert (len == 2 + 4);
+  assert (protobuf_c_message_pack ((ProtobufCMessage *) &opt, buf) == len);
+  assert (protobuf_c_message_pack_to_buffer ((ProtobufCMessage *) &opt,
+                                             &bs.base) == len);
+  assert (bs.len == len && memcmp (bs.data, buf, len) == 0);
+  opt2 = foo__test_mess_optional__unpack (NULL, len, buf);
+  assert (opt2 != NULL);
+  assert (opt2->has_test_sint64 && opt2->test_sint64 == -5);
+  assert (!opt2->has_test_bytes);
+  assert (strcmp (opt2->test_string, "x") == 0);
+  foo__test_mess_optional__free_unpacked (opt2, NULL);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+
+  oneof.test_oneof_case = FOO__TEST_MESS_ONEOF__TEST_ONEOF_TEST_STRING;
+  oneof.test_string = "yz";
+  len = protobuf_c_message_get_packed_size ((ProtobufCMessage *) &oneof);
+  assert (len == 5);
+  assert (protobuf_c_message_pack ((ProtobufCMessage *) &oneof, buf) == len);
+  oneof2 = foo__test_mess_oneof__unpack (NULL, len, buf);
+  assert (oneof2 != NULL);
+  assert (oneof2->test_oneof_case == FOO__TEST_MESS_ONEOF__TEST_ONEOF_TEST_STRING);
+  assert (strcmp (oneof2->test_string, "yz") == 0);
+  foo__test_mess_oneof__free_unpacked (oneof2, NULL);
+}
+
+static void
+test_layout_summary (void)
+{
+  const ProtobufCMessageLayout *layout = foo__sub_mess__descriptor.layout;
+  /* test = 42, then unknown field 100 = 1 */
+  static const uint8_t data[] = { 0xd0, 0x02, 0x05, 0xa0, 0x06, 0x01 };
+  Foo__TestMessRequiredInt32 *msg;
+
+  /* SubMess: required test = 4, optional val1..val2, repeated rep, sub1, sub2 */
+  assert (layout->flags == (PROTOBUF_C_MESSAGE_LAYOUT_HAS_REPEATED |
+                            PROTOBUF_C_MESSAGE_LAYOUT_HAS_REQUIRED));
+  assert (layout->max_field_id == 10);
+  assert (layout->required_mask != NULL && layout->required_mask[0] == 1);
+  assert (layout->n_owning == 3);
+  assert (layout->owning[0] == 3 && layout->owning[2] == 5);
+
+  layout = foo__test_mess_required_int32__descriptor.layout;
+  assert (layout->flags == (PROTOBUF_C_MESSAGE_LAYOUT_HAS_REQUIRED |
+                            PROTOBUF_C_MESSAGE_LAYOUT_ALL_SCALAR));
+  assert (layout->n_owning == 0 && layout->owning == NULL);
+  assert (foo__test_mess_oneof__descriptor.layout->flags &
+          PROTOBUF_C_MESSAGE_LAYOUT_HAS_ONEOF);
+
+  assert (foo__test_mess_required_int32__unpack (NULL, 0, data) == NULL);
+  msg = foo__test_mess_required_int32__unpack (NULL, sizeof (data), data);
+  assert (msg != NULL);
+  assert (msg->test == 5);
+  assert (msg->base.n_unknown_fields == 1);
+  assert (msg->base.unknown_fields[0].tag == 100);
+  assert (protobuf_c_message_check (&msg->base));
+  foo__test_mess_required_int32__free_unpacked (msg, NULL);
+}
+
+/* Straightforward decoder, to check the validator against. */
+static int
+utf8_reference_valid (const uint8_t *s, size_t len)
+{
+  static const uint32_t min_cp[] = { 0, 0, 0x80, 0x800, 0x10000 };
+  size_t i = 0;
+
+  while (i < len)
+    {
+      unsigned n, k;
+      uint32_t cp;
+
+      if (s[i] < 0x80)
+        n = 1, cp = s[i];
+      else if ((s[i] & 0xe0) == 0xc0)
+        n = 2, cp = s[i] & 0x1f;
+      else if ((s[i] & 0xf0) == 0xe0)
+        n = 3, cp = s[i] & 0x0f;
+      else if ((s[i] & 0xf8) == 0xf0)
+        n = 4, cp = s[i] & 0x07;
+      else
+        return 0;
+      if (i + n > len)
+        return 0;
+      for (k = 1; k < n; k++)
+        {
+          if ((s[i + k] & 0xc0) != 0x80)
+            return 0;
+          cp = (cp << 6) | (s[i + k] & 0x3f);
+        }
+      if (n > 1 && cp < min_cp[n])
+        return 0;
+      if (cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+        return 0;
+      i += n;
+    }
+  return 1;
+}
+
+/* Unpack `len` bytes of `text` as field 1 of `desc`, which must be a string. */
+static ProtobufCMessage *
+unpack_utf8_text (const ProtobufCMessageDescriptor *desc,
+                  ProtobufCUnpackContext *context,
+                  const uint8_t *text, size_t len)
+{
+  uint8_t data[256];
+
+  assert (len < 128);
+  data[0] = 0x0a;
+  data[1] = (uint8_t) len;
+  memcpy (data + 2, text, len);
+  return protobuf_c_message_unpack_with_context (desc, NULL, context,
+                                                 len + 2, data);
+}
+
+static void
+test_utf8_validation (void)
+{
+  static const uint8_t interesting[] = {
+    0x41, 0x7f, 0x80, 0x8f, 0x90, 0x9f, 0xa0, 0xbf,
+    0xc1, 0xc2, 0xe0, 0xed, 0xef, 0xf0, 0xf4, 0xf5,
+  };
+  static const char *valid[] = {
+    "",
+    "plain ascii",
+    "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80 \xf4\x8f\xbf\xbf",
+    "a long string that spans more than one block \xe2\x82\xac\xe2\x82\xac"
+    "\xf0\x9f\x98\x80 and ends in ascii",
+  };
+  static const uint8_t raw[] = { 0x1a, 0x02, 0xc0, 0xaf };
+  const ProtobufCMessageDescriptor *checked = &foo__test_mess_utf8__descriptor;
+  const ProtobufCMessageDescriptor *unchecked =
+    &foo__test_message_check__sub_message__descriptor;
+  ProtobufCUnpackContext *context;
+  ProtobufCMessage *msg;
+  Foo__TestMessUtf8 *utf8;
+  uint8_t text[40];
+  unsigned i, a, b, c, d;
+
+  assert (foo__test_mess_utf8__descriptor.fields[0].flags &
+          PROTOBUF_C_FIELD_FLAG_VALIDATE_UTF8);
+  assert (foo__test_mess_utf8__descriptor.fields[1].flags &
+          PROTOBUF_C_FIELD_FLAG_VALIDATE_UTF8);
+  assert (!(foo__test_mess_utf8__descriptor.fields[2].flags &
+            PROTOBUF_C_FIELD_FLAG_VALIDATE_UTF8));
+
+  for (i = 0; i < sizeof (valid) / sizeof (valid[0]); i++)
+    {
+      size_t len = strlen (valid[i]);
+
+      utf8 = (Foo__TestMessUtf8 *)
+        unpack_utf8_text (checked, NULL, (const uint8_t *) valid[i], len);
+      assert (utf8 != NULL);
+      assert (strcmp (utf8->text, valid[i]) == 0);
+      foo__test_mess_utf8__free_unpacked (utf8, NULL);
+    }
+
+  /* bytes fields are never checked */
+  utf8 = foo__test_mess_utf8__unpack (NULL, sizeof (raw), raw);
+  assert (utf8 != NULL && utf8->has_raw && utf8->raw.len == 2);
+  foo__test_mess_utf8__free_unpacked (utf8, NULL);
+
+  /* every 4-byte pattern, short and straddling a 32-byte block boundary */
+  for (a = 0; a < sizeof (interesting); a++)
+    for (b = 0; b < sizeof (interesting); b++)
+      for (c = 0; c < sizeof (interesting); c++)
+        for (d = 0; d < sizeof (interesting); d++)
+          {
+            uint8_t seq[4];
+            int expect;
+
+            seq[0] = interesting[a];
+            seq[1] = interesting[b];
+            seq[2] = interesting[c];
+            seq[3] = interesting[d];
+            expect = utf8_reference_valid (seq, 4);
+
+            msg = unpack_utf8_text (checked, NULL, seq, 4);
+            assert ((msg != NULL) == expect);
+            protobuf_c_message_free_unpacked (msg, NULL);
+
+            memset (text, 'x', sizeof (text));
+            memcpy (text + 30, seq, 4);
+            msg = unpack_utf8_text (checked, NULL, text, sizeof (text));
+            assert ((msg != NULL) == expect);
+            protobuf_c_message_free_unpacked (msg, NULL);
+
+            /* cut off at the end of the string */
+            msg = unpack_utf8_text (checked, NULL, text, 33);
+            assert ((msg != NULL) == utf8_reference_valid (text, 33));
+            protobuf_c_message_free_unpacked (msg, NULL);
+          }
+
+  /* per call: any string field is checked when the context asks for it */
+  text[0] = 0xed;
+  text[1] = 0xa0;
+  text[2] = 0x80;
+  msg = unpack_utf8_text (unchecked, NULL, text, 3);
+  assert (msg != NULL);
+  protobuf_c_message_free_unpacked (msg, NULL);
+
+  context = protobuf_c_unpack_context_new (NULL);
+  assert (context != NULL);
+  protobuf_c_unpack_context_set_flags (context,
+                                       PROTOBUF_C_UNPACK_VALIDATE_UTF8);
+  assert (unpack_utf8_text (unchecked, context, text, 3) == NULL);
+  msg = unpack_utf8_text (unchecked, context,
+                          (const uint8_t *) valid[2], strlen (valid[2]));
+  assert (msg != NULL);
+  protobuf_c_message_free_unpacked (msg, NULL);
+  protobuf_c_unpack_context_set_flags (context, 0);
+  msg = unpack_utf8_text (unchecked, context, text, 3);
+  assert (msg != NULL);
+  protobuf_c_message_free_unpacked (msg, NULL);
+  protobuf_c_unpack_context_free (context);
+}
+
+/*
+ * Serialise `depth` levels of TestMessNested, each one the `child` of the
+ * previous one, with `leaf` as the contents of the innermost message. The
+ * data is written at the end of `buf`; returns its start.
+ */
+static uint8_t *
+build_nested (uint8_t *buf, size_t size, unsigned depth,
+              const uint8_t *leaf, size_t leaf_len)
+{
+  uint8_t *at = buf + size - leaf_len;
+  unsigned i;
+
+  memcpy (at, leaf, leaf_len);
+  for (i = 1; i < depth; i++)
+    {
+      size_t len = buf + size - at;
+      uint8_t prefix[11];
+      size_t n = 0;
+
+      prefix[n++] = 0x0a;
+      do
+        {
+          prefix[n] = len & 0x7f;
+          len >>= 7;
+          if (len != 0)
+            prefix[n] |= 0x80;
+          n++;
+        }
+      while (len != 0);
+      at -= n;
+      assert (at >= buf);
+      memcpy (at, prefix, n);
+    }
+  return at;
+}
+
+static unsigned
+nested_depth (const Foo__TestMessNested *msg)
+{
+  unsigned depth = 1;
+
+  while (msg->child != NULL)
+    {
+      msg = msg->child;
+      depth++;
+    }
+  return depth;
+}
+
+static void
+test_nesting_depth (void)
+{
+  static const uint8_t value_leaf[] = { 0x10, 0x07 };
+  static const uint8_t children_leaf[] = { 0x1a, 0x00 };
+  const ProtobufCMessageDescriptor *desc = &foo__test_mess_nested__descriptor;
+  size_t size = 200000;
+  uint8_t *buf = malloc (size);
+  uint8_t *data, *merged;
+  size_t len, len2;
+  ProtobufCUnpackContext *context;
+  Foo__TestMessNested *msg, *leaf;
+  unsigned i;
+
+  assert (buf != NULL);
+
+  /* the default limit counts the top-level message */
+  data = build_nested (buf, size, PROTOBUF_C_DEFAULT_MAX_DEPTH,
+                       value_leaf, sizeof (value_leaf));
+  msg = foo__test_mess_nested__unpack (NULL, buf + size - data, data);
+  assert (msg != NULL);
+  assert (nested_depth (msg) == PROTOBUF_C_DEFAULT_MAX_DEPTH);
+  foo__test_mess_nested__free_unpacked (msg, NULL);
+
+  data = build_nested (buf, size, PROTOBUF_C_DEFAULT_MAX_DEPTH + 1,
+                       value_leaf, sizeof (value_leaf));
+  len = buf + size - data;
+  assert (foo__test_mess_nested__unpack (NULL, len, data) == NULL);
+  assert (protobuf_c_message_unpack_flat (desc, NULL, len, data) == NULL);
+
+  /* far deeper trees, unpacked and freed without recursion */
+  context = protobuf_c_unpack_context_new (NULL);
+  assert (context != NULL);
+  protobuf_c_unpack_context_set_max_depth (context, 3);
+  assert (protobuf_c_message_unpack_with_context (desc, NULL, context,
+                                                  len, data) == NULL);
+  protobuf_c_unpack_context_set_max_depth (context, 30000);
+  data = build_nested (buf, size, 30000, value_leaf, sizeof (value_leaf));
+  len = buf + size - data;
+  for (i = 0; i < 2; i++)
+    {
+      msg = (Foo__TestMessNested *)
+        protobuf_c_message_unpack_with_context (desc, NULL, context,
+                                                len, data);
+      assert (msg != NULL);
+      assert (nested_depth (msg) == 30000);
+      if (i == 0)
+        {
+          /* packing walks the same tree without recursion */
+          uint8_t *packed = malloc (len);
+          unsigned char scratch[16];
+          ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+
+          assert (packed != NULL);
+          assert (foo__test_mess_nested__get_packed_size (msg) == len);
+          assert (foo__test_mess_nested__pack (msg, packed) == len);
+          assert (memcmp (packed, data, len) == 0);
+          assert (foo__test_mess_nested__pack_to_buffer (msg, &bs.base) == len);
+          assert (bs.len == len);
+          assert (memcmp (bs.data, data, len) == 0);
+          PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+          free (packed);
+        }
+      foo__test_mess_nested__free_unpacked (msg, NULL);
+    }
+  assert (protobuf_c_message_unpack_with_context (desc, NULL, context,
+                                                  len - 1, data) == NULL);
+  protobuf_c_unpack_context_set_max_depth (context, 0);
+  assert (protobuf_c_message_unpack_with_context (desc, NULL, context,
+                                                  len, data) == NULL);
+
+  /* two chains of the same field are merged level by level */
+  data = build_nested (buf, size / 2, 50, value_leaf, sizeof (value_leaf));
+  len = buf + size / 2 - data;
+  merged = build_nested (buf + size / 2, size / 2, 50,
+                         children_leaf, sizeof (children_leaf));
+  len2 = buf + size - merged;
+  memmove (data + len, merged, len2);
+  msg = (Foo__TestMessNested *)
+    protobuf_c_message_unpack_with_context (desc, NULL, context,
+                                            len + len2, data);
+  assert (msg != NULL);
+  assert (nested_depth (msg) == 50);
+  for (leaf = msg; leaf->child != NULL; leaf = leaf->child)
+    ;
+  assert (leaf->has_value && leaf->value == 7);
+  assert (leaf->n_children == 1);
+  foo__test_mess_nested__free_unpacked (msg, NULL);
+
+  msg = (Foo__TestMessNested *)
+    protobuf_c_message_unpack_shared (desc, NULL, len + len2, data);
+  assert (msg != NULL);
+  leaf = msg->child;
+  protobuf_c_message_ref (&leaf->base);
+  protobuf_c_message_unref (&msg->base);
+  assert (nested_depth (leaf) == 49);
+  protobuf_c_message_unref (&leaf->base);
+
+  /* sibling sub-messages along a chain deeper than the stack frames */
+  {
+    Foo__TestMessNested nodes[40], leaves[40];
+    Foo__TestMessNested *children[40][2];
+    unsigned char scratch[16];
+    ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+
+    for (i = 0; i < 40; i++)
+      {
+        foo__test_mess_nested__init (&nodes[i]);
+        foo__test_mess_nested__init (&leaves[i]);
+        leaves[i].has_value = 1;
+        leaves[i].value = i * 1000;
+        children[i][0] = &leaves[i];
+        children[i][1] = i + 1 < 40 ? &nodes[i + 1] : &leaves[i];
+        nodes[i].n_children = 2;
+        nodes[i].children = children[i];
+        nodes[i].child = i % 3 == 0 ? &leaves[i] : NULL;
+      }
+    len = foo__test_mess_nested__get_packed_size (&nodes[0]);
+    assert (len <= size);
+    assert (foo__test_mess_nested__pack (&nodes[0], buf) == len);
+    assert (foo__test_mess_nested__pack_to_buffer (&nodes[0], &bs.base) == len);
+    assert (bs.len == len);
+    assert (memcmp (bs.data, buf, len) == 0);
+    PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+    msg = foo__test_mess_nested__unpack (NULL, len, buf);
+    assert (msg != NULL);
+    for (leaf = msg, i = 0; i + 1 < 40; leaf = leaf->children[1], i++)
+      {
+        assert (leaf->n_children == 2);
+        assert (leaf->children[0]->value == (int32_t) i * 1000);
+        assert ((leaf->child != NULL) == (i % 3 == 0));
+      }
+    assert (leaf->children[1]->value == 39000);
+    foo__test_mess_nested__free_unpacked (msg, NULL);
+  }
+
+  protobuf_c_unpack_context_free (context);
+  free (buf);
+}
+
+/*
+ * Check that protobuf_c_message_validate() agrees with unpacking on `data`,
+ * on every prefix of it and on every single-byte corruption of it.
+ */
+static void
+check_validate_like_unpack (const ProtobufCMessageDescriptor *desc,
+                            size_t len, uint8_t *data)
+{
+  static const uint8_t corrupt[] = { 0x00, 0x07, 0x7f, 0x80, 0xff };
+  ProtobufCMessage *msg;
+  size_t i;
+  unsigned c;
+
+  assert (protobuf_c_message_validate (desc, len, data, 0));
+  for (i = 0; i <= len; i++)
+    {
+      msg = protobuf_c_message_unpack (desc, NULL, i, data);
+      assert (protobuf_c_message_validate (desc, i, data, 0) == (msg != NULL));
+      protobuf_c_message_free_unpacked (msg, NULL);
+    }
+  for (i = 0; i < len; i++)
+    {
+      uint8_t saved = data[i];
+
+      for (c = 0; c < N_ELEMENTS (corrupt); c++)
+        {
+          data[i] = corrupt[c];
+          msg = protobuf_c_message_unpack (desc, NULL, len, data);
+          assert (protobuf_c_message_validate (desc, len, data, 0) ==
+                  (msg != NULL));
+          protobuf_c_message_free_unpacked (msg, NULL);
+        }
+      data[i] = saved;
+    }
+}
+
+static void
+test_validate (void)
+{
+  static const uint8_t required_int32[] = { 0xd0, 0x02, 0x05 };
+  static const uint8_t required_fixed[] = { 0xd5, 0x02, 1, 2, 3, 4 };
+  static const uint8_t bad_utf8[] = { 0x0a, 0x02, 0xc0, 0xaf };
+  static const uint8_t value_leaf[] = { 0x10, 0x07 };
+  /* oneof_mess twice, neither occurrence setting a member of its oneof */
+  static const uint8_t unset_oneof[] = {
+    0x0a, 0x00, 0x12, 0x00, 0x1a, 0x00, 0x1a, 0x00,
+    0x22, 0x02, 0x20, 0x00, 0x2a, 0x00
+  };
+  const ProtobufCMessageDescriptor *nested = &foo__test_mess_nested__descriptor;
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  Foo__TestMessPacked packed_mess = FOO__TEST_MESS_PACKED__INIT;
+  Foo__SubMess subs[5], *psubs[5];
+  const char *strings[] = { "", "one", "caf\xc3\xa9" };
+  int32_t int32s[] = { 0, -1, 300 };
+  int32_t sfixed32s[] = { 7, -7 };
+  uint64_t fixed64s[] = { 1, UINT64_MAX };
+  double doubles[] = { 0.5 };
+  protobuf_c_boolean booleans[] = { 1, 0 };
+  size_t size = 4000;
+  uint8_t *buf = malloc (size);
+  uint8_t *data;
+  size_t len;
+  unsigned i;
+
+  assert (buf != NULL);
+
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__sub_mess__init (&subs[i]);
+      subs[i].test = i;
+      psubs[i] = &subs[i];
+    }
+  mess.n_test_int32 = N_ELEMENTS (int32s);
+  mess.test_int32 = int32s;
+  mess.n_test_sfixed32 = N_ELEMENTS (sfixed32s);
+  mess.test_sfixed32 = sfixed32s;
+  mess.n_test_double = N_ELEMENTS (doubles);
+  mess.test_double = doubles;
+  mess.n_test_boolean = N_ELEMENTS (booleans);
+  mess.test_boolean = booleans;
+  mess.n_test_string = N_ELEMENTS (strings);
+  mess.test_string = strings;
+  mess.n_test_message = N_ELEMENTS (psubs);
+  mess.test_message = psubs;
+  len = foo__test_mess__pack (&mess, buf);
+  check_validate_like_unpack (&foo__test_mess__descriptor, len, buf);
+
+  packed_mess.n_test_int32 = N_ELEMENTS (int32s);
+  packed_mess.test_int32 = int32s;
+  packed_mess.n_test_sfixed32 = N_ELEMENTS (sfixed32s);
+  packed_mess.test_sfixed32 = sfixed32s;
+  packed_mess.n_test_fixed64 = N_ELEMENTS (fixed64s);
+  packed_mess.test_fixed64 = fixed64s;
+  packed_mess.n_test_boolean = N_ELEMENTS (booleans);
+  packed_mess.test_boolean = booleans;
+  len = foo__test_mess_packed__pack (&packed_mess, buf);
+  check_validate_like_unpack (&foo__test_mess_packed__descriptor, len, buf);
+
+  memcpy (buf, unset_oneof, sizeof (unset_oneof));
+  check_validate_like_unpack (&foo__test_mess_sub_mess__descriptor,
+                              sizeof (unset_oneof), buf);
+
+  /* required fields must be present, with the right wire type */
+  assert (!protobuf_c_message_validate
+          (&foo__test_mess_required_int32__descriptor, 0, NULL, 0));
+  assert (protobuf_c_message_validate
+          (&foo__test_mess_required_int32__descriptor,
+           sizeof (required_int32), required_int32, 0));
+  assert (!protobuf_c_message_validate
+          (&foo__test_mess_required_int32__descriptor,
+           sizeof (required_fixed), required_fixed, 0));
+
+  /* the nesting limit is the one unpacking applies by default */
+  data = build_nested (buf, size, PROTOBUF_C_DEFAULT_MAX_DEPTH,
+                       value_leaf, sizeof (value_leaf));
+  assert (protobuf_c_message_validate (nested, buf + size - data, data, 0));
+  data = build_nested (buf, size, PROTOBUF_C_DEFAULT_MAX_DEPTH + 1,
+                       value_leaf, sizeof (value_leaf));
+  assert (!protobuf_c_message_validate (nested, buf + size - data, data, 0));
+
+  /* UTF-8 is checked where the field or the caller asks for it */
+  assert (!protobuf_c_message_validate (&foo__test_mess_utf8__descriptor,
+                                        sizeof (bad_utf8), bad_utf8, 0));
+  assert (protobuf_c_message_validate
+          (&foo__test_message_check__sub_message__descriptor,
+           sizeof (bad_utf8), bad_utf8, 0));
+  assert (!protobuf_c_message_validate
+          (&foo__test_message_check__sub_message__descriptor,
+           sizeof (bad_utf8), bad_utf8, PROTOBUF_C_UNPACK_VALIDATE_UTF8));
+
+  free (buf);
+}
+
+/* Search `len` bytes of `data` for `path` in a `desc` message. */
+static protobuf_c_boolean
+find_wire_field (const ProtobufCMessageDescriptor *desc, const char *path,
+                 size_t len, const uint8_t *data, ProtobufCWireValue *value)
+{
+  ProtobufCWirePath *compiled = protobuf_c_wire_path_new (desc, path, NULL);
+  protobuf_c_boolean rv;
+
+  assert (compiled != NULL);
+  rv = protobuf_c_wire_find_field (compiled, len, data, value);
+  protobuf_c_wire_path_free (compiled);
+  return rv;
+}
+
+static void
+test_wire_find_field (void)
+{
+  static const uint8_t oneof_cleared[] = { 0x08, 0x05, 0x82, 0x01, 0x01, 'x' };
+  static const uint8_t oneof_set[] = { 0x82, 0x01, 0x01, 'x', 0x08, 0x05 };
+  static const uint8_t wrong_wire_type[] = { 0x18, 0x05 };
+  const ProtobufCMessageDescriptor *desc = &foo__test_mess_sub_mess__descriptor;
+  Foo__TestMessSubMess mess = FOO__TEST_MESS_SUB_MESS__INIT;
+  Foo__TestMess rep_mess = FOO__TEST_MESS__INIT;
+  Foo__TestMessOptional opt_mess = FOO__TEST_MESS_OPTIONAL__INIT;
+  Foo__TestMessOneof oneof_mess = FOO__TEST_MESS_ONEOF__INIT;
+  Foo__SubMess req_mess = FOO__SUB_MESS__INIT;
+  Foo__SubMess__SubSubMess sub1 = FOO__SUB_MESS__SUB_SUB_MESS__INIT;
+  Foo__DefaultOptionalValues def_mess = FOO__DEFAULT_OPTIONAL_VALUES__INIT;
+  const char *strings[] = { "skipped", "over" };
+  ProtobufCWireValue value;
+  Foo__TestMessSubMess *unpacked;
+  uint8_t data[512], sub[64];
+  size_t len, len2, sub_len;
+
+  rep_mess.n_test_string = N_ELEMENTS (strings);
+  rep_mess.test_string = strings;
+  oneof_mess.test_oneof_case = FOO__TEST_MESS_ONEOF__TEST_ONEOF_TEST_STRING;
+  oneof_mess.test_string = "x";
+  req_mess.test = 5;
+  sub1.has_val1 = 1;
+  sub1.val1 = 7;
+  sub1.str1 = "abc";
+  req_mess.sub1 = &sub1;
+  mess.rep_mess = &rep_mess;
+  mess.opt_mess = &opt_mess;
+  mess.oneof_mess = &oneof_mess;
+  mess.req_mess = &req_mess;
+  mess.def_mess = &def_mess;
+  len = foo__test_mess_sub_mess__pack (&mess, data);
+
+  /* scalars, strings and sub-messages, set or defaulted */
+  assert (find_wire_field (desc, "req_mess.sub1.val1", len, data, &value));
+  assert (value.present && value.value.v_int32 == 7);
+  assert (value.field == protobuf_c_message_descriptor_get_field_by_name
+          (&foo__sub_mess__sub_sub_mess__descriptor, "val1"));
+  assert (find_wire_field (desc, "req_mess.sub1.str1", len, data, &value));
+  assert (value.present && value.value.v_binary.len == 3);
+  assert (memcmp (value.value.v_binary.data, "abc", 3) == 0);
+  assert (value.value.v_binary.data > data &&
+          value.value.v_binary.data < data + len);
+  assert (find_wire_field (desc, "req_mess.test", len, data, &value));
+  assert (value.present && value.value.v_int32 == 5);
+  assert (find_wire_field (desc, "req_mess.sub2.val1", len, data, &value));
+  assert (!value.present && value.value.v_int32 == 100);
+  assert (find_wire_field (desc, "req_mess.sub2.str1", len, data, &value));
+  assert (!value.present &&
+          value.value.v_binary.len == strlen ("hello world\n"));
+  assert (find_wire_field (desc, "def_mess.v_double", len, data, &value));
+  assert (!value.present && value.value.v_double == 4.5);
+  assert (find_wire_field (desc, "def_mess.v_bytes", len, data, &value));
+  assert (!value.present && value.value.v_binary.len == 13);
+  assert (find_wire_field (desc, "oneof_mess.test_string", len, data, &value));
+  assert (value.present && value.value.v_binary.len == 1);
+  assert (find_wire_field (desc, "oneof_mess.test_int32", len, data, &value));
+  assert (!value.present && value.value.v_int32 == 0);
+  sub_len = foo__sub_mess__pack (&req_mess, sub);
+  assert (find_wire_field (desc, "req_mess", len, data, &value));
+  assert (value.present && value.value.v_binary.len == sub_len);
+  assert (memcmp (value.value.v_binary.data, sub, sub_len) == 0);
+
+  /* concatenated messages merge: the last value set wins */
+  req_mess.sub1 = NULL;
+  req_mess.test = 6;
+  len2 = foo__test_mess_sub_mess__pack (&mess, data + len);
+  assert (find_wire_field (desc, "req_mess.sub1.val1", len + len2, data,
+                           &value));
+  assert (value.present && value.value.v_int32 == 7);
+  assert (find_wire_field (desc, "req_mess.test", len + len2, data, &value));
+  assert (value.present && value.value.v_int32 == 6);
+  unpacked = foo__test_mess_sub_mess__unpack (NULL, len + len2, data);
+  assert (unpacked != NULL);
+  assert (unpacked->req_mess->test == 6);
+  assert (unpacked->req_mess->sub1->val1 == 7);
+  foo__test_mess_sub_mess__free_unpacked (unpacked, NULL);
+
+  /* a later member of the same oneof clears the field */
+  desc = &foo__test_mess_oneof__descriptor;
+  assert (find_wire_field (desc, "test_int32", sizeof (oneof_cleared),
+                           oneof_cleared, &value));
+  assert (!value.present);
+  assert (find_wire_field (desc, "test_int32", sizeof (oneof_set),
+                           oneof_set, &value));
+  assert (value.present && value.value.v_int32 == 5);
+
+  /* malformed data */
+  assert (!find_wire_field (desc, "test_int32", sizeof (oneof_set) - 1,
+                            oneof_set, &value));
+  assert (!find_wire_field (desc, "test_string", sizeof (oneof_cleared) - 1,
+                            oneof_cleared, &value));
+  assert (!find_wire_field (desc, "test_sfixed32", sizeof (wrong_wire_type),
+                            wrong_wire_type, &value));
+
+  /* only singular fields, and messages until the last one */
+  desc = &foo__test_mess_sub_mess__descriptor;
+  assert (protobuf_c_wire_path_new (desc, "rep_mess.test_int32", NULL) == NULL);
+  assert (protobuf_c_wire_path_new (desc, "req_mess.test.val1", NULL) == NULL);
+  assert (protobuf_c_wire_path_new (desc, "req_mess.nope", NULL) == NULL);
+  assert (protobuf_c_wire_path_new (desc, "req_mess.", NULL) == NULL);
+  assert (protobuf_c_wire_path_new (desc, "", NULL) == NULL);
+}
+
+static void
+test_views (void)
+{
+  static const uint8_t oneof_cleared[] = { 0x08, 0x05, 0x82, 0x01, 0x01, 'x' };
+  static const uint8_t missing_required[] = { 0x30, 0x01 };
+  Foo__TestMessOptional opt = FOO__TEST_MESS_OPTIONAL__INIT;
+  Foo__TestMessOptionalView *opt_view;
+  Foo__TestMess mess = FOO__TEST_MESS__INIT, *unpacked;
+  Foo__TestMessPacked packed_mess = FOO__TEST_MESS_PACKED__INIT;
+  Foo__TestMessView *view;
+  Foo__TestMessOneofView *oneof_view;
+  Foo__SubMess subs[3], *psubs[3];
+  Foo__SubMess__SubSubMess sub1 = FOO__SUB_MESS__SUB_SUB_MESS__INIT;
+  Foo__SubMessView *sub_view;
+  ProtobufCView *sub_sub_view;
+  ProtobufCViewIter iter;
+  ProtobufCWireValue value;
+  ProtobufCBinaryData binary;
+  const char *strings[] = { "zero", "", "two" };
+  int32_t int32s[] = { 1, -2, 300000 };
+  double doubles[] = { 0.25, -8 };
+  Foo__TestEnum test_enum;
+  int32_t v_int32;
+  int64_t v_int64;
+  uint64_t v_uint64;
+  double v_double;
+  protobuf_c_boolean v_boolean;
+  uint8_t data[1024];
+  size_t len, len2, i;
+
+  /* singular fields, present and absent */
+  opt.has_test_sint32 = 1;
+  opt.test_sint32 = -77;
+  opt.has_test_sint64 = 1;
+  opt.test_sint64 = INT64_MIN;
+  opt.has_test_fixed64 = 1;
+  opt.test_fixed64 = UINT64_MAX;
+  opt.has_test_boolean = 1;
+  opt.test_boolean = 1;
+  opt.has_test_enum = 1;
+  opt.test_enum = FOO__TEST_ENUM__VALUE2097152;
+  opt.test_string = "text";
+  len = protobuf_c_message_pack (&opt.base, data);
+  opt_view = foo__test_mess_optional_view__new (NULL, len, data);
+  assert (opt_view != NULL);
+  assert (foo__test_mess_optional_view__get_test_sint32 (opt_view, &v_int32));
+  assert (v_int32 == -77);
+  assert (foo__test_mess_optional_view__get_test_sint64 (opt_view, &v_int64));
+  assert (v_int64 == INT64_MIN);
+  assert (foo__test_mess_optional_view__get_test_fixed64 (opt_view,
+                                                          &v_uint64));
+  assert (v_uint64 == UINT64_MAX);
+  assert (foo__test_mess_optional_view__get_test_boolean (opt_view,
+                                                          &v_boolean));
+  assert (v_boolean == 1);
+  assert (foo__test_mess_optional_view__get_test_enum (opt_view, &test_enum));
+  assert (test_enum == FOO__TEST_ENUM__VALUE2097152);
+  assert (foo__test_mess_optional_view__get_test_string (opt_view, &binary));
+  assert (binary.len == 4 && memcmp (binary.data, "text", 4) == 0);
+  assert (binary.data > data && binary.data < data + len);
+  assert (!foo__test_mess_optional_view__get_test_int32 (opt_view, &v_int32));
+  assert (v_int32 == 0);
+  assert (!foo__test_mess_optional_view__get_test_message (opt_view,
+                                                           &binary));
+  assert (binary.len == 0);
+  foo__test_mess_optional_view__free (opt_view);
+
+  /* sub-messages are read from their own views; defaults apply */
+  foo__sub_mess__init (&subs[0]);
+  subs[0].test = 12;
+  sub1.str1 = "str";
+  subs[0].sub1 = &sub1;
+  len = foo__sub_mess__pack (&subs[0], data);
+  sub_view = foo__sub_mess_view__new (NULL, len, data);
+  assert (sub_view != NULL);
+  assert (foo__sub_mess_view__get_test (sub_view, &v_int32) && v_int32 == 12);
+  assert (foo__sub_mess_view__n_rep (sub_view) == 0);
+  assert (!foo__sub_mess_view__get_sub2 (sub_view, &binary));
+  assert (foo__sub_mess_view__get_sub1 (sub_view, &binary));
+  sub_sub_view = protobuf_c_view_new
+    (&foo__sub_mess__sub_sub_mess__descriptor, NULL, binary.len, binary.data);
+  assert (sub_sub_view != NULL);
+  assert (!protobuf_c_view_get (sub_sub_view, 0, &value));
+  assert (value.value.v_int32 == 100);
+  assert (protobuf_c_view_get (sub_sub_view, 2, &value));
+  assert (value.value.v_binary.len == 3);
+  protobuf_c_view_free (sub_sub_view);
+  foo__sub_mess_view__free (sub_view);
+  assert (foo__sub_mess_view__new (NULL, sizeof (missing_required),
+                                   missing_required) == NULL);
+
+  /* repeated fields, packed and not, in the order unpacking sees them */
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__sub_mess__init (&subs[i]);
+      subs[i].test = i;
+      psubs[i] = &subs[i];
+    }
+  mess.n_test_int32 = N_ELEMENTS (int32s);
+  mess.test_int32 = int32s;
+  mess.n_test_double = N_ELEMENTS (doubles);
+  mess.test_double = doubles;
+  mess.n_test_string = N_ELEMENTS (strings);
+  mess.test_string = strings;
+  mess.n_test_message = N_ELEMENTS (psubs);
+  mess.test_message = psubs;
+  len = foo__test_mess__pack (&mess, data);
+  packed_mess.n_test_int32 = N_ELEMENTS (int32s);
+  packed_mess.test_int32 = int32s;
+  packed_mess.n_test_double = N_ELEMENTS (doubles);
+  packed_mess.test_double = doubles;
+  len2 = foo__test_mess_packed__pack (&packed_mess, data + len);
+  len += len2;
+  len2 = foo__test_mess__pack (&mess, data + len);
+  len += len2;
+
+  unpacked = foo__test_mess__unpack (NULL, len, data);
+  assert (unpacked != NULL);
+  view = foo__test_mess_view__new (NULL, len, data);
+  assert (view != NULL);
+  assert (foo__test_mess_view__n_test_int32 (view) == unpacked->n_test_int32);
+  foo__test_mess_view__iter_test_int32 (view, &iter);
+  for (i = 0; foo__test_mess_view__next_test_int32 (&iter, &v_int32); i++)
+    assert (v_int32 == unpacked->test_int32[i]);
+  assert (i == unpacked->n_test_int32);
+  assert (foo__test_mess_view__n_test_double (view) ==
+          unpacked->n_test_double);
+  foo__test_mess_view__iter_test_double (view, &iter);
+  for (i = 0; foo__test_mess_view__next_test_double (&iter, &v_double); i++)
+    assert (v_double == unpacked->test_double[i]);
+  assert (i == unpacked->n_test_double);
+  foo__test_mess_view__iter_test_string (view, &iter);
+  for (i = 0; foo__test_mess_view__next_test_string (&iter, &binary); i++)
+    {
+      assert (binary.len == strlen (unpacked->test_string[i]));
+      assert (memcmp (binary.data, unpacked->test_string[i], binary.len) == 0);
+    }
+  assert (i == unpacked->n_test_string);
+  foo__test_mess_view__iter_test_message (view, &iter);
+  for (i = 0; foo__test_mess_view__next_test_message (&iter, &binary); i++)
+    {
+      sub_view = foo__sub_mess_view__new (NULL, binary.len, binary.data);
+      assert (sub_view != NULL);
+      assert (foo__sub_mess_view__get_test (sub_view, &v_int32));
+      assert (v_int32 == unpacked->test_message[i]->test);
+      foo__sub_mess_view__free (sub_view);
+    }
+  assert (i == unpacked->n_test_message);
+  assert (foo__test_mess_view__n_test_boolean (view) == 0);
+  foo__test_mess_view__iter_test_boolean (view, &iter);
+  assert (!foo__test_mess_view__next_test_boolean (&iter, &v_boolean));
+  foo__test_mess_view__free (view);
+  foo__test_mess__free_unpacked (unpacked, NULL);
+
+  /* malformed data has no view */
+  assert (foo__test_mess_view__new (NULL, len - 1, data) == NULL);
+
+  /* a later member of the same oneof clears the others */
+  oneof_view = foo__test_mess_oneof_view__new (NULL, sizeof (oneof_cleared),
+                                               oneof_cleared);
+  assert (oneof_view != NULL);
+  assert (!foo__test_mess_oneof_view__get_test_int32 (oneof_view, &v_int32));
+  assert (foo__test_mess_oneof_view__get_test_string (oneof_view, &binary));
+  assert (binary.len == 1 && binary.data[0] == 'x');
+  foo__test_mess_oneof_view__free (oneof_view);
+}
+
+static void
+test_unpack_batch (void)
+{
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  Foo__SubMess subs[40], *psubs[40];
+  uint8_t *bufs[20], *repacked;
+  const uint8_t *datas[20];
+  size_t lens[20];
+  ProtobufCMessage *out[20];
+  unsigned i;
+
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__sub_mess__init (&subs[i]);
+      subs[i].test = i;
+      psubs[i] = &subs[i];
+    }
+  mess.test_message = psubs;
+
+  /* messages of growing size, every fifth one truncated */
+  for (i = 0; i < N_ELEMENTS (bufs); i++)
+    {
+      mess.n_test_message = 2 * i;
+      lens[i] = foo__test_mess__get_packed_size (&mess);
+      bufs[i] = malloc (lens[i] + 1);
+      assert (bufs[i] != NULL);
+      assert (foo__test_mess__pack (&mess, bufs[i]) == lens[i]);
+      if (i % 5 == 4)
+        lens[i]--;
+      datas[i] = bufs[i];
+    }
+  assert (protobuf_c_message_unpack_batch (&foo__test_mess__descriptor, NULL,
+                                           N_ELEMENTS (bufs), lens, datas,
+                                           out) == 16);
+  for (i = 0; i < N_ELEMENTS (bufs); i++)
+    {
+      if (i % 5 == 4)
+        {
+          assert (out[i] == NULL);
+          continue;
+        }
+      assert (out[i] != NULL);
+      assert (((Foo__TestMess *) out[i])->n_test_message == 2 * i);
+      repacked = malloc (lens[i] + 1);
+      assert (protobuf_c_message_pack (out[i], repacked) == lens[i]);
+      assert (memcmp (repacked, bufs[i], lens[i]) == 0);
+      free (repacked);
+      protobuf_c_message_free_unpacked (out[i], NULL);
+    }
+
+  /* nothing is left allocated, scratch memory included */
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  assert (protobuf_c_message_unpack_batch (&foo__test_mess__descriptor,
+                                           &test_allocator,
+                                           N_ELEMENTS (bufs), lens, datas,
+                                           out) == 16);
+  for (i = 0; i < N_ELEMENTS (bufs); i++)
+    {
+      protobuf_c_message_free_unpacked (out[i], &test_allocator);
+      free (bufs[i]);
+    }
+  assert (test_allocator_data.alloc_count == 0);
+  assert (protobuf_c_message_unpack_batch (&foo__test_mess__descriptor, NULL,
+                                           0, lens, datas, out) == 0);
+}
+
+/* runs the tasks serially, last first, and counts the runs */
+static void
+reverse_executor_run (ProtobufCExecutor *executor, size_t n,
+                      void (*task) (void *task_data, size_t i),
+                      void *task_data)
+{
+  size_t i;
+
+  ++*(unsigned *) executor->executor_data;
+  for (i = n; i > 0; i--)
+    task (task_data, i - 1);
+}
+
+static void
+test_unpack_executor (void)
+{
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  Foo__SubMess subs[40], *psubs[40];
+  Foo__TestMess *out;
+  ProtobufCUnpackContext *context;
+  unsigned runs = 0;
+  ProtobufCExecutor executor = { reverse_executor_run, &runs };
+  uint8_t *buf, *repacked;
+  size_t len;
+  unsigned i;
+  int good_allocs;
+
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__sub_mess__init (&subs[i]);
+      subs[i].test = i;
+      psubs[i] = &subs[i];
+    }
+  mess.test_message = psubs;
+  mess.n_test_message = N_ELEMENTS (subs);
+  len = foo__test_mess__get_packed_size (&mess);
+  buf = malloc (len);
+  repacked = malloc (len);
+  assert (buf != NULL && repacked != NULL);
+  assert (foo__test_mess__pack (&mess, buf) == len);
+
+  context = protobuf_c_unpack_context_new (NULL);
+  assert (context != NULL);
+  protobuf_c_unpack_context_set_executor (context, &executor, 32);
+
+  /* the elements come out in wire order whatever order the tasks ran in */
+  out = (Foo__TestMess *) protobuf_c_message_unpack_with_context
+    (&foo__test_mess__descriptor, NULL, context, len, buf);
+  assert (out != NULL);
+  assert (runs == 1);
+  assert (out->n_test_message == N_ELEMENTS (subs));
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    assert (out->test_message[i]->test == (int32_t) i);
+  assert (foo__test_mess__pack (out, repacked) == len);
+  assert (memcmp (repacked, buf, len) == 0);
+  foo__test_mess__free_unpacked (out, NULL);
+
+  /* fields below the threshold are unpacked serially */
+  protobuf_c_unpack_context_set_executor (context, &executor, 41);
+  out = (Foo__TestMess *) protobuf_c_message_unpack_with_context
+    (&foo__test_mess__descriptor, NULL, context, len, buf);
+  assert (out != NULL);
+  assert (runs == 1);
+  foo__test_mess__free_unpacked (out, NULL);
+
+  /* a failing element fails the unpack without leaking the others */
+  protobuf_c_unpack_context_set_executor (context, &executor, 1);
+  good_allocs = 0;
+  do
+    {
+      test_allocator_data.alloc_count = 0;
+      test_allocator_data.allocs_left = good_allocs++;
+      out = (Foo__TestMess *) protobuf_c_message_unpack_with_context
+        (&foo__test_mess__descriptor, &test_allocator, context, len, buf);
+      if (out != NULL)
+        {
+          assert (out->n_test_message == N_ELEMENTS (subs));
+          foo__test_mess__free_unpacked (out, &test_allocator);
+        }
+      assert (test_allocator_data.alloc_count == 0);
+    }
+  while (out == NULL);
+
+  protobuf_c_unpack_context_free (context);
+  free (repacked);
+  free (buf);
+}
+
+static void
+test_pack_parallel (void)
+{
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  Foo__SubMess subs[300], *psubs[300];
+  int32_t values[150];
+  int32_t ints[3] = { 1, -1, 300 };
+  const char *strings[2] = { "a", "bc" };
+  unsigned runs = 0;
+  ProtobufCExecutor executor = { reverse_executor_run, &runs };
+  uint8_t *expected, *actual;
+  size_t len;
+  unsigned i;
+
+  for (i = 0; i < N_ELEMENTS (values); i++)
+    values[i] = i * 1000;
+  /* bodies long enough for two-byte length prefixes, and empty ones */
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__sub_mess__init (&subs[i]);
+      subs[i].test = i;
+      subs[i].n_rep = i % N_ELEMENTS (values);
+      subs[i].rep = values;
+      psubs[i] = &subs[i];
+    }
+  mess.test_int32 = ints;
+  mess.n_test_int32 = N_ELEMENTS (ints);
+  mess.test_string = strings;
+  mess.n_test_string = 2;
+  mess.test_message = psubs;
+
+  /* fields too small to split are packed serially */
+  mess.n_test_message = 10;
+  len = foo__test_mess__get_packed_size (&mess);
+  expected = malloc (len);
+  actual = malloc (len);
+  assert (foo__test_mess__pack (&mess, expected) == len);
+  assert (protobuf_c_message_pack_parallel (&mess.base, actual,
+                                            &executor) == len);
+  assert (memcmp (actual, expected, len) == 0);
+  assert (runs == 0);
+  free (expected);
+  free (actual);
+
+  mess.n_test_message = N_ELEMENTS (subs);
+  len = foo__test_mess__get_packed_size (&mess);
+  expected = malloc (len);
+  actual = malloc (len);
+  assert (foo__test_mess__pack (&mess, expected) == len);
+  assert (protobuf_c_message_pack_parallel (&mess.base, actual,
+                                            &executor) == len);
+  assert (memcmp (actual, expected, len) == 0);
+  assert (runs == 2);
+  memset (actual, 0, len);
+  assert (protobuf_c_message_pack_parallel (&mess.base, actual, NULL) == len);
+  assert (memcmp (actual, expected, len) == 0);
+  free (expected);
+  free (actual);
+}
+
+typedef struct
+{
+  unsigned next;
+  unsigned n;
+  Foo__SubMess sub;
+} CountingGenerator;
+
+static protobuf_c_boolean
+generate_int32 (ProtobufCFieldGenerator *generator, void *element)
+{
+  CountingGenerator *gen = generator->generator_data;
+
+  if (gen->next == gen->n)
+    return 0;
+  *(int32_t *) element = gen->next++ * 3;
+  return 1;
+}
+
+/* every element is the same message, refilled */
+static protobuf_c_boolean
+generate_sub_mess (ProtobufCFieldGenerator *generator, void *element)
+{
+  CountingGenerator *gen = generator->generator_data;
+
+  if (gen->next == gen->n)
+    return 0;
+  gen->sub.test = gen->next++;
+  *(ProtobufCMessage **) element = &gen->sub.base;
+  return 1;
+}
+
+static void
+test_pack_to_buffer_generated (void)
+{
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  Foo__TestMessPacked packed_mess = FOO__TEST_MESS_PACKED__INIT;
+  Foo__TestMessPacked *unpacked_packed;
+  Foo__SubMess subs[600], *psubs[600];
+  int32_t int32s[600];
+  const char *strings[] = { "x", "yz" };
+  CountingGenerator int_gen, sub_gen;
+  ProtobufCFieldGenerator generators[2];
+  uint8_t scratch[16];
+  ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  uint8_t *expected;
+  size_t len;
+  unsigned i;
+
+  memset (&int_gen, 0, sizeof (int_gen));
+  memset (&sub_gen, 0, sizeof (sub_gen));
+  foo__sub_mess__init (&sub_gen.sub);
+  int_gen.n = sub_gen.n = N_ELEMENTS (subs);
+  generators[0].field = protobuf_c_message_descriptor_get_field_by_name
+    (&foo__test_mess__descriptor, "test_int32");
+  generators[0].next = generate_int32;
+  generators[0].generator_data = &int_gen;
+  generators[1].field = protobuf_c_message_descriptor_get_field_by_name
+    (&foo__test_mess__descriptor, "test_message");
+  generators[1].next = generate_sub_mess;
+  generators[1].generator_data = &sub_gen;
+
+  /* the same bytes as packing the materialised arrays */
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__sub_mess__init (&subs[i]);
+      subs[i].test = i;
+      psubs[i] = &subs[i];
+      int32s[i] = i * 3;
+    }
+  mess.test_string = strings;
+  mess.n_test_string = N_ELEMENTS (strings);
+  mess.test_int32 = int32s;
+  mess.n_test_int32 = N_ELEMENTS (int32s);
+  mess.test_message = psubs;
+  mess.n_test_message = N_ELEMENTS (subs);
+  len = foo__test_mess__get_packed_size (&mess);
+  expected = malloc (len);
+  assert (expected != NULL);
+  foo__test_mess__pack (&mess, expected);
+
+  /* the arrays of generated fields are ignored */
+  mess.n_test_int32 = 1;
+  mess.test_message = NULL;
+  mess.n_test_message = 0;
+  assert (protobuf_c_message_pack_to_buffer_generated (&mess.base, 2,
+                                                       generators,
+                                                       &bs.base) == len);
+  assert (bs.len == len);
+  assert (memcmp (bs.data, expected, len) == 0);
+  free (expected);
+
+  /* packed values come in runs of packed members */
+  int_gen.next = 0;
+  int_gen.n = 1000;
+  generators[0].field = protobuf_c_message_descriptor_get_field_by_name
+    (&foo__test_mess_packed__descriptor, "test_int32");
+  bs.len = 0;
+  len = protobuf_c_message_pack_to_buffer_generated (&packed_mess.base, 1,
+                                                     generators, &bs.base);
+  assert (len == bs.len);
+  unpacked_packed = foo__test_mess_packed__unpack (NULL, bs.len, bs.data);
+  assert (unpacked_packed != NULL);
+  assert (unpacked_packed->n_test_int32 == 1000);
+  for (i = 0; i < 1000; i++)
+    assert (unpacked_packed->test_int32[i] == (int32_t) i * 3);
+  foo__test_mess_packed__free_unpacked (unpacked_packed, NULL);
+
+  /* an empty generator packs nothing */
+  int_gen.next = 0;
+  int_gen.n = 0;
+  bs.len = 0;
+  assert (protobuf_c_message_pack_to_buffer_generated (&packed_mess.base, 1,
+                                                       generators,
+                                                       &bs.base) == 0);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+}
+
+/* unpack from buffers and check that the result packs to `data` */
+/* Records the largest request, to catch sizes trusted before checking. */
+static size_t iov_largest_alloc;
+
+static void *iov_recording_alloc (void *allocator_data, size_t size)
+{
+  if (size > iov_largest_alloc)
+    iov_largest_alloc = size;
+  return test_alloc (allocator_data, size);
+}
+
+static void
+check_unpack_iov (const ProtobufCBinaryData *iov, size_t iovcnt,
+                  size_t len, const uint8_t *data)
+{
+  ProtobufCMessage *unpacked;
+  uint8_t *repacked = malloc (len + 1);
+
+  assert (repacked != NULL);
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  unpacked = protobuf_c_message_unpack_iov (&foo__test_mess__descriptor,
+                                            &test_allocator, iov, iovcnt);
+  assert (unpacked != NULL);
+  assert (protobuf_c_message_pack (unpacked, repacked) == len);
+  assert (memcmp (repacked, data, len) == 0);
+  protobuf_c_message_free_unpacked (unpacked, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+  free (repacked);
+}
+
+static void
+test_unpack_iov (void)
+{
+  static uint8_t bytes_data[300];
+  static const uint8_t huge_member[] = { 0x0a, 0xff, 0xff, 0xff, 0xff, 0x07, 'x' };
+  ProtobufCAllocator recording_allocator = {
+    .alloc = iov_recording_alloc,
+    .free = test_free,
+    .allocator_data = &test_allocator_data,
+  };
+  const char *strings[] = { "one", "two", "three" };
+  ProtobufCBinaryData bytes[1] = { { sizeof (bytes_data), bytes_data } };
+  int32_t int32s[] = { 1, -1, 1 << 30 };
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  Foo__SubMess subs[5], *psubs[5];
+  ProtobufCBinaryData iov[4], *singles;
+  uint8_t *data;
+  size_t len, cut, i;
+
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__sub_mess__init (&subs[i]);
+      subs[i].test = i * 100000;
+      psubs[i] = &subs[i];
+    }
+  memset (bytes_data, 0xab, sizeof (bytes_data));
+  mess.test_int32 = int32s;
+  mess.n_test_int32 = N_ELEMENTS (int32s);
+  mess.test_string = strings;
+  mess.n_test_string = N_ELEMENTS (strings);
+  mess.test_bytes = bytes;
+  mess.n_test_bytes = N_ELEMENTS (bytes);
+  mess.test_message = psubs;
+  mess.n_test_message = N_ELEMENTS (subs);
+  len = foo__test_mess__get_packed_size (&mess);
+  data = malloc (len);
+  assert (data != NULL);
+  foo__test_mess__pack (&mess, data);
+
+  /* two buffers cut anywhere, with an empty one in between */
+  for (cut = 0; cut <= len; cut++)
+    {
+      iov[0].data = data;
+      iov[0].len = cut;
+      iov[1].data = NULL;
+      iov[1].len = 0;
+      iov[2].data = data + cut;
+      iov[2].len = len - cut;
+      check_unpack_iov (iov, 3, len, data);
+    }
+
+  /* every byte in a buffer of its own */
+  singles = malloc (len * sizeof (ProtobufCBinaryData));
+  assert (singles != NULL);
+  for (i = 0; i < len; i++)
+    {
+      singles[i].data = data + i;
+      singles[i].len = 1;
+    }
+  check_unpack_iov (singles, len, len, data);
+
+  /* truncated data fails without leaking the straddling copies */
+  test_allocator_data.alloc_count = 0;
+  assert (protobuf_c_message_unpack_iov (&foo__test_mess__descriptor,
+                                         &test_allocator, singles,
+                                         len - 1) == NULL);
+  assert (test_allocator_data.alloc_count == 0);
+  iov[0].data = data;
+  iov[0].len = len / 2;
+  iov[1].data = data + len / 2;
+  iov[1].len = len - len / 2 - 1;
+  assert (protobuf_c_message_unpack_iov (&foo__test_mess__descriptor,
+                                         &test_allocator, iov, 2) == NULL);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* a straddling member claiming more than is left is never allocated */
+  iov[0].data = (uint8_t *) huge_member;
+  iov[0].len = 3;
+  iov[1].data = (uint8_t *) huge_member + 3;
+  iov[1].len = sizeof (huge_member) - 3;
+  iov_largest_alloc = 0;
+  assert (protobuf_c_message_unpack_iov (&foo__test_mess__descriptor,
+                                         &recording_allocator, iov, 2) == NULL);
+  assert (iov_largest_alloc < 1000);
+  assert (protobuf_c_message_unpack (&foo__test_mess__descriptor,
+                                     &recording_allocator,
+                                     sizeof (huge_member), huge_member) == NULL);
+  assert (iov_largest_alloc < 1000);
+  assert (test_allocator_data.alloc_count == 0);
+  free (singles);
+  free (data);
+}
+
+/* encode in chunks of each size and compare with a plain pack */
+static void
+check_encoder_chunks (const ProtobufCMessage *message)
+{
+  static const size_t chunk_sizes[] = { 1, 2, 7, 64, 1000, 100000 };
+  size_t len = protobuf_c_message_get_packed_size (message);
+  uint8_t *expected = malloc (len + 1);
+  uint8_t *actual = malloc (len + 1);
+  unsigned i;
+
+  assert (expected != NULL && actual != NULL);
+  assert (protobuf_c_message_pack (message, expected) == len);
+  for (i = 0; i < N_ELEMENTS (chunk_sizes); i++)
+    {
+      ProtobufCEncoder *encoder = protobuf_c_encoder_new (message, NULL);
+      ProtobufCEncodeStatus status;
+      size_t at = 0, written, cap;
+
+      assert (encoder != NULL);
+      do
+        {
+          cap = chunk_sizes[i] < len + 1 - at ? chunk_sizes[i] : len + 1 - at;
+          status = protobuf_c_encoder_next (encoder, actual + at, cap,
+                                            &written);
+          assert (status != PROTOBUF_C_ENCODE_ERROR);
+          assert (status == PROTOBUF_C_ENCODE_DONE || written == cap);
+          at += written;
+          assert (at <= len);
+        }
+      while (status == PROTOBUF_C_ENCODE_MORE);
+      assert (at == len);
+      assert (memcmp (actual, expected, len) == 0);
+      assert (protobuf_c_encoder_next (encoder, actual, 1, &written) ==
+              PROTOBUF_C_ENCODE_DONE);
+      assert (written == 0);
+      protobuf_c_encoder_free (encoder);
+    }
+  free (expected);
+  free (actual);
+}
+
+static void
+test_encoder (void)
+{
+  static char long_string[3000];
+  static int32_t int32s[300];
+  static uint8_t unknown_data[] = { 0x03, 'a', 'b', 'c' };
+  const char *strings[] = { "", long_string, "end" };
+  ProtobufCBinaryData bytes[2] = { { 3, (uint8_t *) "xyz" }, { 0, NULL } };
+  double doubles[] = { 1.5, -2 };
+  ProtobufCMessageUnknownField unknown = {
+    1000, PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED, sizeof (unknown_data),
+    unknown_data
+  };
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  Foo__TestMessPacked packed_mess = FOO__TEST_MESS_PACKED__INIT;
+  Foo__SubMess subs[40], *psubs[40];
+  Foo__SubMess__SubSubMess sub1 = FOO__SUB_MESS__SUB_SUB_MESS__INIT;
+  unsigned i;
+
+  memset (long_string, 'q', sizeof (long_string) - 1);
+  for (i = 0; i < N_ELEMENTS (int32s); i++)
+    int32s[i] = i % 3 ? (int32_t) i * 1000 : -(int32_t) i;
+  sub1.str1 = long_string;
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__sub_mess__init (&subs[i]);
+      subs[i].test = i;
+      subs[i].n_rep = i;
+      subs[i].rep = int32s;
+      if (i % 4 == 0)
+        subs[i].sub1 = &sub1;
+      psubs[i] = &subs[i];
+    }
+
+  /* an empty message */
+  check_encoder_chunks (&mess.base);
+
+  mess.test_int32 = int32s;
+  mess.n_test_int32 = 5;
+  mess.test_string = strings;
+  mess.n_test_string = N_ELEMENTS (strings);
+  mess.test_bytes = bytes;
+  mess.n_test_bytes = N_ELEMENTS (bytes);
+  mess.test_message = psubs;
+  mess.n_test_message = N_ELEMENTS (subs);
+  mess.base.n_unknown_fields = 1;
+  mess.base.unknown_fields = &unknown;
+  check_encoder_chunks (&mess.base);
+
+  packed_mess.test_int32 = int32s;
+  packed_mess.n_test_int32 = N_ELEMENTS (int32s);
+  packed_mess.test_sfixed32 = int32s;
+  packed_mess.n_test_sfixed32 = N_ELEMENTS (int32s);
+  packed_mess.test_double = doubles;
+  packed_mess.n_test_double = N_ELEMENTS (doubles);
+  check_encoder_chunks (&packed_mess.base);
+}
+
+typedef struct
+{
+  int64_t int_sum;
+  double double_sum;
+  size_t n_values;
+  size_t n_strings;
+  size_t n_unknown;
+  size_t stop_after;
+} VisitSums;
+
+static protobuf_c_boolean
+sum_field (const ProtobufCWireValue *value, void *visitor_data)
+{
+  VisitSums *sums = visitor_data;
+  ProtobufCVisitor sub_visitor = { sum_field, NULL, sums };
+
+  sums->n_values++;
+  switch (value->field->type)
+    {
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_SINT32:
+      sums->int_sum += value->value.v_int32;
+      break;
+    case PROTOBUF_C_TYPE_FIXED64:
+      sums->int_sum += value->value.v_uint64;
+      break;
+    case PROTOBUF_C_TYPE_DOUBLE:
+      sums->double_sum += value->value.v_double;
+      break;
+    case PROTOBUF_C_TYPE_STRING:
+      sums->n_strings++;
+      break;
+    case PROTOBUF_C_TYPE_MESSAGE:
+      assert (protobuf_c_message_visit (value->field->descriptor,
+                                        value->value.v_binary.len,
+                                        value->value.v_binary.data,
+                                        &sub_visitor));
+      break;
+    default:
+      break;
+    }
+  return sums->n_values != sums->stop_after;
+}
+
+static protobuf_c_boolean
+count_unknown (const ProtobufCMessageUnknownField *field, void *visitor_data)
+{
+  VisitSums *sums = visitor_data;
+
+  assert (field->tag == 1000);
+  assert (field->wire_type == PROTOBUF_C_WIRE_TYPE_VARINT);
+  assert (field->len == 1 && field->data[0] == 5);
+  sums->n_unknown++;
+  return 1;
+}
+
+static void
+test_visit (void)
+{
+  static const uint8_t unknown[] = { 0xc0, 0x3e, 0x05 };
+  static const uint8_t bad_fixed[] = { 0x1a, 0x03, 0x01, 0x02, 0x03 };
+  static int32_t int32s[1000];
+  const char *strings[] = { "a", "b", "c" };
+  double doubles[] = { 0.5, 0.25 };
+  Foo__TestMessPacked packed_mess = FOO__TEST_MESS_PACKED__INIT;
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  Foo__SubMess subs[3], *psubs[3];
+  VisitSums sums;
+  ProtobufCVisitor visitor = { sum_field, count_unknown, &sums };
+  uint8_t *data;
+  size_t len;
+  unsigned i;
+
+  for (i = 0; i < N_ELEMENTS (int32s); i++)
+    int32s[i] = i % 2 ? -(int32_t) i : (int32_t) i;
+
+  /* packed elements are reported one by one */
+  packed_mess.test_int32 = int32s;
+  packed_mess.n_test_int32 = N_ELEMENTS (int32s);
+  packed_mess.test_double = doubles;
+  packed_mess.n_test_double = N_ELEMENTS (doubles);
+  len = foo__test_mess_packed__get_packed_size (&packed_mess);
+  data = malloc (len + sizeof (unknown));
+  assert (data != NULL);
+  foo__test_mess_packed__pack (&packed_mess, data);
+  memcpy (data + len, unknown, sizeof (unknown));
+  memset (&sums, 0, sizeof (sums));
+  assert (protobuf_c_message_visit (&foo__test_mess_packed__descriptor,
+                                    len + sizeof (unknown), data, &visitor));
+  assert (sums.n_values == N_ELEMENTS (int32s) + N_ELEMENTS (doubles));
+  assert (sums.int_sum == -500);
+  assert (sums.double_sum == 0.75);
+  assert (sums.n_unknown == 1);
+
+  /* a callback can stop the visit, even inside a packed member */
+  memset (&sums, 0, sizeof (sums));
+  sums.stop_after = 10;
+  assert (protobuf_c_message_visit (&foo__test_mess_packed__descriptor,
+                                    len, data, &visitor));
+  assert (sums.n_values == 10);
+
+  /* malformed data is detected as it is reached */
+  memset (&sums, 0, sizeof (sums));
+  assert (!protobuf_c_message_visit (&foo__test_mess_packed__descriptor,
+                                     len - 1, data, &visitor));
+  assert (!protobuf_c_message_visit (&foo__test_mess_packed__descriptor,
+                                     sizeof (bad_fixed), bad_fixed,
+                                     &visitor));
+  free (data);
+
+  /* unpacked elements, strings and sub-messages as slices */
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__sub_mess__init (&subs[i]);
+      subs[i].test = 100 * (i + 1);
+      psubs[i] = &subs[i];
+    }
+  mess.test_int32 = int32s;
+  mess.n_test_int32 = 4;
+  mess.test_string = strings;
+  mess.n_test_string = N_ELEMENTS (strings);
+  mess.test_message = psubs;
+  mess.n_test_message = N_ELEMENTS (subs);
+  len = foo__test_mess__get_packed_size (&mess);
+  data = malloc (len);
+  assert (data != NULL);
+  foo__test_mess__pack (&mess, data);
+  memset (&sums, 0, sizeof (sums));
+  assert (protobuf_c_message_visit (&foo__test_mess__descriptor, len, data,
+                                    &visitor));
+  assert (sums.n_values == 4 + N_ELEMENTS (strings) + 2 * N_ELEMENTS (subs));
+  assert (sums.int_sum == 0 - 1 + 2 - 3 + 100 + 200 + 300);
+  assert (sums.n_strings == N_ELEMENTS (strings));
+  free (data);
+}
+
+#define N_RECORDS 2500
+#define BAD_RECORD 100
+
+typedef struct
+{
+  unsigned seen[N_RECORDS];
+  size_t n_calls;
+  int in_order;
+} RecordCheck;
+
+static void
+check_record (ProtobufCMessage *message, size_t index, void *func_data)
+{
+  RecordCheck *check = func_data;
+
+  assert (index < N_RECORDS);
+  if (index != check->n_calls)
+    check->in_order = 0;
+  check->n_calls++;
+  check->seen[index]++;
+  if (index == BAD_RECORD)
+    {
+      assert (message == NULL);
+      return;
+    }
+  assert (message != NULL);
+  assert (((Foo__SubMess *) message)->test == (int32_t) index);
+  protobuf_c_message_free_unpacked (message, NULL);
+}
+
+static void
+test_unpack_delimited (void)
+{
+  static const uint8_t bad[] = { 0x01, 0x20 };
+  static const uint8_t truncated[] = { 0x05, 0x20, 0x01 };
+  static RecordCheck check;
+  unsigned runs = 0;
+  ProtobufCExecutor executor = { reverse_executor_run, &runs };
+  Foo__SubMess sub = FOO__SUB_MESS__INIT;
+  uint8_t *stream;
+  size_t len = 0, complete, size;
+  unsigned i, pass;
+
+  stream = malloc (N_RECORDS * 16 + sizeof (truncated));
+  assert (stream != NULL);
+  for (i = 0; i < N_RECORDS; i++)
+    {
+      if (i == BAD_RECORD)
+        {
+          memcpy (stream + len, bad, sizeof (bad));
+          len += sizeof (bad);
+          continue;
+        }
+      sub.test = i;
+      size = foo__sub_mess__get_packed_size (&sub);
+      stream[len++] = size;
+      len += foo__sub_mess__pack (&sub, stream + len);
+    }
+  complete = len;
+  memcpy (stream + len, truncated, sizeof (truncated));
+  len += sizeof (truncated);
+
+  /* serially, then ordered and unordered delivery from the executor */
+  for (pass = 0; pass < 3; pass++)
+    {
+      memset (&check, 0, sizeof (check));
+      check.in_order = 1;
+      assert (protobuf_c_message_unpack_delimited (&foo__sub_mess__descriptor,
+                                                   NULL,
+                                                   pass == 0 ? NULL : &executor,
+                                                   len, stream, pass == 1,
+                                                   check_record,
+                                                   &check) == complete);
+      assert (check.n_calls == N_RECORDS);
+      for (i = 0; i < N_RECORDS; i++)
+        assert (check.seen[i] == 1);
+      assert (check.in_order == (pass < 2));
+    }
+  /* three windows of records, in batches of 64 */
+  assert (runs == 2 * 3);
+
+  assert (protobuf_c_message_unpack_delimited (&foo__sub_mess__descriptor,
+                                               NULL, NULL, 0, stream, 1,
+                                               check_record, &check) == 0);
+  free (stream);
+}
+
 static void
 test_free_unpacked_input_check_for_null_message (void)
 {
@@ -2359,6 +4680,37 @@ static Test tests[] =
 
   { "test free unpacked", test_alloc_free_all },
   { "test alloc failure", test_alloc_fail },
+  { "test interned values", test_intern_values },
+  { "test interned alloc failure", test_intern_alloc_fail },
+  { "test shared messages", test_shared_messages },
+  { "test shared mixed allocators", test_shared_mixed_allocators },
+  { "test shared alloc failure", test_shared_alloc_fail },
+  { "test flat unpack", test_flat_unpack },
+  { "test flat unpack of truncated data", test_flat_unpack_truncated },
+  { "test unpack context", test_unpack_context },
+  { "test pool allocator", test_pool_allocator },
+  { "test pool switching", test_pool_switching },
+  { "test sized allocator", test_sized_allocator },
+  { "test sized allocator embedded nul", test_sized_allocator_embedded_nul },
+  { "test sized allocator packed bool", test_sized_allocator_packed_bool },
+  { "test aligned alloc", test_aligned_alloc },
+  { "test dense index", test_dense_index },
+  { "test name hash", test_name_hash },
+  { "test hot fields", test_hot_fields },
+  { "test layout summary", test_layout_summary },
+  { "test utf8 validation", test_utf8_validation },
+  { "test nesting depth", test_nesting_depth },
+  { "test validate", test_validate },
+  { "test wire find field", test_wire_find_field },
+  { "test views", test_views },
+  { "test unpack batch", test_unpack_batch },
+  { "test unpack executor", test_unpack_executor },
+  { "test pack parallel", test_pack_parallel },
+  { "test unpack delimited", test_unpack_delimited },
+  { "test visit", test_visit },
+  { "test pack to buffer generated", test_pack_to_buffer_generated },
+  { "test encoder", test_encoder },
+  { "test unpack iov", test_unpack_iov },
 
   { "test free unpacked input check for null message", test_free_unpacked_input_check_for_null_message },
   { "test free unpacked input check for null repeated field", test_free_unpacked_input_check_for_null_repeated_field },